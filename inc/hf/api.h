@@ -16,6 +16,7 @@
 #include "vmapi/hf/ffa.h"
 
 void api_init(struct mpool *ppool);
+struct mpool *api_page_pool_for(const struct vcpu *current);
 struct vcpu *api_ffa_get_vm_vcpu(struct vm *vm, struct vcpu *current);
 void api_regs_state_saved(struct vcpu *vcpu);
 int64_t api_mailbox_writable_get(const struct vcpu *current);
@@ -46,7 +47,7 @@ struct ffa_value api_ffa_msg_send2(ffa_vm_id_t sender_vm_id, uint32_t flags,
 				   struct vcpu *current);
 struct ffa_value api_ffa_msg_recv(bool block, struct vcpu *current,
 				  struct vcpu **next);
-struct ffa_value api_ffa_rx_release(ffa_vm_id_t receiver_id,
+struct ffa_value api_ffa_rx_release(ffa_vm_id_t receiver_id, uint32_t count,
 				    struct vcpu *current, struct vcpu **next);
 struct ffa_value api_ffa_rx_acquire(ffa_vm_id_t receiver_id,
 				    struct vcpu *current);
@@ -67,7 +68,8 @@ struct ffa_value api_ffa_partition_info_get(struct vcpu *current,
 struct ffa_value api_ffa_id_get(const struct vcpu *current);
 struct ffa_value api_ffa_spm_id_get(void);
 struct ffa_value api_ffa_feature_success(uint32_t arg2);
-struct ffa_value api_ffa_features(uint32_t function_id);
+struct ffa_value api_ffa_features(uint32_t function_id,
+				  struct vcpu *current);
 struct ffa_value api_ffa_msg_wait(struct vcpu *current, struct vcpu **next,
 				  struct ffa_value *args);
 struct ffa_value api_ffa_run(ffa_vm_id_t vm_id, ffa_vcpu_index_t vcpu_idx,
@@ -83,6 +85,8 @@ struct ffa_value api_ffa_mem_relinquish(struct vcpu *current);
 struct ffa_value api_ffa_mem_reclaim(ffa_memory_handle_t handle,
 				     ffa_memory_region_flags_t flags,
 				     struct vcpu *current);
+struct ffa_value api_ffa_mem_op_resume(ffa_memory_handle_t handle,
+				       struct vcpu *current);
 struct ffa_value api_ffa_mem_frag_rx(ffa_memory_handle_t handle,
 				     uint32_t fragment_offset,
 				     ffa_vm_id_t sender_vm_id,
@@ -62,6 +62,18 @@ void arch_regs_set_retval(struct arch_regs *r, struct ffa_value v);
  */
 struct ffa_value arch_regs_get_args(struct arch_regs *regs);
 
+/**
+ * Like `arch_regs_set_retval` but also updates the registers holding the
+ * extended return value of the FF-A v1.2 direct messages, x8-x17 on AArch64.
+ */
+void arch_regs_set_retval_ext(struct arch_regs *r, struct ffa_value_ext v);
+
+/**
+ * Like `arch_regs_get_args` but also extracts the extended arguments of the
+ * FF-A v1.2 direct messages, x8-x17 on AArch64.
+ */
+struct ffa_value_ext arch_regs_get_args_ext(struct arch_regs *regs);
+
 /**
  * Initialize and reset CPU-wide register values.
  */
@@ -95,12 +95,44 @@ uint64_t arch_mm_pte_attrs(pte_t pte, uint8_t level);
 uint64_t arch_mm_combine_table_entry_attrs(uint64_t table_attrs,
 					   uint64_t block_attrs);
 
+/**
+ * Determines if replacing one valid PTE with another valid PTE requires a
+ * break-before-make sequence. If it doesn't, the new entry can be written
+ * directly and the stale TLB entries invalidated afterwards.
+ */
+bool arch_mm_pte_needs_bbm(pte_t old_pte, pte_t new_pte, uint8_t level);
+
+/**
+ * Gets the number of adjacent block entries at the given level that can share a
+ * single TLB entry when marked with the contiguous hint, or 0 if the hint isn't
+ * supported at the level. The entries must be aligned to the size of the range
+ * they cover together.
+ */
+uint8_t arch_mm_contiguous_entries(uint8_t level);
+
+/**
+ * Determines if a block PTE has the contiguous hint set.
+ */
+bool arch_mm_pte_is_contiguous(pte_t pte, uint8_t level);
+
+/**
+ * Sets or clears the contiguous hint of a block PTE.
+ */
+pte_t arch_mm_pte_set_contiguous(pte_t pte, uint8_t level, bool contiguous);
+
 /**
  * Invalidates the given range of stage-1 TLB.
  */
 void arch_mm_invalidate_stage1_range(uint16_t asid, vaddr_t va_begin,
 				     vaddr_t va_end);
 
+/**
+ * Invalidates the stage-1 TLB entries of the current CPU referring to the given
+ * virtual address range. The TLBs of the other CPUs are left alone.
+ */
+void arch_mm_invalidate_stage1_range_local(uint16_t asid, vaddr_t va_begin,
+					   vaddr_t va_end);
+
 /**
  * Invalidates the given range of stage-2 TLB.
  */
@@ -114,6 +146,12 @@ void arch_mm_invalidate_stage2_range(uint16_t vmid, ipaddr_t va_begin,
  */
 void arch_mm_flush_dcache(void *base, size_t size);
 
+/**
+ * Zeroes the given range of virtual memory and writes it back like
+ * `arch_mm_flush_dcache`, in a single pass over the range.
+ */
+void arch_mm_zero_and_flush(void *base, size_t size);
+
 /**
  * Sets the maximum level allowed in the page table for stage-1.
  */
@@ -180,6 +218,11 @@ uint32_t arch_mm_extra_attributes_from_vm(ffa_vm_id_t id);
  */
 void arch_mm_sync_table_writes(void);
 
+/**
+ * Returns the index of the CPU this is running on, which is less than MAX_CPUS.
+ */
+size_t arch_mm_cpu_index(void);
+
 /**
  * Returns the maximum supported PA Range in bits.
  */
@@ -13,3 +13,4 @@
 
 bool arch_other_world_vm_init(struct vm *other_world_vm, struct mpool *ppool);
 struct ffa_value arch_other_world_call(struct ffa_value args);
+struct ffa_value_ext arch_other_world_call_ext(struct ffa_value_ext args);
@@ -72,6 +72,7 @@ bool plat_ffa_is_direct_request_supported(struct vm *sender_vm,
 					  struct vm *receiver_vm);
 bool plat_ffa_direct_request_forward(ffa_vm_id_t receiver_vm_id,
 				     struct ffa_value args,
+				     struct vcpu *current,
 				     struct ffa_value *ret);
 
 bool plat_ffa_rx_release_forward(struct vm_locked vm_locked,
@@ -206,7 +207,7 @@ bool plat_ffa_is_vm_id(ffa_vm_id_t vm_id);
  * Forward normal world calls of FFA_RUN ABI to other world.
  */
 bool plat_ffa_run_forward(ffa_vm_id_t vm_id, ffa_vcpu_index_t vcpu_idx,
-			  struct ffa_value *ret);
+			  struct vcpu *current, struct ffa_value *ret);
 
 bool plat_ffa_notification_info_get_call(struct ffa_value *ret);
 
@@ -13,6 +13,7 @@
 
 #include "vmapi/hf/ffa.h"
 
+void ffa_memory_init(void);
 struct ffa_value ffa_memory_send(struct vm_locked from_locked,
 				 struct ffa_memory_region *memory_region,
 				 uint32_t memory_share_length,
@@ -48,8 +49,20 @@ struct ffa_value ffa_memory_reclaim(struct vm_locked to_locked,
 				    ffa_memory_handle_t handle,
 				    ffa_memory_region_flags_t flags,
 				    struct mpool *page_pool);
+ffa_vm_id_t ffa_memory_interrupted_retriever(ffa_memory_handle_t handle,
+					     struct mpool *page_pool);
+struct ffa_value ffa_memory_retrieve_abort(struct vm_locked to_locked,
+					   struct vm_locked from_locked,
+					   ffa_memory_handle_t handle,
+					   struct mpool *page_pool);
 struct ffa_value ffa_memory_tee_reclaim(struct vm_locked to_locked,
 					struct vm_locked from_locked,
 					ffa_memory_handle_t handle,
 					ffa_memory_region_flags_t flags,
 					struct mpool *page_pool);
+struct ffa_value ffa_memory_op_resume(struct vm_locked vm_locked,
+				      ffa_memory_handle_t handle,
+				      struct mpool *page_pool);
+bool ffa_memory_lazy_fault(struct vm_locked vm_locked, ipaddr_t ipa,
+			   uint32_t access_mode, struct mpool *page_pool);
+void ffa_memory_clear_pending(struct mpool *page_pool);
@@ -20,6 +20,22 @@
 
 #define SP_RTX_BUF_NAME_SIZE 10
 
+/**
+ * The smallest slot of a message queue with room for a message header and some
+ * payload, slots being a multiple of 8 bytes.
+ */
+#define MANIFEST_MSG_QUEUE_SLOT_MIN_SIZE                                 \
+	((sizeof(struct ffa_partition_rxtx_header) / sizeof(uint64_t) + 1) * \
+	 sizeof(uint64_t))
+
+/**
+ * The maximum value of the `msg_queue_slots` property, for which the smallest
+ * RX buffer still has slots of at least MANIFEST_MSG_QUEUE_SLOT_MIN_SIZE.
+ */
+#define MANIFEST_MSG_QUEUE_SLOTS_MAX                                \
+	((FFA_PAGE_SIZE - sizeof(struct ffa_partition_msg_queue)) / \
+	 MANIFEST_MSG_QUEUE_SLOT_MIN_SIZE)
+
 /** FF-A manifest memory and device regions attributes. */
 #define MANIFEST_REGION_ATTR_READ (UINT32_C(1) << 0)
 #define MANIFEST_REGION_ATTR_WRITE (UINT32_C(1) << 1)
@@ -180,6 +196,9 @@ struct manifest_vm {
 	struct smc_whitelist smc_whitelist;
 	bool is_ffa_partition;
 	bool is_hyp_loaded;
+	bool lazy_retrieve;
+	uint16_t rxtx_max_pages;
+	uint16_t msg_queue_slots;
 	struct partition_manifest partition;
 
 	union {
@@ -227,6 +246,8 @@ enum manifest_return_code {
 	MANIFEST_ERROR_MEMORY_REGION_NODE_EMPTY,
 	MANIFEST_ERROR_DEVICE_REGION_NODE_EMPTY,
 	MANIFEST_ERROR_RXTX_SIZE_MISMATCH,
+	MANIFEST_ERROR_RXTX_TOO_LARGE,
+	MANIFEST_ERROR_MSG_QUEUE_SLOTS,
 	MANIFEST_ERROR_MEM_REGION_OVERLAP,
 	MANIFEST_ERROR_INVALID_MEM_PERM,
 	MANIFEST_ERROR_INTERRUPT_ID_REPEATED,
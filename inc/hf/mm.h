@@ -16,6 +16,7 @@
 
 #include "hf/addr.h"
 #include "hf/mpool.h"
+#include "hf/spinlock.h"
 #include "hf/static_assert.h"
 
 /* Keep macro alignment */
@@ -75,6 +76,9 @@
 #define MM_FLAG_UNMAP   0x02
 #define MM_FLAG_STAGE1  0x04
 
+/* The maximum number of levels of a page table below its root. */
+#define MM_MAX_LEVELS 4
+
 /* clang-format on */
 
 #define MM_PPOOL_ENTRY_SIZE sizeof(struct mm_page_table)
@@ -87,6 +91,9 @@ static_assert(sizeof(struct mm_page_table) == PAGE_SIZE,
 static_assert(alignof(struct mm_page_table) == PAGE_SIZE,
 	      "A page table must be page aligned.");
 
+/** The type of addresses stored in the page table. */
+typedef uintvaddr_t ptable_addr_t;
+
 struct mm_ptable {
 	/**
 	 * VMID/ASID associated with a page table. ASID 0 is reserved for use by
@@ -95,18 +102,162 @@ struct mm_ptable {
 	uint16_t id;
 	/** Address of the root of the page table. */
 	paddr_t root;
+	/**
+	 * Range of addresses whose entries have been updated since the table
+	 * was last defragmented, and so may hold subtables that can be merged.
+	 * It is empty if `dirty_begin` is not below `dirty_end`.
+	 */
+	ptable_addr_t dirty_begin;
+	ptable_addr_t dirty_end;
+	/**
+	 * Incremented whenever tables are freed from the page table, so that
+	 * pointers to its tables held across updates can be checked.
+	 */
+	uint32_t generation;
 };
 
-/** The type of addresses stored in the page table. */
-typedef uintvaddr_t ptable_addr_t;
-
 /** Represents the currently locked stage-1 page table of the hypervisor. */
 struct mm_stage1_locked {
 	struct mm_ptable *ptable;
 };
 
+/**
+ * The maximum number of disjoint address ranges a TLB gather records before it
+ * invalidates them and starts over.
+ */
+#define MM_TLB_GATHER_RANGES 8
+
+/**
+ * Collects the address ranges whose TLB entries have been made stale by updates
+ * to a page table, so they can be invalidated in one go once the updates are
+ * complete rather than once per updated entry.
+ *
+ * Overlapping or adjacent ranges are merged, but disjoint ones are kept apart
+ * so that the addresses between them aren't invalidated needlessly.
+ */
+struct mm_tlb_gather {
+	/** The gathered ranges, sorted by address. */
+	struct {
+		ptable_addr_t begin;
+		ptable_addr_t end;
+	} ranges[MM_TLB_GATHER_RANGES];
+	/** Number of gathered ranges. */
+	uint8_t count;
+	/** Flags selecting the translation regime of the page table. */
+	int flags;
+	/** ID of the page table the ranges were gathered from. */
+	uint16_t id;
+	/** The page table being updated, or NULL if none yet. */
+	struct mm_ptable *ptable;
+};
+
+/**
+ * The number of table ranges a reservation can record without allocating, and
+ * the number allocated for each range of addresses it is sized for.
+ */
+#define MM_RESERVATION_SLOTS 8
+#define MM_RESERVATION_SLOTS_PER_RANGE 2
+
+/**
+ * A range of entries in a single page table, all at the same level, which a
+ * prepared mapping needs to write.
+ */
+struct mm_reservation_slot {
+	struct mm_page_table *table;
+	ptable_addr_t begin;
+	ptable_addr_t end;
+	uint8_t level;
+	/**
+	 * The entries referencing the table and its ancestors, indexed by
+	 * their level, so the commit can promote them to blocks.
+	 */
+	pte_t *parents[MM_MAX_LEVELS];
+};
+
+/**
+ * Records, while preparing a mapping, the tables and entries that its commit
+ * will write, so that the commit can update them directly rather than walking
+ * the page table from the root a second time.
+ *
+ * A reservation can be shared by a series of prepares of the same mode in the
+ * same page table, followed by the commits of the same ranges. If it overflows
+ * or the page table changed in a way that may have freed one of the recorded
+ * tables, the commits fall back to walking the page table from the root.
+ */
+struct mm_reservation {
+	/** Page table the reservation was made in, or NULL if none yet. */
+	struct mm_ptable *ptable;
+	/** Attributes and flags of the prepared mappings. */
+	uint64_t attrs;
+	int flags;
+	/** Generation of the page table when the reservation was first made. */
+	uint32_t generation;
+	/** Whether the slots still describe all the prepared ranges. */
+	bool valid;
+	/** The recorded slots, either `inline_slots` or allocated. */
+	struct mm_reservation_slot *slots;
+	uint32_t capacity;
+	uint32_t count;
+	struct mm_reservation_slot inline_slots[MM_RESERVATION_SLOTS];
+	/** The entries descended through by the prepare, indexed by level. */
+	pte_t *path[MM_MAX_LEVELS];
+};
+
+/**
+ * Caches the tables walked through by the last query of the attributes of a
+ * range of a page table, so that the query of a neighbouring range doesn't walk
+ * from the root again, and the attributes found so far, so that a series of
+ * queries can check all the ranges have the same attributes. The page table
+ * must not be updated while the cursor is in use.
+ */
+struct mm_mode_cursor {
+	struct mm_ptable *ptable;
+	int flags;
+	/**
+	 * The lowest level whose table is cached, or more than the maximum
+	 * level of the page table if there is none.
+	 */
+	uint8_t level;
+	/** The cached tables and the first address they cover, per level. */
+	struct mm_page_table *tables[MM_MAX_LEVELS];
+	ptable_addr_t bases[MM_MAX_LEVELS];
+	/** The attributes of all the ranges queried, if any. */
+	bool got_attrs;
+	uint64_t attrs;
+};
+
+/** The number of pages a window can map at once. */
+#define MM_WINDOW_PAGES 16
+
+/**
+ * A range of pages of the hypervisor's address space which can be pointed at
+ * any pages of physical memory, so that memory can be accessed without mapping
+ * it into the hypervisor page table. Its entries are only written by the CPU
+ * holding it, so that updates don't need the lock of the page table and only
+ * invalidate the TLB of that CPU.
+ */
+struct mm_window {
+	struct spinlock lock;
+	/** The first of the stage-1 entries mapping the window. */
+	pte_t *pte;
+	/** The address of the window. */
+	vaddr_t va;
+	/** The number of pages the window currently maps. */
+	size_t pages;
+};
+
 void mm_vm_enable_invalidation(void);
 
+void mm_reservation_init(struct mm_reservation *res);
+void mm_reservation_init_sized(struct mm_reservation *res, size_t range_count,
+			       struct mpool *ppool);
+void mm_reservation_fini(struct mm_reservation *res, struct mpool *ppool);
+
+void mm_tlb_gather_init(struct mm_tlb_gather *tlb);
+void mm_tlb_gather_add(struct mm_tlb_gather *tlb, ptable_addr_t begin,
+		       ptable_addr_t end);
+void mm_tlb_gather_finish(struct mm_tlb_gather *tlb);
+
 bool mm_ptable_init(struct mm_ptable *t, uint16_t id, int flags,
 		    struct mpool *ppool);
 ptable_addr_t mm_ptable_addr_space_end(int flags);
@@ -115,25 +266,40 @@ bool mm_vm_init(struct mm_ptable *t, uint16_t id, struct mpool *ppool);
 void mm_vm_fini(struct mm_ptable *t, struct mpool *ppool);
 
 bool mm_identity_prepare(struct mm_ptable *t, paddr_t begin, paddr_t end,
-			 uint32_t mode, struct mpool *ppool);
+			 uint32_t mode, struct mpool *ppool,
+			 struct mm_reservation *res);
 void *mm_identity_commit(struct mm_ptable *t, paddr_t begin, paddr_t end,
-			 uint32_t mode, struct mpool *ppool);
+			 uint32_t mode, struct mpool *ppool,
+			 struct mm_reservation *res, struct mm_tlb_gather *tlb);
 
 bool mm_vm_identity_map(struct mm_ptable *t, paddr_t begin, paddr_t end,
 			uint32_t mode, struct mpool *ppool, ipaddr_t *ipa);
 bool mm_vm_identity_prepare(struct mm_ptable *t, paddr_t begin, paddr_t end,
-			    uint32_t mode, struct mpool *ppool);
+			    uint32_t mode, struct mpool *ppool,
+			    struct mm_reservation *res);
 void mm_vm_identity_commit(struct mm_ptable *t, paddr_t begin, paddr_t end,
-			   uint32_t mode, struct mpool *ppool, ipaddr_t *ipa);
+			   uint32_t mode, struct mpool *ppool, ipaddr_t *ipa,
+			   struct mm_reservation *res,
+			   struct mm_tlb_gather *tlb);
 bool mm_vm_unmap(struct mm_ptable *t, paddr_t begin, paddr_t end,
 		 struct mpool *ppool);
 void mm_stage1_defrag(struct mm_ptable *t, struct mpool *ppool);
+void mm_stage1_defrag_range(struct mm_ptable *t, paddr_t begin, paddr_t end,
+			    struct mpool *ppool, struct mm_tlb_gather *tlb);
 void mm_vm_defrag(struct mm_ptable *t, struct mpool *ppool);
+void mm_vm_defrag_range(struct mm_ptable *t, paddr_t begin, paddr_t end,
+			struct mpool *ppool, struct mm_tlb_gather *tlb);
 void mm_vm_dump(struct mm_ptable *t);
 bool mm_vm_get_mode(struct mm_ptable *t, ipaddr_t begin, ipaddr_t end,
 		    uint32_t *mode);
 bool mm_get_mode(struct mm_ptable *t, vaddr_t begin, vaddr_t end,
 		 uint32_t *mode);
+void mm_vm_mode_cursor_init(struct mm_mode_cursor *c, struct mm_ptable *t);
+void mm_mode_cursor_init(struct mm_mode_cursor *c, struct mm_ptable *t);
+bool mm_vm_get_mode_next(struct mm_mode_cursor *c, ipaddr_t begin,
+			 ipaddr_t end, uint32_t *mode);
+bool mm_get_mode_next(struct mm_mode_cursor *c, vaddr_t begin, vaddr_t end,
+		      uint32_t *mode);
 
 struct mm_stage1_locked mm_lock_ptable_unsafe(struct mm_ptable *ptable);
 struct mm_stage1_locked mm_lock_stage1(void);
@@ -144,4 +310,9 @@ bool mm_unmap(struct mm_stage1_locked stage1_locked, paddr_t begin, paddr_t end,
 	      struct mpool *ppool);
 void mm_defrag(struct mm_stage1_locked stage1_locked, struct mpool *ppool);
 
+struct mm_window *mm_window_acquire(void);
+void *mm_window_map(struct mm_window *window, paddr_t begin, paddr_t end,
+		    uint32_t mode, size_t *size);
+void mm_window_release(struct mm_window *window);
+
 bool mm_init(struct mpool *ppool);
@@ -13,20 +13,74 @@
 
 #include "hf/spinlock.h"
 
+/**
+ * Number of entries a magazine moves to or from its backing pool at once, and
+ * the number of entries it holds before returning a batch to the backing pool.
+ */
+#define MPOOL_MAGAZINE_BATCH 4
+#define MPOOL_MAGAZINE_CAPACITY (2 * MPOOL_MAGAZINE_BATCH)
+
+/**
+ * Number of block sizes indexed by a buddy pool, the largest block being
+ * 2^(MPOOL_BUDDY_ORDERS - 1) entries.
+ */
+#define MPOOL_BUDDY_ORDERS 11
+
+/**
+ * Counters to help size magazines. They are only updated while holding the
+ * lock of the pool, or by the CPU owning the magazine.
+ */
+struct mpool_stats {
+	/** Number of times the lock of the pool was acquired. */
+	size_t lock_acquired;
+	/** Number of times the lock was already held by another CPU. */
+	size_t lock_contended;
+	/** Number of batches a magazine took from its backing pool. */
+	size_t magazine_refills;
+	/** Number of batches a magazine returned to its backing pool. */
+	size_t magazine_drains;
+	/** Number of entries of a backing pool a slab was refilled with. */
+	size_t slab_refills;
+};
+
 struct mpool {
 	struct spinlock lock;
 	size_t entry_size;
 	struct mpool_chunk *chunk_list;
 	struct mpool_entry *entry_list;
 	struct mpool *fallback;
+
+	/**
+	 * Whether this is a magazine, i.e. a cache of entries of the fallback
+	 * pool only ever used by a single CPU, so accessed without locking.
+	 */
+	bool magazine;
+	/** Number of entries in the free list. */
+	size_t entry_count;
+	struct mpool_stats stats;
+
+	/**
+	 * Whether the chunks added to the pool are indexed as buddy blocks,
+	 * so contiguous entries are found and freed entries coalesced in time
+	 * logarithmic in the size of the chunks.
+	 */
+	bool buddy;
+	/** Chunks indexed by the buddy allocator. */
+	struct mpool_arena *arena_list;
+	/** Free blocks of 2^order entries, indexed by order. */
+	struct mpool_block *free_areas[MPOOL_BUDDY_ORDERS];
 };
 
 void mpool_enable_locks(void);
 void mpool_init(struct mpool *p, size_t entry_size);
+void mpool_init_buddy(struct mpool *p, size_t entry_size);
 void mpool_init_from(struct mpool *p, struct mpool *from);
 void mpool_init_with_fallback(struct mpool *p, struct mpool *fallback);
+void mpool_init_magazine(struct mpool *p, struct mpool *backing);
 void mpool_fini(struct mpool *p);
 bool mpool_add_chunk(struct mpool *p, void *begin, size_t size);
 void *mpool_alloc(struct mpool *p);
+void *mpool_alloc_slab(struct mpool *p, struct mpool *backing);
 void *mpool_alloc_contiguous(struct mpool *p, size_t count, size_t align);
 void mpool_free(struct mpool *p, void *ptr);
+struct mpool_stats mpool_get_stats(struct mpool *p);
@@ -13,6 +13,7 @@
  * implementations of:
  *  - SPINLOCK_INIT
  *  - sl_lock()
+ *  - sl_try_lock()
  *  - sl_unlock()
  */
 #include "hf/arch/spinlock.h"
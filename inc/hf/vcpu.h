@@ -12,6 +12,7 @@
 
 #include "hf/addr.h"
 #include "hf/interrupt_desc.h"
+#include "hf/mpool.h"
 #include "hf/spinlock.h"
 
 #include "vmapi/hf/ffa.h"
@@ -137,6 +138,13 @@ struct vcpu {
 	 */
 	ffa_vm_id_t direct_request_origin_vm_id;
 
+	/**
+	 * Whether the ongoing direct message request is a
+	 * FFA_MSG_SEND_DIRECT_REQ2, which must be answered with a
+	 * FFA_MSG_SEND_DIRECT_RESP2.
+	 */
+	bool direct_request_origin_req2;
+
 	/** Determine whether partition is currently handling managed exit. */
 	bool processing_managed_exit;
 
@@ -224,7 +232,7 @@ bool vcpu_secondary_reset_and_start(struct vcpu_locked vcpu_locked,
 				    ipaddr_t entry, uintreg_t arg);
 
 bool vcpu_handle_page_fault(const struct vcpu *current,
-			    struct vcpu_fault_info *f);
+			    struct vcpu_fault_info *f, struct mpool *ppool);
 
 void vcpu_reset(struct vcpu *vcpu);
 
@@ -23,6 +23,7 @@
 #define MAX_SMCS 32
 #define LOG_BUFFER_SIZE 256
 #define VM_MANIFEST_MAX_INTERRUPTS 32
+#define VM_MAX_LAZY_RETRIEVALS 8
 
 /**
  * The state of an RX buffer.
@@ -67,6 +68,25 @@ struct mailbox {
 	void *recv;
 	const void *send;
 
+	/** The size of each of the `send` and `recv` buffers, in bytes. */
+	uint32_t size;
+
+	/** The most pages the VM may map for each of its buffers. */
+	uint16_t max_page_count;
+
+	/**
+	 * The number of slots indirect messages are queued in, in `recv`, or 0
+	 * if only one message is received at a time.
+	 */
+	uint16_t queue_slots;
+
+	/**
+	 * The number of messages queued and released since the queue was last
+	 * empty. These are the authoritative copies of the indices in `recv`.
+	 */
+	uint32_t queue_producer;
+	uint32_t queue_consumer;
+
 	/** The ID of the VM which sent the message currently in `recv`. */
 	ffa_vm_id_t recv_sender;
 
@@ -238,6 +258,19 @@ struct vm {
 	struct arch_vm arch;
 	bool el0_partition;
 
+	/**
+	 * Whether memory lent or shared with the VM is mapped in its page table
+	 * as it first accesses it, rather than when it is retrieved.
+	 */
+	bool lazy_retrieve;
+
+	/**
+	 * Handles of the memory regions the VM has retrieved but which are
+	 * only mapped as it accesses them. Protected by the VM lock.
+	 */
+	ffa_memory_handle_t lazy_retrievals[VM_MAX_LAZY_RETRIEVALS];
+	uint16_t lazy_retrieval_count;
+
 	/** Interrupt descriptor */
 	struct interrupt_descriptor interrupt_desc[VM_MANIFEST_MAX_INTERRUPTS];
 };
@@ -272,12 +305,17 @@ bool vm_id_is_current_world(ffa_vm_id_t vm_id);
 bool vm_identity_map(struct vm_locked vm_locked, paddr_t begin, paddr_t end,
 		     uint32_t mode, struct mpool *ppool, ipaddr_t *ipa);
 bool vm_identity_prepare(struct vm_locked vm_locked, paddr_t begin, paddr_t end,
-			 uint32_t mode, struct mpool *ppool);
+			 uint32_t mode, struct mpool *ppool,
+			 struct mm_reservation *res);
 void vm_identity_commit(struct vm_locked vm_locked, paddr_t begin, paddr_t end,
-			uint32_t mode, struct mpool *ppool, ipaddr_t *ipa);
+			uint32_t mode, struct mpool *ppool, ipaddr_t *ipa,
+			struct mm_reservation *res, struct mm_tlb_gather *tlb);
 bool vm_unmap(struct vm_locked vm_locked, paddr_t begin, paddr_t end,
 	      struct mpool *ppool);
 void vm_ptable_defrag(struct vm_locked vm_locked, struct mpool *ppool);
+void vm_ptable_defrag_range(struct vm_locked vm_locked, paddr_t begin,
+			    paddr_t end, struct mpool *ppool,
+			    struct mm_tlb_gather *tlb);
 bool vm_unmap_hypervisor(struct vm_locked vm_locked, struct mpool *ppool);
 
 void vm_update_boot(struct vm *vm);
@@ -285,6 +323,15 @@ struct vm *vm_get_first_boot(void);
 
 bool vm_mem_get_mode(struct vm_locked vm_locked, ipaddr_t begin, ipaddr_t end,
 		     uint32_t *mode);
+void vm_mem_mode_cursor_init(struct vm_locked vm_locked,
+			     struct mm_mode_cursor *cursor);
+bool vm_mem_get_mode_next(struct vm_locked vm_locked,
+			  struct mm_mode_cursor *cursor, ipaddr_t begin,
+			  ipaddr_t end, uint32_t *mode);
+bool vm_lazy_retrieval_add(struct vm_locked vm_locked,
+			   ffa_memory_handle_t handle);
+void vm_lazy_retrieval_remove(struct vm_locked vm_locked,
+			      ffa_memory_handle_t handle);
 
 void vm_notifications_init(struct vm *vm, ffa_vcpu_count_t vcpu_count,
 			   struct mpool *ppool);
@@ -18,6 +18,14 @@
  */
 int64_t hf_call(uint64_t arg0, uint64_t arg1, uint64_t arg2, uint64_t arg3);
 struct ffa_value ffa_call(struct ffa_value args);
+
+/**
+ * Like `ffa_call` but also passes and returns x8-x17, as used by the FF-A v1.2
+ * direct messages. An endpoint which negotiated v1.2 may be returned such a
+ * message by any call which blocks, e.g. FFA_MSG_WAIT or a direct response, so
+ * must make these calls with `ffa_call_ext` when it handles them.
+ */
+struct ffa_value_ext ffa_call_ext(struct ffa_value_ext args);
 void memcpy_s(void *dest, size_t destsz, const void *src, size_t count);
 
 /**
@@ -238,6 +246,13 @@ static inline struct ffa_value ffa_mem_reclaim(ffa_memory_handle_t handle,
 					   .arg3 = flags});
 }
 
+static inline struct ffa_value ffa_mem_op_resume(ffa_memory_handle_t handle)
+{
+	return ffa_call((struct ffa_value){.func = FFA_MEM_OP_RESUME_32,
+					   .arg1 = (uint32_t)handle,
+					   .arg2 = (uint32_t)(handle >> 32)});
+}
+
 static inline struct ffa_value ffa_mem_frag_rx(ffa_memory_handle_t handle,
 					       uint32_t fragment_offset)
 {
@@ -280,6 +295,16 @@ static inline struct ffa_value ffa_msg_wait(void)
 	return ffa_call((struct ffa_value){.func = FFA_MSG_WAIT_32});
 }
 
+/**
+ * Like `ffa_msg_wait` but can also return a FFA_MSG_SEND_DIRECT_REQ2, with its
+ * payload in x4-x17.
+ */
+static inline struct ffa_value_ext ffa_msg_wait_ext(void)
+{
+	return ffa_call_ext((struct ffa_value_ext){
+		.val = {.func = FFA_MSG_WAIT_32}});
+}
+
 /**
  * Called by secondary VMs to receive a message. The call will return whether or
  * not a message is available.
@@ -314,6 +339,27 @@ static inline struct ffa_value ffa_rx_release(void)
 	return ffa_call((struct ffa_value){.func = FFA_RX_RELEASE_32});
 }
 
+/**
+ * Releases `count` messages from the front of the caller's message queue, see
+ * `struct ffa_partition_msg_queue`. Messages queued after them are kept, and
+ * the mailbox is only released once no messages are left.
+ *
+ * This is a Hafnium extension of FFA_RX_RELEASE, passing `count` in w2 which
+ * the FF-A specification requires to be zero. It is only supported by Hafnium,
+ * for VMs with the `msg_queue_slots` manifest property.
+ *
+ * Returns:
+ *  - FFA_ERROR FFA_INVALID_PARAMETERS if the caller doesn't queue messages or
+ *    fewer than `count` messages are queued.
+ *  - FFA_ERROR FFA_DENIED if the mailbox hasn't been read.
+ *  - As `ffa_rx_release` otherwise.
+ */
+static inline struct ffa_value ffa_rx_release_queued(uint32_t count)
+{
+	return ffa_call(
+		(struct ffa_value){.func = FFA_RX_RELEASE_32, .arg2 = count});
+}
+
 /**
  * Retrieves the next VM whose mailbox became writable. For a VM to be notified
  * by this function, the caller must have called api_mailbox_send before with
@@ -448,6 +494,69 @@ static inline struct ffa_value ffa_msg_send_direct_resp(
 	});
 }
 
+/**
+ * Builds the arguments of a direct message 2, whose payload of up to 14
+ * registers is passed in x4-x17.
+ */
+static inline struct ffa_value_ext ffa_direct_msg2_args(
+	uint64_t func, uint64_t arg1, uint64_t arg2, uint64_t arg3,
+	const uint64_t *msg, size_t count)
+{
+	uint64_t payload[FFA_DIRECT_MSG2_PAYLOAD_REGS] = {0};
+
+	memcpy_s(payload, sizeof(payload), msg, sizeof(uint64_t) * count);
+
+	return (struct ffa_value_ext){.val = {.func = func,
+					      .arg1 = arg1,
+					      .arg2 = arg2,
+					      .arg3 = arg3,
+					      .arg4 = payload[0],
+					      .arg5 = payload[1],
+					      .arg6 = payload[2],
+					      .arg7 = payload[3]},
+				      .arg8 = payload[4],
+				      .arg9 = payload[5],
+				      .arg10 = payload[6],
+				      .arg11 = payload[7],
+				      .arg12 = payload[8],
+				      .arg13 = payload[9],
+				      .arg14 = payload[10],
+				      .arg15 = payload[11],
+				      .arg16 = payload[12],
+				      .arg17 = payload[13]};
+}
+
+/**
+ * Sends a direct message request to the service with the given UUID of
+ * `target_vm_id`, or to any of its services if `uuid` is null, with a payload
+ * of up to 14 registers. Both endpoints must have negotiated FF-A v1.2.
+ *
+ * Returns FFA_MSG_SEND_DIRECT_RESP2 with the response in x4-x17 on success.
+ */
+static inline struct ffa_value_ext ffa_msg_send_direct_req2(
+	ffa_vm_id_t sender_vm_id, ffa_vm_id_t target_vm_id,
+	const struct ffa_uuid *uuid, const uint64_t *msg, size_t count)
+{
+	return ffa_call_ext(ffa_direct_msg2_args(
+		FFA_MSG_SEND_DIRECT_REQ2_64,
+		((uint64_t)sender_vm_id << 16) | target_vm_id,
+		((uint64_t)uuid->uuid[1] << 32) | uuid->uuid[0],
+		((uint64_t)uuid->uuid[3] << 32) | uuid->uuid[2], msg, count));
+}
+
+/**
+ * Responds to a FFA_MSG_SEND_DIRECT_REQ2 with a payload of up to 14 registers.
+ */
+static inline struct ffa_value_ext ffa_msg_send_direct_resp2(
+	ffa_vm_id_t sender_vm_id, ffa_vm_id_t target_vm_id, const uint64_t *msg,
+	size_t count)
+{
+	return ffa_call_ext(ffa_direct_msg2_args(
+		FFA_MSG_SEND_DIRECT_RESP2_64,
+		((uint64_t)sender_vm_id << 16) | target_vm_id, 0, 0, msg,
+		count));
+}
+
 static inline struct ffa_value ffa_notification_bind(
 	ffa_vm_id_t sender_vm_id, ffa_vm_id_t receiver_vm_id, uint32_t flags,
 	ffa_notifications_bitmap_t bitmap)
@@ -59,6 +59,7 @@
 #define FFA_MEM_RETRIEVE_RESP_32            0x84000075
 #define FFA_MEM_RELINQUISH_32               0x84000076
 #define FFA_MEM_RECLAIM_32                  0x84000077
+#define FFA_MEM_OP_RESUME_32                0x84000079
 #define FFA_MEM_FRAG_RX_32                  0x8400007A
 #define FFA_MEM_FRAG_TX_32                  0x8400007B
 #define FFA_NORMAL_WORLD_RESUME             0x8400007C
@@ -84,6 +85,10 @@
 #define FFA_CONSOLE_LOG_32                  0x8400008A
 #define FFA_CONSOLE_LOG_64                  0xC400008A
 
+/* FF-A v1.2 */
+#define FFA_MSG_SEND_DIRECT_REQ2_64         0xC400008D
+#define FFA_MSG_SEND_DIRECT_RESP2_64        0xC400008E
+
 /* FF-A error codes. */
 #define FFA_NOT_SUPPORTED      INT32_C(-1)
 #define FFA_INVALID_PARAMETERS INT32_C(-2)
@@ -201,6 +206,31 @@ struct ffa_partition_msg {
 /* The maximum length possible for a single message. */
 #define FFA_MSG_PAYLOAD_MAX HF_MAILBOX_SIZE
 
+/**
+ * Header at the start of the RX buffer of a partition which has its indirect
+ * messages queued, a Hafnium extension. It is followed by `slot_count` slots
+ * of `slot_size` bytes, message `i` being in slot `i % slot_count`, starting
+ * with its `struct ffa_partition_rxtx_header`.
+ *
+ * Messages from `consumer` up to but not including `producer` are queued. The
+ * receiver releases those it has read by passing their number to
+ * FFA_RX_RELEASE, which leaves any messages queued since in the buffer.
+ */
+struct ffa_partition_msg_queue {
+	uint32_t producer;
+	uint32_t consumer;
+	uint32_t slot_count;
+	uint32_t slot_size;
+	uint8_t slots[];
+};
+
+static inline struct ffa_partition_rxtx_header *ffa_partition_msg_queue_slot(
+	struct ffa_partition_msg_queue *queue, uint32_t index)
+{
+	return (struct ffa_partition_rxtx_header *)&queue
+		->slots[(index % queue->slot_count) * queue->slot_size];
+}
+
 enum ffa_data_access {
 	FFA_DATA_ACCESS_NOT_SPECIFIED,
 	FFA_DATA_ACCESS_RO,
@@ -342,6 +372,28 @@ struct ffa_value {
 	uint64_t arg7;
 };
 
+/**
+ * Parameter and return type of the FF-A v1.2 functions which also pass
+ * registers x8-x17, i.e. FFA_MSG_SEND_DIRECT_REQ2 and
+ * FFA_MSG_SEND_DIRECT_RESP2.
+ */
+struct ffa_value_ext {
+	struct ffa_value val;
+	uint64_t arg8;
+	uint64_t arg9;
+	uint64_t arg10;
+	uint64_t arg11;
+	uint64_t arg12;
+	uint64_t arg13;
+	uint64_t arg14;
+	uint64_t arg15;
+	uint64_t arg16;
+	uint64_t arg17;
+};
+
+/** Number of registers, x4-x17, carrying the payload of a direct message 2. */
+#define FFA_DIRECT_MSG2_PAYLOAD_REGS 14
+
 static inline uint32_t ffa_func_id(struct ffa_value args)
 {
 	return args.func;
@@ -465,6 +517,17 @@ static inline bool ffa_uuid_is_null(const struct ffa_uuid *uuid)
 	       (uuid->uuid[2] == 0) && (uuid->uuid[3] == 0);
 }
 
+/**
+ * Unpacks the UUID passed in x2/x3 of FFA_MSG_SEND_DIRECT_REQ2, the low and
+ * high 64 bits of the UUID respectively.
+ */
+static inline void ffa_uuid_from_u64x2(uint64_t lo, uint64_t hi,
+				       struct ffa_uuid *uuid)
+{
+	ffa_uuid_init((uint32_t)lo, (uint32_t)(lo >> 32), (uint32_t)hi,
+		      (uint32_t)(hi >> 32), uuid);
+}
+
 /**
  * Flags to determine the partition properties, as required by
  * FFA_PARTITION_INFO_GET.
@@ -1012,4 +1075,4 @@ uint32_t ffa_memory_fragment_init(
 	uint32_t constituent_count, uint32_t *fragment_length);
 void ffa_endpoint_rx_tx_descriptor_init(
 	struct ffa_endpoint_rx_tx_descriptor *desc, ffa_vm_id_t endpoint_id,
-	uint64_t rx_address, uint64_t tx_address);
+	uint64_t rx_address, uint64_t tx_address, uint32_t page_count);
@@ -8,6 +8,7 @@
 
 #include "hf/api.h"
 
+#include "hf/arch/barriers.h"
 #include "hf/arch/cpu.h"
 #include "hf/arch/ffa.h"
 #include "hf/arch/mm.h"
@@ -60,13 +61,39 @@ static_assert(MM_PPOOL_ENTRY_SIZE >= HF_MAILBOX_SIZE,
 
 static struct mpool api_page_pool;
 
+/**
+ * Per-CPU magazines in front of `api_page_pool`, so that memory sharing
+ * operations running concurrently on different CPUs don't all serialise on its
+ * lock.
+ */
+static struct mpool api_cpu_page_pools[MAX_CPUS];
+
 /**
  * Initialises the API page pool by taking ownership of the contents of the
  * given page pool.
  */
 void api_init(struct mpool *ppool)
 {
+	size_t i;
+
 	mpool_init_from(&api_page_pool, ppool);
+
+	for (i = 0; i < MAX_CPUS; i++) {
+		mpool_init_magazine(&api_cpu_page_pools[i], &api_page_pool);
+	}
+}
+
+/**
+ * Returns the page pool to allocate from on the CPU the given vCPU is running
+ * on.
+ */
+struct mpool *api_page_pool_for(const struct vcpu *current)
+{
+	size_t index = cpu_index(current->cpu);
+
+	CHECK(index < MAX_CPUS);
+
+	return &api_cpu_page_pools[index];
 }
 
 /**
@@ -90,6 +117,34 @@ struct vcpu *api_ffa_get_vm_vcpu(struct vm *vm, struct vcpu *current)
 	return vcpu;
 }
 
+/**
+ * Hands the physical CPU over to the corresponding vCPU of the VM whose ID is
+ * given, passing it `to_ret` in x0-x7, and moves the current vCPU, which the
+ * caller has locked, to `vcpu_state`.
+ *
+ * Direct messages use this with the lock they already hold, as the receiver of
+ * a request, or the sender of the request being answered, is known to be
+ * waiting for it, so nothing else needs updating for the switch.
+ */
+static struct vcpu *api_switch_to_vm_locked(struct vcpu_locked current_locked,
+					    struct ffa_value to_ret,
+					    enum vcpu_state vcpu_state,
+					    ffa_vm_id_t to_id)
+{
+	struct vm *to_vm = vm_find(to_id);
+	struct vcpu *next = api_ffa_get_vm_vcpu(to_vm, current_locked.vcpu);
+
+	CHECK(next != NULL);
+
+	/* Set the return value for the target VM. */
+	arch_regs_set_retval(&next->regs, to_ret);
+
+	/* Set the current vCPU state. */
+	current_locked.vcpu->state = vcpu_state;
+
+	return next;
+}
+
 /**
  * Switches the physical CPU back to the corresponding vCPU of the VM whose ID
  * is given as argument of the function.
@@ -106,18 +161,11 @@ static struct vcpu *api_switch_to_vm(struct vcpu *current,
 				     enum vcpu_state vcpu_state,
 				     ffa_vm_id_t to_id)
 {
-	struct vm *to_vm = vm_find(to_id);
-	struct vcpu *next = api_ffa_get_vm_vcpu(to_vm, current);
+	struct vcpu_locked current_locked = vcpu_lock(current);
+	struct vcpu *next = api_switch_to_vm_locked(current_locked, to_ret,
+						    vcpu_state, to_id);
 
-	CHECK(next != NULL);
-
-	/* Set the return value for the target VM. */
-	arch_regs_set_retval(&next->regs, to_ret);
-
-	/* Set the current vCPU state. */
-	sl_lock(&current->lock);
-	current->state = vcpu_state;
-	sl_unlock(&current->lock);
+	vcpu_unlock(&current_locked);
 
 	return next;
 }
@@ -373,7 +421,7 @@ static struct ffa_value send_versioned_partition_info_descriptors(
 
 		partition_info_size = sizeof(struct ffa_partition_info_v1_0);
 		buffer_size = partition_info_size * vm_count;
-		if (buffer_size > HF_MAILBOX_SIZE) {
+		if (buffer_size > vm->mailbox.size) {
 			dlog_error(
 				"Partition information does not fit in the "
 				"VM's RX "
@@ -394,7 +442,7 @@ static struct ffa_value send_versioned_partition_info_descriptors(
 	} else {
 		partition_info_size = sizeof(struct ffa_partition_info);
 		buffer_size = partition_info_size * vm_count;
-		if (buffer_size > HF_MAILBOX_SIZE) {
+		if (buffer_size > vm->mailbox.size) {
 			dlog_error(
 				"Partition information does not fit in the "
 				"VM's RX "
@@ -404,7 +452,7 @@ static struct ffa_value send_versioned_partition_info_descriptors(
 
 		/* Populate the VM's RX buffer with the partition information.
 		 */
-		memcpy_s(vm->mailbox.recv, HF_MAILBOX_SIZE, partitions,
+		memcpy_s(vm->mailbox.recv, vm->mailbox.size, partitions,
 			 buffer_size);
 	}
 
@@ -963,10 +1011,13 @@ struct ffa_value api_ffa_run(ffa_vm_id_t vm_id, ffa_vcpu_index_t vcpu_idx,
 		return ret;
 	}
 
-	if (plat_ffa_run_forward(vm_id, vcpu_idx, &ret)) {
+	if (plat_ffa_run_forward(vm_id, vcpu_idx, current, &ret)) {
 		return ret;
 	}
 
+	/* Make some progress clearing memory relinquished to be cleared. */
+	ffa_memory_clear_pending(api_page_pool_for(current));
+
 	/* The requested VM must exist. */
 	vm = vm_find(vm_id);
 	if (vm == NULL) {
@@ -1160,6 +1211,8 @@ struct ffa_value api_vm_configure_pages(
 	uint32_t orig_send_mode = 0;
 	uint32_t orig_recv_mode = 0;
 	uint32_t extra_attributes;
+	uint16_t max_page_count;
+	uint64_t size;
 
 	/* We only allow these to be setup once. */
 	if (vm_locked.vm->mailbox.send || vm_locked.vm->mailbox.recv) {
@@ -1167,11 +1220,21 @@ struct ffa_value api_vm_configure_pages(
 		goto out;
 	}
 
-	/* Hafnium only supports a fixed size of RX/TX buffers. */
-	if (page_count != HF_MAILBOX_SIZE / FFA_PAGE_SIZE) {
+	/*
+	 * Buffers may be as large as the VM's manifest allows, so that memory
+	 * region descriptors with many constituents fit in one. Endpoints of
+	 * the other world have no manifest here, so the platform limit applies.
+	 */
+	max_page_count = vm_id_is_current_world(vm_locked.vm->id)
+				 ? vm_locked.vm->mailbox.max_page_count
+				 : MAX_RXTX_PAGES;
+	if (page_count == 0 || page_count > max_page_count) {
+		dlog_verbose("RX/TX buffers of %d pages not supported.\n",
+			     page_count);
 		ret = ffa_error(FFA_INVALID_PARAMETERS);
 		goto out;
 	}
+	size = (uint64_t)page_count * FFA_PAGE_SIZE;
 
 	/* Fail if addresses are not page-aligned. */
 	if (!is_aligned(ipa_addr(send), PAGE_SIZE) ||
@@ -1180,14 +1243,22 @@ struct ffa_value api_vm_configure_pages(
 		goto out;
 	}
 
+	/* Fail if either buffer wraps around the end of the address space. */
+	if (ipa_addr(send) > UINTPTR_MAX - size ||
+	    ipa_addr(recv) > UINTPTR_MAX - size) {
+		ret = ffa_error(FFA_INVALID_PARAMETERS);
+		goto out;
+	}
+
 	/* Convert to physical addresses. */
 	pa_send_begin = pa_from_ipa(send);
-	pa_send_end = pa_add(pa_send_begin, HF_MAILBOX_SIZE);
+	pa_send_end = pa_add(pa_send_begin, size);
 	pa_recv_begin = pa_from_ipa(recv);
-	pa_recv_end = pa_add(pa_recv_begin, HF_MAILBOX_SIZE);
+	pa_recv_end = pa_add(pa_recv_begin, size);
 
-	/* Fail if the same page is used for the send and receive pages. */
-	if (pa_addr(pa_send_begin) == pa_addr(pa_recv_begin)) {
+	/* Fail if any page is used for both the send and receive buffers. */
+	if (pa_addr(pa_send_begin) < pa_addr(pa_recv_end) &&
+	    pa_addr(pa_recv_begin) < pa_addr(pa_send_end)) {
 		ret = ffa_error(FFA_INVALID_PARAMETERS);
 		goto out;
 	}
@@ -1198,7 +1269,7 @@ struct ffa_value api_vm_configure_pages(
 		 * Ensure the pages are valid, owned and exclusive to the VM and
 		 * that the VM has the required access to the memory.
 		 */
-		if (!vm_mem_get_mode(vm_locked, send, ipa_add(send, PAGE_SIZE),
+		if (!vm_mem_get_mode(vm_locked, send, ipa_add(send, size),
 				     &orig_send_mode) ||
 		    !api_mode_valid_owned_and_exclusive(orig_send_mode) ||
 		    (orig_send_mode & MM_MODE_R) == 0 ||
@@ -1210,7 +1281,7 @@ struct ffa_value api_vm_configure_pages(
 			goto out;
 		}
 
-		if (!vm_mem_get_mode(vm_locked, recv, ipa_add(recv, PAGE_SIZE),
+		if (!vm_mem_get_mode(vm_locked, recv, ipa_add(recv, size),
 				     &orig_recv_mode) ||
 		    !api_mode_valid_owned_and_exclusive(orig_recv_mode) ||
 		    (orig_recv_mode & MM_MODE_R) == 0) {
@@ -1274,6 +1345,7 @@ struct ffa_value api_vm_configure_pages(
 				     extra_attributes, local_page_pool)) {
 		goto fail_undo_send_and_recv;
 	}
+	vm_locked.vm->mailbox.size = size;
 
 	ret = (struct ffa_value){.func = FFA_SUCCESS_32};
 	goto out;
@@ -1339,6 +1411,7 @@ static void api_get_rxtx_description(struct vm_locked vm_locked, ipaddr_t *send,
 struct ffa_value api_ffa_rxtx_map(ipaddr_t send, ipaddr_t recv,
 				  uint32_t page_count, struct vcpu *current)
 {
+	struct mpool *page_pool = api_page_pool_for(current);
 	struct vm *vm = current->vm;
 	struct ffa_value ret;
 	struct vm_locked vm_locked;
@@ -1368,7 +1441,7 @@ struct ffa_value api_ffa_rxtx_map(ipaddr_t send, ipaddr_t recv,
 	 * thread. This is to ensure the original mapping can be restored if any
 	 * stage of the process fails.
 	 */
-	mpool_init_with_fallback(&local_page_pool, &api_page_pool);
+	mpool_init_with_fallback(&local_page_pool, page_pool);
 
 	mm_stage1_locked = mm_lock_stage1();
 
@@ -1441,11 +1514,10 @@ struct ffa_value api_ffa_rxtx_unmap(ffa_vm_id_t allocator_id,
 		goto out;
 	}
 
-	/* Currently a mailbox size of 1 page is assumed. */
 	send_pa_begin = pa_from_va(va_from_ptr(vm->mailbox.send));
-	send_pa_end = pa_add(send_pa_begin, HF_MAILBOX_SIZE);
+	send_pa_end = pa_add(send_pa_begin, vm->mailbox.size);
 	recv_pa_begin = pa_from_va(va_from_ptr(vm->mailbox.recv));
-	recv_pa_end = pa_add(recv_pa_begin, HF_MAILBOX_SIZE);
+	recv_pa_end = pa_add(recv_pa_begin, vm->mailbox.size);
 
 	mm_stage1_locked = mm_lock_stage1();
 
@@ -1473,6 +1545,7 @@ struct ffa_value api_ffa_rxtx_unmap(ffa_vm_id_t allocator_id,
 
 	vm->mailbox.send = NULL;
 	vm->mailbox.recv = NULL;
+	vm->mailbox.size = 0;
 	plat_ffa_vm_destroy(vm_locked);
 
 	/* Forward buffer unmapping to SPMC if coming from a VM. */
@@ -1629,6 +1702,103 @@ out:
 	return ret;
 }
 
+/**
+ * Returns the size of each slot of the RX buffer of a VM which queues its
+ * indirect messages.
+ */
+static uint32_t api_msg_queue_slot_size(const struct vm *vm)
+{
+	uint32_t slot_size =
+		(vm->mailbox.size - sizeof(struct ffa_partition_msg_queue)) /
+		vm->mailbox.queue_slots;
+
+	return slot_size - slot_size % sizeof(uint64_t);
+}
+
+/**
+ * Returns true if an indirect message can be added to the messages already
+ * queued in the VM's RX buffer.
+ */
+static bool api_msg_queue_has_space(struct vm_locked to_locked)
+{
+	struct mailbox *mailbox = &to_locked.vm->mailbox;
+
+	return mailbox->queue_slots != 0 && mailbox->recv != NULL &&
+	       mailbox->state != MAILBOX_STATE_EMPTY &&
+	       mailbox->recv_func == FFA_MSG_SEND2_32 &&
+	       mailbox->queue_producer - mailbox->queue_consumer <
+		       mailbox->queue_slots;
+}
+
+/**
+ * Adds an indirect message to the queue in the VM's RX buffer, starting a new
+ * queue if the buffer is empty. The receiver may be reading the queue
+ * concurrently, so the message is written before the index which covers it.
+ */
+static void api_msg_queue_push(struct vm_locked to_locked, const void *msg,
+			       uint32_t msg_size)
+{
+	struct mailbox *mailbox = &to_locked.vm->mailbox;
+	struct ffa_partition_msg_queue *queue = mailbox->recv;
+	uint32_t slot_size = api_msg_queue_slot_size(to_locked.vm);
+
+	if (mailbox->state == MAILBOX_STATE_EMPTY) {
+		mailbox->queue_producer = 0;
+		mailbox->queue_consumer = 0;
+		queue->producer = 0;
+		queue->consumer = 0;
+		queue->slot_count = mailbox->queue_slots;
+		queue->slot_size = slot_size;
+	}
+
+	memcpy_s(ffa_partition_msg_queue_slot(queue, mailbox->queue_producer),
+		 slot_size, msg, msg_size);
+	mailbox->queue_producer++;
+	memory_ordering_barrier();
+	queue->producer = mailbox->queue_producer;
+
+	mailbox->recv_size = sizeof(struct ffa_partition_msg_queue) +
+			     mailbox->queue_slots * slot_size;
+}
+
+/**
+ * Releases `count` messages from the front of the queue in the VM's RX buffer.
+ *
+ * Returns true if that leaves the queue empty so the whole buffer is to be
+ * released, or false with the value to return in `ret` otherwise.
+ */
+static bool api_msg_queue_release(struct vm_locked vm_locked, uint32_t count,
+				  struct ffa_value *ret)
+{
+	struct mailbox *mailbox = &vm_locked.vm->mailbox;
+	struct ffa_partition_msg_queue *queue = mailbox->recv;
+
+	if (mailbox->queue_slots == 0 ||
+	    mailbox->state == MAILBOX_STATE_EMPTY ||
+	    mailbox->recv_func != FFA_MSG_SEND2_32 ||
+	    count > mailbox->queue_producer - mailbox->queue_consumer) {
+		dlog_verbose("Can't release %d queued messages of VM %#x.\n",
+			     count, vm_locked.vm->id);
+		*ret = ffa_error(FFA_INVALID_PARAMETERS);
+		return false;
+	}
+
+	if (mailbox->state != MAILBOX_STATE_READ) {
+		*ret = ffa_error(FFA_DENIED);
+		return false;
+	}
+
+	mailbox->queue_consumer += count;
+	queue->consumer = mailbox->queue_consumer;
+
+	if (mailbox->queue_consumer == mailbox->queue_producer) {
+		return true;
+	}
+
+	*ret = (struct ffa_value){.func = FFA_SUCCESS_32};
+	return false;
+}
+
 /**
  * Copies data from the sender's send buffer to the recipient's receive buffer
  * and notifies the receiver.
@@ -1648,6 +1818,7 @@ struct ffa_value api_ffa_msg_send2(ffa_vm_id_t sender_vm_id, uint32_t flags,
 	ffa_vm_id_t receiver_id;
 	uint32_t msg_size;
 	ffa_notifications_bitmap_t rx_buffer_full;
+	bool queued;
 
 	/* Only Hypervisor can set `sender_vm_id` when forwarding messages. */
 	if (from->id != HF_HYPERVISOR_VM_ID && sender_vm_id != 0) {
@@ -1738,8 +1909,14 @@ struct ffa_value api_ffa_msg_send2(ffa_vm_id_t sender_vm_id, uint32_t flags,
 		goto out;
 	}
 
-	if (to->mailbox.state != MAILBOX_STATE_EMPTY ||
-	    to->mailbox.recv == NULL) {
+	/*
+	 * A receiver which queues messages may get more while it holds its RX
+	 * buffer, as long as there is space left in the queue.
+	 */
+	queued = api_msg_queue_has_space(to_locked);
+
+	if (!queued && (to->mailbox.state != MAILBOX_STATE_EMPTY ||
+			to->mailbox.recv == NULL)) {
 		dlog_error(
 			"Cannot deliver message to VM %#x, RX buffer not "
 			"ready.\n",
@@ -1748,13 +1925,10 @@ struct ffa_value api_ffa_msg_send2(ffa_vm_id_t sender_vm_id, uint32_t flags,
 		goto out;
 	}
 
-	/* Acquire receiver's RX buffer. */
-	if (!plat_ffa_acquire_receiver_rx(to_locked, &ret)) {
-		dlog_error("Failed to acquire RX buffer for VM %#x\n", to->id);
-		goto out;
-	}
-
-	/* Check the size of transfer. */
+	/*
+	 * Check the size of transfer before acquiring the receiver's RX buffer,
+	 * which would otherwise have to be given back.
+	 */
 	msg_size = FFA_RXTX_HEADER_SIZE + header.size;
 	if ((msg_size > FFA_PARTITION_MSG_PAYLOAD_MAX) ||
 	    (header.size > FFA_PARTITION_MSG_PAYLOAD_MAX)) {
@@ -1763,12 +1937,34 @@ struct ffa_value api_ffa_msg_send2(ffa_vm_id_t sender_vm_id, uint32_t flags,
 		goto out;
 	}
 
+	if (to->mailbox.queue_slots != 0 &&
+	    msg_size > api_msg_queue_slot_size(to)) {
+		dlog_error("Message is too big for queue slot.\n");
+		ret = ffa_error(FFA_INVALID_PARAMETERS);
+		goto out;
+	}
+
+	/* Acquire receiver's RX buffer. */
+	if (!queued && !plat_ffa_acquire_receiver_rx(to_locked, &ret)) {
+		dlog_error("Failed to acquire RX buffer for VM %#x\n", to->id);
+		goto out;
+	}
+
 	/* Copy data. */
-	memcpy_s(to->mailbox.recv, FFA_MSG_PAYLOAD_MAX, from_msg, msg_size);
-	to->mailbox.recv_size = msg_size;
+	if (to->mailbox.queue_slots != 0) {
+		api_msg_queue_push(to_locked, from_msg, msg_size);
+	} else {
+		memcpy_s(to->mailbox.recv, FFA_MSG_PAYLOAD_MAX, from_msg,
+			 msg_size);
+		to->mailbox.recv_size = msg_size;
+	}
 	to->mailbox.recv_sender = sender_id;
 	to->mailbox.recv_func = FFA_MSG_SEND2_32;
-	to->mailbox.state = MAILBOX_STATE_RECEIVED;
+
+	/* The receiver keeps its buffer if it's reading earlier messages. */
+	if (!queued) {
+		to->mailbox.state = MAILBOX_STATE_RECEIVED;
+	}
 
 	rx_buffer_full = plat_ffa_is_vm_id(sender_id)
 				 ? FFA_NOTIFICATION_HYP_BUFFER_FULL_MASK
@@ -1985,6 +2181,12 @@ int64_t api_mailbox_waiter_get(ffa_vm_id_t vm_id, const struct vcpu *current)
  * caller must have copied out all data they wish to preserve as new messages
  * will overwrite the old and will arrive asynchronously.
  *
+ * If `count` is non-zero, only that many messages are released from the front
+ * of the caller's message queue, and the mailbox is released once the queue is
+ * empty. The count is passed in w2, which the FF-A specification reserves as
+ * MBZ: this is a Hafnium extension, only accepted from VMs which queue their
+ * messages, so that others still get FFA_INVALID_PARAMETERS for a non-zero w2.
+ *
  * Returns:
  *  - FFA_ERROR FFA_INVALID_PARAMETERS if message is forwarded to SPMC but
  *    there's no buffer pair mapped.
@@ -1994,7 +2196,7 @@ int64_t api_mailbox_waiter_get(ffa_vm_id_t vm_id, const struct vcpu *current)
  *    needs to wake up or kick waiters. Waiters should be retrieved by calling
  *    hf_mailbox_waiter_get.
  */
-struct ffa_value api_ffa_rx_release(ffa_vm_id_t receiver_id,
+struct ffa_value api_ffa_rx_release(ffa_vm_id_t receiver_id, uint32_t count,
 				    struct vcpu *current, struct vcpu **next)
 {
 	struct vm *current_vm = current->vm;
@@ -2028,6 +2230,10 @@ struct ffa_value api_ffa_rx_release(ffa_vm_id_t receiver_id,
 		return ffa_error(FFA_INVALID_PARAMETERS);
 	}
 
+	if (count != 0 && !api_msg_queue_release(vm_locked, count, &ret)) {
+		goto out;
+	}
+
 	if (!plat_ffa_rx_release_forward(vm_locked, &ret)) {
 		dlog_verbose("RX_RELEASE forward failed for VM ID %#x.\n",
 			     release_vm_id);
@@ -2351,11 +2557,21 @@ struct ffa_value api_ffa_feature_success(uint32_t arg2)
 		.func = FFA_SUCCESS_32, .arg1 = 0U, .arg2 = arg2};
 }
 
+/**
+ * Returns true if `vm` negotiated a version of FF-A providing the direct
+ * messages 2, i.e. FF-A v1.2 or later.
+ */
+static bool api_ffa_dir_msg2_is_supported(struct vm *vm)
+{
+	return vm->ffa_version >= MAKE_FFA_VERSION(1, 2);
+}
+
 /**
  * Discovery function returning information about the implementation of optional
  * FF-A interfaces.
  */
-struct ffa_value api_ffa_features(uint32_t feature_function_id)
+struct ffa_value api_ffa_features(uint32_t feature_function_id,
+				  struct vcpu *current)
 {
 	/*
 	 * According to table 13.8 of FF-A v1.1 Beta 0 spec, bits [30:8] MBZ
@@ -2387,6 +2603,7 @@ struct ffa_value api_ffa_features(uint32_t feature_function_id)
 	case FFA_MEM_RETRIEVE_RESP_32:
 	case FFA_MEM_RELINQUISH_32:
 	case FFA_MEM_RECLAIM_32:
+	case FFA_MEM_OP_RESUME_32:
 	case FFA_MEM_FRAG_RX_32:
 	case FFA_MEM_FRAG_TX_32:
 	case FFA_MSG_SEND_DIRECT_RESP_64:
@@ -2411,6 +2628,16 @@ struct ffa_value api_ffa_features(uint32_t feature_function_id)
 #endif
 		return (struct ffa_value){.func = FFA_SUCCESS_32};
 
+#if (MAKE_FFA_VERSION(1, 2) <= FFA_VERSION_COMPILED)
+	/* FF-A v1.2 features, if the caller negotiated v1.2. */
+	case FFA_MSG_SEND_DIRECT_REQ2_64:
+	case FFA_MSG_SEND_DIRECT_RESP2_64:
+		if (!api_ffa_dir_msg2_is_supported(current->vm)) {
+			return ffa_error(FFA_NOT_SUPPORTED);
+		}
+		return (struct ffa_value){.func = FFA_SUCCESS_32};
+#endif
+
 #if (MAKE_FFA_VERSION(1, 1) <= FFA_VERSION_COMPILED)
 	/* Check support of a feature provided respective feature ID. */
 	case FFA_FEATURE_NPI:
@@ -2426,11 +2653,19 @@ struct ffa_value api_ffa_features(uint32_t feature_function_id)
 
 /**
  * FF-A specification states that x2/w2 Must Be Zero for direct messaging
- * interfaces.
+ * interfaces, and x3 too for FFA_MSG_SEND_DIRECT_RESP2.
+ * FFA_MSG_SEND_DIRECT_REQ2 passes the UUID of the receiver in x2/x3 instead.
  */
-static inline bool api_ffa_dir_msg_is_arg2_zero(struct ffa_value args)
+static inline bool api_ffa_dir_msg_is_mbz_zero(struct ffa_value args)
 {
-	return args.arg2 == 0U;
+	switch (args.func) {
+	case FFA_MSG_SEND_DIRECT_REQ2_64:
+		return true;
+	case FFA_MSG_SEND_DIRECT_RESP2_64:
+		return args.arg2 == 0U && args.arg3 == 0U;
+	default:
+		return args.arg2 == 0U;
+	}
 }
 
 /**
@@ -2461,6 +2696,12 @@ static struct ffa_value api_ffa_dir_msg_value(struct ffa_value args)
 		return api_ffa_value_copy32(args);
 	}
 
+	/* Pass on the UUID of FFA_MSG_SEND_DIRECT_REQ2 in x2/x3. */
+	if (args.func == FFA_MSG_SEND_DIRECT_REQ2_64 ||
+	    args.func == FFA_MSG_SEND_DIRECT_RESP2_64) {
+		return args;
+	}
+
 	return (struct ffa_value){
 		.func = args.func,
 		.arg1 = args.arg1,
@@ -2473,6 +2714,36 @@ static struct ffa_value api_ffa_dir_msg_value(struct ffa_value args)
 	};
 }
 
+/**
+ * Returns the direct message 2 `args` of `current` along with the rest of its
+ * payload, in x8-x17, to pass on to the receiver.
+ */
+static struct ffa_value_ext api_ffa_dir_msg2_value(struct vcpu *current,
+						   struct ffa_value args)
+{
+	struct ffa_value_ext ret = arch_regs_get_args_ext(&current->regs);
+
+	ret.val = args;
+
+	return ret;
+}
+
+/**
+ * Returns true if `current` may use the direct message interface `args.func`:
+ * the direct messages 2 are only available to endpoints which negotiated FF-A
+ * v1.2.
+ */
+static bool api_ffa_dir_msg_is_supported(struct vcpu *current,
+					 struct ffa_value args)
+{
+	if (args.func != FFA_MSG_SEND_DIRECT_REQ2_64 &&
+	    args.func != FFA_MSG_SEND_DIRECT_RESP2_64) {
+		return true;
+	}
+
+	return api_ffa_dir_msg2_is_supported(current->vm);
+}
+
 /**
  * Send an FF-A direct message request.
  */
@@ -2489,7 +2760,11 @@ struct ffa_value api_ffa_msg_send_direct_req(ffa_vm_id_t sender_vm_id,
 	struct two_vcpu_locked vcpus_locked;
 	enum vcpu_state next_state = VCPU_STATE_BLOCKED;
 
-	if (!api_ffa_dir_msg_is_arg2_zero(args)) {
+	if (!api_ffa_dir_msg_is_supported(current, args)) {
+		return ffa_error(FFA_NOT_SUPPORTED);
+	}
+
+	if (!api_ffa_dir_msg_is_mbz_zero(args)) {
 		return ffa_error(FFA_INVALID_PARAMETERS);
 	}
 
@@ -2498,7 +2773,8 @@ struct ffa_value api_ffa_msg_send_direct_req(ffa_vm_id_t sender_vm_id,
 		return ffa_error(FFA_INVALID_PARAMETERS);
 	}
 
-	if (plat_ffa_direct_request_forward(receiver_vm_id, args, &ret)) {
+	if (plat_ffa_direct_request_forward(receiver_vm_id, args, current,
+					    &ret)) {
 		return ret;
 	}
 
@@ -2510,6 +2786,27 @@ struct ffa_value api_ffa_msg_send_direct_req(ffa_vm_id_t sender_vm_id,
 		return ffa_error(FFA_INVALID_PARAMETERS);
 	}
 
+	/*
+	 * FFA_MSG_SEND_DIRECT_REQ2 targets the service of the receiver with
+	 * the given UUID, or any of its services if the UUID is null. The
+	 * receiver must be able to take the payload in x8-x17.
+	 */
+	if (args.func == FFA_MSG_SEND_DIRECT_REQ2_64) {
+		struct ffa_uuid uuid;
+
+		if (!api_ffa_dir_msg2_is_supported(receiver_vm)) {
+			dlog_verbose("Receiver doesn't support FF-A v1.2!\n");
+			return ffa_error(FFA_INVALID_PARAMETERS);
+		}
+
+		ffa_uuid_from_u64x2(args.arg2, args.arg3, &uuid);
+		if (!ffa_uuid_is_null(&uuid) &&
+		    !ffa_uuid_equal(&uuid, &receiver_vm->uuid)) {
+			dlog_verbose("Receiver doesn't implement UUID!\n");
+			return ffa_error(FFA_INVALID_PARAMETERS);
+		}
+	}
+
 	/*
 	 * Check if sender supports sending direct message req, and if
 	 * receiver supports receipt of direct message requests.
@@ -2600,18 +2897,25 @@ struct ffa_value api_ffa_msg_send_direct_req(ffa_vm_id_t sender_vm_id,
 	receiver_vcpu->state = VCPU_STATE_RUNNING;
 	receiver_vcpu->regs_available = false;
 	receiver_vcpu->direct_request_origin_vm_id = sender_vm_id;
+	receiver_vcpu->direct_request_origin_req2 =
+		args.func == FFA_MSG_SEND_DIRECT_REQ2_64;
 
-	arch_regs_set_retval(&receiver_vcpu->regs, api_ffa_dir_msg_value(args));
-
+	/* Switch to receiver vCPU targeted to by direct msg request */
 	assert(next_state == VCPU_STATE_BLOCKED);
-	current->state = VCPU_STATE_BLOCKED;
+	*next = api_switch_to_vm_locked(vcpus_locked.vcpu2,
+					api_ffa_dir_msg_value(args),
+					VCPU_STATE_BLOCKED, receiver_vm_id);
+	assert(*next == receiver_vcpu);
+
+	/* The receiver was passed x0-x7 above, now pass the rest. */
+	if (args.func == FFA_MSG_SEND_DIRECT_REQ2_64) {
+		arch_regs_set_retval_ext(&receiver_vcpu->regs,
+					 api_ffa_dir_msg2_value(current, args));
+	}
 
 	plat_ffa_wind_call_chain_ffa_direct_req(vcpus_locked.vcpu2,
 						vcpus_locked.vcpu1);
 
-	/* Switch to receiver vCPU targeted to by direct msg request */
-	*next = receiver_vcpu;
-
 	if (!receiver_locked.vm->el0_partition) {
 		/*
 		 * If the scheduler in the system is giving CPU cycles to the
@@ -2651,7 +2955,11 @@ struct ffa_value api_ffa_msg_send_direct_resp(ffa_vm_id_t sender_vm_id,
 	struct vcpu_locked current_locked;
 	enum vcpu_state next_state = VCPU_STATE_WAITING;
 
-	if (!api_ffa_dir_msg_is_arg2_zero(args)) {
+	if (!api_ffa_dir_msg_is_supported(current, args)) {
+		return ffa_error(FFA_NOT_SUPPORTED);
+	}
+
+	if (!api_ffa_dir_msg_is_mbz_zero(args)) {
 		return ffa_error(FFA_INVALID_PARAMETERS);
 	}
 
@@ -2684,6 +2992,17 @@ struct ffa_value api_ffa_msg_send_direct_resp(ffa_vm_id_t sender_vm_id,
 		return ffa_error(FFA_DENIED);
 	}
 
+	/*
+	 * A FFA_MSG_SEND_DIRECT_REQ2 must be answered with a
+	 * FFA_MSG_SEND_DIRECT_RESP2, and a FFA_MSG_SEND_DIRECT_REQ with a
+	 * FFA_MSG_SEND_DIRECT_RESP.
+	 */
+	if (current->direct_request_origin_req2 !=
+	    (args.func == FFA_MSG_SEND_DIRECT_RESP2_64)) {
+		vcpu_unlock(&current_locked);
+		return ffa_error(FFA_DENIED);
+	}
+
 	if (api_ffa_is_managed_exit_ongoing(current_locked)) {
 		/*
 		 * Per FF-A v1.1 EAC0 section 8.3.1.2.1 rule 6, SPMC can signal
@@ -2715,10 +3034,10 @@ struct ffa_value api_ffa_msg_send_direct_resp(ffa_vm_id_t sender_vm_id,
 
 	/* Clear direct request origin for the caller. */
 	current->direct_request_origin_vm_id = HF_INVALID_VM_ID;
-
-	vcpu_unlock(&current_locked);
+	current->direct_request_origin_req2 = false;
 
 	if (!vm_id_is_current_world(receiver_vm_id)) {
+		vcpu_unlock(&current_locked);
 		*next = api_switch_to_other_world(
 			current, to_ret,
 			/*
@@ -2726,28 +3045,25 @@ struct ffa_value api_ffa_msg_send_direct_resp(ffa_vm_id_t sender_vm_id,
 			 * waiting state.
 			 */
 			VCPU_STATE_WAITING);
-	} else if (receiver_vm_id == HF_PRIMARY_VM_ID) {
-		*next = api_switch_to_primary(
-			current, to_ret,
-			/*
-			 * Current vcpu sent a direct response. It moves to
-			 * waiting state.
-			 */
-			VCPU_STATE_WAITING);
-	} else if (vm_id_is_current_world(receiver_vm_id)) {
+	} else {
 		/*
-		 * It is expected the receiver_vm_id to be from an SP, otherwise
-		 * 'plat_ffa_is_direct_response_valid' should have
-		 * made function return error before getting to this point.
+		 * The receiver is the primary VM or, as checked by
+		 * 'plat_ffa_is_direct_response_valid', an SP. Current vCPU
+		 * sent a direct response, so it moves to waiting state under
+		 * the lock it already holds.
 		 */
-		*next = api_switch_to_vm(current, to_ret,
-					 /*
-					  * current vcpu sent a direct response.
-					  * It moves to waiting state.
-					  */
-					 VCPU_STATE_WAITING, receiver_vm_id);
-	} else {
-		panic("Invalid direct message response invocation");
+		*next = api_switch_to_vm_locked(current_locked, to_ret,
+						VCPU_STATE_WAITING,
+						receiver_vm_id);
+		vcpu_unlock(&current_locked);
+	}
+
+	/* The requester was passed x0-x7 above, now pass the rest. */
+	if (args.func == FFA_MSG_SEND_DIRECT_RESP2_64) {
+		struct ffa_value_ext to_ret_ext =
+			api_ffa_dir_msg2_value(current, to_ret);
+
+		arch_regs_set_retval_ext(&(*next)->regs, to_ret_ext);
 	}
 
 	plat_ffa_unwind_call_chain_ffa_direct_resp(current, *next);
@@ -2785,14 +3101,97 @@ static bool api_memory_region_check_flags(
 	return true;
 }
 
+/**
+ * Returns the length of the first part of a memory region descriptor, of which
+ * `fragment_length` bytes are in the sender's TX buffer, to pass on in a page
+ * from the page pool. If the fragment doesn't fit in a page, the first part
+ * ends at the last constituent which does, so that the rest can be passed on
+ * in whole constituents by `api_ffa_mem_send_fragments`.
+ *
+ * Returns 0 if the fragment can't be split so.
+ */
+static uint32_t api_ffa_mem_send_first_length(
+	struct ffa_memory_region *memory_region, uint32_t fragment_length)
+{
+	uint32_t composite_offset =
+		memory_region->receivers[0].composite_memory_region_offset;
+	uint32_t constituents_offset;
+	uint32_t first_length;
+
+	if (fragment_length <= MM_PPOOL_ENTRY_SIZE) {
+		return fragment_length;
+	}
+
+	constituents_offset =
+		composite_offset + sizeof(struct ffa_composite_memory_region);
+	if (composite_offset == 0 ||
+	    constituents_offset > MM_PPOOL_ENTRY_SIZE) {
+		return 0;
+	}
+
+	first_length = MM_PPOOL_ENTRY_SIZE -
+		       (MM_PPOOL_ENTRY_SIZE - constituents_offset) %
+			       sizeof(struct ffa_memory_region_constituent);
+	if ((fragment_length - first_length) %
+		    sizeof(struct ffa_memory_region_constituent) !=
+	    0) {
+		return 0;
+	}
+
+	return first_length;
+}
+
+/**
+ * Passes on the part of a memory region descriptor in the sender's TX buffer
+ * from `offset` to `length` a page at a time, while `ret`, the result of
+ * passing on the part before it, asks for more. Buffers larger than a page can
+ * so carry whole descriptors without FFA_MEM_FRAG_TX calls, while they are
+ * still stored in page-sized fragments.
+ *
+ * If a page can't be allocated, the sender is told how much was passed on so
+ * far, as if that was all it sent, and can send the rest with FFA_MEM_FRAG_TX.
+ */
+static struct ffa_value api_ffa_mem_send_fragments(
+	struct vm_locked from_locked, const uint8_t *from_msg, uint32_t offset,
+	uint32_t length, struct ffa_value ret, struct mpool *page_pool)
+{
+	while (ret.func == FFA_MEM_FRAG_RX_32 && offset < length) {
+		uint32_t fragment_length = length - offset;
+		void *fragment_copy;
+
+		if (fragment_length > MM_PPOOL_ENTRY_SIZE) {
+			fragment_length = MM_PPOOL_ENTRY_SIZE;
+		}
+
+		fragment_copy = mpool_alloc(page_pool);
+		if (fragment_copy == NULL) {
+			dlog_verbose("Failed to allocate fragment copy.\n");
+			break;
+		}
+		memcpy_s(fragment_copy, MM_PPOOL_ENTRY_SIZE, &from_msg[offset],
+			 fragment_length);
+
+		/* This takes ownership of the fragment copy. */
+		ret = ffa_memory_send_continue(from_locked, fragment_copy,
+					       fragment_length,
+					       ffa_frag_handle(ret), page_pool);
+		offset += fragment_length;
+	}
+
+	return ret;
+}
+
 struct ffa_value api_ffa_mem_send(uint32_t share_func, uint32_t length,
 				  uint32_t fragment_length, ipaddr_t address,
 				  uint32_t page_count, struct vcpu *current)
 {
+	struct mpool *page_pool = api_page_pool_for(current);
 	struct vm *from = current->vm;
 	struct vm *to;
 	const void *from_msg;
+	uint32_t from_msg_size;
 	struct ffa_memory_region *memory_region;
+	uint32_t first_length;
 	struct ffa_value ret;
 	bool targets_other_world = false;
 
@@ -2829,6 +3228,7 @@ struct ffa_value api_ffa_mem_send(uint32_t share_func, uint32_t length,
 	 */
 	sl_lock(&from->lock);
 	from_msg = from->mailbox.send;
+	from_msg_size = from->mailbox.size;
 	sl_unlock(&from->lock);
 
 	if (from_msg == NULL) {
@@ -2838,18 +3238,20 @@ struct ffa_value api_ffa_mem_send(uint32_t share_func, uint32_t length,
 	/*
 	 * Copy the memory region descriptor to a fresh page from the memory
 	 * pool. This prevents the sender from changing it underneath us, and
-	 * also lets us keep it around in the share state table if needed.
+	 * also lets us keep it around in the share state table if needed. If
+	 * it doesn't fit in a page, only the first part is copied for now.
 	 */
-	if (fragment_length > HF_MAILBOX_SIZE ||
-	    fragment_length > MM_PPOOL_ENTRY_SIZE) {
+	if (fragment_length > from_msg_size) {
 		return ffa_error(FFA_INVALID_PARAMETERS);
 	}
-	memory_region = (struct ffa_memory_region *)mpool_alloc(&api_page_pool);
+	memory_region = (struct ffa_memory_region *)mpool_alloc(page_pool);
 	if (memory_region == NULL) {
 		dlog_verbose("Failed to allocate memory region copy.\n");
 		return ffa_error(FFA_NO_MEMORY);
 	}
-	memcpy_s(memory_region, MM_PPOOL_ENTRY_SIZE, from_msg, fragment_length);
+	memcpy_s(memory_region, MM_PPOOL_ENTRY_SIZE, from_msg,
+		 fragment_length < MM_PPOOL_ENTRY_SIZE ? fragment_length
+						       : MM_PPOOL_ENTRY_SIZE);
 
 	/* The sender must match the caller. */
 	if (memory_region->sender != from->id) {
@@ -2921,6 +3323,16 @@ struct ffa_value api_ffa_mem_send(uint32_t share_func, uint32_t length,
 		}
 	}
 
+	first_length = api_ffa_mem_send_first_length(memory_region,
+						     fragment_length);
+	if (first_length == 0 ||
+	    (targets_other_world && first_length != fragment_length)) {
+		dlog_verbose("Can't split fragment of length %d.\n",
+			     fragment_length);
+		ret = ffa_error(FFA_INVALID_PARAMETERS);
+		goto out;
+	}
+
 	/* Allow for one memory region to be shared to the TEE. */
 	if (targets_other_world) {
 		assert(memory_region->receiver_count == 1 &&
@@ -2938,7 +3350,7 @@ struct ffa_value api_ffa_mem_send(uint32_t share_func, uint32_t length,
 
 		ret = ffa_memory_tee_send(
 			vm_to_from_lock.vm2, vm_to_from_lock.vm1, memory_region,
-			length, fragment_length, share_func, &api_page_pool);
+			length, fragment_length, share_func, page_pool);
 		/*
 		 * ffa_tee_memory_send takes ownership of the memory_region, so
 		 * make sure we don't free it.
@@ -2952,20 +3364,23 @@ struct ffa_value api_ffa_mem_send(uint32_t share_func, uint32_t length,
 		struct vm_locked from_locked = vm_lock(from);
 
 		ret = ffa_memory_send(from_locked, memory_region, length,
-				      fragment_length, share_func,
-				      &api_page_pool);
+				      first_length, share_func, page_pool);
 		/*
 		 * ffa_memory_send takes ownership of the memory_region, so
 		 * make sure we don't free it.
 		 */
 		memory_region = NULL;
 
+		ret = api_ffa_mem_send_fragments(from_locked, from_msg,
+						 first_length, fragment_length,
+						 ret, page_pool);
+
 		vm_unlock(&from_locked);
 	}
 
 out:
 	if (memory_region != NULL) {
-		mpool_free(&api_page_pool, memory_region);
+		mpool_free(page_pool, memory_region);
 	}
 
 	return ret;
@@ -2976,6 +3391,7 @@ struct ffa_value api_ffa_mem_retrieve_req(uint32_t length,
 					  ipaddr_t address, uint32_t page_count,
 					  struct vcpu *current)
 {
+	struct mpool *page_pool = api_page_pool_for(current);
 	struct vm *to = current->vm;
 	struct vm_locked to_locked;
 	const void *to_msg;
@@ -2999,7 +3415,7 @@ struct ffa_value api_ffa_mem_retrieve_req(uint32_t length,
 	retrieve_request =
 		(struct ffa_memory_region *)cpu_get_buffer(current->cpu);
 	message_buffer_size = cpu_get_buffer_size(current->cpu);
-	if (length > HF_MAILBOX_SIZE || length > message_buffer_size) {
+	if (length > message_buffer_size) {
 		dlog_verbose("Retrieve request too long.\n");
 		return ffa_error(FFA_INVALID_PARAMETERS);
 	}
@@ -3013,6 +3429,12 @@ struct ffa_value api_ffa_mem_retrieve_req(uint32_t length,
 		goto out;
 	}
 
+	if (length > to->mailbox.size) {
+		dlog_verbose("Retrieve request larger than TX buffer.\n");
+		ret = ffa_error(FFA_INVALID_PARAMETERS);
+		goto out;
+	}
+
 	/*
 	 * Copy the retrieve request descriptor to an internal buffer, so that
 	 * the caller can't change it underneath us.
@@ -3030,7 +3452,7 @@ struct ffa_value api_ffa_mem_retrieve_req(uint32_t length,
 	}
 
 	ret = ffa_memory_retrieve(to_locked, retrieve_request, length,
-				  &api_page_pool);
+				  page_pool);
 
 out:
 	vm_unlock(&to_locked);
@@ -3039,6 +3461,7 @@ out:
 
 struct ffa_value api_ffa_mem_relinquish(struct vcpu *current)
 {
+	struct mpool *page_pool = api_page_pool_for(current);
 	struct vm *from = current->vm;
 	struct vm_locked from_locked;
 	const void *from_msg;
@@ -3070,7 +3493,7 @@ struct ffa_value api_ffa_mem_relinquish(struct vcpu *current)
 	relinquish_request =
 		(struct ffa_mem_relinquish *)cpu_get_buffer(current->cpu);
 	message_buffer_size = cpu_get_buffer_size(current->cpu);
-	if (length > HF_MAILBOX_SIZE || length > message_buffer_size) {
+	if (length > from->mailbox.size || length > message_buffer_size) {
 		dlog_verbose("Relinquish message too long.\n");
 		ret = ffa_error(FFA_INVALID_PARAMETERS);
 		goto out;
@@ -3087,8 +3510,7 @@ struct ffa_value api_ffa_mem_relinquish(struct vcpu *current)
 		goto out;
 	}
 
-	ret = ffa_memory_relinquish(from_locked, relinquish_request,
-				    &api_page_pool);
+	ret = ffa_memory_relinquish(from_locked, relinquish_request, page_pool);
 
 out:
 	vm_unlock(&from_locked);
@@ -3099,14 +3521,39 @@ struct ffa_value api_ffa_mem_reclaim(ffa_memory_handle_t handle,
 				     ffa_memory_region_flags_t flags,
 				     struct vcpu *current)
 {
+	struct mpool *page_pool = api_page_pool_for(current);
 	struct vm *to = current->vm;
 	struct ffa_value ret;
 
 	if (plat_ffa_memory_handle_allocated_by_current_world(handle)) {
-		struct vm_locked to_locked = vm_lock(to);
+		struct vm *from = vm_find(
+			ffa_memory_interrupted_retriever(handle, page_pool));
+		struct vm_locked to_locked;
+
+		/*
+		 * A receiver which was interrupted retrieving the memory, and
+		 * may never resume, would keep it from being reclaimed, so its
+		 * retrieve is aborted first. This needs its lock as well.
+		 */
+		if (from != NULL && from != to) {
+			struct two_vm_locked vm_to_from_lock =
+				vm_lock_both(to, from);
+
+			ret = ffa_memory_retrieve_abort(vm_to_from_lock.vm1,
+							vm_to_from_lock.vm2,
+							handle, page_pool);
 
-		ret = ffa_memory_reclaim(to_locked, handle, flags,
-					 &api_page_pool);
+			vm_unlock(&vm_to_from_lock.vm1);
+			vm_unlock(&vm_to_from_lock.vm2);
+
+			if (ret.func != FFA_SUCCESS_32) {
+				return ret;
+			}
+		}
+
+		to_locked = vm_lock(to);
+
+		ret = ffa_memory_reclaim(to_locked, handle, flags, page_pool);
 
 		vm_unlock(&to_locked);
 	} else {
@@ -3115,7 +3562,7 @@ struct ffa_value api_ffa_mem_reclaim(ffa_memory_handle_t handle,
 
 		ret = ffa_memory_tee_reclaim(vm_to_from_lock.vm1,
 					     vm_to_from_lock.vm2, handle, flags,
-					     &api_page_pool);
+					     page_pool);
 
 		vm_unlock(&vm_to_from_lock.vm1);
 		vm_unlock(&vm_to_from_lock.vm2);
@@ -3124,11 +3571,35 @@ struct ffa_value api_ffa_mem_reclaim(ffa_memory_handle_t handle,
 	return ret;
 }
 
+/**
+ * Resumes a memory sharing call on the memory with the given handle which
+ * returned FFA_INTERRUPTED, and returns what the call returns once completed.
+ */
+struct ffa_value api_ffa_mem_op_resume(ffa_memory_handle_t handle,
+				       struct vcpu *current)
+{
+	struct vm_locked vm_locked;
+	struct ffa_value ret;
+
+	/* Calls on memory shared with the other world are never interrupted. */
+	if (!plat_ffa_memory_handle_allocated_by_current_world(handle)) {
+		return ffa_error(FFA_INVALID_PARAMETERS);
+	}
+
+	vm_locked = vm_lock(current->vm);
+	ret = ffa_memory_op_resume(vm_locked, handle,
+				   api_page_pool_for(current));
+	vm_unlock(&vm_locked);
+
+	return ret;
+}
+
 struct ffa_value api_ffa_mem_frag_rx(ffa_memory_handle_t handle,
 				     uint32_t fragment_offset,
 				     ffa_vm_id_t sender_vm_id,
 				     struct vcpu *current)
 {
+	struct mpool *page_pool = api_page_pool_for(current);
 	struct vm *to = current->vm;
 	struct vm_locked to_locked;
 	struct ffa_value ret;
@@ -3151,7 +3622,7 @@ struct ffa_value api_ffa_mem_frag_rx(ffa_memory_handle_t handle,
 	}
 
 	ret = ffa_memory_retrieve_continue(to_locked, handle, fragment_offset,
-					   &api_page_pool);
+					   page_pool);
 
 out:
 	vm_unlock(&to_locked);
@@ -3163,8 +3634,11 @@ struct ffa_value api_ffa_mem_frag_tx(ffa_memory_handle_t handle,
 				     ffa_vm_id_t sender_vm_id,
 				     struct vcpu *current)
 {
+	struct mpool *page_pool = api_page_pool_for(current);
 	struct vm *from = current->vm;
 	const void *from_msg;
+	uint32_t from_msg_size;
+	uint32_t first_length;
 	void *fragment_copy;
 	struct ffa_value ret;
 
@@ -3181,6 +3655,7 @@ struct ffa_value api_ffa_mem_frag_tx(ffa_memory_handle_t handle,
 	 */
 	sl_lock(&from->lock);
 	from_msg = from->mailbox.send;
+	from_msg_size = from->mailbox.size;
 	sl_unlock(&from->lock);
 
 	if (from_msg == NULL) {
@@ -3190,13 +3665,13 @@ struct ffa_value api_ffa_mem_frag_tx(ffa_memory_handle_t handle,
 	/*
 	 * Copy the fragment to a fresh page from the memory pool. This prevents
 	 * the sender from changing it underneath us, and also lets us keep it
-	 * around in the share state table if needed.
+	 * around in the share state table if needed. If it doesn't fit in a
+	 * page, the rest is copied a page at a time after the first.
 	 */
-	if (fragment_length > HF_MAILBOX_SIZE ||
-	    fragment_length > MM_PPOOL_ENTRY_SIZE) {
+	if (fragment_length > from_msg_size) {
 		dlog_verbose(
 			"Fragment length %d larger than mailbox size %d.\n",
-			fragment_length, HF_MAILBOX_SIZE);
+			fragment_length, from_msg_size);
 		return ffa_error(FFA_INVALID_PARAMETERS);
 	}
 	if (fragment_length < sizeof(struct ffa_memory_region_constituent) ||
@@ -3205,12 +3680,21 @@ struct ffa_value api_ffa_mem_frag_tx(ffa_memory_handle_t handle,
 		dlog_verbose("Invalid fragment length %d.\n", fragment_length);
 		return ffa_error(FFA_INVALID_PARAMETERS);
 	}
-	fragment_copy = mpool_alloc(&api_page_pool);
+	if ((handle & FFA_MEMORY_HANDLE_ALLOCATOR_MASK) !=
+		    FFA_MEMORY_HANDLE_ALLOCATOR_HYPERVISOR &&
+	    fragment_length > MM_PPOOL_ENTRY_SIZE) {
+		dlog_verbose("Fragment for the TEE larger than a page.\n");
+		return ffa_error(FFA_INVALID_PARAMETERS);
+	}
+	first_length = fragment_length < MM_PPOOL_ENTRY_SIZE
+			       ? fragment_length
+			       : MM_PPOOL_ENTRY_SIZE;
+	fragment_copy = mpool_alloc(page_pool);
 	if (fragment_copy == NULL) {
 		dlog_verbose("Failed to allocate fragment copy.\n");
 		return ffa_error(FFA_NO_MEMORY);
 	}
-	memcpy_s(fragment_copy, MM_PPOOL_ENTRY_SIZE, from_msg, fragment_length);
+	memcpy_s(fragment_copy, MM_PPOOL_ENTRY_SIZE, from_msg, first_length);
 
 	/*
 	 * Hafnium doesn't support fragmentation of memory retrieve requests
@@ -3226,12 +3710,14 @@ struct ffa_value api_ffa_mem_frag_tx(ffa_memory_handle_t handle,
 		struct vm_locked from_locked = vm_lock(from);
 
 		ret = ffa_memory_send_continue(from_locked, fragment_copy,
-					       fragment_length, handle,
-					       &api_page_pool);
+					       first_length, handle, page_pool);
 		/*
 		 * `ffa_memory_send_continue` takes ownership of the
 		 * fragment_copy, so we don't need to free it here.
 		 */
+		ret = api_ffa_mem_send_fragments(from_locked, from_msg,
+						 first_length, fragment_length,
+						 ret, page_pool);
 		vm_unlock(&from_locked);
 	} else {
 		struct vm *to = vm_find(HF_TEE_VM_ID);
@@ -3246,7 +3732,7 @@ struct ffa_value api_ffa_mem_frag_tx(ffa_memory_handle_t handle,
 
 		ret = ffa_memory_tee_send_continue(
 			vm_to_from_lock.vm2, vm_to_from_lock.vm1, fragment_copy,
-			fragment_length, handle, &api_page_pool);
+			fragment_length, handle, page_pool);
 		/*
 		 * `ffa_memory_tee_send_continue` takes ownership of the
 		 * fragment_copy, so we don't need to free it here.
@@ -3811,12 +4297,14 @@ out:
 struct ffa_value api_ffa_mem_perm_set(vaddr_t base_addr, uint32_t page_count,
 				      uint32_t mem_perm, struct vcpu *current)
 {
+	struct mpool *page_pool = api_page_pool_for(current);
 	struct vm_locked vm_locked;
 	struct ffa_value ret;
 	bool mode_ret = false;
 	uint32_t original_mode;
 	uint32_t new_mode;
 	struct mpool local_page_pool;
+	struct mm_reservation res;
 
 	if (!plat_ffa_is_mem_perm_set_valid(current)) {
 		return ffa_error(FFA_NOT_SUPPORTED);
@@ -3840,7 +4328,7 @@ struct ffa_value api_ffa_mem_perm_set(vaddr_t base_addr, uint32_t page_count,
 	 * thread. This is to ensure the original mapping can be restored if any
 	 * stage of the process fails.
 	 */
-	mpool_init_with_fallback(&local_page_pool, &api_page_pool);
+	mpool_init_with_fallback(&local_page_pool, page_pool);
 
 	vm_locked = vm_lock(current->vm);
 
@@ -3886,10 +4374,11 @@ struct ffa_value api_ffa_mem_perm_set(vaddr_t base_addr, uint32_t page_count,
 	 * Safe to re-map memory, since we know the requested permissions are
 	 * valid, and the memory requested to be re-mapped is also valid.
 	 */
+	mm_reservation_init(&res);
 	if (!mm_identity_prepare(
 		    &vm_locked.vm->ptable, pa_from_va(base_addr),
 		    pa_from_va(va_add(base_addr, page_count * PAGE_SIZE)),
-		    new_mode, &local_page_pool)) {
+		    new_mode, &local_page_pool, &res)) {
 		/*
 		 * Defrag the table into the local page pool.
 		 * mm_identity_prepare could have allocated or freed pages to
@@ -3906,13 +4395,13 @@ struct ffa_value api_ffa_mem_perm_set(vaddr_t base_addr, uint32_t page_count,
 		CHECK(mm_identity_prepare(
 			&vm_locked.vm->ptable, pa_from_va(base_addr),
 			pa_from_va(va_add(base_addr, page_count * PAGE_SIZE)),
-			original_mode, &local_page_pool));
+			original_mode, &local_page_pool, NULL));
 		mm_identity_commit(
 			&vm_locked.vm->ptable, pa_from_va(base_addr),
 			pa_from_va(va_add(base_addr, page_count * PAGE_SIZE)),
-			original_mode, &local_page_pool);
+			original_mode, &local_page_pool, NULL, NULL);
 
-		mm_stage1_defrag(&vm_locked.vm->ptable, &api_page_pool);
+		mm_stage1_defrag(&vm_locked.vm->ptable, page_pool);
 		ret = ffa_error(FFA_NO_MEMORY);
 		goto out;
 	}
@@ -3920,7 +4409,7 @@ struct ffa_value api_ffa_mem_perm_set(vaddr_t base_addr, uint32_t page_count,
 	mm_identity_commit(
 		&vm_locked.vm->ptable, pa_from_va(base_addr),
 		pa_from_va(va_add(base_addr, page_count * PAGE_SIZE)), new_mode,
-		&local_page_pool);
+		&local_page_pool, &res, NULL);
 
 	ret = (struct ffa_value){.func = FFA_SUCCESS_32};
 
@@ -126,3 +126,9 @@ void arch_vm_mm_reset(void)
 	write_msr(sctlr_el1, mm_reset_sctlr_el1);
 	isb();
 }
+
+size_t arch_mm_cpu_index(void)
+{
+	/* Tests don't access memory through windows. */
+	return 0;
+}
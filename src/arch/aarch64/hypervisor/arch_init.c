@@ -10,8 +10,12 @@
 #include "hf/arch/mmu.h"
 #include "hf/arch/plat/psci.h"
 
+#include "hf/check.h"
+#include "hf/cpu.h"
 #include "hf/layout.h"
 
+#include "msr.h"
+
 /**
  * Performs arch specific boot time initialization.
  */
@@ -38,3 +42,18 @@ bool arch_stack_mm_init(struct mm_stage1_locked stage1_locked,
 			       ppool);
 #endif
 }
+
+/**
+ * Returns the index of the CPU this is running on, finding it by the affinity
+ * bits of mpidr as its ID was set from them at boot.
+ */
+size_t arch_mm_cpu_index(void)
+{
+	uint64_t mpidr = read_msr(mpidr_el1);
+	struct cpu *c =
+		cpu_find((mpidr & 0xffffff) | (((mpidr >> 32) & 0xff) << 32));
+
+	CHECK(c != NULL);
+
+	return cpu_index(c);
+}
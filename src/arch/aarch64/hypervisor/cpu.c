@@ -22,6 +22,7 @@
 #include "hf/vm.h"
 
 #include "feature_id.h"
+#include "fpsimd.h"
 #include "msr.h"
 #include "perfmon.h"
 #include "sysregs.h"
@@ -88,6 +89,7 @@ void arch_regs_reset(struct vcpu *vcpu)
 	uintreg_t arg = r->r[0];
 	uintreg_t cnthctl;
 
+	fpsimd_log_stats(vcpu);
 	memset_s(r, sizeof(*r), 0, sizeof(*r));
 
 	r->pc = pc;
@@ -203,6 +205,38 @@ struct ffa_value arch_regs_get_args(struct arch_regs *regs)
 	};
 }
 
+void arch_regs_set_retval_ext(struct arch_regs *r, struct ffa_value_ext v)
+{
+	arch_regs_set_retval(r, v.val);
+	r->r[8] = v.arg8;
+	r->r[9] = v.arg9;
+	r->r[10] = v.arg10;
+	r->r[11] = v.arg11;
+	r->r[12] = v.arg12;
+	r->r[13] = v.arg13;
+	r->r[14] = v.arg14;
+	r->r[15] = v.arg15;
+	r->r[16] = v.arg16;
+	r->r[17] = v.arg17;
+}
+
+struct ffa_value_ext arch_regs_get_args_ext(struct arch_regs *regs)
+{
+	return (struct ffa_value_ext){
+		.val = arch_regs_get_args(regs),
+		.arg8 = regs->r[8],
+		.arg9 = regs->r[9],
+		.arg10 = regs->r[10],
+		.arg11 = regs->r[11],
+		.arg12 = regs->r[12],
+		.arg13 = regs->r[13],
+		.arg14 = regs->r[14],
+		.arg15 = regs->r[15],
+		.arg16 = regs->r[16],
+		.arg17 = regs->r[17],
+	};
+}
+
 /* Returns the SVE implemented VL in bytes (constrained by ZCR_EL3.LEN) */
 static uint64_t arch_cpu_sve_len_get(void)
 {
@@ -245,6 +279,87 @@ static void arch_cpu_sve_configure_sve_vector_length(void)
 	isb();
 }
 
+/**
+ * The vCPU whose lazy registers are live in the system registers of each pCPU,
+ * i.e. the vCPU they were last restored for.
+ */
+static struct vcpu *lazy_state_owner[MAX_CPUS];
+
+/* Implemented in exceptions.S. */
+void vcpu_lazy_state_save(struct vcpu *vcpu);
+
+/**
+ * Saves the lazy registers live in the system registers of the given pCPU, if
+ * saving them was deferred, before they are overwritten or lost.
+ */
+void vcpu_lazy_state_flush(struct cpu *c)
+{
+	struct vcpu *owner = lazy_state_owner[cpu_index(c)];
+
+	if (owner != NULL && owner->regs.lazy_unsaved) {
+		vcpu_lazy_state_save(owner);
+		owner->regs.lazy_unsaved = false;
+	}
+}
+
+/**
+ * Returns true if saving the lazy registers of `vcpu`, which the pCPU is
+ * switching away from to `next`, can be deferred until another vCPU needs the
+ * system registers. This is the case when switching to the other world, which
+ * can't change them as the SPMD preserves the system registers of each world,
+ * if `vcpu` is pinned to the pCPU so it can't be restored on another one in the
+ * meantime. An SP answering direct requests from the normal world then has
+ * its lazy registers neither saved nor restored between them.
+ */
+bool vcpu_lazy_state_defer_save(struct vcpu *vcpu, struct vcpu *next)
+{
+	bool defer = false;
+
+#if SECURE_WORLD == 1
+	defer = next->vm->id == HF_OTHER_WORLD_ID &&
+		vcpu->vm->vcpu_count > 1 && !vcpu->vm->el0_partition &&
+		lazy_state_owner[cpu_index(vcpu->cpu)] == vcpu &&
+		vcpu->regs.lazy_cpu == vcpu->cpu;
+#else
+	(void)next;
+#endif
+
+	vcpu->regs.lazy_unsaved = defer;
+
+	return defer;
+}
+
+/**
+ * Returns true if the system registers of the current pCPU still hold the lazy
+ * registers of `vcpu`, which is about to run on it, so restoring them can be
+ * skipped. This is the case when resuming the vCPU which last ran on the pCPU,
+ * such as an SP after a call to the normal world, as the SPMD preserves the
+ * system registers of each world across world switches. Otherwise, records that
+ * the caller is about to restore them.
+ */
+bool vcpu_lazy_state_is_live(struct vcpu *vcpu)
+{
+	size_t current_cpu_index = cpu_index(vcpu->cpu);
+
+	/*
+	 * The saved registers may have been restored on another pCPU since,
+	 * and have changed there, or have been reset.
+	 */
+	if (lazy_state_owner[current_cpu_index] == vcpu &&
+	    vcpu->regs.lazy_cpu == vcpu->cpu) {
+		return true;
+	}
+
+	/* Registers left live on another pCPU can't be restored here. */
+	CHECK(!vcpu->regs.lazy_unsaved);
+
+	vcpu_lazy_state_flush(vcpu->cpu);
+	lazy_state_owner[current_cpu_index] = vcpu;
+	vcpu->regs.lazy_cpu = vcpu->cpu;
+
+	return false;
+}
+
 void arch_cpu_init(struct cpu *c, ipaddr_t entry_point)
 {
 	plat_psci_cpu_resume(c, entry_point);
@@ -256,6 +371,10 @@ void arch_cpu_init(struct cpu *c, ipaddr_t entry_point)
 	lor_disable();
 
 	write_msr(CPTR_EL2, get_cptr_el2_value());
+	fpsimd_cpu_init(c);
+
+	/* The system registers were lost if the pCPU was powered down. */
+	lazy_state_owner[cpu_index(c)] = NULL;
 
 	/* Initialize counter-timer virtual offset register to 0. */
 	write_msr(CNTVOFF_EL2, 0);
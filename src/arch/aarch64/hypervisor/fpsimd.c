@@ -0,0 +1,227 @@
+/*
+ * Copyright 2023 The Hafnium Authors.
+ *
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/BSD-3-Clause.
+ */
+
+#include "fpsimd.h"
+
+#include "hf/arch/barriers.h"
+#include "hf/arch/sve.h"
+#include "hf/arch/vmid_base.h"
+
+#include "hf/dlog.h"
+#include "hf/vm.h"
+
+#include "msr.h"
+#include "sysregs.h"
+
+/*
+ * The floating point registers are only switched when a vCPU first accesses
+ * them after being run, as most vCPUs never do. Accesses are trapped by
+ * CPTR_EL2 whenever the registers of the current pCPU don't hold those of the
+ * current vCPU, so the hypervisor must only ever access them with traps
+ * disabled.
+ */
+
+/* Implemented in exceptions.S. */
+void fpsimd_regs_save(struct vcpu *vcpu);
+void fpsimd_regs_restore(struct vcpu *vcpu);
+#if SECURE_WORLD == 1
+void sve_regs_save(struct vcpu *vcpu, struct sve_context_t *ctx);
+void sve_regs_restore(struct vcpu *vcpu, struct sve_context_t *ctx);
+
+extern struct sve_context_t sve_context[MAX_CPUS];
+#endif
+
+/**
+ * The vCPU whose floating point registers were last loaded in, or saved from,
+ * each pCPU.
+ */
+static struct vcpu *fpsimd_owner[MAX_CPUS];
+
+/**
+ * Forgets the floating point registers of the given pCPU, which are lost when
+ * it is powered down.
+ */
+void fpsimd_cpu_init(struct cpu *c)
+{
+	fpsimd_owner[cpu_index(c)] = NULL;
+}
+
+/**
+ * Returns true if the vCPU always runs on the same pCPU, in which case saving
+ * its floating point registers is deferred until another vCPU accesses them.
+ * Those of other vCPUs are saved when switching away from them, as they may
+ * next run on another pCPU.
+ */
+static bool fpsimd_is_pinned(const struct vcpu *vcpu)
+{
+#if SECURE_WORLD == 1
+	return vcpu->vm->id == HF_OTHER_WORLD_ID;
+#else
+	return vcpu->vm->id == HF_PRIMARY_VM_ID;
+#endif
+}
+
+/**
+ * Returns true if the floating point registers of the pCPU the vCPU is running
+ * on hold those of the vCPU.
+ */
+static bool fpsimd_is_live(struct vcpu *vcpu)
+{
+	return fpsimd_owner[cpu_index(vcpu->cpu)] == vcpu &&
+	       vcpu->regs.fp_cpu == vcpu->cpu;
+}
+
+/**
+ * Traps, or stops trapping, floating point accesses from the current pCPU.
+ */
+static void fpsimd_set_trap(bool trap)
+{
+	uintreg_t cptr_el2 = read_msr(CPTR_EL2);
+	uintreg_t new_cptr_el2;
+
+	if (has_vhe_support()) {
+		new_cptr_el2 = trap ? cptr_el2 & ~CPTR_EL2_VHE_FPEN
+				    : cptr_el2 | CPTR_EL2_VHE_FPEN;
+	} else {
+		new_cptr_el2 = trap ? cptr_el2 | CPTR_EL2_TFP
+				    : cptr_el2 & ~CPTR_EL2_TFP;
+	}
+
+	/* Avoid the synchronisation if the traps are already as required. */
+	if (new_cptr_el2 != cptr_el2) {
+		write_msr(CPTR_EL2, new_cptr_el2);
+		isb();
+	}
+}
+
+static void fpsimd_save(struct vcpu *vcpu)
+{
+#if SECURE_WORLD == 1
+	/* The other world may use the full SVE registers. */
+	if (vcpu->vm->id == HF_OTHER_WORLD_ID && is_arch_feat_sve_supported()) {
+		sve_regs_save(vcpu, &sve_context[cpu_index(vcpu->cpu)]);
+		return;
+	}
+#endif
+	fpsimd_regs_save(vcpu);
+}
+
+static void fpsimd_restore(struct vcpu *vcpu)
+{
+#if SECURE_WORLD == 1
+	if (vcpu->vm->id == HF_OTHER_WORLD_ID && is_arch_feat_sve_supported()) {
+		sve_regs_restore(vcpu, &sve_context[cpu_index(vcpu->cpu)]);
+		return;
+	}
+#endif
+	fpsimd_regs_restore(vcpu);
+}
+
+/**
+ * Loads the floating point registers of the vCPU in the current pCPU, after
+ * saving those of the vCPU they belong to if it deferred doing so. Traps must
+ * be disabled.
+ */
+static void fpsimd_load(struct vcpu *vcpu)
+{
+	size_t current_cpu_index = cpu_index(vcpu->cpu);
+	struct vcpu *owner = fpsimd_owner[current_cpu_index];
+
+	/*
+	 * The registers of vCPUs which aren't pinned were saved when switching
+	 * away from them, and their saved copy may have been updated since on
+	 * another pCPU.
+	 */
+	if (owner != NULL && fpsimd_is_pinned(owner) && fpsimd_is_live(owner)) {
+		fpsimd_save(owner);
+	}
+
+	fpsimd_restore(vcpu);
+	fpsimd_owner[current_cpu_index] = vcpu;
+	vcpu->regs.fp_cpu = vcpu->cpu;
+}
+
+/**
+ * Saves the floating point registers of the vCPU being switched away from, if
+ * it accessed them and may next run on another pCPU.
+ */
+void fpsimd_save_state(struct vcpu *vcpu)
+{
+	if (fpsimd_is_live(vcpu) && !fpsimd_is_pinned(vcpu)) {
+		fpsimd_save(vcpu);
+		return;
+	}
+
+	vcpu->regs.fp_stats.saves_skipped++;
+}
+
+/**
+ * Gives the vCPU about to run access to the floating point registers if they
+ * still hold its own, and otherwise traps its first access to them.
+ */
+void fpsimd_prepare_to_run(struct vcpu *vcpu)
+{
+	if (fpsimd_is_live(vcpu)) {
+		fpsimd_set_trap(false);
+		vcpu->regs.fp_stats.restores_skipped++;
+		return;
+	}
+
+	fpsimd_set_trap(true);
+}
+
+/**
+ * Handles a trapped floating point access of the current vCPU by loading its
+ * floating point registers. The access is then retried.
+ */
+void fpsimd_access_trap(struct vcpu *vcpu)
+{
+	fpsimd_set_trap(false);
+	fpsimd_load(vcpu);
+	vcpu->regs.fp_stats.traps++;
+}
+
+/**
+ * Writes the floating point switch counters of the vCPU to the debug log, if
+ * it ran at all, before they are lost with the rest of its registers on reset.
+ */
+void fpsimd_log_stats(const struct vcpu *vcpu)
+{
+	uint32_t traps = vcpu->regs.fp_stats.traps;
+	uint32_t restores_skipped = vcpu->regs.fp_stats.restores_skipped;
+	uint32_t saves_skipped = vcpu->regs.fp_stats.saves_skipped;
+
+	if (traps == 0 && restores_skipped == 0 && saves_skipped == 0) {
+		return;
+	}
+
+	dlog_verbose(
+		"VM %#x vCPU %u floating point: %u trapped loads, %u restores "
+		"skipped, %u saves skipped.\n",
+		vcpu->vm->id, vcpu_index(vcpu), traps, restores_skipped,
+		saves_skipped);
+}
+
+#if SECURE_WORLD == 1
+/**
+ * Loads the floating point registers of the other world vCPU before returning
+ * to it, unless they still hold its own. The other world doesn't run with the
+ * traps of the SPMC, so they can't be loaded on demand.
+ */
+void fpsimd_prepare_other_world(struct vcpu *vcpu)
+{
+	fpsimd_set_trap(false);
+
+	if (fpsimd_is_live(vcpu)) {
+		vcpu->regs.fp_stats.restores_skipped++;
+		return;
+	}
+
+	fpsimd_load(vcpu);
+}
+#endif
@@ -0,0 +1,27 @@
+/*
+ * Copyright 2023 The Hafnium Authors.
+ *
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/BSD-3-Clause.
+ */
+
+#pragma once
+
+#include "hf/arch/types.h"
+
+#include "hf/cpu.h"
+
+void fpsimd_cpu_init(struct cpu *c);
+
+void fpsimd_save_state(struct vcpu *vcpu);
+
+void fpsimd_prepare_to_run(struct vcpu *vcpu);
+
+void fpsimd_access_trap(struct vcpu *vcpu);
+
+void fpsimd_log_stats(const struct vcpu *vcpu);
+
+#if SECURE_WORLD == 1
+void fpsimd_prepare_other_world(struct vcpu *vcpu);
+#endif
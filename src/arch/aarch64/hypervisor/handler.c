@@ -28,6 +28,7 @@
 
 #include "debug_el1.h"
 #include "feature_id.h"
+#include "fpsimd.h"
 #include "msr.h"
 #include "perfmon.h"
 #include "psci.h"
@@ -324,6 +325,9 @@ static void set_virtual_fiq_current(bool enable)
 
 #if SECURE_WORLD == 1
 
+/* Implemented in cpu.c. */
+void vcpu_lazy_state_flush(struct cpu *c);
+
 /**
  * Handle special direct messages from SPMD to SPMC. For now related to power
  * management only.
@@ -367,6 +371,9 @@ static bool spmd_handler(struct ffa_value *args, struct vcpu *current)
 
 			dlog_verbose("%s cpu off notification cpuid %#x\n",
 				     __func__, vcpu->cpu->id);
+
+			/* Lazy registers left live would be lost. */
+			vcpu_lazy_state_flush(current->cpu);
 			cpu_off(vcpu->cpu);
 			break;
 		}
@@ -496,10 +503,12 @@ static bool ffa_handler(struct ffa_value *args, struct vcpu *current,
 		*args = api_ffa_spm_id_get();
 		return true;
 	case FFA_FEATURES_32:
-		*args = api_ffa_features(args->arg1);
+		*args = api_ffa_features(args->arg1, current);
 		return true;
 	case FFA_RX_RELEASE_32:
-		*args = api_ffa_rx_release(ffa_receiver(*args), current, next);
+		/* w2 counts the queued messages, a Hafnium extension. */
+		*args = api_ffa_rx_release(ffa_receiver(*args), args->arg2,
+					   current, next);
 		return true;
 	case FFA_RXTX_MAP_64:
 		*args = api_ffa_rxtx_map(ipa_init(args->arg1),
@@ -554,6 +563,10 @@ static bool ffa_handler(struct ffa_value *args, struct vcpu *current,
 			ffa_assemble_handle(args->arg1, args->arg2), args->arg3,
 			current);
 		return true;
+	case FFA_MEM_OP_RESUME_32:
+		*args = api_ffa_mem_op_resume(
+			ffa_assemble_handle(args->arg1, args->arg2), current);
+		return true;
 	case FFA_MEM_FRAG_RX_32:
 		*args = api_ffa_mem_frag_rx(ffa_frag_handle(*args), args->arg3,
 					    (args->arg4 >> 16) & 0xffff,
@@ -576,6 +589,14 @@ static bool ffa_handler(struct ffa_value *args, struct vcpu *current,
 						    current, next);
 		return true;
 	}
+#if (MAKE_FFA_VERSION(1, 2) <= FFA_VERSION_COMPILED)
+	case FFA_MSG_SEND_DIRECT_REQ2_64:
+		*args = api_ffa_msg_send_direct_req(ffa_sender(*args),
+						    ffa_receiver(*args), *args,
+						    current, next);
+		return true;
+	case FFA_MSG_SEND_DIRECT_RESP2_64:
+#endif
 	case FFA_MSG_SEND_DIRECT_RESP_64:
 	case FFA_MSG_SEND_DIRECT_RESP_32:
 		*args = api_ffa_msg_send_direct_resp(ffa_sender(*args),
@@ -1169,11 +1190,20 @@ struct vcpu *sync_lower_exception(uintreg_t esr, uintreg_t far)
 		/* WFI */
 		return api_wait_for_interrupt(vcpu);
 
+	case EC_FP_ASIMD:
+		/*
+		 * Load the floating point registers of the vCPU on its first
+		 * access to them, and retry the instruction.
+		 */
+		fpsimd_access_trap(vcpu);
+		return NULL;
+
 	case EC_DATA_ABORT_LOWER_EL:
 		info = fault_info_init(
 			esr, vcpu, (esr & (1U << 6)) ? MM_MODE_W : MM_MODE_R);
 
-		resume = vcpu_handle_page_fault(vcpu, &info);
+		resume = vcpu_handle_page_fault(vcpu, &info,
+						api_page_pool_for(vcpu));
 		if (is_el0_partition) {
 			dlog_warning("Data abort on EL0 partition\n");
 			/*
@@ -1202,7 +1232,8 @@ struct vcpu *sync_lower_exception(uintreg_t esr, uintreg_t far)
 	case EC_INSTRUCTION_ABORT_LOWER_EL:
 		info = fault_info_init(esr, vcpu, MM_MODE_X);
 
-		if (vcpu_handle_page_fault(vcpu, &info)) {
+		if (vcpu_handle_page_fault(vcpu, &info,
+					   api_page_pool_for(vcpu))) {
 			return NULL;
 		}
 
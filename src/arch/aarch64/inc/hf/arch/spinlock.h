@@ -20,6 +20,7 @@
  * the guarantees provided by atomic instructions introduced in Armv8.1 LSE.
  */
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #include "hf/arch/types.h"
@@ -58,6 +59,37 @@ static inline void sl_lock(struct spinlock *l)
 		: "cc");
 }
 
+/**
+ * Tries to acquire the lock once, without waiting if it is currently taken.
+ * Returns true if the lock was acquired.
+ */
+static inline bool sl_try_lock(struct spinlock *l)
+{
+	register uintreg_t tmp1;
+	register uintreg_t tmp2;
+
+	/*
+	 * Use the same LDAXR/STXR pair as `sl_lock`, retrying only if the
+	 * exclusive store fails while the lock is free, and giving up if the
+	 * lock is taken. The exclusive monitor is then cleared, as there is no
+	 * store to clear it.
+	 */
+	__asm__ volatile(
+		"	mov	%w2, #1\n"
+		"1:	ldaxr	%w1, [%3]\n"	  /* load lock value */
+		"	cbnz	%w1, 2f\n"	  /* if lock taken, give up */
+		"	stxr	%w1, %w2, [%3]\n" /* try to take lock */
+		"	cbnz	%w1, 1b\n"	  /* loop if unsuccessful */
+		"	b	3f\n"
+		"2:	clrex\n" /* clear exclusive monitor */
+		"3:\n"
+		: "+m"(*l), "=&r"(tmp1), "=&r"(tmp2)
+		: "r"(l)
+		: "cc");
+
+	return tmp1 == 0;
+}
+
 static inline void sl_unlock(struct spinlock *l)
 {
 	/*
@@ -135,11 +135,42 @@ struct arch_regs {
 		uintreg_t par_el1;
 	} lazy;
 
+	/*
+	 * CPU on which the lazy registers were last restored, see
+	 * vcpu_lazy_state_is_live(). It is cleared along with the registers
+	 * on reset, so that they are then restored.
+	 */
+	struct cpu *lazy_cpu;
+
+	/*
+	 * Whether saving the lazy registers was deferred, leaving them live in
+	 * the system registers of `lazy_cpu`, see
+	 * vcpu_lazy_state_defer_save().
+	 */
+	bool lazy_unsaved;
+
 	/* Floating point registers. */
 	struct float_reg fp[32];
 	uintreg_t fpsr;
 	uintreg_t fpcr;
 
+	/*
+	 * CPU whose floating point registers were last loaded from, or saved
+	 * to, the registers above, see fpsimd_prepare_to_run(). It is cleared
+	 * on reset, so that they are then loaded on first use.
+	 */
+	struct cpu *fp_cpu;
+
+	/* How often switching the floating point registers lazily paid off. */
+	struct {
+		/* Floating point accesses trapped to load the registers. */
+		uint32_t traps;
+		/* Runs with the registers still loaded from a previous run. */
+		uint32_t restores_skipped;
+		/* Switches away without saving the registers. */
+		uint32_t saves_skipped;
+	} fp_stats;
+
 #if GIC_VERSION == 3 || GIC_VERSION == 4
 	struct {
 		uintreg_t ich_hcr_el2;
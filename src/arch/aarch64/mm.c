@@ -14,6 +14,7 @@
 
 #include "hf/check.h"
 #include "hf/dlog.h"
+#include "hf/std.h"
 
 #include "msr.h"
 #include "sysregs.h"
@@ -101,6 +102,10 @@
 
 #define CACHE_WORD_SIZE 4
 
+/* DCZID_EL0 fields describing DC ZVA. */
+#define DCZID_EL0_DZP (UINT64_C(1) << 4)
+#define DCZID_EL0_BS_MASK UINT64_C(0xf)
+
 /**
  * Threshold number of pages in TLB to invalidate after which we invalidate all
  * TLB entries on a given level.
@@ -108,6 +113,33 @@
  */
 #define MAX_TLBI_OPS  MM_PTE_PER_PAGE
 
+/*
+ * Fields of the operand of the FEAT_TLBIRANGE instructions. The range covers
+ * (NUM + 1) * 2^(5 * SCALE + 1) pages starting from the page at BaseADDR.
+ */
+#define TLBI_RANGE_TG_4KB      (UINT64_C(1) << 46)
+#define TLBI_RANGE_SCALE(x)    ((uint64_t)(x) << 44)
+#define TLBI_RANGE_NUM(x)      ((uint64_t)(x) << 39)
+#define TLBI_RANGE_BADDR_MASK  ((UINT64_C(1) << 37) - 1)
+#define TLBI_RANGE_ASID(x)     ((uint64_t)(x) << 48)
+
+#define TLBI_RANGE_PAGES(num, scale) \
+	((uint64_t)((num) + 1) << (5 * (scale) + 1))
+
+/**
+ * Number of pages from which a range invalidation is no longer possible, or
+ * faster than invalidating all TLB entries.
+ */
+#define MAX_TLBI_RANGE_PAGES TLBI_RANGE_PAGES(31, 3)
+
+/*
+ * System instruction encodings of the FEAT_TLBIRANGE operations, so they can be
+ * issued regardless of the architecture revision targeted by the assembler.
+ */
+#define TLBI_RVAE1IS    "#0, c8, c2, #1"
+#define TLBI_RVAE2IS    "#4, c8, c2, #1"
+#define TLBI_RIPAS2E1IS "#4, c8, c0, #2"
+
 /* clang-format on */
 
 #define tlbi(op)                               \
@@ -118,13 +150,43 @@
 	do {                                                           \
 		__asm__ __volatile__("tlbi " #op ", %0" : : "r"(reg)); \
 	} while (0)
+#define tlbi_range(op, reg)                                          \
+	do {                                                         \
+		__asm__ __volatile__("sys " op ", %0" : : "r"(reg)); \
+	} while (0)
 
 /** Mask for the address bits of the pte. */
 #define PTE_ADDR_MASK \
 	(((UINT64_C(1) << 48) - 1) & ~((UINT64_C(1) << PAGE_BITS) - 1))
 
-/** Mask for the attribute bits of the pte. */
-#define PTE_ATTR_MASK (~(PTE_ADDR_MASK | (UINT64_C(1) << 1)))
+/**
+ * The contiguous hint is at the same position in stage-1 and stage-2 block
+ * descriptors.
+ */
+#define PTE_CONTIGUOUS STAGE1_CONTIGUOUS
+
+/**
+ * The number of aligned entries covered by the contiguous hint with a 4KB
+ * granule.
+ */
+#define PTE_CONTIGUOUS_ENTRIES 16
+
+/**
+ * Mask for the attribute bits of the pte. The contiguous hint isn't one of them
+ * as it is managed by the page table code depending on the adjacent entries.
+ */
+#define PTE_ATTR_MASK \
+	(~(PTE_ADDR_MASK | (UINT64_C(1) << 1) | PTE_CONTIGUOUS))
+
+/**
+ * Mask for the attribute bits of a block or page descriptor that can be changed
+ * without a break-before-make sequence, i.e. the access permissions, the
+ * execute-never controls and the software defined bits. The stage-2 S2AP and
+ * XN fields occupy the same bits as their stage-1 counterparts.
+ */
+#define PTE_BBM_FREE_MASK                                   \
+	(STAGE1_AP(UINT64_C(3)) | STAGE1_PXN | STAGE1_UXN | \
+	 STAGE1_SW_OWNED | STAGE1_SW_EXCLUSIVE)
 
 /**
  * Configuration information for memory management. Order is important as this
@@ -146,6 +208,7 @@ struct arch_mm_config {
 static uint8_t mm_s1_max_level;
 static uint8_t mm_s2_max_level;
 static uint8_t mm_s2_root_table_count;
+static bool mm_tlbi_range_supported;
 
 /**
  * Returns the encoding of a page table entry that isn't present.
@@ -279,6 +342,32 @@ uint64_t arch_mm_pte_attrs(pte_t pte, uint8_t level)
 	return pte & PTE_ATTR_MASK;
 }
 
+/**
+ * Gets the number of adjacent block entries which can be marked with the
+ * contiguous hint. It is only used for pages and 2MB blocks.
+ */
+uint8_t arch_mm_contiguous_entries(uint8_t level)
+{
+	return level <= 1 ? PTE_CONTIGUOUS_ENTRIES : 0;
+}
+
+/**
+ * Determines if the given block pte has the contiguous hint set.
+ */
+bool arch_mm_pte_is_contiguous(pte_t pte, uint8_t level)
+{
+	return arch_mm_pte_is_block(pte, level) && (pte & PTE_CONTIGUOUS) != 0;
+}
+
+/**
+ * Sets or clears the contiguous hint of the given block pte.
+ */
+pte_t arch_mm_pte_set_contiguous(pte_t pte, uint8_t level, bool contiguous)
+{
+	(void)level;
+	return contiguous ? pte | PTE_CONTIGUOUS : pte & ~PTE_CONTIGUOUS;
+}
+
 /**
  * Execute any barriers or synchronization that is required
  * by a given architecture, after page table writes.
@@ -291,6 +380,75 @@ void arch_mm_sync_table_writes(void)
 	dsb(ish);
 }
 
+/**
+ * Determines whether it is quicker to invalidate all TLB entries than only
+ * those of a range of the given size.
+ *
+ * Revisions prior to Armv8.4 do not support invalidating a range of addresses,
+ * which means we have to loop over individual pages. If there are too many, it
+ * is quicker to invalidate all TLB entries. With FEAT_TLBIRANGE a handful of
+ * operations cover any range up to MAX_TLBI_RANGE_PAGES.
+ */
+static bool arch_mm_invalidate_all_is_faster(uint64_t size)
+{
+	if (mm_tlbi_range_supported) {
+		return size >= (MAX_TLBI_RANGE_PAGES * PAGE_SIZE);
+	}
+
+	return size > (MAX_TLBI_OPS * PAGE_SIZE);
+}
+
+/**
+ * Invalidates the TLB entries of the given number of pages starting from the
+ * given page number with the fewest FEAT_TLBIRANGE operations. A range operation
+ * covers an even number of pages so the first page of an odd sized range is
+ * invalidated on its own. `operand` holds the fields other than the address
+ * range, e.g. the ASID.
+ */
+static void arch_mm_invalidate_pages_by_range(uint64_t page, uint64_t pages,
+					      uint64_t operand, bool stage2)
+{
+	uint32_t scale = 0;
+
+	while (pages > 0) {
+		uint64_t num;
+		uint64_t range;
+
+		if (pages % 2 == 1) {
+			if (stage2) {
+				tlbi_reg(ipas2e1is, page);
+			} else if (VM_TOOLCHAIN == 1) {
+				tlbi_reg(vae1is, operand | page);
+			} else {
+				tlbi_reg(vae2is, operand | page);
+			}
+			page++;
+			pages--;
+			continue;
+		}
+
+		/* Invalidate the pages covered by this scale in one go. */
+		num = (pages >> (5 * scale + 1)) & 0x1f;
+		if (num != 0) {
+			range = operand | TLBI_RANGE_TG_4KB |
+				TLBI_RANGE_SCALE(scale) |
+				TLBI_RANGE_NUM(num - 1) |
+				(page & TLBI_RANGE_BADDR_MASK);
+			if (stage2) {
+				tlbi_range(TLBI_RIPAS2E1IS, range);
+			} else if (VM_TOOLCHAIN == 1) {
+				tlbi_range(TLBI_RVAE1IS, range);
+			} else {
+				tlbi_range(TLBI_RVAE2IS, range);
+			}
+			page += TLBI_RANGE_PAGES(num - 1, scale);
+			pages -= TLBI_RANGE_PAGES(num - 1, scale);
+		}
+
+		scale++;
+	}
+}
+
 /**
  * Invalidates stage-1 TLB entries referring to the given virtual address range.
  */
@@ -305,30 +463,29 @@ void arch_mm_invalidate_stage1_range(uint16_t asid, vaddr_t va_begin,
 	arch_mm_sync_table_writes();
 
 	/*
-	 * Revisions prior to Armv8.4 do not support invalidating a range of
-	 * addresses, which means we have to loop over individual pages. If
-	 * there are too many, it is quicker to invalidate all TLB entries.
+	 * Mask upper 8 bits of asid passed in. Hafnium on aarch64 currently
+	 * only uses 8 bit asids.TCR_EL2.AS is set to 0 on implementations which
+	 * support 16 bit asids and is res0 on implementations that dont support
+	 * 16 bit asids.
 	 */
-	if ((end - begin) > (MAX_TLBI_OPS * PAGE_SIZE)) {
+	asid &= 0xff;
+
+	if (arch_mm_invalidate_all_is_faster(end - begin)) {
 		if (VM_TOOLCHAIN == 1) {
 			tlbi(vmalle1is);
 		} else {
 			tlbi(alle2is);
 		}
+	} else if (mm_tlbi_range_supported) {
+		arch_mm_invalidate_pages_by_range(begin >> 12,
+						  (end - begin) >> 12,
+						  TLBI_RANGE_ASID(asid), false);
 	} else {
 		begin >>= 12;
 		end >>= 12;
 		/* Invalidate stage-1 TLB, one page from the range at a time. */
 		for (it = begin; it < end;
 		     it += (UINT64_C(1) << (PAGE_BITS - 12))) {
-			/*
-			 * Mask upper 8 bits of asid passed in. Hafnium on
-			 * aarch64 currently only uses 8 bit asids.TCR_EL2.AS is
-			 * set to 0 on implementations which support 16 bit
-			 * asids and is res0 on implementations that dont
-			 * support 16 bit asids.
-			 */
-			asid &= 0xff;
 			it |= (uint64_t)asid << 48;
 			if (VM_TOOLCHAIN == 1) {
 				tlbi_reg(vae1is, it);
@@ -345,6 +502,41 @@ void arch_mm_invalidate_stage1_range(uint16_t asid, vaddr_t va_begin,
 	isb();
 }
 
+/**
+ * Invalidates the stage-1 TLB entries of the current CPU referring to the given
+ * virtual address range, without broadcasting the invalidation to the other
+ * CPUs. Only suitable for entries that no other CPU may be using.
+ */
+void arch_mm_invalidate_stage1_range_local(uint16_t asid, vaddr_t va_begin,
+					   vaddr_t va_end)
+{
+	uintvaddr_t begin = va_addr(va_begin) >> 12;
+	uintvaddr_t end = va_addr(va_end) >> 12;
+	uintvaddr_t it;
+
+	/* Sync with page table updates, only walked by this CPU. */
+	dsb(nshst);
+
+	/* Only 8 bit asids are used, see arch_mm_invalidate_stage1_range. */
+	asid &= 0xff;
+
+	for (it = begin; it < end; it += (UINT64_C(1) << (PAGE_BITS - 12))) {
+		uint64_t operand = it | ((uint64_t)asid << 48);
+
+		if (VM_TOOLCHAIN == 1) {
+			tlbi_reg(vae1, operand);
+		} else {
+			tlbi_reg(vae2, operand);
+		}
+	}
+
+	/* Sync data accesses with TLB invalidation completion. */
+	dsb(nsh);
+
+	/* Sync instruction fetches with TLB invalidation completion. */
+	isb();
+}
+
 /**
  * Invalidates stage-2 TLB entries referring to the given intermediate physical
  * address range.
@@ -373,12 +565,7 @@ void arch_mm_invalidate_stage2_range(uint16_t vmid, ipaddr_t va_begin,
 	 */
 	vhe_switch_to_host_or_guest(true);
 
-	/*
-	 * Revisions prior to Armv8.4 do not support invalidating a range of
-	 * addresses, which means we have to loop over individual pages. If
-	 * there are too many, it is quicker to invalidate all TLB entries.
-	 */
-	if ((end - begin) > (MAX_TLBI_OPS * PAGE_SIZE)) {
+	if (arch_mm_invalidate_all_is_faster(end - begin)) {
 		/*
 		 * Invalidate all stage-1 and stage-2 entries of the TLB for
 		 * the current VMID.
@@ -389,13 +576,19 @@ void arch_mm_invalidate_stage2_range(uint16_t vmid, ipaddr_t va_begin,
 		end >>= 12;
 
 		/*
-		 * Invalidate stage-2 TLB, one page from the range at a time.
-		 * Note that this has no effect if the CPU has a TLB with
-		 * combined stage-1/stage-2 translation.
+		 * Invalidate stage-2 TLB, using range operations if available
+		 * or otherwise one page from the range at a time. Note that
+		 * this has no effect if the CPU has a TLB with combined
+		 * stage-1/stage-2 translation.
 		 */
-		for (it = begin; it < end;
-		     it += (UINT64_C(1) << (PAGE_BITS - 12))) {
-			tlbi_reg(ipas2e1is, it);
+		if (mm_tlbi_range_supported) {
+			arch_mm_invalidate_pages_by_range(begin, end - begin, 0,
+							  true);
+		} else {
+			for (it = begin; it < end;
+			     it += (UINT64_C(1) << (PAGE_BITS - 12))) {
+				tlbi_reg(ipas2e1is, it);
+			}
 		}
 
 		/*
@@ -431,17 +624,102 @@ static uint16_t arch_mm_dcache_line_size(void)
 	       (UINT16_C(1) << ((read_msr(CTR_EL0) >> 16) & 0xf));
 }
 
-void arch_mm_flush_dcache(void *base, size_t size)
+/**
+ * Cleans and invalidates each data cache line overlapping the given range,
+ * without waiting for completion.
+ */
+static void arch_mm_flush_dcache_lines(uintptr_t begin, uintptr_t end,
+				       uint16_t line_size)
 {
-	/* Clean and invalidate each data cache line in the range. */
-	uint16_t line_size = arch_mm_dcache_line_size();
-	uintptr_t line_begin = (uintptr_t)base & ~(line_size - 1);
-	uintptr_t end = (uintptr_t)base + size;
+	uintptr_t line_begin = begin & ~(uintptr_t)(line_size - 1);
 
 	while (line_begin < end) {
 		__asm__ volatile("dc civac, %0" : : "r"(line_begin));
 		line_begin += line_size;
 	}
+}
+
+void arch_mm_flush_dcache(void *base, size_t size)
+{
+	/* Clean and invalidate each data cache line in the range. */
+	arch_mm_flush_dcache_lines((uintptr_t)base, (uintptr_t)base + size,
+				   arch_mm_dcache_line_size());
+	dsb(sy);
+}
+
+/**
+ * Returns the size of the block zeroed by DC ZVA, or 0 if it may not be used.
+ */
+static size_t arch_mm_dc_zva_block_size(void)
+{
+	uint64_t dczid = read_msr(DCZID_EL0);
+
+	if (dczid & DCZID_EL0_DZP) {
+		return 0;
+	}
+
+	return CACHE_WORD_SIZE << (dczid & DCZID_EL0_BS_MASK);
+}
+
+/**
+ * Zeroes the given range with the widest stores that are aligned, for the parts
+ * of a range which DC ZVA can't be used for.
+ */
+static void arch_mm_zero_stores(uintptr_t begin, uintptr_t end)
+{
+	while (begin < end && !is_aligned(begin, 16)) {
+		*(volatile uint8_t *)begin = 0;
+		begin++;
+	}
+
+	while (end - begin >= 16) {
+		__asm__ volatile("stp xzr, xzr, [%0]"
+				 :
+				 : "r"(begin)
+				 : "memory");
+		begin += 16;
+	}
+
+	while (begin < end) {
+		*(volatile uint8_t *)begin = 0;
+		begin++;
+	}
+}
+
+void arch_mm_zero_and_flush(void *base, size_t size)
+{
+	uint16_t line_size = arch_mm_dcache_line_size();
+	size_t block_size = arch_mm_dc_zva_block_size();
+	uintptr_t begin = (uintptr_t)base;
+	uintptr_t end = begin + size;
+	uintptr_t zva_begin = end;
+	uintptr_t zva_end = end;
+	uintptr_t block;
+
+	if (block_size != 0 && align_up(begin, block_size) <
+				       align_down(end, block_size)) {
+		zva_begin = align_up(begin, block_size);
+		zva_end = align_down(end, block_size);
+	}
+
+	/* The unaligned head and tail are zeroed with stores. */
+	arch_mm_zero_stores(begin, zva_begin);
+	arch_mm_flush_dcache_lines(begin, zva_begin, line_size);
+
+	/*
+	 * The rest is zeroed a block at a time without reading it from memory
+	 * first, and each block is written back straight away while it is
+	 * still in the cache rather than in a second pass over the range.
+	 */
+	for (block = zva_begin; block < zva_end; block += block_size) {
+		__asm__ volatile("dc zva, %0" : : "r"(block) : "memory");
+		arch_mm_flush_dcache_lines(block, block + block_size,
+					   line_size);
+	}
+
+	arch_mm_zero_stores(zva_end, end);
+	arch_mm_flush_dcache_lines(zva_end, end, line_size);
+
 	dsb(sy);
 }
 
@@ -762,6 +1040,23 @@ uint64_t arch_mm_combine_table_entry_attrs(uint64_t table_attrs,
 	return block_attrs;
 }
 
+/**
+ * Determines if replacing a valid pte with another valid pte requires a
+ * break-before-make sequence. The architecture only allows a live block or page
+ * descriptor to be rewritten if the output address, memory type, shareability
+ * and size of the mapping are unchanged, which is the case for changes to the
+ * permissions or the software defined bits.
+ */
+bool arch_mm_pte_needs_bbm(pte_t old_pte, pte_t new_pte, uint8_t level)
+{
+	if (!arch_mm_pte_is_block(old_pte, level) ||
+	    !arch_mm_pte_is_block(new_pte, level)) {
+		return true;
+	}
+
+	return ((old_pte ^ new_pte) & ~PTE_BBM_FREE_MASK) != 0;
+}
+
 /**
  * This is called early in initialization without MMU or caches enabled.
  */
@@ -780,6 +1075,8 @@ bool arch_mm_init(paddr_t table)
 		return false;
 	}
 
+	mm_tlbi_range_supported = is_arch_feat_tlbirange_supported();
+
 	/* Check the physical address range. */
 	if (!pa_bits) {
 		dlog_error(
@@ -121,10 +121,12 @@ void plat_ffa_rxtx_unmap_forward(ffa_vm_id_t id)
 
 bool plat_ffa_direct_request_forward(ffa_vm_id_t receiver_vm_id,
 				     struct ffa_value args,
+				     struct vcpu *current,
 				     struct ffa_value *ret)
 {
 	(void)receiver_vm_id;
 	(void)args;
+	(void)current;
 	(void)ret;
 
 	return false;
@@ -326,10 +328,11 @@ bool plat_ffa_is_vm_id(ffa_vm_id_t vm_id)
 }
 
 bool plat_ffa_run_forward(ffa_vm_id_t vm_id, ffa_vcpu_index_t vcpu_idx,
-			  struct ffa_value *ret)
+			  struct vcpu *current, struct ffa_value *ret)
 {
 	(void)vm_id;
 	(void)vcpu_idx;
+	(void)current;
 	(void)ret;
 
 	return false;
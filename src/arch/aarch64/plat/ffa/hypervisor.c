@@ -7,6 +7,7 @@
  */
 
 #include "hf/arch/barriers.h"
+#include "hf/arch/cpu.h"
 #include "hf/arch/ffa.h"
 #include "hf/arch/other_world.h"
 #include "hf/arch/plat/ffa.h"
@@ -108,6 +109,7 @@ void plat_ffa_init(struct mpool *ppool)
 	/* Setup TEE VM RX/TX buffers */
 	other_world_vm->mailbox.send = &other_world_send_buffer;
 	other_world_vm->mailbox.recv = &other_world_recv_buffer;
+	other_world_vm->mailbox.size = HF_MAILBOX_SIZE;
 
 	/*
 	 * Note that send and recv are swapped around, as the send buffer from
@@ -125,15 +127,34 @@ void plat_ffa_init(struct mpool *ppool)
 	dlog_verbose("TEE finished setting up buffers.\n");
 }
 
+/**
+ * Forwards the FF-A call `args` of `current` to the SPMC, along with its
+ * registers x8-x17. The call may be answered with a FF-A v1.2 direct message,
+ * so x8-x17 of `current` are updated with those returned.
+ */
+static struct ffa_value plat_ffa_other_world_call_ext(struct vcpu *current,
+						      struct ffa_value args)
+{
+	struct ffa_value_ext ret = arch_regs_get_args_ext(&current->regs);
+
+	ret.val = args;
+	ret = arch_other_world_call_ext(ret);
+	arch_regs_set_retval_ext(&current->regs, ret);
+
+	return ret.val;
+}
+
 bool plat_ffa_run_forward(ffa_vm_id_t vm_id, ffa_vcpu_index_t vcpu_idx,
-			  struct ffa_value *ret)
+			  struct vcpu *current, struct ffa_value *ret)
 {
 	/*
 	 * VM's requests should be forwarded to the SPMC, if target is an SP.
 	 */
 	if (!vm_id_is_current_world(vm_id)) {
-		*ret = arch_other_world_call((struct ffa_value){
-			.func = FFA_RUN_32, ffa_vm_vcpu(vm_id, vcpu_idx)});
+		struct ffa_value args = {.func = FFA_RUN_32,
+					 ffa_vm_vcpu(vm_id, vcpu_idx)};
+
+		*ret = plat_ffa_other_world_call_ext(current, args);
 		return true;
 	}
 
@@ -225,6 +246,7 @@ bool plat_ffa_is_direct_response_valid(struct vcpu *current,
 
 bool plat_ffa_direct_request_forward(ffa_vm_id_t receiver_vm_id,
 				     struct ffa_value args,
+				     struct vcpu *current,
 				     struct ffa_value *ret)
 {
 	if (!ffa_tee_enabled) {
@@ -238,7 +260,7 @@ bool plat_ffa_direct_request_forward(ffa_vm_id_t receiver_vm_id,
 		dlog_verbose("%s calling SPMC %#x %#x %#x %#x %#x\n", __func__,
 			     args.func, args.arg1, args.arg2, args.arg3,
 			     args.arg4);
-		*ret = arch_other_world_call(args);
+		*ret = plat_ffa_other_world_call_ext(current, args);
 		return true;
 	}
 
@@ -705,7 +727,7 @@ void plat_ffa_rxtx_map_forward(struct vm_locked vm_locked)
 		(struct ffa_endpoint_rx_tx_descriptor *)
 			other_world->mailbox.recv,
 		vm->id, (uintptr_t)vm->mailbox.recv,
-		(uintptr_t)vm->mailbox.send);
+		(uintptr_t)vm->mailbox.send, vm->mailbox.size / FFA_PAGE_SIZE);
 
 	plat_ffa_rxtx_map_spmc(pa_init(0), pa_init(0), 0);
 }
@@ -962,6 +984,7 @@ bool plat_ffa_check_runtime_state_transition(
 		return true;
 	case FFA_MSG_SEND_DIRECT_REQ_64:
 	case FFA_MSG_SEND_DIRECT_REQ_32:
+	case FFA_MSG_SEND_DIRECT_REQ2_64:
 	case FFA_RUN_32:
 		*next_state = VCPU_STATE_BLOCKED;
 		return true;
@@ -969,6 +992,7 @@ bool plat_ffa_check_runtime_state_transition(
 		/* Fall through. */
 	case FFA_MSG_SEND_DIRECT_RESP_64:
 	case FFA_MSG_SEND_DIRECT_RESP_32:
+	case FFA_MSG_SEND_DIRECT_RESP2_64:
 		*next_state = VCPU_STATE_WAITING;
 		return true;
 	default:
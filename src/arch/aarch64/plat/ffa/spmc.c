@@ -58,7 +58,7 @@ void sri_state_unlock(struct sri_state_locked sri_state_locked)
 	sl_unlock(&sri_state_lock_instance);
 }
 
-/** Other world SVE context (accessed from other_world_loop). */
+/** Other world SVE context (saved and restored by fpsimd.c). */
 struct sve_context_t sve_context[MAX_CPUS];
 
 /**
@@ -236,10 +236,11 @@ void plat_ffa_init(struct mpool *ppool)
 }
 
 bool plat_ffa_run_forward(ffa_vm_id_t vm_id, ffa_vcpu_index_t vcpu_idx,
-			  struct ffa_value *ret)
+			  struct vcpu *current, struct ffa_value *ret)
 {
 	(void)vm_id;
 	(void)vcpu_idx;
+	(void)current;
 	(void)ret;
 
 	return false;
@@ -315,6 +316,7 @@ static bool plat_ffa_check_rtm_ffa_run(struct vcpu *current, struct vcpu *vcpu,
 	switch (func) {
 	case FFA_MSG_SEND_DIRECT_REQ_64:
 	case FFA_MSG_SEND_DIRECT_REQ_32:
+	case FFA_MSG_SEND_DIRECT_REQ2_64:
 		/* Fall through. */
 	case FFA_RUN_32: {
 		/* Rules 1,2 section 7.2 EAC0 spec. */
@@ -334,6 +336,7 @@ static bool plat_ffa_check_rtm_ffa_run(struct vcpu *current, struct vcpu *vcpu,
 		return true;
 	case FFA_MSG_SEND_DIRECT_RESP_64:
 	case FFA_MSG_SEND_DIRECT_RESP_32:
+	case FFA_MSG_SEND_DIRECT_RESP2_64:
 		/* Rule 3 section 7.2 EAC0 spec. Fall through. */
 	default:
 		/* Deny state transitions by default. */
@@ -354,6 +357,7 @@ static bool plat_ffa_check_rtm_ffa_dir_req(struct vcpu *current,
 	switch (func) {
 	case FFA_MSG_SEND_DIRECT_REQ_64:
 	case FFA_MSG_SEND_DIRECT_REQ_32:
+	case FFA_MSG_SEND_DIRECT_REQ2_64:
 		/* Fall through. */
 	case FFA_RUN_32: {
 		/* Rules 1,2. */
@@ -365,7 +369,8 @@ static bool plat_ffa_check_rtm_ffa_dir_req(struct vcpu *current,
 		return true;
 	}
 	case FFA_MSG_SEND_DIRECT_RESP_64:
-	case FFA_MSG_SEND_DIRECT_RESP_32: {
+	case FFA_MSG_SEND_DIRECT_RESP_32:
+	case FFA_MSG_SEND_DIRECT_RESP2_64: {
 		/* Rule 3. */
 		if (current->direct_request_origin_vm_id == receiver_vm_id) {
 			*next_state = VCPU_STATE_WAITING;
@@ -397,6 +402,7 @@ static bool plat_ffa_check_rtm_sec_interrupt(struct vcpu *current,
 	switch (func) {
 	case FFA_MSG_SEND_DIRECT_REQ_64:
 	case FFA_MSG_SEND_DIRECT_REQ_32:
+	case FFA_MSG_SEND_DIRECT_REQ2_64:
 		/* Rule 3. */
 		*next_state = VCPU_STATE_BLOCKED;
 		return true;
@@ -417,6 +423,7 @@ static bool plat_ffa_check_rtm_sec_interrupt(struct vcpu *current,
 		/* Rule 4. Fall through. */
 	case FFA_MSG_SEND_DIRECT_RESP_64:
 	case FFA_MSG_SEND_DIRECT_RESP_32:
+	case FFA_MSG_SEND_DIRECT_RESP2_64:
 		/* Rule 5. Fall through. */
 	default:
 		/* Deny state transitions by default. */
@@ -433,7 +440,8 @@ static bool plat_ffa_check_rtm_sp_init(struct vcpu *vcpu, uint32_t func,
 {
 	switch (func) {
 	case FFA_MSG_SEND_DIRECT_REQ_64:
-	case FFA_MSG_SEND_DIRECT_REQ_32: {
+	case FFA_MSG_SEND_DIRECT_REQ_32:
+	case FFA_MSG_SEND_DIRECT_REQ2_64: {
 		assert(vcpu != NULL);
 		/* Rule 1. */
 		if (vcpu->is_bootstrapped) {
@@ -455,6 +463,7 @@ static bool plat_ffa_check_rtm_sp_init(struct vcpu *vcpu, uint32_t func,
 		/* Rule 6. Fall through. */
 	case FFA_MSG_SEND_DIRECT_RESP_64:
 	case FFA_MSG_SEND_DIRECT_RESP_32:
+	case FFA_MSG_SEND_DIRECT_RESP2_64:
 		/* Rule 5. Fall through. */
 	default:
 		/* Deny state transitions by default. */
@@ -578,6 +587,7 @@ bool plat_ffa_is_direct_response_valid(struct vcpu *current,
 
 bool plat_ffa_direct_request_forward(ffa_vm_id_t receiver_vm_id,
 				     struct ffa_value args,
+				     struct vcpu *current,
 				     struct ffa_value *ret)
 {
 	/*
@@ -585,6 +595,7 @@ bool plat_ffa_direct_request_forward(ffa_vm_id_t receiver_vm_id,
 	 */
 	(void)receiver_vm_id;
 	(void)args;
+	(void)current;
 	(void)ret;
 
 	return false;
@@ -244,3 +244,14 @@ bool is_arch_feat_sve_supported(void)
 	return ((id_aa64pfr0_el1 >> ID_AA64PFR0_EL1_SVE_SHIFT) &
 		ID_AA64PFR0_EL1_SVE_MASK) == ID_AA64PFR0_EL1_SVE_SUPPORTED;
 }
+
+/**
+ * Returns true if the TLB range maintenance instructions are implemented.
+ */
+bool is_arch_feat_tlbirange_supported(void)
+{
+	uint64_t id_aa64isar0_el1 = read_msr(ID_AA64ISAR0_EL1);
+
+	return ((id_aa64isar0_el1 >> ID_AA64ISAR0_EL1_TLB_SHIFT) &
+		ID_AA64ISAR0_EL1_TLB_MASK) == ID_AA64ISAR0_EL1_TLB_RANGE;
+}
@@ -63,3 +63,8 @@ static inline void vhe_switch_to_host_or_guest(bool guest)
  * Returns true if the SVE feature is implemented.
  */
 bool is_arch_feat_sve_supported(void);
+
+/**
+ * Returns true if the TLB range maintenance instructions are implemented.
+ */
+bool is_arch_feat_tlbirange_supported(void);
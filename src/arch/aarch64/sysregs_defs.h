@@ -113,6 +113,12 @@
  */
 #define EC_WFI_WFE UINT64_C(0x1)
 
+/**
+ * ESR code for an access to SVE, Advanced SIMD or floating-point functionality
+ * trapped by CPTR_EL2.
+ */
+#define EC_FP_ASIMD UINT64_C(0x7)
+
 /**
  * ESR code for SVC instruction execution.
  */
@@ -494,6 +500,12 @@
 #define CPTR_EL2_TTA (UINT64_C(0x1) << 20)
 #define CPTR_EL2_VHE_TTA (UINT64_C(0x1) << 28)
 
+/**
+ * When HCR_EL2.E2H=0, traps execution of SVE, Advanced SIMD and floating-point
+ * instructions at EL2/1/0 to EL2.
+ */
+#define CPTR_EL2_TFP (UINT64_C(0x1) << 10)
+
 /**
  * When HCR_EL2.E2H=1 (ARMv8.1-VHE enabled), CPTR_EL2 contains control bits to
  * enable and disable access to Floating Point, Advanced SIMD and SVE
@@ -676,6 +688,13 @@
 #define ID_AA64PFR0_EL1_SVE_MASK UINT64_C(0xf)
 #define ID_AA64PFR0_EL1_SVE_SUPPORTED UINT64_C(0x1)
 
+/**
+ * TLB maintenance instructions by range (FEAT_TLBIRANGE).
+ */
+#define ID_AA64ISAR0_EL1_TLB_SHIFT 56
+#define ID_AA64ISAR0_EL1_TLB_MASK UINT64_C(0xf)
+#define ID_AA64ISAR0_EL1_TLB_RANGE UINT64_C(0x2)
+
 /**
  * Returns true if the SVE feature is implemented.
  */
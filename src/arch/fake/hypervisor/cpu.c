@@ -60,6 +60,26 @@ void arch_regs_set_retval(struct arch_regs *r, struct ffa_value v)
 	r->arg[7] = v.arg7;
 }
 
+void arch_regs_set_retval_ext(struct arch_regs *r, struct ffa_value_ext v)
+{
+	/* There are no extended registers to update. */
+	arch_regs_set_retval(r, v.val);
+}
+
+struct ffa_value_ext arch_regs_get_args_ext(struct arch_regs *regs)
+{
+	return (struct ffa_value_ext){
+		.val = {.func = regs->arg[0],
+			.arg1 = regs->arg[1],
+			.arg2 = regs->arg[2],
+			.arg3 = regs->arg[3],
+			.arg4 = regs->arg[4],
+			.arg5 = regs->arg[5],
+			.arg6 = regs->arg[6],
+			.arg7 = regs->arg[7]},
+	};
+}
+
 void arch_cpu_init(struct cpu *c, ipaddr_t entry_point)
 {
 	(void)c;
@@ -17,3 +17,9 @@ struct ffa_value arch_other_world_call(struct ffa_value args)
 	dlog_error("Attempted to call TEE function %#x\n", args.func);
 	return ffa_error(FFA_NOT_SUPPORTED);
 }
+
+struct ffa_value_ext arch_other_world_call_ext(struct ffa_value_ext args)
+{
+	dlog_error("Attempted to call TEE function %#x\n", args.val.func);
+	return (struct ffa_value_ext){.val = ffa_error(FFA_NOT_SUPPORTED)};
+}
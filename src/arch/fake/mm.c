@@ -9,6 +9,7 @@
 #include "hf/arch/mm.h"
 
 #include "hf/mm.h"
+#include "hf/std.h"
 
 /*
  * The fake architecture uses the mode flags to represent the attributes applied
@@ -24,6 +25,9 @@
  */
 #define PTE_TABLE (UINT64_C(1) << (PAGE_BITS - 1))
 
+/* The contiguous hint uses the bit below the table bit. */
+#define PTE_CONTIGUOUS (UINT64_C(1) << (PAGE_BITS - 2))
+
 /* Mask for the address part of an entry. */
 #define PTE_ADDR_MASK (~(PTE_ATTR_MODE_MASK | (UINT64_C(1) << PAGE_BITS) - 1))
 
@@ -103,12 +107,46 @@ uint64_t arch_mm_combine_table_entry_attrs(uint64_t table_attrs,
 	return table_attrs | block_attrs;
 }
 
+bool arch_mm_pte_needs_bbm(pte_t old_pte, pte_t new_pte, uint8_t level)
+{
+	return !arch_mm_pte_is_block(old_pte, level) ||
+	       !arch_mm_pte_is_block(new_pte, level) ||
+	       pa_addr(arch_mm_block_from_pte(old_pte, level)) !=
+		       pa_addr(arch_mm_block_from_pte(new_pte, level)) ||
+	       arch_mm_pte_is_contiguous(old_pte, level) !=
+		       arch_mm_pte_is_contiguous(new_pte, level);
+}
+
+uint8_t arch_mm_contiguous_entries(uint8_t level)
+{
+	return level <= 1 ? 16 : 0;
+}
+
+bool arch_mm_pte_is_contiguous(pte_t pte, uint8_t level)
+{
+	return arch_mm_pte_is_block(pte, level) &&
+	       ((pte << PTE_LEVEL_SHIFT(level)) & PTE_CONTIGUOUS) != 0;
+}
+
+pte_t arch_mm_pte_set_contiguous(pte_t pte, uint8_t level, bool contiguous)
+{
+	pte_t bit = PTE_CONTIGUOUS >> PTE_LEVEL_SHIFT(level);
+
+	return contiguous ? pte | bit : pte & ~bit;
+}
+
 void arch_mm_invalidate_stage1_range(uint16_t asid, vaddr_t va_begin,
 				     vaddr_t va_end)
 {
 	/* There's no modelling of the stage-1 TLB. */
 }
 
+void arch_mm_invalidate_stage1_range_local(uint16_t asid, vaddr_t va_begin,
+					   vaddr_t va_end)
+{
+	/* There's no modelling of the stage-1 TLB. */
+}
+
 void arch_mm_invalidate_stage2_range(uint16_t vmid, ipaddr_t va_begin,
 				     ipaddr_t va_end)
 {
@@ -120,6 +158,11 @@ void arch_mm_flush_dcache(void *base, size_t size)
 	/* There's no modelling of the cache. */
 }
 
+void arch_mm_zero_and_flush(void *base, size_t size)
+{
+	memset_s(base, size, 0, size);
+}
+
 void arch_mm_stage1_max_level_set(uint32_t pa_bits)
 {
 	/* Not required to set this value as its hardcoded to 2 */
@@ -174,6 +217,12 @@ void arch_stack_mm_init(struct mm_stage1_locked stage1_locked,
 	(void)ppool;
 }
 
+size_t arch_mm_cpu_index(void)
+{
+	/* There is only one CPU. */
+	return 0;
+}
+
 bool arch_mm_init(paddr_t table)
 {
 	/* No initialization required. */
@@ -8,6 +8,8 @@
 
 #include "hf/ffa_memory.h"
 
+#include <stdatomic.h>
+
 #include "hf/arch/mm.h"
 #include "hf/arch/other_world.h"
 #include "hf/arch/plat/ffa.h"
@@ -21,12 +23,18 @@
 #include "hf/std.h"
 #include "hf/vm.h"
 
+/*
+ * MAX_MEM_SHARES, the maximum number of memory sharing handles which may be
+ * active at once, is set by the build. A DONATE handle is active from when it
+ * is sent to when it is retrieved; a SHARE or LEND handle is active from when
+ * it is sent to when it is reclaimed.
+ */
+
 /**
- * The maximum number of memory sharing handles which may be active at once. A
- * DONATE handle is active from when it is sent to when it is retrieved; a SHARE
- * or LEND handle is active from when it is sent to when it is reclaimed.
+ * The number of buckets of the index of share states by handle. Must be a
+ * power of two.
  */
-#define MAX_MEM_SHARES 100
+#define SHARE_STATES_HASH_BUCKETS 128
 
 /**
  * The maximum number of fragments into which a memory sharing message may be
@@ -34,6 +42,42 @@
  */
 #define MAX_FRAGMENTS 20
 
+/**
+ * The number of constituents in each page pool entry in which the sorted
+ * constituents of a share state are stored.
+ */
+#define SORTED_FRAGMENT_CONSTITUENTS \
+	(MM_PPOOL_ENTRY_SIZE / sizeof(struct ffa_memory_region_constituent))
+
+/**
+ * The number of slabs in which memory region descriptors and fragments are
+ * stored, and the value recorded for those stored in a page pool entry instead.
+ */
+#define DESCRIPTOR_SLAB_COUNT 4
+#define DESCRIPTOR_SLAB_NONE UINT8_MAX
+
+/**
+ * The maximum number of pages of memory cleared in the background by each call
+ * to `ffa_memory_clear_pending`.
+ */
+#define CLEAR_PENDING_PAGES_PER_STEP 32
+
+/*
+ * MAX_MEM_OP_PAGES, the maximum number of pages a memory sharing call clears
+ * before returning, and MAX_MEM_OP_CONSTITUENTS, the maximum number of
+ * constituents it maps or unmaps, are set by the build. Calls which have more
+ * to do return FFA_INTERRUPTED and are completed with FFA_MEM_OP_RESUME, which
+ * bounds the time spent in the hypervisor on behalf of a VM.
+ */
+
+/**
+ * The size of the blocks in which memory retrieved to be mapped on demand is
+ * mapped, as the receiver first accesses each.
+ */
+#define LAZY_MAP_BLOCK_SIZE (PAGE_SIZE << PAGE_LEVEL_BITS)
+
+static_assert(MAX_MEM_SHARES < UINT16_MAX,
+	      "Share state indices must fit in the hash chain links.");
 static_assert(sizeof(struct ffa_memory_region_constituent) % 16 == 0,
 	      "struct ffa_memory_region_constituent must be a multiple of 16 "
 	      "bytes long.");
@@ -50,15 +94,74 @@ static_assert(sizeof(struct ffa_mem_relinquish) % 16 == 0,
 	      "struct ffa_mem_relinquish must be a multiple of 16 "
 	      "bytes long.");
 
+/**
+ * A call on the memory of a share state which was interrupted before updating
+ * the page table of the VM which made it for all of its constituents, to be
+ * completed by FFA_MEM_OP_RESUME.
+ */
+struct ffa_memory_op {
+	/** The function ID of the call, or 0 if there is none. */
+	uint32_t func;
+
+	/** The VM which made the call, and whose page table it updates. */
+	ffa_vm_id_t vm_id;
+
+	/**
+	 * The index of the receiver which made the call to retrieve or
+	 * relinquish the memory, and the permissions it retrieves it with.
+	 */
+	uint32_t receiver_index;
+	ffa_memory_access_permissions_t permissions;
+
+	/** True if the memory is to be cleared once it is relinquished. */
+	bool clear;
+
+	/** The mode the memory is mapped with by the call. */
+	uint32_t mode;
+
+	/**
+	 * How far updating the page table has got: the sorted fragment, and the
+	 * constituent in it, to be updated next.
+	 */
+	uint32_t fragment;
+	uint32_t constituent;
+};
+
 struct ffa_memory_share_state {
+	/**
+	 * Guards all the other members of the share state other than `handle`.
+	 * The share states lock may be acquired while holding this lock, but
+	 * not the other way around.
+	 */
+	struct spinlock lock;
+
+	/**
+	 * The handle of the share state while it is allocated. Guarded by the
+	 * share states lock rather than `lock`, so that share states can be
+	 * looked up without locking each of them.
+	 */
+	ffa_memory_handle_t handle;
+
+	/** The index of the share state in the table. Never changes. */
+	uint16_t index;
+
 	/**
 	 * The memory region being shared, or NULL if this share state is
 	 * unallocated.
 	 */
 	struct ffa_memory_region *memory_region;
 
+	/** The slab `memory_region` is stored in. */
+	uint8_t memory_region_slab;
+
 	struct ffa_memory_region_constituent *fragments[MAX_FRAGMENTS];
 
+	/**
+	 * The slab each fragment other than the first, which is part of
+	 * `memory_region`, is stored in.
+	 */
+	uint8_t fragment_slabs[MAX_FRAGMENTS];
+
 	/** The number of constituents in each fragment. */
 	uint32_t fragment_constituent_counts[MAX_FRAGMENTS];
 
@@ -68,6 +171,24 @@ struct ffa_memory_share_state {
 	 */
 	uint32_t fragment_count;
 
+	/**
+	 * The constituents of all the fragments sorted by address, with empty
+	 * ones dropped and adjacent ones merged, which the page tables are
+	 * updated with once sending is complete. The descriptor itself is kept
+	 * as it was sent. Every sorted fragment but the last fills a page pool
+	 * entry, so that a constituent can be found directly from its index.
+	 */
+	struct ffa_memory_region_constituent *sorted_fragments[MAX_FRAGMENTS];
+
+	/** The slab each sorted fragment is stored in. */
+	uint8_t sorted_fragment_slabs[MAX_FRAGMENTS];
+
+	/** The number of constituents in each sorted fragment. */
+	uint32_t sorted_constituent_counts[MAX_FRAGMENTS];
+
+	/** The number of valid elements in the `sorted_*` arrays. */
+	uint32_t sorted_fragment_count;
+
 	/**
 	 * The FF-A function used for sharing the memory. Must be one of
 	 * FFA_MEM_DONATE_32, FFA_MEM_LEND_32 or FFA_MEM_SHARE_32 if the
@@ -96,21 +217,146 @@ struct ffa_memory_share_state {
 	 * entries beyond the receiver_count will always be 0.
 	 */
 	uint32_t retrieved_fragment_count[MAX_MEM_SHARE_RECIPIENTS];
+
+	/**
+	 * The mode each recipient which retrieved the memory to have it mapped
+	 * on demand is to have it mapped with, in the same order, or 0 if the
+	 * memory was mapped when retrieved or hasn't been retrieved.
+	 */
+	uint32_t lazy_mode[MAX_MEM_SHARE_RECIPIENTS];
+
+	/**
+	 * True if the memory was sent, relinquished or reclaimed with the clear
+	 * flag and hasn't been cleared yet. It is cleared in the background,
+	 * and what remains is cleared before the memory is mapped for a VM
+	 * again.
+	 */
+	bool clear_pending;
+
+	/** The mode of the memory to clear for the security state. */
+	uint32_t clear_mode;
+
+	/**
+	 * How far clearing has got: the sorted fragment, the constituent in
+	 * it, and the number of pages of that constituent already cleared.
+	 */
+	uint32_t clear_fragment;
+	uint32_t clear_constituent;
+	uint32_t clear_page;
+
+	/**
+	 * The interrupted call of the sender to send or reclaim this memory. No
+	 * other call mapping or unmapping the memory can be made meanwhile.
+	 */
+	struct ffa_memory_op op;
+
+	/**
+	 * The interrupted call of each receiver to retrieve or relinquish this
+	 * memory. It only updates the page table of that receiver, so it only
+	 * holds up the calls of the sender and of that receiver.
+	 */
+	struct ffa_memory_op receiver_ops[MAX_MEM_SHARE_RECIPIENTS];
 };
 
 /**
  * Encapsulates the set of share states while the `share_states_lock` is held.
  */
 struct share_states_locked {
-	struct ffa_memory_share_state *share_states;
+	struct share_states_segment *segments;
 };
 
 /**
- * All access to members of a `struct ffa_memory_share_state` must be guarded
- * by this lock.
+ * Encapsulates a share state while its own lock is held.
+ */
+struct share_state_locked {
+	struct ffa_memory_share_state *share_state;
+};
+
+/**
+ * Guards allocating, looking up and freeing share states, i.e. which share
+ * states are allocated and their handles. The rest of each share state is
+ * guarded by its own lock, so operations on different share states can run in
+ * parallel.
  */
 static struct spinlock share_states_lock_instance = SPINLOCK_INIT;
-static struct ffa_memory_share_state share_states[MAX_MEM_SHARES];
+
+/**
+ * The number of share states in each segment of the share state table, which
+ * takes one entry of the page pool.
+ */
+#define SHARE_STATES_PER_SEGMENT \
+	(MM_PPOOL_ENTRY_SIZE / sizeof(struct ffa_memory_share_state))
+#define SHARE_STATES_SEGMENTS                              \
+	((MAX_MEM_SHARES + SHARE_STATES_PER_SEGMENT - 1) / \
+	 SHARE_STATES_PER_SEGMENT)
+
+static_assert(SHARE_STATES_PER_SEGMENT > 0,
+	      "A share state must fit in an entry of the page pool.");
+
+/**
+ * A segment of the share state table. Segments are allocated from the page
+ * pool when the first of their share states is allocated and freed once none
+ * of their share states are in use, so the table only takes as much memory as
+ * the handles which are active. Share state indices, and so the handles made
+ * from them, are independent of which segments happen to be allocated.
+ */
+struct share_states_segment {
+	/** The share states of the segment, or NULL if it isn't allocated. */
+	struct ffa_memory_share_state *share_states;
+
+	/** The number of allocated share states in the segment. */
+	uint16_t allocated_count;
+
+	/**
+	 * The number of users keeping the segment allocated other than its
+	 * allocated share states, such as lookups yet to lock the share state
+	 * they found.
+	 */
+	uint16_t pin_count;
+};
+
+/** The share state table. Guarded by the share states lock. */
+static struct share_states_segment share_states_segments[SHARE_STATES_SEGMENTS];
+
+/**
+ * Bitmap of the allocated share states, so that a free one can be found
+ * without looking at each of them. Guarded by the share states lock.
+ */
+static uint32_t share_states_allocated[(MAX_MEM_SHARES + 31) / 32];
+
+/**
+ * Bitmap of the share states whose memory is still to be cleared, and their
+ * number, which is also read without the lock to skip looking for them when
+ * there are none. Guarded by the share states lock.
+ */
+static uint32_t share_states_clear_pending[(MAX_MEM_SHARES + 31) / 32];
+static atomic_uint_least32_t share_states_clear_pending_count;
+
+/**
+ * Index of the share states with a handle allocated by the other world, as
+ * those handles don't encode the index of the share state. Each bucket holds
+ * one more than the index of the first share state in its chain, or 0 if it is
+ * empty, and `share_states_hash_next` links the chains in the same way.
+ * Guarded by the share states lock.
+ */
+static uint16_t share_states_hash_buckets[SHARE_STATES_HASH_BUCKETS];
+static uint16_t share_states_hash_next[MAX_MEM_SHARES];
+
+/**
+ * The sizes of the slabs in which memory region descriptors and fragments are
+ * stored once they have been copied from the sender, so that the small ones
+ * typical of single receiver transactions don't each take an entry of the page
+ * pool. Larger ones stay in the page pool entry they were copied into.
+ */
+static const size_t descriptor_slab_sizes[DESCRIPTOR_SLAB_COUNT] = {
+	256, 512, 1024, 2048};
+
+static_assert(MM_PPOOL_ENTRY_SIZE % 2048 == 0,
+	      "Slabs are refilled with entries of the page pool.");
+static_assert(HF_MAILBOX_SIZE <= MM_PPOOL_ENTRY_SIZE,
+	      "Constituents take no more sorted fragments than fragments.");
+
+static struct mpool descriptor_slabs[DESCRIPTOR_SLAB_COUNT];
 
 /**
  * Buffer for retrieving memory region information from the TEE for when a
@@ -129,93 +375,349 @@ uint64_t ffa_memory_handle_get_index(ffa_memory_handle_t handle)
 }
 
 /**
- * Initialises the next available `struct ffa_memory_share_state` and sets
- * `share_state_ret` to a pointer to it. If `handle` is
- * `FFA_MEMORY_HANDLE_INVALID` then allocates an appropriate handle, otherwise
- * uses the provided handle which is assumed to be globally unique.
- *
- * Returns true on success or false if none are available.
+ * Initialises the slabs in which memory region descriptors are stored.
  */
-static bool allocate_share_state(
-	struct share_states_locked share_states, uint32_t share_func,
-	struct ffa_memory_region *memory_region, uint32_t fragment_length,
-	ffa_memory_handle_t handle,
-	struct ffa_memory_share_state **share_state_ret)
+void ffa_memory_init(void)
 {
-	uint64_t i;
+	size_t i;
 
-	assert(share_states.share_states != NULL);
-	assert(memory_region != NULL);
+	for (i = 0; i < DESCRIPTOR_SLAB_COUNT; ++i) {
+		mpool_init(&descriptor_slabs[i], descriptor_slab_sizes[i]);
+	}
+}
 
-	for (i = 0; i < MAX_MEM_SHARES; ++i) {
-		if (share_states.share_states[i].share_func == 0) {
-			uint32_t j;
-			struct ffa_memory_share_state *allocated_state =
-				&share_states.share_states[i];
-			struct ffa_composite_memory_region *composite =
-				ffa_memory_region_get_composite(memory_region,
-								0);
-
-			if (handle == FFA_MEMORY_HANDLE_INVALID) {
-				memory_region->handle =
-					plat_ffa_memory_handle_make(i);
-			} else {
-				memory_region->handle = handle;
-			}
-			allocated_state->share_func = share_func;
-			allocated_state->memory_region = memory_region;
-			allocated_state->fragment_count = 1;
-			allocated_state->fragments[0] = composite->constituents;
-			allocated_state->fragment_constituent_counts[0] =
-				(fragment_length -
-				 ffa_composite_constituent_offset(memory_region,
-								  0)) /
-				sizeof(struct ffa_memory_region_constituent);
-			allocated_state->sending_complete = false;
-			for (j = 0; j < MAX_MEM_SHARE_RECIPIENTS; ++j) {
-				allocated_state->retrieved_fragment_count[j] =
-					0;
-			}
-			if (share_state_ret != NULL) {
-				*share_state_ret = allocated_state;
-			}
-			return true;
+/**
+ * Moves the given memory region descriptor or fragment of `length` bytes from
+ * the page pool entry it was copied into to the smallest slab it fits in, and
+ * frees the entry. Returns where the descriptor is now stored and sets
+ * `slab_ret` to the slab it is in, which is DESCRIPTOR_SLAB_NONE if it is too
+ * large for any slab or the slab is out of memory.
+ */
+static void *descriptor_compact(void *descriptor, uint32_t length,
+				struct mpool *page_pool, uint8_t *slab_ret)
+{
+	uint8_t slab;
+	void *compacted;
+
+	*slab_ret = DESCRIPTOR_SLAB_NONE;
+
+	for (slab = 0; slab < DESCRIPTOR_SLAB_COUNT; ++slab) {
+		if (length <= descriptor_slab_sizes[slab]) {
+			break;
 		}
 	}
 
-	return false;
+	if (slab == DESCRIPTOR_SLAB_COUNT) {
+		return descriptor;
+	}
+
+	compacted = mpool_alloc_slab(&descriptor_slabs[slab], page_pool);
+	if (compacted == NULL) {
+		return descriptor;
+	}
+
+	memcpy_s(compacted, descriptor_slab_sizes[slab], descriptor, length);
+	mpool_free(page_pool, descriptor);
+	*slab_ret = slab;
+
+	return compacted;
+}
+
+/** Frees a descriptor stored by `descriptor_compact`. */
+static void descriptor_free(void *descriptor, uint8_t slab,
+			    struct mpool *page_pool)
+{
+	if (slab == DESCRIPTOR_SLAB_NONE) {
+		mpool_free(page_pool, descriptor);
+	} else {
+		mpool_free(&descriptor_slabs[slab], descriptor);
+	}
+}
+
+/** Returns the bucket of the share states index for the given handle. */
+static uint16_t *share_states_hash_bucket(ffa_memory_handle_t handle)
+{
+	uint64_t hash = handle ^ (handle >> 32);
+
+	return &share_states_hash_buckets[hash &
+					  (SHARE_STATES_HASH_BUCKETS - 1)];
+}
+
+/**
+ * Adds the share state with the given index to the index by handle, if its
+ * handle was allocated by the other world.
+ */
+static void share_states_hash_insert(uint64_t index,
+				     ffa_memory_handle_t handle)
+{
+	uint16_t *bucket;
+
+	if (plat_ffa_memory_handle_allocated_by_current_world(handle)) {
+		return;
+	}
+
+	bucket = share_states_hash_bucket(handle);
+	share_states_hash_next[index] = *bucket;
+	*bucket = index + 1;
+}
+
+/**
+ * Removes the share state with the given index from the index by handle, if
+ * its handle was allocated by the other world.
+ */
+static void share_states_hash_remove(uint64_t index,
+				     ffa_memory_handle_t handle)
+{
+	uint16_t *link;
+
+	if (plat_ffa_memory_handle_allocated_by_current_world(handle)) {
+		return;
+	}
+
+	for (link = share_states_hash_bucket(handle); *link != 0;
+	     link = &share_states_hash_next[*link - 1]) {
+		if (*link == index + 1) {
+			*link = share_states_hash_next[index];
+			return;
+		}
+	}
 }
 
 /** Locks the share states lock. */
-struct share_states_locked share_states_lock(void)
+static struct share_states_locked share_states_lock(void)
 {
 	sl_lock(&share_states_lock_instance);
 
-	return (struct share_states_locked){.share_states = share_states};
+	return (struct share_states_locked){.segments = share_states_segments};
 }
 
 /** Unlocks the share states lock. */
 static void share_states_unlock(struct share_states_locked *share_states)
 {
-	assert(share_states->share_states != NULL);
-	share_states->share_states = NULL;
+	assert(share_states->segments != NULL);
+	share_states->segments = NULL;
 	sl_unlock(&share_states_lock_instance);
 }
 
 /**
- * If the given handle is a valid handle for an allocated share state then
- * initialises `share_state_ret` to point to the share state and returns true.
- * Otherwise returns false.
+ * Returns the share state with the given index, or NULL if its segment isn't
+ * allocated.
  */
-static bool get_share_state(struct share_states_locked share_states,
-			    ffa_memory_handle_t handle,
-			    struct ffa_memory_share_state **share_state_ret)
+static struct ffa_memory_share_state *share_state_at(
+	struct share_states_locked share_states, uint64_t index)
 {
-	struct ffa_memory_share_state *share_state;
-	uint64_t index;
+	struct share_states_segment *segment =
+		&share_states.segments[index / SHARE_STATES_PER_SEGMENT];
 
-	assert(share_states.share_states != NULL);
-	assert(share_state_ret != NULL);
+	if (segment->share_states == NULL) {
+		return NULL;
+	}
+
+	return &segment->share_states[index % SHARE_STATES_PER_SEGMENT];
+}
+
+/**
+ * Allocates the given segment of the share state table if it isn't already.
+ * Returns false if there is no memory for it.
+ */
+static bool share_states_segment_grow(struct share_states_locked share_states,
+				      uint64_t segment_index,
+				      struct mpool *page_pool)
+{
+	struct share_states_segment *segment =
+		&share_states.segments[segment_index];
+	struct ffa_memory_share_state *segment_states;
+	uint32_t i;
+
+	if (segment->share_states != NULL) {
+		return true;
+	}
+
+	segment_states = mpool_alloc(page_pool);
+	if (segment_states == NULL) {
+		return false;
+	}
+
+	memset_s(segment_states, MM_PPOOL_ENTRY_SIZE, 0, MM_PPOOL_ENTRY_SIZE);
+	for (i = 0; i < SHARE_STATES_PER_SEGMENT; ++i) {
+		sl_init(&segment_states[i].lock);
+		segment_states[i].index =
+			segment_index * SHARE_STATES_PER_SEGMENT + i;
+	}
+
+	segment->share_states = segment_states;
+	return true;
+}
+
+/**
+ * Frees the given segment of the share state table if none of its share states
+ * are in use. The first segment is kept so that sharing one region at a time
+ * doesn't allocate and free it every time.
+ */
+static void share_states_segment_shrink(
+	struct share_states_locked share_states, uint64_t segment_index,
+	struct mpool *page_pool)
+{
+	struct share_states_segment *segment =
+		&share_states.segments[segment_index];
+
+	if (segment_index == 0 || segment->share_states == NULL ||
+	    segment->allocated_count != 0 || segment->pin_count != 0) {
+		return;
+	}
+
+	mpool_free(page_pool, segment->share_states);
+	segment->share_states = NULL;
+}
+
+/**
+ * Releases a pin on the given segment of the share state table, freeing the
+ * segment if it is no longer in use.
+ */
+static void share_states_segment_unpin(uint64_t segment_index,
+				       struct mpool *page_pool)
+{
+	struct share_states_locked share_states = share_states_lock();
+
+	assert(share_states.segments[segment_index].pin_count > 0);
+	share_states.segments[segment_index].pin_count--;
+	share_states_segment_shrink(share_states, segment_index, page_pool);
+	share_states_unlock(&share_states);
+}
+
+/** Unlocks the given share state, if one is locked. */
+static void share_state_unlock(struct share_state_locked *share_state_locked)
+{
+	if (share_state_locked->share_state != NULL) {
+		sl_unlock(&share_state_locked->share_state->lock);
+		share_state_locked->share_state = NULL;
+	}
+}
+
+/**
+ * Reserves the first free share state and gives it the handle `handle`, or one
+ * derived from its index if `handle` is `FFA_MEMORY_HANDLE_INVALID`. Returns
+ * the share state or NULL if none are available.
+ */
+static struct ffa_memory_share_state *share_state_reserve(
+	ffa_memory_handle_t handle, struct mpool *page_pool)
+{
+	struct share_states_locked share_states = share_states_lock();
+	struct ffa_memory_share_state *reserved_state = NULL;
+	uint64_t i;
+	uint32_t word;
+
+	/* Find the first free share state from the bitmap. */
+	for (word = 0; word < ARRAY_SIZE(share_states_allocated); ++word) {
+		if (share_states_allocated[word] != UINT32_MAX) {
+			break;
+		}
+	}
+
+	if (word == ARRAY_SIZE(share_states_allocated)) {
+		goto out;
+	}
+
+	i = word * 32 + ctz(~share_states_allocated[word]);
+	if (i >= MAX_MEM_SHARES) {
+		goto out;
+	}
+
+	if (!share_states_segment_grow(share_states,
+				       i / SHARE_STATES_PER_SEGMENT,
+				       page_pool)) {
+		goto out;
+	}
+
+	share_states_allocated[word] |= UINT32_C(1) << (i % 32);
+	share_states.segments[i / SHARE_STATES_PER_SEGMENT].allocated_count++;
+
+	reserved_state = share_state_at(share_states, i);
+	reserved_state->handle = handle == FFA_MEMORY_HANDLE_INVALID
+					 ? plat_ffa_memory_handle_make(i)
+					 : handle;
+	share_states_hash_insert(i, reserved_state->handle);
+
+out:
+	share_states_unlock(&share_states);
+	return reserved_state;
+}
+
+/**
+ * Initialises the next available `struct ffa_memory_share_state` and sets
+ * `share_state_ret` to it, locked. If `handle` is `FFA_MEMORY_HANDLE_INVALID`
+ * then allocates an appropriate handle, otherwise uses the provided handle
+ * which is assumed to be globally unique. If `share_state_ret` is NULL the
+ * share state is unlocked again once initialised.
+ *
+ * On success, the share state takes ownership of `memory_region`, which may be
+ * moved so must only be accessed through the share state from then on.
+ *
+ * Returns true on success or false if none are available.
+ */
+static bool allocate_share_state(uint32_t share_func,
+				 struct ffa_memory_region *memory_region,
+				 uint32_t fragment_length,
+				 ffa_memory_handle_t handle,
+				 struct share_state_locked *share_state_ret,
+				 struct mpool *page_pool)
+{
+	uint32_t j;
+	struct ffa_memory_share_state *allocated_state;
+	struct ffa_composite_memory_region *composite;
+
+	assert(memory_region != NULL);
+
+	allocated_state = share_state_reserve(handle, page_pool);
+	if (allocated_state == NULL) {
+		return false;
+	}
+
+	/*
+	 * The share state can't be found by its handle until it is initialised
+	 * below, as lookups check `share_func` once they hold its lock.
+	 */
+	sl_lock(&allocated_state->lock);
+
+	memory_region = descriptor_compact(
+		memory_region, fragment_length, page_pool,
+		&allocated_state->memory_region_slab);
+	composite = ffa_memory_region_get_composite(memory_region, 0);
+	memory_region->handle = allocated_state->handle;
+	allocated_state->share_func = share_func;
+	allocated_state->memory_region = memory_region;
+	allocated_state->fragment_count = 1;
+	allocated_state->fragments[0] = composite->constituents;
+	allocated_state->fragment_constituent_counts[0] =
+		(fragment_length -
+		 ffa_composite_constituent_offset(memory_region, 0)) /
+		sizeof(struct ffa_memory_region_constituent);
+	allocated_state->sorted_fragment_count = 0;
+	allocated_state->sending_complete = false;
+	allocated_state->op.func = 0;
+	for (j = 0; j < MAX_MEM_SHARE_RECIPIENTS; ++j) {
+		allocated_state->retrieved_fragment_count[j] = 0;
+		allocated_state->lazy_mode[j] = 0;
+		allocated_state->receiver_ops[j].func = 0;
+	}
+	if (share_state_ret != NULL) {
+		share_state_ret->share_state = allocated_state;
+	} else {
+		sl_unlock(&allocated_state->lock);
+	}
+	return true;
+}
+
+/**
+ * Finds the share state with the given handle, if it is allocated, and pins
+ * its segment so that it can be locked.
+ */
+static struct ffa_memory_share_state *share_state_find(
+	ffa_memory_handle_t handle)
+{
+	struct share_states_locked share_states = share_states_lock();
+	struct ffa_memory_share_state *share_state = NULL;
+	uint64_t index;
 
 	/*
 	 * First look for a share_state allocated by us, in which case the
@@ -223,22 +725,92 @@ static bool get_share_state(struct share_states_locked share_states,
 	 */
 	if (plat_ffa_memory_handle_allocated_by_current_world(handle)) {
 		index = ffa_memory_handle_get_index(handle);
-		if (index < MAX_MEM_SHARES) {
-			share_state = &share_states.share_states[index];
-			if (share_state->share_func != 0) {
-				*share_state_ret = share_state;
-				return true;
-			}
+		if (index < MAX_MEM_SHARES &&
+		    (share_states_allocated[index / 32] &
+		     (UINT32_C(1) << (index % 32))) != 0) {
+			share_state = share_state_at(share_states, index);
+		}
+		goto out;
+	}
+
+	/* Otherwise look the handle up in the index of foreign handles. */
+	for (index = *share_states_hash_bucket(handle); index != 0;
+	     index = share_states_hash_next[index - 1]) {
+		if (share_state_at(share_states, index - 1)->handle == handle) {
+			share_state = share_state_at(share_states, index - 1);
+			break;
 		}
 	}
 
-	/* Fall back to a linear scan. */
-	for (index = 0; index < MAX_MEM_SHARES; ++index) {
-		share_state = &share_states.share_states[index];
-		if (share_state->memory_region != NULL &&
-		    share_state->memory_region->handle == handle &&
-		    share_state->share_func != 0) {
-			*share_state_ret = share_state;
+out:
+	if (share_state != NULL) {
+		share_states.segments[share_state->index /
+				      SHARE_STATES_PER_SEGMENT]
+			.pin_count++;
+	}
+	share_states_unlock(&share_states);
+	return share_state;
+}
+
+/**
+ * If the given handle is a valid handle for an allocated share state then
+ * locks the share state, initialises `share_state_ret` to it and returns true.
+ * Otherwise returns false.
+ */
+static bool get_share_state(ffa_memory_handle_t handle,
+			    struct share_state_locked *share_state_ret,
+			    struct mpool *page_pool)
+{
+	struct ffa_memory_share_state *share_state;
+	uint64_t segment_index;
+	bool valid;
+
+	assert(share_state_ret != NULL);
+
+	share_state = share_state_find(handle);
+	if (share_state == NULL) {
+		return false;
+	}
+	segment_index = share_state->index / SHARE_STATES_PER_SEGMENT;
+
+	/*
+	 * The share state may have been freed, or be yet to be initialised,
+	 * by the time its lock is acquired, so check it again.
+	 */
+	sl_lock(&share_state->lock);
+	valid = share_state->share_func != 0 &&
+		share_state->memory_region != NULL &&
+		share_state->memory_region->handle == handle;
+	if (!valid) {
+		sl_unlock(&share_state->lock);
+	}
+
+	/* Once locked, a valid share state keeps its segment allocated. */
+	share_states_segment_unpin(segment_index, page_pool);
+
+	if (!valid) {
+		return false;
+	}
+
+	share_state_ret->share_state = share_state;
+	return true;
+}
+
+/**
+ * Returns true if a call of the sender or of any receiver on the memory of the
+ * given share state was interrupted and is still to be completed with
+ * FFA_MEM_OP_RESUME.
+ */
+static bool share_state_op_pending(struct ffa_memory_share_state *share_state)
+{
+	uint32_t i;
+
+	if (share_state->op.func != 0) {
+		return true;
+	}
+
+	for (i = 0; i < MAX_MEM_SHARE_RECIPIENTS; ++i) {
+		if (share_state->receiver_ops[i].func != 0) {
 			return true;
 		}
 	}
@@ -246,17 +818,26 @@ static bool get_share_state(struct share_states_locked share_states,
 	return false;
 }
 
-/** Marks a share state as unallocated. */
-static void share_state_free(struct share_states_locked share_states,
-			     struct ffa_memory_share_state *share_state,
+/**
+ * Marks a share state as unallocated and unlocks it.
+ */
+static void share_state_free(struct share_state_locked *share_state_locked,
 			     struct mpool *page_pool)
 {
+	struct ffa_memory_share_state *share_state =
+		share_state_locked->share_state;
+	struct share_states_locked share_states;
+	uint64_t index;
+	uint64_t segment_index;
 	uint32_t i;
 
-	assert(share_states.share_states != NULL);
+	assert(share_state != NULL);
+	assert(!share_state->clear_pending);
+	assert(!share_state_op_pending(share_state));
 	share_state->share_func = 0;
 	share_state->sending_complete = false;
-	mpool_free(page_pool, share_state->memory_region);
+	descriptor_free(share_state->memory_region,
+			share_state->memory_region_slab, page_pool);
 	/*
 	 * First fragment is part of the same page as the `memory_region`, so it
 	 * doesn't need to be freed separately.
@@ -264,26 +845,51 @@ static void share_state_free(struct share_states_locked share_states,
 	share_state->fragments[0] = NULL;
 	share_state->fragment_constituent_counts[0] = 0;
 	for (i = 1; i < share_state->fragment_count; ++i) {
-		mpool_free(page_pool, share_state->fragments[i]);
+		descriptor_free(share_state->fragments[i],
+				share_state->fragment_slabs[i], page_pool);
 		share_state->fragments[i] = NULL;
 		share_state->fragment_constituent_counts[i] = 0;
 	}
 	share_state->fragment_count = 0;
+	for (i = 0; i < share_state->sorted_fragment_count; ++i) {
+		descriptor_free(share_state->sorted_fragments[i],
+				share_state->sorted_fragment_slabs[i],
+				page_pool);
+		share_state->sorted_fragments[i] = NULL;
+		share_state->sorted_constituent_counts[i] = 0;
+	}
+	share_state->sorted_fragment_count = 0;
 	share_state->memory_region = NULL;
+
+	/*
+	 * Unlock the share state before making it available to be allocated
+	 * again, as that may free its segment.
+	 */
+	index = share_state->index;
+	share_state_unlock(share_state_locked);
+
+	share_states = share_states_lock();
+	share_states_hash_remove(index, share_state->handle);
+	share_states_allocated[index / 32] &= ~(UINT32_C(1) << (index % 32));
+	segment_index = index / SHARE_STATES_PER_SEGMENT;
+	share_states.segments[segment_index].allocated_count--;
+	share_states_segment_shrink(share_states, segment_index, page_pool);
+	share_states_unlock(&share_states);
 }
 
 /** Checks whether the given share state has been fully sent. */
 static bool share_state_sending_complete(
-	struct share_states_locked share_states,
-	struct ffa_memory_share_state *share_state)
+	struct share_state_locked share_state_locked)
 {
+	struct ffa_memory_share_state *share_state =
+		share_state_locked.share_state;
 	struct ffa_composite_memory_region *composite;
 	uint32_t expected_constituent_count;
 	uint32_t fragment_constituent_count_total = 0;
 	uint32_t i;
 
 	/* Lock must be held. */
-	assert(share_states.share_states != NULL);
+	assert(share_state != NULL);
 
 	/*
 	 * Share state must already be valid, or it's not possible to get hold
@@ -313,14 +919,15 @@ static bool share_state_sending_complete(
  * state.
  */
 static uint32_t share_state_next_fragment_offset(
-	struct share_states_locked share_states,
-	struct ffa_memory_share_state *share_state)
+	struct share_state_locked share_state_locked)
 {
+	struct ffa_memory_share_state *share_state =
+		share_state_locked.share_state;
 	uint32_t next_fragment_offset;
 	uint32_t i;
 
 	/* Lock must be held. */
-	assert(share_states.share_states != NULL);
+	assert(share_state != NULL);
 
 	next_fragment_offset =
 		ffa_composite_constituent_offset(share_state->memory_region, 0);
@@ -361,47 +968,69 @@ static void dump_memory_region(struct ffa_memory_region *memory_region)
 	dlog("]");
 }
 
-static void dump_share_states(void)
+static void dump_share_state(struct ffa_memory_share_state *share_state)
+{
+	switch (share_state->share_func) {
+	case FFA_MEM_SHARE_32:
+		dlog("SHARE");
+		break;
+	case FFA_MEM_LEND_32:
+		dlog("LEND");
+		break;
+	case FFA_MEM_DONATE_32:
+		dlog("DONATE");
+		break;
+	default:
+		dlog("invalid share_func %#x", share_state->share_func);
+	}
+	dlog(" %#x (", share_state->memory_region->handle);
+	dump_memory_region(share_state->memory_region);
+	if (share_state->sending_complete) {
+		dlog("): fully sent");
+	} else {
+		dlog("): partially sent");
+	}
+	dlog(" with %d fragments, %d retrieved, "
+	     " sender's original mode: %#x\n",
+	     share_state->fragment_count,
+	     share_state->retrieved_fragment_count[0],
+	     share_state->sender_orig_mode);
+}
+
+static void dump_share_states(struct mpool *page_pool)
 {
+	struct share_states_locked share_states;
+	struct ffa_memory_share_state *segment_states;
 	uint32_t i;
+	uint32_t j;
 
 	if (LOG_LEVEL < LOG_LEVEL_VERBOSE) {
 		return;
 	}
 
 	dlog("Current share states:\n");
-	sl_lock(&share_states_lock_instance);
-	for (i = 0; i < MAX_MEM_SHARES; ++i) {
-		if (share_states[i].share_func != 0) {
-			switch (share_states[i].share_func) {
-			case FFA_MEM_SHARE_32:
-				dlog("SHARE");
-				break;
-			case FFA_MEM_LEND_32:
-				dlog("LEND");
-				break;
-			case FFA_MEM_DONATE_32:
-				dlog("DONATE");
-				break;
-			default:
-				dlog("invalid share_func %#x",
-				     share_states[i].share_func);
-			}
-			dlog(" %#x (", share_states[i].memory_region->handle);
-			dump_memory_region(share_states[i].memory_region);
-			if (share_states[i].sending_complete) {
-				dlog("): fully sent");
-			} else {
-				dlog("): partially sent");
+	for (i = 0; i < SHARE_STATES_SEGMENTS; ++i) {
+		share_states = share_states_lock();
+		segment_states = share_states.segments[i].share_states;
+		if (segment_states != NULL) {
+			share_states.segments[i].pin_count++;
+		}
+		share_states_unlock(&share_states);
+
+		if (segment_states == NULL) {
+			continue;
+		}
+
+		for (j = 0; j < SHARE_STATES_PER_SEGMENT; ++j) {
+			sl_lock(&segment_states[j].lock);
+			if (segment_states[j].share_func != 0) {
+				dump_share_state(&segment_states[j]);
 			}
-			dlog(" with %d fragments, %d retrieved, "
-			     " sender's original mode: %#x\n",
-			     share_states[i].fragment_count,
-			     share_states[i].retrieved_fragment_count[0],
-			     share_states[i].sender_orig_mode);
+			sl_unlock(&segment_states[j].lock);
 		}
+
+		share_states_segment_unpin(i, page_pool);
 	}
-	sl_unlock(&share_states_lock_instance);
 }
 
 /* TODO: Add device attributes: GRE, cacheability, shareability. */
@@ -444,6 +1073,10 @@ static inline uint32_t ffa_memory_permissions_to_mode(
  * Get the current mode in the stage-2 page table of the given vm of all the
  * pages in the given constituents, if they all have the same mode, or return
  * an appropriate FF-A error if not.
+ *
+ * The page table walk resumes from one constituent to the next rather than
+ * starting from the root for each, and stops at the first page whose mode
+ * differs.
  */
 static struct ffa_value constituents_get_mode(
 	struct vm_locked vm, uint32_t *orig_mode,
@@ -452,6 +1085,7 @@ static struct ffa_value constituents_get_mode(
 {
 	uint32_t i;
 	uint32_t j;
+	struct mm_mode_cursor cursor;
 
 	if (fragment_count == 0 || fragment_constituent_counts[0] == 0) {
 		/*
@@ -461,12 +1095,13 @@ static struct ffa_value constituents_get_mode(
 		return ffa_error(FFA_INVALID_PARAMETERS);
 	}
 
+	vm_mem_mode_cursor_init(vm, &cursor);
+
 	for (i = 0; i < fragment_count; ++i) {
 		for (j = 0; j < fragment_constituent_counts[i]; ++j) {
 			ipaddr_t begin = ipa_init(fragments[i][j].address);
 			size_t size = fragments[i][j].page_count * PAGE_SIZE;
 			ipaddr_t end = ipa_add(begin, size);
-			uint32_t current_mode;
 
 			/* Fail if addresses are not page-aligned. */
 			if (!is_aligned(ipa_addr(begin), PAGE_SIZE) ||
@@ -476,23 +1111,13 @@ static struct ffa_value constituents_get_mode(
 
 			/*
 			 * Ensure that this constituent memory range is all
-			 * mapped with the same mode.
+			 * mapped with the same mode as all the previous ones.
 			 */
-			if (!vm_mem_get_mode(vm, begin, end, &current_mode)) {
-				return ffa_error(FFA_DENIED);
-			}
-
-			/*
-			 * Ensure that all constituents are mapped with the same
-			 * mode.
-			 */
-			if (i == 0) {
-				*orig_mode = current_mode;
-			} else if (current_mode != *orig_mode) {
+			if (!vm_mem_get_mode_next(vm, &cursor, begin, end,
+						  orig_mode)) {
 				dlog_verbose(
-					"Expected mode %#x but was %#x for %d "
-					"pages at %#x.\n",
-					*orig_mode, current_mode,
+					"Mode of %d pages at %#x differs from "
+					"the previous constituents.\n",
 					fragments[i][j].page_count,
 					ipa_addr(begin));
 				return ffa_error(FFA_DENIED);
@@ -716,6 +1341,24 @@ static struct ffa_value ffa_retrieve_check_transition(
 	return (struct ffa_value){.func = FFA_SUCCESS_32};
 }
 
+/**
+ * Initialises a reservation with room for the entries of all the constituents
+ * of the given fragments. It must be freed with mm_reservation_fini().
+ */
+static void ffa_region_group_reservation_init(
+	struct mm_reservation *res, const uint32_t *fragment_constituent_counts,
+	uint32_t fragment_count, struct mpool *ppool)
+{
+	size_t constituent_count = 0;
+	uint32_t i;
+
+	for (i = 0; i < fragment_count; ++i) {
+		constituent_count += fragment_constituent_counts[i];
+	}
+
+	mm_reservation_init_sized(res, constituent_count, ppool);
+}
+
 /**
  * Updates a VM's page table such that the given set of physical address ranges
  * are mapped in the address space at the corresponding address ranges, in the
@@ -728,8 +1371,16 @@ static struct ffa_value ffa_retrieve_check_transition(
  * series of changes atomically you can call them all with commit false before
  * calling them all with commit true.
  *
- * vm_ptable_defrag should always be called after a series of page table
- * updates, whether they succeed or fail.
+ * ffa_region_group_defrag should always be called after a series of page
+ * table updates, whether they succeed or fail.
+ *
+ * If `res` is not NULL, the entries to write are recorded in it when preparing
+ * so that the commit with the same reservation doesn't walk the page table from
+ * the root again for each constituent.
+ *
+ * If `tlb` is not NULL, the TLB invalidation for all the constituents committed
+ * is deferred until the caller finishes the gather, instead of being done for
+ * each constituent.
  *
  * Returns true on success, or false if the update failed and no changes were
  * made to memory mappings.
@@ -738,7 +1389,8 @@ static bool ffa_region_group_identity_map(
 	struct vm_locked vm_locked,
 	struct ffa_memory_region_constituent **fragments,
 	const uint32_t *fragment_constituent_counts, uint32_t fragment_count,
-	uint32_t mode, struct mpool *ppool, bool commit)
+	uint32_t mode, struct mpool *ppool, bool commit,
+	struct mm_reservation *res, struct mm_tlb_gather *tlb)
 {
 	uint32_t i;
 	uint32_t j;
@@ -768,9 +1420,10 @@ static bool ffa_region_group_identity_map(
 
 			if (commit) {
 				vm_identity_commit(vm_locked, pa_begin, pa_end,
-						   mode, ppool, NULL);
+						   mode, ppool, NULL, res, tlb);
 			} else if (!vm_identity_prepare(vm_locked, pa_begin,
-							pa_end, mode, ppool)) {
+							pa_end, mode, ppool,
+							res)) {
 				return false;
 			}
 		}
@@ -780,42 +1433,78 @@ static bool ffa_region_group_identity_map(
 }
 
 /**
- * Clears a region of physical memory by overwriting it with zeros. The data is
- * flushed from the cache so the memory has been cleared across the system.
+ * Defragments the part of a VM's page table covering the given set of physical
+ * address ranges. Only the entries updated by ffa_region_group_identity_map are
+ * visited rather than the whole page table, and the TLB is invalidated once for
+ * all of them.
  */
-static bool clear_memory(paddr_t begin, paddr_t end, struct mpool *ppool,
-			 uint32_t extra_mode_attributes)
+static void ffa_region_group_defrag(
+	struct vm_locked vm_locked,
+	struct ffa_memory_region_constituent **fragments,
+	const uint32_t *fragment_constituent_counts, uint32_t fragment_count,
+	struct mpool *ppool)
 {
-	/*
-	 * TODO: change this to a CPU local single page window rather than a
-	 *       global mapping of the whole range. Such an approach will limit
-	 *       the changes to stage-1 tables and will allow only local
-	 *       invalidation.
-	 */
-	bool ret;
-	struct mm_stage1_locked stage1_locked = mm_lock_stage1();
-	void *ptr = mm_identity_map(stage1_locked, begin, end,
-				    MM_MODE_W | (extra_mode_attributes &
-						 plat_ffa_other_world_mode()),
-				    ppool);
-	size_t size = pa_difference(begin, end);
+	struct mm_tlb_gather tlb;
+	uint32_t i;
+	uint32_t j;
+
+	mm_tlb_gather_init(&tlb);
+
+	for (i = 0; i < fragment_count; ++i) {
+		for (j = 0; j < fragment_constituent_counts[i]; ++j) {
+			size_t size = fragments[i][j].page_count * PAGE_SIZE;
+			paddr_t pa_begin =
+				pa_from_ipa(ipa_init(fragments[i][j].address));
+			paddr_t pa_end = pa_add(pa_begin, size);
 
-	if (!ptr) {
-		goto fail;
+			vm_ptable_defrag_range(vm_locked, pa_begin, pa_end,
+					       ppool, &tlb);
+		}
 	}
 
-	memset_s(ptr, size, 0, size);
-	arch_mm_flush_dcache(ptr, size);
-	mm_unmap(stage1_locked, begin, end, ppool);
+	mm_tlb_gather_finish(&tlb);
+}
 
-	ret = true;
-	goto out;
+/**
+ * Updates a VM's page table such that the given set of physical address ranges
+ * are mapped with the given mode, reserving the memory needed for all of them
+ * first so that it doesn't run out half way, then defragments it.
+ *
+ * Returns true on success, or false if there wasn't enough memory, in which
+ * case no changes were made to memory mappings.
+ */
+static bool ffa_region_group_update(
+	struct vm_locked vm_locked,
+	struct ffa_memory_region_constituent **fragments,
+	const uint32_t *fragment_constituent_counts, uint32_t fragment_count,
+	uint32_t mode, struct mpool *ppool)
+{
+	struct mm_reservation res;
+	struct mm_tlb_gather tlb;
+	bool ret = false;
 
-fail:
-	ret = false;
+	ffa_region_group_reservation_init(&res, fragment_constituent_counts,
+					  fragment_count, ppool);
+	if (ffa_region_group_identity_map(vm_locked, fragments,
+					  fragment_constituent_counts,
+					  fragment_count, mode, ppool, false,
+					  &res, NULL)) {
+		/*
+		 * This won't allocate because the update was prepared above.
+		 * The TLB is invalidated for all constituents in one go.
+		 */
+		mm_tlb_gather_init(&tlb);
+		CHECK(ffa_region_group_identity_map(
+			vm_locked, fragments, fragment_constituent_counts,
+			fragment_count, mode, ppool, true, &res, &tlb));
+		mm_tlb_gather_finish(&tlb);
+		ret = true;
+	}
 
-out:
-	mm_unlock_stage1(&stage1_locked);
+	mm_reservation_fini(&res, ppool);
+	ffa_region_group_defrag(vm_locked, fragments,
+				fragment_constituent_counts, fragment_count,
+				ppool);
 
 	return ret;
 }
@@ -824,22 +1513,39 @@ out:
  * Clears a region of physical memory by overwriting it with zeros. The data is
  * flushed from the cache so the memory has been cleared across the system.
  */
-static bool ffa_clear_memory_constituents(
-	uint32_t security_state_mode,
-	struct ffa_memory_region_constituent **fragments,
-	const uint32_t *fragment_constituent_counts, uint32_t fragment_count,
-	struct mpool *page_pool)
+static void clear_memory(paddr_t begin, paddr_t end,
+			 uint32_t extra_mode_attributes)
 {
-	struct mpool local_page_pool;
-	uint32_t i;
-	bool ret = false;
+	uint32_t mode = MM_MODE_W |
+			(extra_mode_attributes & plat_ffa_other_world_mode());
+	struct mm_window *window = mm_window_acquire();
 
 	/*
-	 * Create a local pool so any freed memory can't be used by another
-	 * thread. This is to ensure each constituent that is mapped can be
-	 * unmapped again afterwards.
+	 * Slide the window over the region rather than mapping the whole
+	 * region in the hypervisor page table, so this doesn't hold up the
+	 * updates of other CPUs to the page table.
 	 */
-	mpool_init_with_fallback(&local_page_pool, page_pool);
+	while (pa_addr(begin) < pa_addr(end)) {
+		size_t size;
+		void *ptr = mm_window_map(window, begin, end, mode, &size);
+
+		arch_mm_zero_and_flush(ptr, size);
+		begin = pa_add(begin, size);
+	}
+
+	mm_window_release(window);
+}
+
+/**
+ * Clears a region of physical memory by overwriting it with zeros. The data is
+ * flushed from the cache so the memory has been cleared across the system.
+ */
+static void ffa_clear_memory_constituents(
+	uint32_t security_state_mode,
+	struct ffa_memory_region_constituent **fragments,
+	const uint32_t *fragment_constituent_counts, uint32_t fragment_count)
+{
+	uint32_t i;
 
 	/* Iterate over the memory region constituents within each fragment. */
 	for (i = 0; i < fragment_count; ++i) {
@@ -851,22 +1557,206 @@ static bool ffa_clear_memory_constituents(
 				pa_from_ipa(ipa_init(fragments[i][j].address));
 			paddr_t end = pa_add(begin, size);
 
-			if (!clear_memory(begin, end, &local_page_pool,
-					  security_state_mode)) {
-				/*
-				 * api_clear_memory will defrag on failure, so
-				 * no need to do it here.
-				 */
-				goto out;
-			}
+			clear_memory(begin, end, security_state_mode);
 		}
 	}
+}
 
-	ret = true;
+/**
+ * Clears up to `page_count` pages of the memory of the given share state which
+ * is still to be cleared, carrying on from where clearing last got to. Returns
+ * true once all of it has been cleared.
+ */
+static bool share_state_clear_pages(struct ffa_memory_share_state *share_state,
+				    uint32_t page_count)
+{
+	while (share_state->clear_fragment <
+	       share_state->sorted_fragment_count) {
+		uint32_t fragment = share_state->clear_fragment;
+		struct ffa_memory_region_constituent *constituent;
+		uint32_t pages;
+		paddr_t begin;
+
+		if (share_state->clear_constituent >=
+		    share_state->sorted_constituent_counts[fragment]) {
+			share_state->clear_fragment++;
+			share_state->clear_constituent = 0;
+			continue;
+		}
 
-out:
-	mpool_fini(&local_page_pool);
-	return ret;
+		constituent =
+			&share_state->sorted_fragments
+				 [fragment][share_state->clear_constituent];
+		if (share_state->clear_page >= constituent->page_count) {
+			share_state->clear_constituent++;
+			share_state->clear_page = 0;
+			continue;
+		}
+
+		if (page_count == 0) {
+			return false;
+		}
+
+		pages = constituent->page_count - share_state->clear_page;
+		if (pages > page_count) {
+			pages = page_count;
+		}
+
+		begin = pa_add(pa_from_ipa(ipa_init(constituent->address)),
+			       (size_t)share_state->clear_page * PAGE_SIZE);
+		clear_memory(begin, pa_add(begin, (size_t)pages * PAGE_SIZE),
+			     share_state->clear_mode);
+
+		share_state->clear_page += pages;
+		page_count -= pages;
+	}
+
+	return true;
+}
+
+/**
+ * Defers clearing the memory of the given share state, in the given mode for
+ * the security state, rather than clearing it all before returning to the VM
+ * which relinquished it. Clearing starts over if it was already pending, as
+ * another borrower may have written to the memory since.
+ */
+static void share_state_clear_defer(struct ffa_memory_share_state *share_state,
+				    uint32_t mode)
+{
+	struct share_states_locked share_states;
+	uint64_t index = share_state->index;
+
+	share_state->clear_mode = mode;
+	share_state->clear_fragment = 0;
+	share_state->clear_constituent = 0;
+	share_state->clear_page = 0;
+
+	if (share_state->clear_pending) {
+		return;
+	}
+	share_state->clear_pending = true;
+
+	share_states = share_states_lock();
+	share_states_clear_pending[index / 32] |= UINT32_C(1) << (index % 32);
+	atomic_fetch_add_explicit(&share_states_clear_pending_count, 1,
+				  memory_order_relaxed);
+	share_states_unlock(&share_states);
+}
+
+/**
+ * Clears up to `page_count` more pages of the memory of the given share state
+ * which is still to be cleared. Returns true once none is left to clear, so
+ * that the memory can be mapped for a VM again.
+ */
+static bool share_state_clear_continue(
+	struct ffa_memory_share_state *share_state, uint32_t page_count)
+{
+	struct share_states_locked share_states;
+	uint64_t index = share_state->index;
+
+	if (!share_state->clear_pending) {
+		return true;
+	}
+
+	if (!share_state_clear_pages(share_state, page_count)) {
+		return false;
+	}
+	share_state->clear_pending = false;
+
+	share_states = share_states_lock();
+	share_states_clear_pending[index / 32] &=
+		~(UINT32_C(1) << (index % 32));
+	atomic_fetch_sub_explicit(&share_states_clear_pending_count, 1,
+				  memory_order_relaxed);
+	share_states_unlock(&share_states);
+
+	return true;
+}
+
+/**
+ * Returns the error for a call on the memory with the given handle which was
+ * interrupted, having used up its share of time, before completing. The handle
+ * is returned so that the caller can resume the call with FFA_MEM_OP_RESUME.
+ */
+static struct ffa_value ffa_mem_interrupted(ffa_memory_handle_t handle)
+{
+	return (struct ffa_value){.func = FFA_ERROR_32,
+				  .arg2 = FFA_INTERRUPTED,
+				  .arg3 = (uint32_t)handle,
+				  .arg4 = (uint32_t)(handle >> 32)};
+}
+
+/**
+ * Returns true, and logs why, if the given call on the memory of the given
+ * share state was interrupted and is still to be completed with
+ * FFA_MEM_OP_RESUME, in which case no other call updating the same page table
+ * can be made.
+ */
+static bool share_state_op_blocks(struct ffa_memory_share_state *share_state,
+				  struct ffa_memory_op *op)
+{
+	if (op->func == 0) {
+		return false;
+	}
+
+	dlog_verbose(
+		"Call %#x by VM %#x on memory with handle %#x is still to be "
+		"resumed.\n",
+		op->func, op->vm_id, share_state->memory_region->handle);
+	return true;
+}
+
+/**
+ * Clears some of the memory which is still to be cleared. This is called each
+ * time a vCPU is about to be run, so that clearing large regions is spread over
+ * the scheduling of VMs rather than holding up the VMs sharing them, and does a
+ * bounded amount of work.
+ */
+void ffa_memory_clear_pending(struct mpool *page_pool)
+{
+	struct share_states_locked share_states;
+	struct ffa_memory_share_state *share_state = NULL;
+	uint64_t segment_index;
+	uint32_t word;
+
+	if (atomic_load_explicit(&share_states_clear_pending_count,
+				 memory_order_relaxed) == 0) {
+		return;
+	}
+
+	/* Find a share state to clear and pin it so that it can be locked. */
+	share_states = share_states_lock();
+	for (word = 0; word < ARRAY_SIZE(share_states_clear_pending); ++word) {
+		if (share_states_clear_pending[word] != 0) {
+			share_state = share_state_at(
+				share_states,
+				word * 32 +
+					ctz(share_states_clear_pending[word]));
+			break;
+		}
+	}
+	if (share_state != NULL) {
+		segment_index = share_state->index / SHARE_STATES_PER_SEGMENT;
+		share_states.segments[segment_index].pin_count++;
+	}
+	share_states_unlock(&share_states);
+
+	if (share_state == NULL) {
+		return;
+	}
+
+	/*
+	 * Leave it to whoever holds the share state, which clears the rest of
+	 * it before mapping it if needs be. It can't be freed while clearing
+	 * is pending, but check once locked that it hasn't just finished.
+	 */
+	if (sl_try_lock(&share_state->lock)) {
+		share_state_clear_continue(share_state,
+					   CLEAR_PENDING_PAGES_PER_STEP);
+		sl_unlock(&share_state->lock);
+	}
+
+	share_states_segment_unpin(segment_index, page_pool);
 }
 
 /**
@@ -895,7 +1785,8 @@ static struct ffa_value ffa_send_check_update(
 	uint32_t i;
 	uint32_t orig_from_mode;
 	uint32_t from_mode;
-	struct mpool local_page_pool;
+	struct mm_reservation res;
+	struct mm_tlb_gather tlb;
 	struct ffa_value ret;
 
 	/*
@@ -927,22 +1818,16 @@ static struct ffa_value ffa_send_check_update(
 		*orig_from_mode_ret = orig_from_mode;
 	}
 
-	/*
-	 * Create a local pool so any freed memory can't be used by another
-	 * thread. This is to ensure the original mapping can be restored if the
-	 * clear fails.
-	 */
-	mpool_init_with_fallback(&local_page_pool, page_pool);
-
 	/*
 	 * First reserve all required memory for the new page table entries
 	 * without committing, to make sure the entire operation will succeed
 	 * without exhausting the page pool.
 	 */
+	ffa_region_group_reservation_init(&res, fragment_constituent_counts,
+					  fragment_count, page_pool);
 	if (!ffa_region_group_identity_map(
 		    from_locked, fragments, fragment_constituent_counts,
-		    fragment_count, from_mode, page_pool, false)) {
-		/* TODO: partial defrag of failed range. */
+		    fragment_count, from_mode, page_pool, false, &res, NULL)) {
 		ret = ffa_error(FFA_NO_MEMORY);
 		goto out;
 	}
@@ -952,144 +1837,249 @@ static struct ffa_value ffa_send_check_update(
 	 * transaction was already prepared above, but may free pages in the
 	 * case that a whole block is being unmapped that was previously
 	 * partially mapped.
+	 *
+	 * The TLB is invalidated for all constituents in one go, which must
+	 * happen before the memory is cleared so the sender can't access it.
 	 */
+	mm_tlb_gather_init(&tlb);
 	CHECK(ffa_region_group_identity_map(
 		from_locked, fragments, fragment_constituent_counts,
-		fragment_count, from_mode, &local_page_pool, true));
+		fragment_count, from_mode, page_pool, true, &res, &tlb));
+	mm_tlb_gather_finish(&tlb);
 
 	/* Clear the memory so no VM or device can see the previous contents. */
-	if (clear &&
-	    !ffa_clear_memory_constituents(
-		    plat_ffa_owner_world_mode(from_locked.vm->id), fragments,
-		    fragment_constituent_counts, fragment_count, page_pool)) {
-		/*
-		 * On failure, roll back by returning memory to the sender. This
-		 * may allocate pages which were previously freed into
-		 * `local_page_pool` by the call above, but will never allocate
-		 * more pages than that so can never fail.
-		 */
-		CHECK(ffa_region_group_identity_map(
-			from_locked, fragments, fragment_constituent_counts,
-			fragment_count, orig_from_mode, &local_page_pool,
-			true));
-
-		ret = ffa_error(FFA_NO_MEMORY);
-		goto out;
+	if (clear) {
+		ffa_clear_memory_constituents(
+			plat_ffa_owner_world_mode(from_locked.vm->id),
+			fragments, fragment_constituent_counts,
+			fragment_count);
 	}
 
 	ret = (struct ffa_value){.func = FFA_SUCCESS_32};
 
 out:
-	mpool_fini(&local_page_pool);
+	mm_reservation_fini(&res, page_pool);
 
 	/*
 	 * Tidy up the page table by reclaiming failed mappings (if there was an
 	 * error) or merging entries into blocks where possible (on success).
 	 */
-	vm_ptable_defrag(from_locked, page_pool);
+	ffa_region_group_defrag(from_locked, fragments,
+				fragment_constituent_counts, fragment_count,
+				page_pool);
 
 	return ret;
 }
 
 /**
- * Validates and maps memory shared from one VM to another.
- *
- * This function requires the calling context to hold the <to> lock.
+ * Checks that the call in progress on the memory of the given share state can
+ * update the page table of the VM which made it for the given constituents,
+ * and gets the mode they are to be mapped with and, for calls which send or
+ * relinquish the memory, the mode they have now.
  *
- * Returns:
- *  In case of error, one of the following values is returned:
- *   1) FFA_INVALID_PARAMETERS - The endpoint provided parameters were
- *     erroneous;
- *   2) FFA_NO_MEMORY - Hafnium did not have sufficient memory to complete
- *     the request.
- *  Success is indicated by FFA_SUCCESS.
+ * This is checked for all the constituents when the call is made, and again
+ * for each chunk of them as the call goes on, as the VM may have made other
+ * calls on the memory in between if the call was interrupted.
  */
-static struct ffa_value ffa_retrieve_check_update(
-	struct vm_locked to_locked, ffa_vm_id_t from_id,
+static struct ffa_value share_state_op_check_transition(
+	struct vm_locked vm_locked, struct ffa_memory_share_state *share_state,
+	struct ffa_memory_op *op,
 	struct ffa_memory_region_constituent **fragments,
 	uint32_t *fragment_constituent_counts, uint32_t fragment_count,
-	uint32_t memory_to_attributes, uint32_t share_func, bool clear,
-	struct mpool *page_pool)
+	uint32_t *orig_mode, uint32_t *mode)
 {
-	uint32_t i;
-	uint32_t to_mode;
-	struct mpool local_page_pool;
-	struct ffa_value ret;
+	struct ffa_memory_region *memory_region = share_state->memory_region;
 
-	/*
-	 * Make sure constituents are properly aligned to a 64-bit boundary. If
-	 * not we would get alignment faults trying to read (64-bit) values.
-	 */
-	for (i = 0; i < fragment_count; ++i) {
-		if (!is_aligned(fragments[i], 8)) {
-			return ffa_error(FFA_INVALID_PARAMETERS);
+	switch (op->func) {
+	case FFA_MEM_DONATE_32:
+	case FFA_MEM_LEND_32:
+	case FFA_MEM_SHARE_32:
+		return ffa_send_check_transition(
+			vm_locked, op->func,
+			memory_region->receivers, memory_region->receiver_count,
+			orig_mode, fragments, fragment_constituent_counts,
+			fragment_count, mode);
+	case FFA_MEM_RETRIEVE_REQ_32:
+		return ffa_retrieve_check_transition(
+			vm_locked, share_state->share_func, fragments,
+			fragment_constituent_counts, fragment_count,
+			ffa_memory_permissions_to_mode(
+				op->permissions, share_state->sender_orig_mode),
+			mode);
+	case FFA_MEM_RELINQUISH_32:
+		if (share_state->lazy_mode[op->receiver_index] != 0) {
+			/*
+			 * Memory mapped on demand is only mapped where it was
+			 * accessed, so there is no single mode to check.
+			 * Unmapping leaves the rest as it is, without
+			 * allocating.
+			 */
+			*mode = MM_MODE_UNMAPPED_MASK;
+			return (struct ffa_value){.func = FFA_SUCCESS_32};
 		}
+		return ffa_relinquish_check_transition(
+			vm_locked, orig_mode, fragments,
+			fragment_constituent_counts, fragment_count, mode);
+	case FFA_MEM_RECLAIM_32:
+		return ffa_retrieve_check_transition(
+			vm_locked, FFA_MEM_RECLAIM_32, fragments,
+			fragment_constituent_counts, fragment_count,
+			share_state->sender_orig_mode, mode);
+	default:
+		panic("Invalid memory sharing call %#x.", op->func);
 	}
+}
 
-	/*
-	 * Check if the state transition is lawful for the recipient, and ensure
-	 * that all constituents of the memory region being retrieved are at the
-	 * same state.
-	 */
-	ret = ffa_retrieve_check_transition(
-		to_locked, share_func, fragments, fragment_constituent_counts,
-		fragment_count, memory_to_attributes, &to_mode);
+/**
+ * Starts a call of the given function on the memory of the given share state,
+ * by the VM whose page table it updates, after checking that it can update it
+ * for all of the constituents. The call is tracked in `op`, which is the
+ * sender's or that of the receiver making it, and whose receiver index,
+ * permissions and clear flag must already be set if the call needs them.
+ *
+ * The page table is then updated by `share_state_op_continue`, which the call
+ * is left to if it is interrupted. If the check fails, the call isn't started.
+ */
+static struct ffa_value share_state_op_start(
+	struct vm_locked vm_locked, struct ffa_memory_share_state *share_state,
+	struct ffa_memory_op *op, uint32_t func, uint32_t *orig_mode)
+{
+	struct ffa_value ret;
+
+	op->func = func;
+	op->vm_id = vm_locked.vm->id;
+	op->fragment = 0;
+	op->constituent = 0;
+
+	ret = share_state_op_check_transition(
+		vm_locked, share_state, op, share_state->sorted_fragments,
+		share_state->sorted_constituent_counts,
+		share_state->sorted_fragment_count, orig_mode, &op->mode);
 	if (ret.func != FFA_SUCCESS_32) {
-		dlog_verbose("Invalid transition for retrieve.\n");
-		return ret;
+		dlog_verbose("Invalid transition for %#x.\n", func);
+		op->func = 0;
 	}
 
-	/*
-	 * Create a local pool so any freed memory can't be used by another
-	 * thread. This is to ensure the original mapping can be restored if the
-	 * clear fails.
-	 */
-	mpool_init_with_fallback(&local_page_pool, page_pool);
+	return ret;
+}
+
+/**
+ * Carries on with the call in progress on the memory of the given share state:
+ * clears whatever is left to clear of the memory, then updates the page table
+ * of the VM which made the call for up to MAX_MEM_OP_CONSTITUENTS more of its
+ * constituents. The call is interrupted if that leaves any more to do, so that
+ * the locks of the VM and the share state are held for a bounded time.
+ *
+ * The constituents of each chunk are prepared and committed in one go, as
+ * memory reserved for the page table can't be kept across calls.
+ *
+ * Returns FFA_SUCCESS once the whole page table has been updated, in which case
+ * the call is no longer in progress and the caller completes it. If this fails
+ * before any of the page table was updated, the call is no longer in progress
+ * either and can be failed. Otherwise the call stays in progress, to be resumed
+ * again.
+ */
+static struct ffa_value share_state_op_continue(
+	struct vm_locked vm_locked, struct ffa_memory_share_state *share_state,
+	struct ffa_memory_op *op, struct mpool *page_pool)
+{
+	ffa_memory_handle_t handle = share_state->memory_region->handle;
+	struct ffa_memory_region_constituent *fragments[MAX_FRAGMENTS];
+	uint32_t fragment_constituent_counts[MAX_FRAGMENTS];
+	uint32_t fragment_count = 0;
+	uint32_t constituent_count = 0;
+	uint32_t fragment = op->fragment;
+	uint32_t constituent = op->constituent;
+	bool started = fragment != 0 || constituent != 0;
+	uint32_t orig_mode;
+	uint32_t mode;
+	struct ffa_value ret;
+
+	assert(op->func != 0);
+	assert(op->vm_id == vm_locked.vm->id);
 
 	/*
-	 * First reserve all required memory for the new page table entries in
-	 * the recipient page tables without committing, to make sure the entire
-	 * operation will succeed without exhausting the page pool.
+	 * The memory can't be mapped until it has been cleared, if that is
+	 * still pending.
 	 */
-	if (!ffa_region_group_identity_map(
-		    to_locked, fragments, fragment_constituent_counts,
-		    fragment_count, to_mode, page_pool, false)) {
-		/* TODO: partial defrag of failed range. */
-		dlog_verbose(
-			"Insufficient memory to update recipient page "
-			"table.\n");
-		ret = ffa_error(FFA_NO_MEMORY);
-		goto out;
+	if (!share_state_clear_continue(share_state, MAX_MEM_OP_PAGES)) {
+		dlog_verbose("Call on handle %#x interrupted to clear.\n",
+			     handle);
+		return ffa_mem_interrupted(handle);
+	}
+
+	/* Gather the constituents to update in this chunk. */
+	while (fragment < share_state->sorted_fragment_count &&
+	       constituent_count < MAX_MEM_OP_CONSTITUENTS) {
+		uint32_t count =
+			share_state->sorted_constituent_counts[fragment] -
+			constituent;
+
+		if (count > MAX_MEM_OP_CONSTITUENTS - constituent_count) {
+			count = MAX_MEM_OP_CONSTITUENTS - constituent_count;
+		}
+
+		if (count > 0) {
+			fragments[fragment_count] =
+				&share_state->sorted_fragments[fragment]
+							      [constituent];
+			fragment_constituent_counts[fragment_count] = count;
+			fragment_count++;
+			constituent_count += count;
+			constituent += count;
+		}
+
+		if (constituent ==
+		    share_state->sorted_constituent_counts[fragment]) {
+			fragment++;
+			constituent = 0;
+		}
 	}
 
-	/* Clear the memory so no VM or device can see the previous contents. */
-	if (clear &&
-	    !ffa_clear_memory_constituents(
-		    plat_ffa_owner_world_mode(from_id), fragments,
-		    fragment_constituent_counts, fragment_count, page_pool)) {
-		ret = ffa_error(FFA_NO_MEMORY);
-		goto out;
+	if (fragment_count > 0) {
+		ret = share_state_op_check_transition(
+			vm_locked, share_state, op, fragments,
+			fragment_constituent_counts, fragment_count,
+			&orig_mode, &mode);
+		if (ret.func == FFA_SUCCESS_32 && mode != op->mode) {
+			dlog_verbose(
+				"Mode of memory with handle %#x changed while "
+				"the call on it was interrupted.\n",
+				handle);
+			ret = ffa_error(FFA_DENIED);
+		}
+		if (ret.func != FFA_SUCCESS_32) {
+			goto out;
+		}
+
+		if (!ffa_region_group_update(vm_locked, fragments,
+					     fragment_constituent_counts,
+					     fragment_count, mode, page_pool)) {
+			dlog_verbose(
+				"Insufficient memory to update page table.\n");
+			ret = ffa_error(FFA_NO_MEMORY);
+			goto out;
+		}
+
+		op->fragment = fragment;
+		op->constituent = constituent;
 	}
 
-	/*
-	 * Complete the transfer by mapping the memory into the recipient. This
-	 * won't allocate because the transaction was already prepared above, so
-	 * it doesn't need to use the `local_page_pool`.
-	 */
-	CHECK(ffa_region_group_identity_map(
-		to_locked, fragments, fragment_constituent_counts,
-		fragment_count, to_mode, page_pool, true));
+	if (fragment < share_state->sorted_fragment_count) {
+		dlog_verbose("Call on handle %#x interrupted to update page "
+			     "table.\n",
+			     handle);
+		return ffa_mem_interrupted(handle);
+	}
 
-	ret = (struct ffa_value){.func = FFA_SUCCESS_32};
+	op->func = 0;
+	return (struct ffa_value){.func = FFA_SUCCESS_32};
 
 out:
-	mpool_fini(&local_page_pool);
-
-	/*
-	 * Tidy up the page table by reclaiming failed mappings (if there was an
-	 * error) or merging entries into blocks where possible (on success).
-	 */
-	vm_ptable_defrag(to_locked, page_pool);
+	/* The call can fail as a whole if nothing was updated yet. */
+	if (!started) {
+		op->func = 0;
+	}
 
 	return ret;
 }
@@ -1118,6 +2108,8 @@ static struct ffa_value ffa_tee_reclaim_check_update(
 {
 	uint32_t to_mode;
 	struct mpool local_page_pool;
+	struct mm_reservation res;
+	struct mm_tlb_gather tlb;
 	struct ffa_value ret;
 	ffa_memory_region_flags_t tee_flags;
 
@@ -1155,10 +2147,10 @@ static struct ffa_value ffa_tee_reclaim_check_update(
 	 * the recipient page tables without committing, to make sure the entire
 	 * operation will succeed without exhausting the page pool.
 	 */
+	mm_reservation_init_sized(&res, constituent_count, page_pool);
 	if (!ffa_region_group_identity_map(to_locked, &constituents,
 					   &constituent_count, 1, to_mode,
-					   page_pool, false)) {
-		/* TODO: partial defrag of failed range. */
+					   page_pool, false, &res, NULL)) {
 		dlog_verbose(
 			"Insufficient memory to update recipient page "
 			"table.\n");
@@ -1191,148 +2183,313 @@ static struct ffa_value ffa_tee_reclaim_check_update(
 	 * The TEE was happy with it, so complete the reclaim by mapping the
 	 * memory into the recipient. This won't allocate because the
 	 * transaction was already prepared above, so it doesn't need to use the
-	 * `local_page_pool`.
+	 * `local_page_pool`. The TLB is invalidated for all constituents in one
+	 * go.
 	 */
+	mm_tlb_gather_init(&tlb);
 	CHECK(ffa_region_group_identity_map(to_locked, &constituents,
 					    &constituent_count, 1, to_mode,
-					    page_pool, true));
+					    page_pool, true, &res, &tlb));
+	mm_tlb_gather_finish(&tlb);
 
 	ret = (struct ffa_value){.func = FFA_SUCCESS_32};
 
 out:
 	mpool_fini(&local_page_pool);
+	mm_reservation_fini(&res, page_pool);
 
 	/*
 	 * Tidy up the page table by reclaiming failed mappings (if there was an
 	 * error) or merging entries into blocks where possible (on success).
 	 */
-	vm_ptable_defrag(to_locked, page_pool);
+	ffa_region_group_defrag(to_locked, &constituents, &constituent_count, 1,
+				page_pool);
 
 	return ret;
 }
 
-static struct ffa_value ffa_relinquish_check_update(
-	struct vm_locked from_locked,
-	struct ffa_memory_region_constituent **fragments,
-	uint32_t *fragment_constituent_counts, uint32_t fragment_count,
-	struct mpool *page_pool, bool clear)
+/**
+ * Returns the sorted constituent of the given share state with the given index.
+ */
+static struct ffa_memory_region_constituent *share_state_sorted_constituent(
+	struct ffa_memory_share_state *share_state, uint32_t index)
 {
-	uint32_t orig_from_mode;
-	uint32_t from_mode;
-	struct mpool local_page_pool;
-	struct ffa_value ret;
+	return &share_state->sorted_fragments
+			[index / SORTED_FRAGMENT_CONSTITUENTS]
+			[index % SORTED_FRAGMENT_CONSTITUENTS];
+}
 
-	ret = ffa_relinquish_check_transition(
-		from_locked, &orig_from_mode, fragments,
-		fragment_constituent_counts, fragment_count, &from_mode);
-	if (ret.func != FFA_SUCCESS_32) {
-		dlog_verbose("Invalid transition for relinquish.\n");
-		return ret;
-	}
+/**
+ * Moves the constituent at `root` of the heap of the first `count` sorted
+ * constituents of the given share state down until it is ordered with its
+ * children, largest address first.
+ */
+static void share_state_sorted_sift_down(
+	struct ffa_memory_share_state *share_state, uint32_t root,
+	uint32_t count)
+{
+	for (;;) {
+		uint32_t child = 2 * root + 1;
+		struct ffa_memory_region_constituent *parent_constituent;
+		struct ffa_memory_region_constituent *child_constituent;
+		struct ffa_memory_region_constituent tmp;
+
+		if (child >= count) {
+			return;
+		}
 
-	/*
-	 * Create a local pool so any freed memory can't be used by another
-	 * thread. This is to ensure the original mapping can be restored if the
-	 * clear fails.
-	 */
-	mpool_init_with_fallback(&local_page_pool, page_pool);
+		child_constituent =
+			share_state_sorted_constituent(share_state, child);
+		if (child + 1 < count) {
+			struct ffa_memory_region_constituent *right =
+				share_state_sorted_constituent(share_state,
+							       child + 1);
 
-	/*
-	 * First reserve all required memory for the new page table entries
-	 * without committing, to make sure the entire operation will succeed
-	 * without exhausting the page pool.
-	 */
-	if (!ffa_region_group_identity_map(
-		    from_locked, fragments, fragment_constituent_counts,
-		    fragment_count, from_mode, page_pool, false)) {
-		/* TODO: partial defrag of failed range. */
-		ret = ffa_error(FFA_NO_MEMORY);
-		goto out;
+			if (right->address > child_constituent->address) {
+				child++;
+				child_constituent = right;
+			}
+		}
+
+		parent_constituent =
+			share_state_sorted_constituent(share_state, root);
+		if (parent_constituent->address >=
+		    child_constituent->address) {
+			return;
+		}
+
+		tmp = *parent_constituent;
+		*parent_constituent = *child_constituent;
+		*child_constituent = tmp;
+		root = child;
 	}
+}
 
-	/*
-	 * Update the mapping for the sender. This won't allocate because the
-	 * transaction was already prepared above, but may free pages in the
-	 * case that a whole block is being unmapped that was previously
-	 * partially mapped.
-	 */
-	CHECK(ffa_region_group_identity_map(
-		from_locked, fragments, fragment_constituent_counts,
-		fragment_count, from_mode, &local_page_pool, true));
+/**
+ * Copies the constituents of all the fragments of the given share state into
+ * its sorted fragments, then sorts them by address, drops empty ones and merges
+ * adjacent ones, so that the page tables are updated with as few and as large
+ * ranges as possible. Ranges aligned to a block are then mapped as blocks
+ * rather than a page at a time. The descriptor is left as it was sent.
+ *
+ * Returns FFA_INVALID_PARAMETERS if any constituents overlap, or FFA_NO_MEMORY
+ * if there isn't enough memory for the copy. Whatever was allocated is freed
+ * along with the share state.
+ */
+static struct ffa_value share_state_normalise_constituents(
+	struct ffa_memory_share_state *share_state, struct mpool *page_pool)
+{
+	uint32_t *counts = share_state->sorted_constituent_counts;
+	struct ffa_memory_region_constituent *last = NULL;
+	uint32_t count = 0;
+	uint32_t merged_count = 0;
+	uint32_t remaining;
+	uint32_t i;
+	uint32_t j;
 
-	/* Clear the memory so no VM or device can see the previous contents. */
-	if (clear &&
-	    !ffa_clear_memory_constituents(
-		    plat_ffa_owner_world_mode(from_locked.vm->id), fragments,
-		    fragment_constituent_counts, fragment_count, page_pool)) {
+	for (i = 0; i < share_state->fragment_count; ++i) {
 		/*
-		 * On failure, roll back by returning memory to the sender. This
-		 * may allocate pages which were previously freed into
-		 * `local_page_pool` by the call above, but will never allocate
-		 * more pages than that so can never fail.
+		 * Make sure constituents are properly aligned to a 64-bit
+		 * boundary. If not we would get alignment faults trying to
+		 * read (64-bit) values.
 		 */
-		CHECK(ffa_region_group_identity_map(
-			from_locked, fragments, fragment_constituent_counts,
-			fragment_count, orig_from_mode, &local_page_pool,
-			true));
+		if (!is_aligned(share_state->fragments[i], 8)) {
+			dlog_verbose("Constituents not aligned.\n");
+			return ffa_error(FFA_INVALID_PARAMETERS);
+		}
 
-		ret = ffa_error(FFA_NO_MEMORY);
-		goto out;
+		for (j = 0; j < share_state->fragment_constituent_counts[i];
+		     ++j) {
+			if (count % SORTED_FRAGMENT_CONSTITUENTS == 0) {
+				uint32_t sorted_fragment =
+					share_state->sorted_fragment_count;
+				void *entry = mpool_alloc(page_pool);
+
+				if (entry == NULL) {
+					dlog_verbose(
+						"Insufficient memory to sort "
+						"constituents.\n");
+					return ffa_error(FFA_NO_MEMORY);
+				}
+
+				share_state->sorted_fragments[sorted_fragment] =
+					entry;
+				share_state->sorted_fragment_slabs
+					[sorted_fragment] =
+					DESCRIPTOR_SLAB_NONE;
+				counts[sorted_fragment] = 0;
+				share_state->sorted_fragment_count++;
+			}
+
+			*share_state_sorted_constituent(share_state, count) =
+				share_state->fragments[i][j];
+			counts[share_state->sorted_fragment_count - 1]++;
+			count++;
+		}
 	}
 
-	ret = (struct ffa_value){.func = FFA_SUCCESS_32};
+	/* Heap sort, as the constituents can be indexed directly. */
+	for (i = count / 2; i > 0; --i) {
+		share_state_sorted_sift_down(share_state, i - 1, count);
+	}
+	for (i = count; i > 1; --i) {
+		struct ffa_memory_region_constituent *first =
+			share_state_sorted_constituent(share_state, 0);
+		struct ffa_memory_region_constituent *end =
+			share_state_sorted_constituent(share_state, i - 1);
+		struct ffa_memory_region_constituent tmp = *first;
+
+		*first = *end;
+		*end = tmp;
+		share_state_sorted_sift_down(share_state, 0, i - 1);
+	}
 
-out:
-	mpool_fini(&local_page_pool);
+	for (i = 0; i < count; ++i) {
+		struct ffa_memory_region_constituent *constituent =
+			share_state_sorted_constituent(share_state, i);
+		uint64_t last_end;
+
+		if (constituent->page_count == 0) {
+			continue;
+		}
+
+		if (last != NULL) {
+			last_end = last->address +
+				   (uint64_t)last->page_count * PAGE_SIZE;
+			if (last_end < last->address ||
+			    constituent->address < last_end) {
+				dlog_verbose(
+					"Constituent at %#x overlaps the "
+					"previous one.\n",
+					constituent->address);
+				return ffa_error(FFA_INVALID_PARAMETERS);
+			}
+
+			if (constituent->address == last_end &&
+			    last->page_count <=
+				    UINT32_MAX - constituent->page_count) {
+				last->page_count += constituent->page_count;
+				continue;
+			}
+		}
+
+		last = share_state_sorted_constituent(share_state,
+						      merged_count);
+		*last = *constituent;
+		merged_count++;
+	}
+
+	/* Fill the sorted fragments in order with the merged constituents. */
+	remaining = merged_count;
+	for (i = 0; i < share_state->sorted_fragment_count; ++i) {
+		if (counts[i] > remaining) {
+			counts[i] = remaining;
+		}
+		remaining -= counts[i];
+	}
+
+	/* Free those left empty, and compact the last one. */
+	while (share_state->sorted_fragment_count > 0 &&
+	       counts[share_state->sorted_fragment_count - 1] == 0) {
+		share_state->sorted_fragment_count--;
+		i = share_state->sorted_fragment_count;
+		mpool_free(page_pool, share_state->sorted_fragments[i]);
+		share_state->sorted_fragments[i] = NULL;
+	}
+
+	if (share_state->sorted_fragment_count > 0) {
+		i = share_state->sorted_fragment_count - 1;
+		share_state->sorted_fragments[i] = descriptor_compact(
+			share_state->sorted_fragments[i],
+			counts[i] *
+				sizeof(struct ffa_memory_region_constituent),
+			page_pool, &share_state->sorted_fragment_slabs[i]);
+	}
+
+	return (struct ffa_value){.func = FFA_SUCCESS_32};
+}
+
+/**
+ * Carries on with the call in progress to send the memory of the given share
+ * state, updating the sender page table, and then either marks the share state
+ * as having completed sending (once done) or frees it (on failure).
+ *
+ * Returns FFA_SUCCESS with the handle encoded, or the relevant FFA_ERROR.
+ */
+static struct ffa_value ffa_memory_send_resume(
+	struct vm_locked from_locked,
+	struct share_state_locked *share_state_locked, struct mpool *page_pool)
+{
+	struct ffa_memory_share_state *share_state =
+		share_state_locked->share_state;
+	struct ffa_memory_region *memory_region = share_state->memory_region;
+	struct ffa_value ret;
+
+	ret = share_state_op_continue(from_locked, share_state,
+				      &share_state->op, page_pool);
+	if (ret.func != FFA_SUCCESS_32) {
+		if (share_state->op.func == 0) {
+			/*
+			 * Free share state, it failed to send so it can't be
+			 * retrieved.
+			 */
+			dlog_verbose("Complete failed, freeing share state.\n");
+			share_state_free(share_state_locked, page_pool);
+		}
+		return ret;
+	}
+
+	share_state->sending_complete = true;
+	dlog_verbose("Marked sending complete.\n");
 
 	/*
-	 * Tidy up the page table by reclaiming failed mappings (if there was an
-	 * error) or merging entries into blocks where possible (on success).
+	 * No VM has access to the memory until it is retrieved, so it can be
+	 * cleared in the meantime.
 	 */
-	vm_ptable_defrag(from_locked, page_pool);
+	if ((memory_region->flags & FFA_MEMORY_REGION_FLAG_CLEAR) != 0) {
+		share_state_clear_defer(
+			share_state,
+			plat_ffa_owner_world_mode(from_locked.vm->id));
+	}
 
-	return ret;
+	return ffa_mem_success(memory_region->handle);
 }
 
 /**
- * Complete a memory sending operation by checking that it is valid, updating
- * the sender page table, and then either marking the share state as having
- * completed sending (on success) or freeing it (on failure).
+ * Complete a memory sending operation by sorting and merging the constituents,
+ * checking that it is valid, and then updating the sender page table with
+ * `ffa_memory_send_resume`.
  *
  * Returns FFA_SUCCESS with the handle encoded, or the relevant FFA_ERROR.
  */
 static struct ffa_value ffa_memory_send_complete(
-	struct vm_locked from_locked, struct share_states_locked share_states,
-	struct ffa_memory_share_state *share_state, struct mpool *page_pool,
-	uint32_t *orig_from_mode_ret)
+	struct vm_locked from_locked,
+	struct share_state_locked *share_state_locked, struct mpool *page_pool)
 {
-	struct ffa_memory_region *memory_region = share_state->memory_region;
+	struct ffa_memory_share_state *share_state =
+		share_state_locked->share_state;
 	struct ffa_value ret;
 
-	/* Lock must be held. */
-	assert(share_states.share_states != NULL);
-
-	/* Check that state is valid in sender page table and update. */
-	ret = ffa_send_check_update(
-		from_locked, share_state->fragments,
-		share_state->fragment_constituent_counts,
-		share_state->fragment_count, share_state->share_func,
-		memory_region->receivers, memory_region->receiver_count,
-		page_pool, memory_region->flags & FFA_MEMORY_REGION_FLAG_CLEAR,
-		orig_from_mode_ret);
+	ret = share_state_normalise_constituents(share_state, page_pool);
+
+	/* Check that state is valid in sender page table. */
+	if (ret.func == FFA_SUCCESS_32) {
+		ret = share_state_op_start(from_locked, share_state,
+					   &share_state->op,
+					   share_state->share_func,
+					   &share_state->sender_orig_mode);
+	}
 	if (ret.func != FFA_SUCCESS_32) {
 		/*
 		 * Free share state, it failed to send so it can't be retrieved.
 		 */
 		dlog_verbose("Complete failed, freeing share state.\n");
-		share_state_free(share_states, share_state, page_pool);
+		share_state_free(share_state_locked, page_pool);
 		return ret;
 	}
 
-	share_state->sending_complete = true;
-	dlog_verbose("Marked sending complete.\n");
-
-	return ffa_mem_success(share_state->memory_region->handle);
+	return ffa_memory_send_resume(from_locked, share_state_locked,
+				      page_pool);
 }
 
 /**
@@ -1618,8 +2775,8 @@ static struct ffa_value memory_send_tee_forward(
  * not.
  */
 static struct ffa_value ffa_memory_send_continue_validate(
-	struct share_states_locked share_states, ffa_memory_handle_t handle,
-	struct ffa_memory_share_state **share_state_ret, ffa_vm_id_t from_vm_id,
+	ffa_memory_handle_t handle,
+	struct share_state_locked *share_state_ret, ffa_vm_id_t from_vm_id,
 	struct mpool *page_pool)
 {
 	struct ffa_memory_share_state *share_state;
@@ -1629,14 +2786,16 @@ static struct ffa_value ffa_memory_send_continue_validate(
 
 	/*
 	 * Look up the share state by handle and make sure that the VM ID
-	 * matches.
+	 * matches. It is left locked in `share_state_ret` even if it turns out
+	 * to be invalid, for the caller to unlock.
 	 */
-	if (!get_share_state(share_states, handle, &share_state)) {
+	if (!get_share_state(handle, share_state_ret, page_pool)) {
 		dlog_verbose(
 			"Invalid handle %#x for memory send continuation.\n",
 			handle);
 		return ffa_error(FFA_INVALID_PARAMETERS);
 	}
+	share_state = share_state_ret->share_state;
 	memory_region = share_state->memory_region;
 
 	if (memory_region->sender != from_vm_id) {
@@ -1644,7 +2803,8 @@ static struct ffa_value ffa_memory_send_continue_validate(
 		return ffa_error(FFA_INVALID_PARAMETERS);
 	}
 
-	if (share_state->sending_complete) {
+	/* All the fragments were sent if sending is still to be resumed. */
+	if (share_state->sending_complete || share_state->op.func != 0) {
 		dlog_verbose(
 			"Sending of memory handle %#x is already complete.\n",
 			handle);
@@ -1661,12 +2821,10 @@ static struct ffa_value ffa_memory_send_continue_validate(
 			"only %d supported.\n",
 			handle, MAX_FRAGMENTS);
 		/* Free share state, as it's not possible to complete it. */
-		share_state_free(share_states, share_state, page_pool);
+		share_state_free(share_state_ret, page_pool);
 		return ffa_error(FFA_NO_MEMORY);
 	}
 
-	*share_state_ret = share_state;
-
 	return (struct ffa_value){.func = FFA_SUCCESS_32};
 }
 
@@ -1721,7 +2879,7 @@ struct ffa_value ffa_memory_send(struct vm_locked from_locked,
 				 struct mpool *page_pool)
 {
 	struct ffa_value ret;
-	struct share_states_locked share_states;
+	struct share_state_locked share_state_locked = {.share_state = NULL};
 	struct ffa_memory_share_state *share_state;
 
 	/*
@@ -1752,38 +2910,38 @@ struct ffa_value ffa_memory_send(struct vm_locked from_locked,
 		break;
 	}
 
-	share_states = share_states_lock();
 	/*
 	 * Allocate a share state before updating the page table. Otherwise if
 	 * updating the page table succeeded but allocating the share state
 	 * failed then it would leave the memory in a state where nobody could
 	 * get it back.
 	 */
-	if (!allocate_share_state(share_states, share_func, memory_region,
-				  fragment_length, FFA_MEMORY_HANDLE_INVALID,
-				  &share_state)) {
+	if (!allocate_share_state(share_func, memory_region, fragment_length,
+				  FFA_MEMORY_HANDLE_INVALID,
+				  &share_state_locked, page_pool)) {
 		dlog_verbose("Failed to allocate share state.\n");
 		mpool_free(page_pool, memory_region);
 		ret = ffa_error(FFA_NO_MEMORY);
 		goto out;
 	}
+	share_state = share_state_locked.share_state;
 
 	if (fragment_length == memory_share_length) {
 		/* No more fragments to come, everything fit in one message. */
-		ret = ffa_memory_send_complete(
-			from_locked, share_states, share_state, page_pool,
-			&(share_state->sender_orig_mode));
+		ret = ffa_memory_send_complete(from_locked,
+					       &share_state_locked, page_pool);
 	} else {
 		ret = (struct ffa_value){
 			.func = FFA_MEM_FRAG_RX_32,
-			.arg1 = (uint32_t)memory_region->handle,
-			.arg2 = (uint32_t)(memory_region->handle >> 32),
+			.arg1 = (uint32_t)share_state->memory_region->handle,
+			.arg2 = (uint32_t)(share_state->memory_region->handle >>
+					   32),
 			.arg3 = fragment_length};
 	}
 
 out:
-	share_states_unlock(&share_states);
-	dump_share_states();
+	share_state_unlock(&share_state_locked);
+	dump_share_states(page_pool);
 	return ret;
 }
 
@@ -1867,12 +3025,12 @@ struct ffa_value ffa_memory_tee_send(
 			CHECK(ffa_region_group_identity_map(
 				from_locked, &constituents,
 				&composite->constituent_count, 1,
-				orig_from_mode, &local_page_pool, true));
+				orig_from_mode, &local_page_pool, true, NULL,
+				NULL));
 		}
 
 		mpool_fini(&local_page_pool);
 	} else {
-		struct share_states_locked share_states = share_states_lock();
 		ffa_memory_handle_t handle;
 
 		/*
@@ -1886,7 +3044,7 @@ struct ffa_value ffa_memory_tee_send(
 			to_locked, from_locked.vm->id, share_func,
 			memory_region, memory_share_length, fragment_length);
 		if (ret.func == FFA_ERROR_32) {
-			goto out_unlock;
+			goto out;
 		} else if (ret.func != FFA_MEM_FRAG_RX_32) {
 			dlog_warning(
 				"Got %#x from TEE in response to %#x for "
@@ -1895,7 +3053,7 @@ struct ffa_value ffa_memory_tee_send(
 				ret.func, share_func, fragment_length,
 				memory_share_length);
 			ret = ffa_error(FFA_INVALID_PARAMETERS);
-			goto out_unlock;
+			goto out;
 		}
 		handle = ffa_frag_handle(ret);
 		if (ret.arg3 != fragment_length) {
@@ -1904,7 +3062,7 @@ struct ffa_value ffa_memory_tee_send(
 				"FFA_MEM_FRAG_RX from TEE (expected %d).\n",
 				ret.arg3, fragment_length);
 			ret = ffa_error(FFA_INVALID_PARAMETERS);
-			goto out_unlock;
+			goto out;
 		}
 		if (ffa_frag_sender(ret) != from_locked.vm->id) {
 			dlog_warning(
@@ -1912,30 +3070,28 @@ struct ffa_value ffa_memory_tee_send(
 				"FFA_MEM_FRAG_RX from TEE (expected %d).\n",
 				ffa_frag_sender(ret), from_locked.vm->id);
 			ret = ffa_error(FFA_INVALID_PARAMETERS);
-			goto out_unlock;
+			goto out;
 		}
 
-		if (!allocate_share_state(share_states, share_func,
-					  memory_region, fragment_length,
-					  handle, NULL)) {
+		if (!allocate_share_state(share_func, memory_region,
+					  fragment_length, handle, NULL,
+					  page_pool)) {
 			dlog_verbose("Failed to allocate share state.\n");
 			ret = ffa_error(FFA_NO_MEMORY);
-			goto out_unlock;
+			goto out;
 		}
 		/*
 		 * Don't free the memory region fragment, as it has been stored
 		 * in the share state.
 		 */
 		memory_region = NULL;
-	out_unlock:
-		share_states_unlock(&share_states);
 	}
 
 out:
 	if (memory_region != NULL) {
 		mpool_free(page_pool, memory_region);
 	}
-	dump_share_states();
+	dump_share_states(page_pool);
 	return ret;
 }
 
@@ -1958,17 +3114,18 @@ struct ffa_value ffa_memory_send_continue(struct vm_locked from_locked,
 					  ffa_memory_handle_t handle,
 					  struct mpool *page_pool)
 {
-	struct share_states_locked share_states = share_states_lock();
+	struct share_state_locked share_state_locked = {.share_state = NULL};
 	struct ffa_memory_share_state *share_state;
 	struct ffa_value ret;
 	struct ffa_memory_region *memory_region;
+	uint8_t fragment_slab;
 
-	ret = ffa_memory_send_continue_validate(share_states, handle,
-						&share_state,
+	ret = ffa_memory_send_continue_validate(handle, &share_state_locked,
 						from_locked.vm->id, page_pool);
 	if (ret.func != FFA_SUCCESS_32) {
 		goto out_free_fragment;
 	}
+	share_state = share_state_locked.share_state;
 	memory_region = share_state->memory_region;
 
 	if (memory_region->receivers[0].receiver_permissions.receiver ==
@@ -1982,23 +3139,26 @@ struct ffa_value ffa_memory_send_continue(struct vm_locked from_locked,
 	}
 
 	/* Add this fragment. */
+	fragment = descriptor_compact(fragment, fragment_length, page_pool,
+				      &fragment_slab);
 	share_state->fragments[share_state->fragment_count] = fragment;
+	share_state->fragment_slabs[share_state->fragment_count] =
+		fragment_slab;
 	share_state->fragment_constituent_counts[share_state->fragment_count] =
 		fragment_length / sizeof(struct ffa_memory_region_constituent);
 	share_state->fragment_count++;
 
 	/* Check whether the memory send operation is now ready to complete. */
-	if (share_state_sending_complete(share_states, share_state)) {
-		ret = ffa_memory_send_complete(
-			from_locked, share_states, share_state, page_pool,
-			&(share_state->sender_orig_mode));
+	if (share_state_sending_complete(share_state_locked)) {
+		ret = ffa_memory_send_complete(from_locked,
+					       &share_state_locked, page_pool);
 	} else {
 		ret = (struct ffa_value){
 			.func = FFA_MEM_FRAG_RX_32,
 			.arg1 = (uint32_t)handle,
 			.arg2 = (uint32_t)(handle >> 32),
-			.arg3 = share_state_next_fragment_offset(share_states,
-								 share_state)};
+			.arg3 = share_state_next_fragment_offset(
+				share_state_locked)};
 	}
 	goto out;
 
@@ -2006,7 +3166,7 @@ out_free_fragment:
 	mpool_free(page_pool, fragment);
 
 out:
-	share_states_unlock(&share_states);
+	share_state_unlock(&share_state_locked);
 	return ret;
 }
 
@@ -2029,17 +3189,17 @@ struct ffa_value ffa_memory_tee_send_continue(struct vm_locked from_locked,
 					      ffa_memory_handle_t handle,
 					      struct mpool *page_pool)
 {
-	struct share_states_locked share_states = share_states_lock();
+	struct share_state_locked share_state_locked = {.share_state = NULL};
 	struct ffa_memory_share_state *share_state;
 	struct ffa_value ret;
 	struct ffa_memory_region *memory_region;
 
-	ret = ffa_memory_send_continue_validate(share_states, handle,
-						&share_state,
+	ret = ffa_memory_send_continue_validate(handle, &share_state_locked,
 						from_locked.vm->id, page_pool);
 	if (ret.func != FFA_SUCCESS_32) {
 		goto out_free_fragment;
 	}
+	share_state = share_state_locked.share_state;
 	memory_region = share_state->memory_region;
 
 	if (memory_region->receivers[0].receiver_permissions.receiver !=
@@ -2061,20 +3221,22 @@ struct ffa_value ffa_memory_tee_send_continue(struct vm_locked from_locked,
 			.func = FFA_MEM_FRAG_RX_32,
 			.arg1 = (uint32_t)handle,
 			.arg2 = (uint32_t)(handle >> 32),
-			.arg3 = share_state_next_fragment_offset(share_states,
-								 share_state),
+			.arg3 = share_state_next_fragment_offset(
+				share_state_locked),
 		};
 		goto out_free_fragment;
 	}
 
 	/* Add this fragment. */
 	share_state->fragments[share_state->fragment_count] = fragment;
+	share_state->fragment_slabs[share_state->fragment_count] =
+		DESCRIPTOR_SLAB_NONE;
 	share_state->fragment_constituent_counts[share_state->fragment_count] =
 		fragment_length / sizeof(struct ffa_memory_region_constituent);
 	share_state->fragment_count++;
 
 	/* Check whether the memory send operation is now ready to complete. */
-	if (share_state_sending_complete(share_states, share_state)) {
+	if (share_state_sending_complete(share_state_locked)) {
 		struct mpool local_page_pool;
 		uint32_t orig_from_mode;
 
@@ -2083,9 +3245,21 @@ struct ffa_value ffa_memory_tee_send_continue(struct vm_locked from_locked,
 		 */
 		mpool_init_with_fallback(&local_page_pool, page_pool);
 
-		ret = ffa_memory_send_complete(from_locked, share_states,
-					       share_state, &local_page_pool,
-					       &orig_from_mode);
+		/*
+		 * Check that state is valid in sender page table and update.
+		 * The share state is freed once the TEE has the memory, so
+		 * its constituents aren't sorted.
+		 */
+		ret = ffa_send_check_update(
+			from_locked, share_state->fragments,
+			share_state->fragment_constituent_counts,
+			share_state->fragment_count, share_state->share_func,
+			share_state->memory_region->receivers,
+			share_state->memory_region->receiver_count,
+			&local_page_pool,
+			share_state->memory_region->flags &
+				FFA_MEMORY_REGION_FLAG_CLEAR,
+			&orig_from_mode);
 
 		if (ret.func == FFA_SUCCESS_32) {
 			/*
@@ -2122,11 +3296,11 @@ struct ffa_value ffa_memory_tee_send_continue(struct vm_locked from_locked,
 						->fragment_constituent_counts,
 					share_state->fragment_count,
 					orig_from_mode, &local_page_pool,
-					true));
+					true, NULL, NULL));
 			}
 
 			/* Free share state. */
-			share_state_free(share_states, share_state, page_pool);
+			share_state_free(&share_state_locked, page_pool);
 		} else {
 			/* Abort sending to TEE. */
 			struct ffa_value tee_ret =
@@ -2147,16 +3321,16 @@ struct ffa_value ffa_memory_tee_send_continue(struct vm_locked from_locked,
 					tee_ret.func, tee_ret.arg2);
 			}
 			/*
-			 * We don't need to free the share state in this case
-			 * because ffa_memory_send_complete does that already.
+			 * Free share state, it failed to send so it can't be
+			 * retrieved.
 			 */
+			share_state_free(&share_state_locked, page_pool);
 		}
 
 		mpool_fini(&local_page_pool);
 	} else {
 		uint32_t next_fragment_offset =
-			share_state_next_fragment_offset(share_states,
-							 share_state);
+			share_state_next_fragment_offset(share_state_locked);
 
 		ret = memory_send_continue_tee_forward(
 			to_locked, from_locked.vm->id, fragment,
@@ -2176,7 +3350,7 @@ struct ffa_value ffa_memory_tee_send_continue(struct vm_locked from_locked,
 				ffa_frag_sender(ret), handle,
 				next_fragment_offset, from_locked.vm->id);
 			/* Free share state. */
-			share_state_free(share_states, share_state, page_pool);
+			share_state_free(&share_state_locked, page_pool);
 			ret = ffa_error(FFA_INVALID_PARAMETERS);
 			goto out;
 		}
@@ -2192,25 +3366,83 @@ out_free_fragment:
 	mpool_free(page_pool, fragment);
 
 out:
-	share_states_unlock(&share_states);
+	share_state_unlock(&share_state_locked);
 	return ret;
 }
 
+/**
+ * Returns whether the memory of the given share state is to be mapped in the
+ * page table of the given retrieving VM as it accesses it, rather than now.
+ *
+ * The VM must have asked for it in its manifest. Donated memory is always
+ * mapped, as the share state doesn't outlive the retrieval. So is memory
+ * retrieved by EL0 partitions, whose faults are not resolved this way.
+ */
+static bool ffa_memory_retrieve_lazily(
+	struct vm_locked to_locked, struct ffa_memory_share_state *share_state)
+{
+	struct vm *vm = to_locked.vm;
+
+	return vm->lazy_retrieve && !vm->el0_partition &&
+	       share_state->share_func != FFA_MEM_DONATE_32 &&
+	       vm->lazy_retrieval_count < VM_MAX_LAZY_RETRIEVALS;
+}
+
 /** Clean up after the receiver has finished retrieving a memory region. */
 static void ffa_memory_retrieve_complete(
-	struct share_states_locked share_states,
-	struct ffa_memory_share_state *share_state, struct mpool *page_pool)
+	struct share_state_locked *share_state_locked, struct mpool *page_pool)
 {
-	if (share_state->share_func == FFA_MEM_DONATE_32) {
+	if (share_state_locked->share_state->share_func == FFA_MEM_DONATE_32) {
 		/*
 		 * Memory that has been donated can't be relinquished,
 		 * so no need to keep the share state around.
 		 */
-		share_state_free(share_states, share_state, page_pool);
+		share_state_free(share_state_locked, page_pool);
 		dlog_verbose("Freed share state for donate.\n");
 	}
 }
 
+/**
+ * Appends the constituents of as many of the fragments the receiver hasn't
+ * retrieved yet as fit to the `fragment_length` bytes already in its RX buffer,
+ * so that a receiver with an RX buffer larger than a page needs fewer
+ * FFA_MEM_FRAG_RX calls. Fragments are only sent whole, so that
+ * `ffa_memory_retrieve_continue` can carry on from the next one.
+ *
+ * Returns the new length of the message in the RX buffer.
+ */
+static uint32_t ffa_memory_retrieve_pack_fragments(
+	struct vm_locked to_locked, struct ffa_memory_share_state *share_state,
+	uint32_t receiver_index, uint32_t fragment_length)
+{
+	uint8_t *recv = to_locked.vm->mailbox.recv;
+	uint32_t recv_size = to_locked.vm->mailbox.size;
+	uint32_t i = share_state->retrieved_fragment_count[receiver_index];
+
+	for (; i < share_state->fragment_count; ++i) {
+		uint32_t count = share_state->fragment_constituent_counts[i];
+		uint32_t length =
+			count * sizeof(struct ffa_memory_region_constituent);
+		struct ffa_memory_region_constituent *constituents =
+			(struct ffa_memory_region_constituent *)&recv
+				[fragment_length];
+
+		if (length > recv_size - fragment_length) {
+			break;
+		}
+
+		CHECK(ffa_memory_fragment_init(constituents,
+					       recv_size - fragment_length,
+					       share_state->fragments[i], count,
+					       NULL) == 0);
+		fragment_length += length;
+	}
+
+	share_state->retrieved_fragment_count[receiver_index] = i;
+
+	return fragment_length;
+}
+
 /*
  * Gets the receiver's access permissions from 'struct ffa_memory_region' and
  * returns its index in the receiver's array. If receiver's ID doesn't exist
@@ -2431,6 +3663,79 @@ static struct ffa_value ffa_memory_retrieve_validate_memory_access_list(
 	return (struct ffa_value){.func = FFA_SUCCESS_32};
 }
 
+/**
+ * Carries on with the call in progress to retrieve the memory of the given
+ * share state, updating the receiver page table, and once done writes the
+ * response to the receiver's RX buffer.
+ */
+static struct ffa_value ffa_memory_retrieve_resume(
+	struct vm_locked to_locked,
+	struct share_state_locked *share_state_locked, uint32_t receiver_index,
+	struct mpool *page_pool)
+{
+	struct ffa_memory_share_state *share_state =
+		share_state_locked->share_state;
+	struct ffa_memory_op *op = &share_state->receiver_ops[receiver_index];
+	struct ffa_memory_region *memory_region = share_state->memory_region;
+	ffa_memory_handle_t handle = memory_region->handle;
+	struct ffa_composite_memory_region *composite;
+	uint32_t total_length;
+	uint32_t fragment_length;
+	struct ffa_value ret;
+
+	if (to_locked.vm->mailbox.state != MAILBOX_STATE_EMPTY ||
+	    to_locked.vm->mailbox.recv == NULL) {
+		/*
+		 * Can't retrieve memory information if the mailbox is not
+		 * available.
+		 */
+		dlog_verbose("RX buffer not ready.\n");
+		return ffa_error(FFA_BUSY);
+	}
+
+	ret = share_state_op_continue(to_locked, share_state, op, page_pool);
+	if (ret.func != FFA_SUCCESS_32) {
+		return ret;
+	}
+
+	/*
+	 * Copy response to RX buffer of caller and deliver the message. This
+	 * must be done before the share_state is (possibly) freed.
+	 */
+	/* TODO: combine attributes from sender and request. */
+	composite = ffa_memory_region_get_composite(memory_region, 0);
+	/*
+	 * Constituents which we received in the first fragment should always
+	 * fit in the first fragment we are sending, because the header is the
+	 * same size in both cases and we have a fixed message buffer size. So
+	 * `ffa_retrieved_memory_region_init` should never fail.
+	 */
+	CHECK(ffa_retrieved_memory_region_init(
+		to_locked.vm->mailbox.recv, to_locked.vm->mailbox.size,
+		memory_region->sender, memory_region->attributes,
+		memory_region->flags, handle, to_locked.vm->id,
+		op->permissions, composite->page_count,
+		composite->constituent_count, share_state->fragments[0],
+		share_state->fragment_constituent_counts[0], &total_length,
+		&fragment_length));
+	share_state->retrieved_fragment_count[receiver_index] = 1;
+	fragment_length = ffa_memory_retrieve_pack_fragments(
+		to_locked, share_state, receiver_index, fragment_length);
+	to_locked.vm->mailbox.recv_size = fragment_length;
+	to_locked.vm->mailbox.recv_sender = HF_HYPERVISOR_VM_ID;
+	to_locked.vm->mailbox.recv_func = FFA_MEM_RETRIEVE_RESP_32;
+	to_locked.vm->mailbox.state = MAILBOX_STATE_READ;
+
+	if (share_state->retrieved_fragment_count[receiver_index] ==
+	    share_state->fragment_count) {
+		ffa_memory_retrieve_complete(share_state_locked, page_pool);
+	}
+
+	return (struct ffa_value){.func = FFA_MEM_RETRIEVE_RESP_32,
+				  .arg1 = total_length,
+				  .arg2 = fragment_length};
+}
+
 struct ffa_value ffa_memory_retrieve(struct vm_locked to_locked,
 				     struct ffa_memory_region *retrieve_request,
 				     uint32_t retrieve_request_length,
@@ -2446,16 +3751,13 @@ struct ffa_value ffa_memory_retrieve(struct vm_locked to_locked,
 		FFA_MEMORY_REGION_TRANSACTION_TYPE_MASK;
 	struct ffa_memory_region *memory_region;
 	ffa_memory_access_permissions_t permissions;
-	uint32_t memory_to_attributes;
-	struct share_states_locked share_states;
+	struct share_state_locked share_state_locked = {.share_state = NULL};
 	struct ffa_memory_share_state *share_state;
+	struct ffa_memory_op *op;
 	struct ffa_value ret;
-	struct ffa_composite_memory_region *composite;
-	uint32_t total_length;
-	uint32_t fragment_length;
 	uint32_t receiver_index;
 
-	dump_share_states();
+	dump_share_states(page_pool);
 
 	if (retrieve_request_length != expected_retrieve_request_length) {
 		dlog_verbose(
@@ -2466,13 +3768,13 @@ struct ffa_value ffa_memory_retrieve(struct vm_locked to_locked,
 		return ffa_error(FFA_INVALID_PARAMETERS);
 	}
 
-	share_states = share_states_lock();
-	if (!get_share_state(share_states, handle, &share_state)) {
+	if (!get_share_state(handle, &share_state_locked, page_pool)) {
 		dlog_verbose("Invalid handle %#x for FFA_MEM_RETRIEVE_REQ.\n",
 			     handle);
 		ret = ffa_error(FFA_INVALID_PARAMETERS);
 		goto out;
 	}
+	share_state = share_state_locked.share_state;
 
 	if (!share_state->sending_complete) {
 		dlog_verbose(
@@ -2501,6 +3803,13 @@ struct ffa_value ffa_memory_retrieve(struct vm_locked to_locked,
 		goto out;
 	}
 
+	op = &share_state->receiver_ops[receiver_index];
+	if (share_state_op_blocks(share_state, &share_state->op) ||
+	    share_state_op_blocks(share_state, op)) {
+		ret = ffa_error(FFA_DENIED);
+		goto out;
+	}
+
 	if (share_state->retrieved_fragment_count[receiver_index] != 0U) {
 		dlog_verbose("Memory with handle %#x already retrieved.\n",
 			     handle);
@@ -2616,56 +3925,32 @@ struct ffa_value ffa_memory_retrieve(struct vm_locked to_locked,
 		}
 	}
 
-	memory_to_attributes = ffa_memory_permissions_to_mode(
-		permissions, share_state->sender_orig_mode);
-	ret = ffa_retrieve_check_update(
-		to_locked, memory_region->sender, share_state->fragments,
-		share_state->fragment_constituent_counts,
-		share_state->fragment_count, memory_to_attributes,
-		share_state->share_func, false, page_pool);
+	op->receiver_index = receiver_index;
+	op->permissions = permissions;
+	ret = share_state_op_start(to_locked, share_state, op,
+				   FFA_MEM_RETRIEVE_REQ_32, NULL);
 	if (ret.func != FFA_SUCCESS_32) {
 		goto out;
 	}
 
-	/*
-	 * Copy response to RX buffer of caller and deliver the message. This
-	 * must be done before the share_state is (possibly) freed.
-	 */
-	/* TODO: combine attributes from sender and request. */
-	composite = ffa_memory_region_get_composite(memory_region, 0);
-	/*
-	 * Constituents which we received in the first fragment should always
-	 * fit in the first fragment we are sending, because the header is the
-	 * same size in both cases and we have a fixed message buffer size. So
-	 * `ffa_retrieved_memory_region_init` should never fail.
-	 */
-	CHECK(ffa_retrieved_memory_region_init(
-		to_locked.vm->mailbox.recv, HF_MAILBOX_SIZE,
-		memory_region->sender, memory_region->attributes,
-		memory_region->flags, handle, to_locked.vm->id, permissions,
-		composite->page_count, composite->constituent_count,
-		share_state->fragments[0],
-		share_state->fragment_constituent_counts[0], &total_length,
-		&fragment_length));
-	to_locked.vm->mailbox.recv_size = fragment_length;
-	to_locked.vm->mailbox.recv_sender = HF_HYPERVISOR_VM_ID;
-	to_locked.vm->mailbox.recv_func = FFA_MEM_RETRIEVE_RESP_32;
-	to_locked.vm->mailbox.state = MAILBOX_STATE_READ;
+	if (ffa_memory_retrieve_lazily(to_locked, share_state)) {
+		/* Checked by `ffa_memory_retrieve_lazily`. */
+		CHECK(vm_lazy_retrieval_add(to_locked, handle));
+		share_state->lazy_mode[receiver_index] = op->mode;
 
-	share_state->retrieved_fragment_count[receiver_index] = 1;
-	if (share_state->retrieved_fragment_count[receiver_index] ==
-	    share_state->fragment_count) {
-		ffa_memory_retrieve_complete(share_states, share_state,
-					     page_pool);
+		/*
+		 * Nothing is mapped until it is accessed, but it may still have
+		 * to be cleared.
+		 */
+		op->fragment = share_state->sorted_fragment_count;
 	}
 
-	ret = (struct ffa_value){.func = FFA_MEM_RETRIEVE_RESP_32,
-				 .arg1 = total_length,
-				 .arg2 = fragment_length};
+	ret = ffa_memory_retrieve_resume(to_locked, &share_state_locked,
+					 receiver_index, page_pool);
 
 out:
-	share_states_unlock(&share_states);
-	dump_share_states();
+	share_state_unlock(&share_state_locked);
+	dump_share_states(page_pool);
 	return ret;
 }
 
@@ -2675,7 +3960,7 @@ struct ffa_value ffa_memory_retrieve_continue(struct vm_locked to_locked,
 					      struct mpool *page_pool)
 {
 	struct ffa_memory_region *memory_region;
-	struct share_states_locked share_states;
+	struct share_state_locked share_state_locked = {.share_state = NULL};
 	struct ffa_memory_share_state *share_state;
 	struct ffa_value ret;
 	uint32_t fragment_index;
@@ -2686,15 +3971,15 @@ struct ffa_value ffa_memory_retrieve_continue(struct vm_locked to_locked,
 	uint32_t fragment_length;
 	uint32_t receiver_index;
 
-	dump_share_states();
+	dump_share_states(page_pool);
 
-	share_states = share_states_lock();
-	if (!get_share_state(share_states, handle, &share_state)) {
+	if (!get_share_state(handle, &share_state_locked, page_pool)) {
 		dlog_verbose("Invalid handle %#x for FFA_MEM_FRAG_RX.\n",
 			     handle);
 		ret = ffa_error(FFA_INVALID_PARAMETERS);
 		goto out;
 	}
+	share_state = share_state_locked.share_state;
 
 	memory_region = share_state->memory_region;
 	CHECK(memory_region != NULL);
@@ -2762,20 +4047,21 @@ struct ffa_value ffa_memory_retrieve_continue(struct vm_locked to_locked,
 	}
 
 	remaining_constituent_count = ffa_memory_fragment_init(
-		to_locked.vm->mailbox.recv, HF_MAILBOX_SIZE,
+		to_locked.vm->mailbox.recv, to_locked.vm->mailbox.size,
 		share_state->fragments[fragment_index],
 		share_state->fragment_constituent_counts[fragment_index],
 		&fragment_length);
 	CHECK(remaining_constituent_count == 0);
+	share_state->retrieved_fragment_count[receiver_index]++;
+	fragment_length = ffa_memory_retrieve_pack_fragments(
+		to_locked, share_state, receiver_index, fragment_length);
 	to_locked.vm->mailbox.recv_size = fragment_length;
 	to_locked.vm->mailbox.recv_sender = HF_HYPERVISOR_VM_ID;
 	to_locked.vm->mailbox.recv_func = FFA_MEM_FRAG_TX_32;
 	to_locked.vm->mailbox.state = MAILBOX_STATE_READ;
-	share_state->retrieved_fragment_count[receiver_index]++;
 	if (share_state->retrieved_fragment_count[receiver_index] ==
 	    share_state->fragment_count) {
-		ffa_memory_retrieve_complete(share_states, share_state,
-					     page_pool);
+		ffa_memory_retrieve_complete(&share_state_locked, page_pool);
 	}
 
 	ret = (struct ffa_value){.func = FFA_MEM_FRAG_TX_32,
@@ -2784,8 +4070,54 @@ struct ffa_value ffa_memory_retrieve_continue(struct vm_locked to_locked,
 				 .arg3 = fragment_length};
 
 out:
-	share_states_unlock(&share_states);
-	dump_share_states();
+	share_state_unlock(&share_state_locked);
+	dump_share_states(page_pool);
+	return ret;
+}
+
+/**
+ * Carries on with the call in progress to relinquish the memory of the given
+ * share state, updating the borrower page table, and once done marks it as not
+ * retrieved by the borrower.
+ */
+static struct ffa_value ffa_memory_relinquish_resume(
+	struct vm_locked from_locked,
+	struct share_state_locked *share_state_locked, uint32_t receiver_index,
+	struct mpool *page_pool)
+{
+	struct ffa_memory_share_state *share_state =
+		share_state_locked->share_state;
+	struct ffa_memory_op *op = &share_state->receiver_ops[receiver_index];
+	struct ffa_value ret;
+
+	ret = share_state_op_continue(from_locked, share_state, op, page_pool);
+	if (ret.func != FFA_SUCCESS_32) {
+		return ret;
+	}
+
+	/*
+	 * Mark memory handle as not retrieved, so it can be reclaimed (or
+	 * retrieved again).
+	 */
+	share_state->retrieved_fragment_count[receiver_index] = 0;
+
+	if (share_state->lazy_mode[receiver_index] != 0) {
+		share_state->lazy_mode[receiver_index] = 0;
+		vm_lazy_retrieval_remove(from_locked,
+					 share_state->memory_region->handle);
+	}
+
+	/*
+	 * Clear the memory in the background, so that the time taken doesn't
+	 * depend on its size. Whatever is left is cleared before the memory is
+	 * mapped for a VM again.
+	 */
+	if (op->clear) {
+		share_state_clear_defer(
+			share_state,
+			plat_ffa_owner_world_mode(from_locked.vm->id));
+	}
+
 	return ret;
 }
 
@@ -2794,12 +4126,14 @@ struct ffa_value ffa_memory_relinquish(
 	struct ffa_mem_relinquish *relinquish_request, struct mpool *page_pool)
 {
 	ffa_memory_handle_t handle = relinquish_request->handle;
-	struct share_states_locked share_states;
+	struct share_state_locked share_state_locked = {.share_state = NULL};
 	struct ffa_memory_share_state *share_state;
 	struct ffa_memory_region *memory_region;
+	struct ffa_memory_op *op;
 	bool clear;
 	struct ffa_value ret;
 	uint32_t receiver_index;
+	uint32_t orig_from_mode;
 
 	if (relinquish_request->endpoint_count != 1) {
 		dlog_verbose(
@@ -2817,15 +4151,15 @@ struct ffa_value ffa_memory_relinquish(
 		return ffa_error(FFA_INVALID_PARAMETERS);
 	}
 
-	dump_share_states();
+	dump_share_states(page_pool);
 
-	share_states = share_states_lock();
-	if (!get_share_state(share_states, handle, &share_state)) {
+	if (!get_share_state(handle, &share_state_locked, page_pool)) {
 		dlog_verbose("Invalid handle %#x for FFA_MEM_RELINQUISH.\n",
 			     handle);
 		ret = ffa_error(FFA_INVALID_PARAMETERS);
 		goto out;
 	}
+	share_state = share_state_locked.share_state;
 
 	if (!share_state->sending_complete) {
 		dlog_verbose(
@@ -2851,6 +4185,13 @@ struct ffa_value ffa_memory_relinquish(
 		goto out;
 	}
 
+	op = &share_state->receiver_ops[receiver_index];
+	if (share_state_op_blocks(share_state, &share_state->op) ||
+	    share_state_op_blocks(share_state, op)) {
+		ret = ffa_error(FFA_DENIED);
+		goto out;
+	}
+
 	if (share_state->retrieved_fragment_count[receiver_index] !=
 	    share_state->fragment_count) {
 		dlog_verbose(
@@ -2873,22 +4214,41 @@ struct ffa_value ffa_memory_relinquish(
 		goto out;
 	}
 
-	ret = ffa_relinquish_check_update(
-		from_locked, share_state->fragments,
-		share_state->fragment_constituent_counts,
-		share_state->fragment_count, page_pool, clear);
-
+	op->receiver_index = receiver_index;
+	op->clear = clear;
+	ret = share_state_op_start(from_locked, share_state, op,
+				   FFA_MEM_RELINQUISH_32, &orig_from_mode);
 	if (ret.func == FFA_SUCCESS_32) {
-		/*
-		 * Mark memory handle as not retrieved, so it can be reclaimed
-		 * (or retrieved again).
-		 */
-		share_state->retrieved_fragment_count[receiver_index] = 0;
+		ret = ffa_memory_relinquish_resume(from_locked,
+						   &share_state_locked,
+						   receiver_index, page_pool);
 	}
 
 out:
-	share_states_unlock(&share_states);
-	dump_share_states();
+	share_state_unlock(&share_state_locked);
+	dump_share_states(page_pool);
+	return ret;
+}
+
+/**
+ * Carries on with the call in progress to reclaim the memory of the given share
+ * state, updating the owner page table, and once done frees the share state.
+ */
+static struct ffa_value ffa_memory_reclaim_resume(
+	struct vm_locked to_locked,
+	struct share_state_locked *share_state_locked, struct mpool *page_pool)
+{
+	struct ffa_memory_share_state *share_state =
+		share_state_locked->share_state;
+	struct ffa_value ret;
+
+	ret = share_state_op_continue(to_locked, share_state, &share_state->op,
+				      page_pool);
+	if (ret.func == FFA_SUCCESS_32) {
+		share_state_free(share_state_locked, page_pool);
+		dlog_verbose("Freed share state after successful reclaim.\n");
+	}
+
 	return ret;
 }
 
@@ -2902,20 +4262,20 @@ struct ffa_value ffa_memory_reclaim(struct vm_locked to_locked,
 				    ffa_memory_region_flags_t flags,
 				    struct mpool *page_pool)
 {
-	struct share_states_locked share_states;
+	struct share_state_locked share_state_locked = {.share_state = NULL};
 	struct ffa_memory_share_state *share_state;
 	struct ffa_memory_region *memory_region;
 	struct ffa_value ret;
 
-	dump_share_states();
+	dump_share_states(page_pool);
 
-	share_states = share_states_lock();
-	if (!get_share_state(share_states, handle, &share_state)) {
+	if (!get_share_state(handle, &share_state_locked, page_pool)) {
 		dlog_verbose("Invalid handle %#x for FFA_MEM_RECLAIM.\n",
 			     handle);
 		ret = ffa_error(FFA_INVALID_PARAMETERS);
 		goto out;
 	}
+	share_state = share_state_locked.share_state;
 
 	memory_region = share_state->memory_region;
 	CHECK(memory_region != NULL);
@@ -2938,7 +4298,22 @@ struct ffa_value ffa_memory_reclaim(struct vm_locked to_locked,
 		goto out;
 	}
 
+	/*
+	 * A receiver's retrieve left interrupted must have been aborted with
+	 * `ffa_memory_retrieve_abort` first.
+	 */
+	if (share_state_op_blocks(share_state, &share_state->op)) {
+		ret = ffa_error(FFA_DENIED);
+		goto out;
+	}
+
 	for (uint32_t i = 0; i < memory_region->receiver_count; i++) {
+		if (share_state_op_blocks(share_state,
+					  &share_state->receiver_ops[i])) {
+			ret = ffa_error(FFA_DENIED);
+			goto out;
+		}
+
 		if (share_state->retrieved_fragment_count[i] != 0) {
 			dlog_verbose(
 				"Tried to reclaim memory handle %#x that has "
@@ -2951,22 +4326,373 @@ struct ffa_value ffa_memory_reclaim(struct vm_locked to_locked,
 		}
 	}
 
-	ret = ffa_retrieve_check_update(
-		to_locked, memory_region->sender, share_state->fragments,
-		share_state->fragment_constituent_counts,
-		share_state->fragment_count, share_state->sender_orig_mode,
-		FFA_MEM_RECLAIM_32, flags & FFA_MEM_RECLAIM_CLEAR, page_pool);
+	/*
+	 * Nothing has access to the memory, so clearing it if requested can
+	 * be resumed if it doesn't finish in this call. It is not started over
+	 * if already pending, as it can't have been written since.
+	 */
+	if ((flags & FFA_MEM_RECLAIM_CLEAR) != 0 &&
+	    !share_state->clear_pending) {
+		share_state_clear_defer(
+			share_state,
+			plat_ffa_owner_world_mode(to_locked.vm->id));
+	}
 
+	ret = share_state_op_start(to_locked, share_state, &share_state->op,
+				   FFA_MEM_RECLAIM_32, NULL);
 	if (ret.func == FFA_SUCCESS_32) {
-		share_state_free(share_states, share_state, page_pool);
-		dlog_verbose("Freed share state after successful reclaim.\n");
+		ret = ffa_memory_reclaim_resume(to_locked, &share_state_locked,
+						page_pool);
 	}
 
 out:
-	share_states_unlock(&share_states);
+	share_state_unlock(&share_state_locked);
+	return ret;
+}
+
+/**
+ * Returns the ID of a receiver which started retrieving the memory with the
+ * given handle but was interrupted and hasn't resumed yet, or HF_INVALID_VM_ID
+ * if there is none.
+ */
+ffa_vm_id_t ffa_memory_interrupted_retriever(ffa_memory_handle_t handle,
+					     struct mpool *page_pool)
+{
+	struct share_state_locked share_state_locked = {.share_state = NULL};
+	struct ffa_memory_share_state *share_state;
+	ffa_vm_id_t ret = HF_INVALID_VM_ID;
+	uint32_t i;
+
+	if (!get_share_state(handle, &share_state_locked, page_pool)) {
+		return HF_INVALID_VM_ID;
+	}
+	share_state = share_state_locked.share_state;
+
+	for (i = 0; i < share_state->memory_region->receiver_count; ++i) {
+		if (share_state->receiver_ops[i].func ==
+		    FFA_MEM_RETRIEVE_REQ_32) {
+			ret = share_state->receiver_ops[i].vm_id;
+			break;
+		}
+	}
+
+	share_state_unlock(&share_state_locked);
+	return ret;
+}
+
+/**
+ * Aborts the retrieve of the memory with the given handle which the <from>
+ * receiver was interrupted in, on behalf of the <to> sender about to reclaim
+ * it, so that a receiver which never resumes can't keep it from being
+ * reclaimed. The part of the memory already mapped for the receiver is
+ * unmapped again, and it is left to fail resuming the call. Nothing is done if
+ * the retrieve was completed meanwhile.
+ *
+ * This function requires the calling context to hold the <to> and <from> locks.
+ *
+ * Returns:
+ *  In case of error, one of the following values is returned:
+ *   1) FFA_INVALID_PARAMETERS - The handle isn't valid or wasn't sent by <to>.
+ *   2) FFA_NO_MEMORY - Hafnium did not have sufficient memory to unmap the
+ *     memory from the receiver.
+ *  Success is indicated by FFA_SUCCESS.
+ */
+struct ffa_value ffa_memory_retrieve_abort(struct vm_locked to_locked,
+					   struct vm_locked from_locked,
+					   ffa_memory_handle_t handle,
+					   struct mpool *page_pool)
+{
+	struct share_state_locked share_state_locked = {.share_state = NULL};
+	struct ffa_memory_share_state *share_state;
+	struct ffa_memory_region_constituent *fragments[MAX_FRAGMENTS];
+	uint32_t fragment_constituent_counts[MAX_FRAGMENTS];
+	uint32_t fragment_count;
+	struct ffa_memory_op *op;
+	uint32_t receiver_index;
+	uint32_t i;
+	struct ffa_value ret = {.func = FFA_SUCCESS_32};
+
+	if (!get_share_state(handle, &share_state_locked, page_pool)) {
+		dlog_verbose("Invalid handle %#x for FFA_MEM_RECLAIM.\n",
+			     handle);
+		return ffa_error(FFA_INVALID_PARAMETERS);
+	}
+	share_state = share_state_locked.share_state;
+
+	if (to_locked.vm->id != share_state->memory_region->sender) {
+		dlog_verbose(
+			"VM %#x attempted to reclaim memory handle %#x "
+			"originally sent by VM %#x.\n",
+			to_locked.vm->id, handle,
+			share_state->memory_region->sender);
+		ret = ffa_error(FFA_INVALID_PARAMETERS);
+		goto out;
+	}
+
+	receiver_index = ffa_memory_region_get_receiver(
+		share_state->memory_region, from_locked.vm->id);
+	if (receiver_index == share_state->memory_region->receiver_count) {
+		goto out;
+	}
+
+	op = &share_state->receiver_ops[receiver_index];
+	if (op->func != FFA_MEM_RETRIEVE_REQ_32) {
+		goto out;
+	}
+
+	if (share_state->lazy_mode[receiver_index] != 0) {
+		/* Nothing is mapped until the retrieve completes. */
+		share_state->lazy_mode[receiver_index] = 0;
+		vm_lazy_retrieval_remove(from_locked, handle);
+	} else {
+		/*
+		 * Unmap the constituents mapped so far: the whole of the
+		 * sorted fragments before the one to be updated next, and the
+		 * start of that one.
+		 */
+		for (i = 0; i < op->fragment; ++i) {
+			fragments[i] = share_state->sorted_fragments[i];
+			fragment_constituent_counts[i] =
+				share_state->sorted_constituent_counts[i];
+		}
+		fragment_count = op->fragment;
+		if (op->constituent > 0) {
+			fragments[fragment_count] =
+				share_state->sorted_fragments[op->fragment];
+			fragment_constituent_counts[fragment_count] =
+				op->constituent;
+			fragment_count++;
+		}
+
+		if (fragment_count > 0 &&
+		    !ffa_region_group_update(
+			    from_locked, fragments, fragment_constituent_counts,
+			    fragment_count, MM_MODE_UNMAPPED_MASK, page_pool)) {
+			dlog_verbose(
+				"Insufficient memory to unmap memory with "
+				"handle %#x from VM %#x.\n",
+				handle, from_locked.vm->id);
+			ret = ffa_error(FFA_NO_MEMORY);
+			goto out;
+		}
+	}
+
+	dlog_verbose("Aborted retrieve of memory with handle %#x by VM %#x.\n",
+		     handle, from_locked.vm->id);
+	op->func = 0;
+
+out:
+	share_state_unlock(&share_state_locked);
+	return ret;
+}
+
+/**
+ * Resumes the call on the memory with the given handle which was interrupted
+ * before completing, on behalf of the VM which made it, and returns what the
+ * call itself returns once it completes.
+ *
+ * This function requires the calling context to hold the lock of the VM.
+ */
+struct ffa_value ffa_memory_op_resume(struct vm_locked vm_locked,
+				      ffa_memory_handle_t handle,
+				      struct mpool *page_pool)
+{
+	struct share_state_locked share_state_locked = {.share_state = NULL};
+	struct ffa_memory_share_state *share_state;
+	struct ffa_memory_op *op = NULL;
+	uint32_t receiver_index;
+	struct ffa_value ret;
+
+	if (!get_share_state(handle, &share_state_locked, page_pool)) {
+		dlog_verbose("Invalid handle %#x for FFA_MEM_OP_RESUME.\n",
+			     handle);
+		ret = ffa_error(FFA_INVALID_PARAMETERS);
+		goto out;
+	}
+	share_state = share_state_locked.share_state;
+
+	receiver_index = ffa_memory_region_get_receiver(
+		share_state->memory_region, vm_locked.vm->id);
+	if (vm_locked.vm->id == share_state->memory_region->sender) {
+		op = &share_state->op;
+	} else if (receiver_index <
+		   share_state->memory_region->receiver_count) {
+		op = &share_state->receiver_ops[receiver_index];
+	}
+
+	if (op == NULL || op->func == 0) {
+		dlog_verbose(
+			"VM %#x has no call on memory with handle %#x to "
+			"resume.\n",
+			vm_locked.vm->id, handle);
+		ret = ffa_error(FFA_INVALID_PARAMETERS);
+		goto out;
+	}
+
+	assert(op->vm_id == vm_locked.vm->id);
+
+	switch (op->func) {
+	case FFA_MEM_DONATE_32:
+	case FFA_MEM_LEND_32:
+	case FFA_MEM_SHARE_32:
+		ret = ffa_memory_send_resume(vm_locked, &share_state_locked,
+					     page_pool);
+		break;
+	case FFA_MEM_RETRIEVE_REQ_32:
+		ret = ffa_memory_retrieve_resume(vm_locked, &share_state_locked,
+						 receiver_index, page_pool);
+		break;
+	case FFA_MEM_RELINQUISH_32:
+		ret = ffa_memory_relinquish_resume(vm_locked,
+						   &share_state_locked,
+						   receiver_index, page_pool);
+		break;
+	case FFA_MEM_RECLAIM_32:
+		ret = ffa_memory_reclaim_resume(vm_locked, &share_state_locked,
+						page_pool);
+		break;
+	default:
+		panic("Invalid memory sharing call %#x.", op->func);
+	}
+
+out:
+	share_state_unlock(&share_state_locked);
+	dump_share_states(page_pool);
 	return ret;
 }
 
+/**
+ * Maps the block of memory containing the given address in the page table of
+ * the given VM, if it is memory of the given share state which the VM retrieved
+ * to be mapped on demand with a mode allowing the access.
+ *
+ * Returns true if the memory was mapped.
+ */
+static bool share_state_lazy_map(struct vm_locked vm_locked,
+				 struct ffa_memory_share_state *share_state,
+				 ipaddr_t ipa, uint32_t access_mode,
+				 struct mpool *page_pool)
+{
+	struct ffa_memory_region_constituent *constituent = NULL;
+	uint32_t receiver_index;
+	uint32_t mode;
+	uint32_t count = 0;
+	uint32_t low = 0;
+	uint32_t high;
+	uint64_t begin;
+	uint64_t end;
+	uint64_t constituent_end;
+	uint32_t i;
+
+	receiver_index = ffa_memory_region_get_receiver(
+		share_state->memory_region, vm_locked.vm->id);
+	if (receiver_index == share_state->memory_region->receiver_count) {
+		return false;
+	}
+
+	mode = share_state->lazy_mode[receiver_index];
+	if (mode == 0 || (mode & access_mode) != access_mode) {
+		return false;
+	}
+
+	/*
+	 * The memory may still be being cleared for the receiver, or being
+	 * unmapped as it relinquishes it.
+	 */
+	if (share_state->receiver_ops[receiver_index].func != 0) {
+		return false;
+	}
+
+	for (i = 0; i < share_state->sorted_fragment_count; ++i) {
+		count += share_state->sorted_constituent_counts[i];
+	}
+
+	/*
+	 * The constituents were sorted by address when sending completed, so
+	 * the one containing the address can be found by bisection.
+	 */
+	high = count;
+	while (low < high) {
+		uint32_t middle = low + (high - low) / 2;
+		struct ffa_memory_region_constituent *c =
+			share_state_sorted_constituent(share_state, middle);
+
+		if (ipa_addr(ipa) < c->address) {
+			high = middle;
+		} else if (ipa_addr(ipa) >=
+			   c->address + (uint64_t)c->page_count * PAGE_SIZE) {
+			low = middle + 1;
+		} else {
+			constituent = c;
+			break;
+		}
+	}
+
+	if (constituent == NULL) {
+		return false;
+	}
+
+	/*
+	 * Map the whole block around the address, as far as the constituent
+	 * goes, so that later accesses nearby don't fault and the page table
+	 * can use a block entry.
+	 */
+	begin = ipa_addr(ipa) & ~((uint64_t)LAZY_MAP_BLOCK_SIZE - 1);
+	end = begin + LAZY_MAP_BLOCK_SIZE;
+	constituent_end = constituent->address +
+			  (uint64_t)constituent->page_count * PAGE_SIZE;
+	if (begin < constituent->address) {
+		begin = constituent->address;
+	}
+	if (end > constituent_end) {
+		end = constituent_end;
+	}
+
+	if (!vm_identity_map(vm_locked, pa_init(begin), pa_init(end), mode,
+			     page_pool, NULL)) {
+		dlog_verbose("Insufficient memory to map %#x on demand.\n",
+			     begin);
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Handles a stage-2 fault of the given VM at the given address for an access
+ * of the given mode, by mapping the memory if the VM retrieved it to be mapped
+ * on demand.
+ *
+ * Returns true if the memory was mapped, so the access can be retried.
+ */
+bool ffa_memory_lazy_fault(struct vm_locked vm_locked, ipaddr_t ipa,
+			   uint32_t access_mode, struct mpool *page_pool)
+{
+	struct vm *vm = vm_locked.vm;
+	uint16_t i;
+
+	for (i = 0; i < vm->lazy_retrieval_count; ++i) {
+		struct share_state_locked share_state_locked;
+		bool mapped;
+
+		if (!get_share_state(vm->lazy_retrievals[i],
+				     &share_state_locked, page_pool)) {
+			continue;
+		}
+
+		mapped = share_state_lazy_map(vm_locked,
+					      share_state_locked.share_state,
+					      ipa, access_mode, page_pool);
+		share_state_unlock(&share_state_locked);
+
+		if (mapped) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
 /**
  * Validates that the reclaim transition is allowed for the memory region with
  * the given handle which was previously shared with the TEE, tells the TEE to
@@ -0,0 +1,706 @@
+/*
+ * Copyright 2023 The Hafnium Authors.
+ *
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/BSD-3-Clause.
+ */
+
+#include <gmock/gmock.h>
+
+extern "C" {
+#include "hf/ffa_memory.h"
+#include "hf/mm.h"
+#include "hf/mpool.h"
+#include "hf/vm.h"
+}
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace
+{
+using struct_vm = struct vm;
+
+constexpr size_t TEST_HEAP_SIZE = PAGE_SIZE * 512;
+constexpr size_t RX_BUFFER_SIZE = HF_MAILBOX_SIZE * 16;
+constexpr uint64_t MEMORY_BASE = 0x4000'0000;
+
+/* Enough constituents for calls on them to be interrupted twice. */
+constexpr uint32_t CONSTITUENT_COUNT = MAX_MEM_OP_CONSTITUENTS * 2 + 1;
+
+/* The number of threads, and calls each makes, in the concurrency tests. */
+constexpr uint32_t THREAD_COUNT = 4;
+constexpr uint32_t ITERATIONS = 100;
+
+class ffa_memory : public ::testing::Test
+{
+       protected:
+	static void SetUpTestSuite()
+	{
+		test_heap = std::make_unique<uint8_t[]>(TEST_HEAP_SIZE);
+		mpool_enable_locks();
+		mpool_init(&ppool, sizeof(struct mm_page_table));
+		mpool_add_chunk(&ppool, test_heap.get(), TEST_HEAP_SIZE);
+		ffa_memory_init();
+
+		sender = init_vm(0);
+		receiver = init_vm(1);
+		for (uint32_t i = 0; i < THREAD_COUNT; ++i) {
+			receivers[i] = init_vm(2 + i);
+		}
+	}
+
+	/**
+	 * Initialises the VM with the given index counting down from the last
+	 * one, without counting it among those initialised by vm_init_next(),
+	 * which the tests of other modules rely on.
+	 */
+	static struct_vm *init_vm(uint16_t index)
+	{
+		struct_vm *vm = vm_init(HF_VM_ID_OFFSET + MAX_VMS - 1 - index,
+					1, &ppool, false);
+
+		EXPECT_NE(vm, nullptr);
+		return vm;
+	}
+
+	void SetUp() override
+	{
+		rx_buffer = std::make_unique<uint8_t[]>(RX_BUFFER_SIZE);
+		receiver->mailbox.recv = rx_buffer.get();
+		receiver->mailbox.size = RX_BUFFER_SIZE;
+		receiver->mailbox.state = MAILBOX_STATE_EMPTY;
+	}
+
+	/**
+	 * Gives the sender the memory of the given constituents, which must
+	 * each be a single page.
+	 */
+	void map_for_sender(
+		const std::vector<struct ffa_memory_region_constituent>
+			&constituents)
+	{
+		struct vm_locked sender_locked = vm_lock(sender);
+
+		for (const auto &constituent : constituents) {
+			paddr_t begin = pa_init(constituent.address);
+
+			ASSERT_TRUE(vm_identity_map(
+				sender_locked, begin, pa_add(begin, PAGE_SIZE),
+				MM_MODE_R | MM_MODE_W | MM_MODE_X, &ppool,
+				NULL));
+		}
+		vm_unlock(&sender_locked);
+	}
+
+	/**
+	 * Returns whether the given VM has the page at the given address
+	 * mapped.
+	 */
+	static bool is_mapped(struct_vm *vm, uint64_t address)
+	{
+		struct vm_locked vm_locked = vm_lock(vm);
+		uint32_t mode;
+		bool ret = vm_mem_get_mode(vm_locked, ipa_init(address),
+					   ipa_init(address + PAGE_SIZE),
+					   &mode) &&
+			   (mode & MM_MODE_INVALID) == 0;
+
+		vm_unlock(&vm_locked);
+		return ret;
+	}
+
+	/**
+	 * Returns the memory access descriptors giving the given VMs read and
+	 * write access.
+	 */
+	static std::vector<struct ffa_memory_access> accesses(
+		const std::vector<struct_vm *> &vms)
+	{
+		std::vector<struct ffa_memory_access> ret(vms.size());
+
+		for (size_t i = 0; i < vms.size(); ++i) {
+			ffa_memory_access_init_permissions(
+				&ret[i], vms[i]->id, FFA_DATA_ACCESS_RW,
+				FFA_INSTRUCTION_ACCESS_NOT_SPECIFIED, 0);
+		}
+
+		return ret;
+	}
+
+	/**
+	 * Lends the memory of the given constituents from the sender to the
+	 * given receiver, splitting the descriptor into fragments as the API
+	 * does. Returns what the last call returned.
+	 */
+	static struct ffa_value lend(
+		const std::vector<struct ffa_memory_region_constituent>
+			&constituents,
+		struct_vm *to = receiver)
+	{
+		return lend(constituents, std::vector<struct_vm *>{to});
+	}
+
+	/**
+	 * Lends the memory of the given constituents from the sender to all of
+	 * the given receivers.
+	 */
+	static struct ffa_value lend(
+		const std::vector<struct ffa_memory_region_constituent>
+			&constituents,
+		const std::vector<struct_vm *> &to)
+	{
+		std::vector<struct ffa_memory_access> receivers_access =
+			accesses(to);
+		std::vector<uint8_t> descriptor(
+			sizeof(struct ffa_memory_region) +
+			to.size() * sizeof(struct ffa_memory_access) +
+			sizeof(struct ffa_composite_memory_region) +
+			constituents.size() *
+				sizeof(struct ffa_memory_region_constituent));
+		struct vm_locked sender_locked;
+		void *fragment;
+		uint32_t total_length;
+		uint32_t length;
+		uint32_t offset;
+		struct ffa_value ret;
+
+		/*
+		 * The memory type is only specified when lending to several
+		 * receivers.
+		 */
+		ffa_memory_region_init(
+			(struct ffa_memory_region *)descriptor.data(),
+			descriptor.size(), sender->id, receivers_access.data(),
+			receivers_access.size(), constituents.data(),
+			constituents.size(), 0, 0,
+			to.size() > 1 ? FFA_MEMORY_NORMAL_MEM
+				      : FFA_MEMORY_NOT_SPECIFIED_MEM,
+			FFA_MEMORY_CACHE_WRITE_BACK,
+			FFA_MEMORY_INNER_SHAREABLE, &total_length, &length);
+
+		sender_locked = vm_lock(sender);
+		length = sizeof(struct ffa_memory_region) +
+			 to.size() * sizeof(struct ffa_memory_access) +
+			 sizeof(struct ffa_composite_memory_region);
+		length += (MM_PPOOL_ENTRY_SIZE - length) /
+			  sizeof(struct ffa_memory_region_constituent) *
+			  sizeof(struct ffa_memory_region_constituent);
+		length = std::min(length, total_length);
+		fragment = mpool_alloc(&ppool);
+		memcpy(fragment, descriptor.data(), length);
+		ret = ffa_memory_send(sender_locked,
+				      (struct ffa_memory_region *)fragment,
+				      total_length, length, FFA_MEM_LEND_32,
+				      &ppool);
+
+		for (offset = length;
+		     ret.func == FFA_MEM_FRAG_RX_32 && offset < total_length;
+		     offset += length) {
+			length = std::min<uint32_t>(total_length - offset,
+						    MM_PPOOL_ENTRY_SIZE);
+			fragment = mpool_alloc(&ppool);
+			memcpy(fragment, &descriptor[offset], length);
+			ret = ffa_memory_send_continue(sender_locked, fragment,
+						       length,
+						       ffa_frag_handle(ret),
+						       &ppool);
+		}
+		vm_unlock(&sender_locked);
+
+		return ret;
+	}
+
+	/**
+	 * Retrieves the memory with the given handle for the given receiver,
+	 * listing all of the receivers it was lent to.
+	 */
+	static struct ffa_value retrieve(ffa_memory_handle_t handle,
+					 struct_vm *to = receiver)
+	{
+		return retrieve(handle, to, std::vector<struct_vm *>{to});
+	}
+
+	static struct ffa_value retrieve(ffa_memory_handle_t handle,
+					 struct_vm *to,
+					 const std::vector<struct_vm *> &all)
+	{
+		std::vector<struct ffa_memory_access> receivers_access =
+			accesses(all);
+		uint32_t length =
+			sizeof(struct ffa_memory_region) +
+			all.size() * sizeof(struct ffa_memory_access);
+		std::vector<uint8_t> request(length);
+		struct vm_locked vm_locked;
+		struct ffa_value ret;
+
+		ffa_memory_retrieve_request_init(
+			(struct ffa_memory_region *)request.data(), handle,
+			sender->id, receivers_access.data(),
+			receivers_access.size(), 0, 0, FFA_MEMORY_NORMAL_MEM,
+			FFA_MEMORY_CACHE_WRITE_BACK,
+			FFA_MEMORY_INNER_SHAREABLE);
+		vm_locked = vm_lock(to);
+		ret = ffa_memory_retrieve(
+			vm_locked, (struct ffa_memory_region *)request.data(),
+			length, &ppool);
+		vm_unlock(&vm_locked);
+
+		return ret;
+	}
+
+	/**
+	 * Relinquishes the memory with the given handle for the given receiver.
+	 */
+	static struct ffa_value relinquish(ffa_memory_handle_t handle,
+					   struct_vm *to = receiver)
+	{
+		std::vector<uint8_t> request(sizeof(struct ffa_mem_relinquish) +
+					     sizeof(ffa_vm_id_t));
+		auto *relinquish_request =
+			(struct ffa_mem_relinquish *)request.data();
+		struct vm_locked vm_locked;
+		struct ffa_value ret;
+
+		relinquish_request->handle = handle;
+		relinquish_request->flags = 0;
+		relinquish_request->endpoint_count = 1;
+		relinquish_request->endpoints[0] = to->id;
+		vm_locked = vm_lock(to);
+		ret = ffa_memory_relinquish(vm_locked, relinquish_request,
+					    &ppool);
+		vm_unlock(&vm_locked);
+
+		return ret;
+	}
+
+	/**
+	 * Releases the RX buffer of the given VM, as FFA_RX_RELEASE does once
+	 * it has read a retrieve response.
+	 */
+	static void release_rx(struct_vm *vm)
+	{
+		struct vm_locked vm_locked = vm_lock(vm);
+
+		vm->mailbox.state = MAILBOX_STATE_EMPTY;
+		vm_unlock(&vm_locked);
+	}
+
+	/**
+	 * Reclaims the memory with the given handle for the sender.
+	 */
+	static struct ffa_value reclaim(ffa_memory_handle_t handle)
+	{
+		struct vm_locked vm_locked = vm_lock(sender);
+		struct ffa_value ret;
+
+		ret = ffa_memory_reclaim(vm_locked, handle, 0, &ppool);
+		vm_unlock(&vm_locked);
+
+		return ret;
+	}
+
+	/**
+	 * Resumes the call on the memory with the given handle made by the
+	 * given VM until it completes, and returns what it returned then.
+	 * `interrupts` is set to the number of times it was interrupted again.
+	 */
+	static struct ffa_value resume(struct_vm *vm,
+				       ffa_memory_handle_t handle,
+				       uint32_t *interrupts)
+	{
+		struct ffa_value ret;
+
+		*interrupts = 0;
+		for (;;) {
+			struct vm_locked vm_locked = vm_lock(vm);
+
+			ret = ffa_memory_op_resume(vm_locked, handle, &ppool);
+			vm_unlock(&vm_locked);
+
+			if (ret.func != FFA_ERROR_32 ||
+			    ffa_error_code(ret) != FFA_INTERRUPTED) {
+				return ret;
+			}
+			++*interrupts;
+		}
+	}
+
+	static std::unique_ptr<uint8_t[]> test_heap;
+	static struct mpool ppool;
+	static struct_vm *sender;
+	static struct_vm *receiver;
+	static struct_vm *receivers[THREAD_COUNT];
+
+	std::unique_ptr<uint8_t[]> rx_buffer;
+};
+
+std::unique_ptr<uint8_t[]> ffa_memory::test_heap;
+struct mpool ffa_memory::ppool;
+struct_vm *ffa_memory::sender;
+struct_vm *ffa_memory::receiver;
+struct_vm *ffa_memory::receivers[THREAD_COUNT];
+
+/**
+ * Returns the handle of the memory which a call was interrupted on.
+ */
+ffa_memory_handle_t interrupted_handle(struct ffa_value ret)
+{
+	return (uint64_t)ret.arg3 | ((uint64_t)ret.arg4 << 32);
+}
+
+/**
+ * Returns `count` single page constituents, spaced out so that they can't be
+ * merged, starting at the given address.
+ */
+std::vector<struct ffa_memory_region_constituent> make_constituents(
+	uint64_t base, uint32_t count)
+{
+	std::vector<struct ffa_memory_region_constituent> constituents(count);
+
+	for (uint32_t i = 0; i < count; ++i) {
+		constituents[i].address = base + 2 * i * PAGE_SIZE;
+		constituents[i].page_count = 1;
+		constituents[i].reserved = 0;
+	}
+
+	return constituents;
+}
+
+/**
+ * Calls mapping or unmapping more constituents than are updated at a time are
+ * interrupted part way through, and resuming them completes them.
+ */
+TEST_F(ffa_memory, interrupted_calls_complete_when_resumed)
+{
+	std::vector<struct ffa_memory_region_constituent> constituents =
+		make_constituents(MEMORY_BASE, CONSTITUENT_COUNT);
+	uint64_t first = constituents.front().address;
+	uint64_t last = constituents.back().address;
+	struct vm_locked vm_locked;
+	ffa_memory_handle_t handle;
+	uint32_t interrupts;
+	struct ffa_value ret;
+
+	map_for_sender(constituents);
+
+	/* Lending stops after unmapping the first chunk from the sender. */
+	ret = lend(constituents);
+	EXPECT_EQ(ret.func, FFA_ERROR_32);
+	EXPECT_EQ(ffa_error_code(ret), FFA_INTERRUPTED);
+	handle = interrupted_handle(ret);
+	EXPECT_FALSE(is_mapped(sender, first));
+	EXPECT_TRUE(is_mapped(sender, last));
+
+	/* Only the VM which made the call can resume it. */
+	vm_locked = vm_lock(receiver);
+	ret = ffa_memory_op_resume(vm_locked, handle, &ppool);
+	vm_unlock(&vm_locked);
+	EXPECT_EQ(ffa_error_code(ret), FFA_INVALID_PARAMETERS);
+
+	ret = resume(sender, handle, &interrupts);
+	EXPECT_EQ(ret.func, FFA_SUCCESS_32);
+	EXPECT_EQ(ffa_mem_success_handle(ret), handle);
+	EXPECT_EQ(interrupts, 1);
+	EXPECT_FALSE(is_mapped(sender, last));
+
+	/* Retrieving maps the memory a chunk at a time in the same way. */
+	ret = retrieve(handle);
+	EXPECT_EQ(ffa_error_code(ret), FFA_INTERRUPTED);
+	EXPECT_EQ(interrupted_handle(ret), handle);
+	EXPECT_TRUE(is_mapped(receiver, first));
+	EXPECT_FALSE(is_mapped(receiver, last));
+	EXPECT_EQ(receiver->mailbox.state, MAILBOX_STATE_EMPTY);
+
+	/* Nothing else can map or unmap the memory meanwhile. */
+	ret = reclaim(handle);
+	EXPECT_EQ(ffa_error_code(ret), FFA_DENIED);
+
+	ret = resume(receiver, handle, &interrupts);
+	EXPECT_EQ(ret.func, FFA_MEM_RETRIEVE_RESP_32);
+	EXPECT_EQ(interrupts, 1);
+	EXPECT_TRUE(is_mapped(receiver, last));
+	EXPECT_EQ(receiver->mailbox.state, MAILBOX_STATE_READ);
+	EXPECT_EQ(receiver->mailbox.recv_size, ret.arg2);
+	EXPECT_EQ(ret.arg1, ret.arg2);
+
+	/* Relinquishing unmaps it again. */
+	ret = relinquish(handle);
+	EXPECT_EQ(ffa_error_code(ret), FFA_INTERRUPTED);
+	EXPECT_FALSE(is_mapped(receiver, first));
+	EXPECT_TRUE(is_mapped(receiver, last));
+
+	ret = resume(receiver, handle, &interrupts);
+	EXPECT_EQ(ret.func, FFA_SUCCESS_32);
+	EXPECT_EQ(interrupts, 1);
+	EXPECT_FALSE(is_mapped(receiver, last));
+
+	/* Reclaiming gives it back to the sender and frees the handle. */
+	ret = reclaim(handle);
+	EXPECT_EQ(ffa_error_code(ret), FFA_INTERRUPTED);
+	EXPECT_TRUE(is_mapped(sender, first));
+	EXPECT_FALSE(is_mapped(sender, last));
+
+	ret = resume(sender, handle, &interrupts);
+	EXPECT_EQ(ret.func, FFA_SUCCESS_32);
+	EXPECT_EQ(interrupts, 1);
+	EXPECT_TRUE(is_mapped(sender, last));
+
+	vm_locked = vm_lock(sender);
+	ret = ffa_memory_op_resume(vm_locked, handle, &ppool);
+	vm_unlock(&vm_locked);
+	EXPECT_EQ(ffa_error_code(ret), FFA_INVALID_PARAMETERS);
+}
+
+/**
+ * A receiver which is interrupted retrieving memory and never resumes only
+ * holds up its own calls: another receiver can still retrieve and relinquish
+ * the memory, and the sender can abort the retrieve to reclaim it.
+ */
+TEST_F(ffa_memory, borrower_never_resumes)
+{
+	std::vector<struct ffa_memory_region_constituent> constituents =
+		make_constituents(MEMORY_BASE, CONSTITUENT_COUNT);
+	uint64_t first = constituents.front().address;
+	uint64_t last = constituents.back().address;
+	struct_vm *other = receivers[0];
+	std::vector<struct_vm *> borrowers = {receiver, other};
+	std::vector<uint8_t> other_rx_buffer(RX_BUFFER_SIZE);
+	struct two_vm_locked vm_to_from_lock;
+	ffa_memory_handle_t handle;
+	uint32_t interrupts;
+	struct ffa_value ret;
+
+	map_for_sender(constituents);
+	release_rx(other);
+	other->mailbox.recv = other_rx_buffer.data();
+	other->mailbox.size = other_rx_buffer.size();
+
+	ret = lend(constituents, borrowers);
+	EXPECT_EQ(ffa_error_code(ret), FFA_INTERRUPTED);
+	handle = interrupted_handle(ret);
+	ret = resume(sender, handle, &interrupts);
+	EXPECT_EQ(ret.func, FFA_SUCCESS_32);
+
+	/* The receiver stops part way through and never resumes. */
+	ret = retrieve(handle, receiver, borrowers);
+	EXPECT_EQ(ffa_error_code(ret), FFA_INTERRUPTED);
+	EXPECT_TRUE(is_mapped(receiver, first));
+	EXPECT_FALSE(is_mapped(receiver, last));
+
+	/* The other receiver's calls go ahead. */
+	ret = retrieve(handle, other, borrowers);
+	EXPECT_EQ(ffa_error_code(ret), FFA_INTERRUPTED);
+	ret = resume(other, handle, &interrupts);
+	EXPECT_EQ(ret.func, FFA_MEM_RETRIEVE_RESP_32);
+	EXPECT_TRUE(is_mapped(other, last));
+	release_rx(other);
+
+	ret = relinquish(handle, other);
+	EXPECT_EQ(ffa_error_code(ret), FFA_INTERRUPTED);
+	ret = resume(other, handle, &interrupts);
+	EXPECT_EQ(ret.func, FFA_SUCCESS_32);
+	EXPECT_FALSE(is_mapped(other, first));
+
+	/* Reclaiming is denied until the retrieve is aborted. */
+	ret = reclaim(handle);
+	EXPECT_EQ(ffa_error_code(ret), FFA_DENIED);
+	EXPECT_EQ(ffa_memory_interrupted_retriever(handle, &ppool),
+		  receiver->id);
+
+	vm_to_from_lock = vm_lock_both(sender, receiver);
+	ret = ffa_memory_retrieve_abort(vm_to_from_lock.vm1,
+					vm_to_from_lock.vm2, handle, &ppool);
+	vm_unlock(&vm_to_from_lock.vm1);
+	vm_unlock(&vm_to_from_lock.vm2);
+	EXPECT_EQ(ret.func, FFA_SUCCESS_32);
+	EXPECT_FALSE(is_mapped(receiver, first));
+	EXPECT_EQ(ffa_memory_interrupted_retriever(handle, &ppool),
+		  HF_INVALID_VM_ID);
+
+	/* The receiver has nothing left to resume. */
+	ret = resume(receiver, handle, &interrupts);
+	EXPECT_EQ(ffa_error_code(ret), FFA_INVALID_PARAMETERS);
+	EXPECT_EQ(receiver->mailbox.state, MAILBOX_STATE_EMPTY);
+
+	ret = reclaim(handle);
+	EXPECT_EQ(ffa_error_code(ret), FFA_INTERRUPTED);
+	ret = resume(sender, handle, &interrupts);
+	EXPECT_EQ(ret.func, FFA_SUCCESS_32);
+	EXPECT_TRUE(is_mapped(sender, first));
+	EXPECT_TRUE(is_mapped(sender, last));
+}
+
+/**
+ * Adjacent constituents are merged to update the page tables, but receivers
+ * retrieve the descriptor as it was sent.
+ */
+TEST_F(ffa_memory, retrieved_descriptor_is_as_sent)
+{
+	std::vector<struct ffa_memory_region_constituent> constituents(
+		CONSTITUENT_COUNT);
+	struct ffa_memory_region *response;
+	struct ffa_composite_memory_region *composite;
+	ffa_memory_handle_t handle;
+	struct ffa_value ret;
+
+	/* Adjacent pages, in reverse order. */
+	for (uint32_t i = 0; i < CONSTITUENT_COUNT; ++i) {
+		constituents[i].address =
+			MEMORY_BASE + (CONSTITUENT_COUNT - 1 - i) * PAGE_SIZE;
+		constituents[i].page_count = 1;
+		constituents[i].reserved = 0;
+	}
+	map_for_sender(constituents);
+
+	/* Being merged into one, they are updated without interruption. */
+	ret = lend(constituents);
+	EXPECT_EQ(ret.func, FFA_SUCCESS_32);
+	handle = ffa_mem_success_handle(ret);
+	EXPECT_FALSE(is_mapped(sender, MEMORY_BASE));
+
+	ret = retrieve(handle);
+	EXPECT_EQ(ret.func, FFA_MEM_RETRIEVE_RESP_32);
+	EXPECT_TRUE(is_mapped(receiver, MEMORY_BASE));
+	EXPECT_TRUE(is_mapped(receiver, constituents[0].address));
+
+	response = (struct ffa_memory_region *)rx_buffer.get();
+	composite = ffa_memory_region_get_composite(response, 0);
+	EXPECT_EQ(composite->constituent_count, CONSTITUENT_COUNT);
+	EXPECT_EQ(composite->page_count, CONSTITUENT_COUNT);
+	EXPECT_EQ(composite->constituents[0].address, constituents[0].address);
+	EXPECT_EQ(composite->constituents[0].page_count, 1);
+	EXPECT_EQ(composite->constituents[1].address, constituents[1].address);
+
+	EXPECT_EQ(relinquish(handle).func, FFA_SUCCESS_32);
+	EXPECT_FALSE(is_mapped(receiver, MEMORY_BASE));
+	EXPECT_EQ(reclaim(handle).func, FFA_SUCCESS_32);
+	EXPECT_TRUE(is_mapped(sender, MEMORY_BASE));
+	EXPECT_TRUE(is_mapped(sender, constituents[0].address));
+}
+
+/**
+ * Memory lent to different receivers can be retrieved, relinquished and
+ * reclaimed concurrently, each call only locking the share state of its own
+ * handle.
+ */
+TEST_F(ffa_memory, concurrent_calls_on_different_handles)
+{
+	std::vector<std::thread> threads;
+
+	for (uint32_t i = 0; i < THREAD_COUNT; ++i) {
+		threads.emplace_back([this, i] {
+			struct_vm *to = receivers[i];
+			std::vector<struct ffa_memory_region_constituent>
+				constituents = make_constituents(
+					MEMORY_BASE + 2 * i * PAGE_SIZE, 1);
+			uint64_t address = constituents[0].address;
+			std::vector<uint8_t> to_rx_buffer(HF_MAILBOX_SIZE);
+
+			map_for_sender(constituents);
+			release_rx(to);
+			to->mailbox.recv = to_rx_buffer.data();
+			to->mailbox.size = to_rx_buffer.size();
+
+			for (uint32_t j = 0; j < ITERATIONS; ++j) {
+				struct ffa_value ret = lend(constituents, to);
+				ffa_memory_handle_t handle;
+
+				ASSERT_EQ(ret.func, FFA_SUCCESS_32);
+				handle = ffa_mem_success_handle(ret);
+				EXPECT_FALSE(is_mapped(sender, address));
+
+				ret = retrieve(handle, to);
+				ASSERT_EQ(ret.func, FFA_MEM_RETRIEVE_RESP_32);
+				EXPECT_TRUE(is_mapped(to, address));
+				release_rx(to);
+
+				ret = relinquish(handle, to);
+				ASSERT_EQ(ret.func, FFA_SUCCESS_32);
+				EXPECT_FALSE(is_mapped(to, address));
+
+				ret = reclaim(handle);
+				ASSERT_EQ(ret.func, FFA_SUCCESS_32);
+				EXPECT_TRUE(is_mapped(sender, address));
+			}
+		});
+	}
+
+	for (auto &thread : threads) {
+		thread.join();
+	}
+}
+
+/**
+ * Memory being retrieved and relinquished over and over can only be reclaimed
+ * concurrently while the receiver doesn't have it, after which the receiver
+ * can't retrieve it any more.
+ */
+TEST_F(ffa_memory, concurrent_calls_on_same_handle)
+{
+	std::vector<struct ffa_memory_region_constituent> constituents =
+		make_constituents(MEMORY_BASE, 1);
+	uint64_t address = constituents[0].address;
+	std::atomic<uint32_t> retrieved(0);
+	std::atomic<bool> reclaimed(false);
+	ffa_memory_handle_t handle;
+	struct ffa_value ret;
+
+	map_for_sender(constituents);
+	ret = lend(constituents);
+	ASSERT_EQ(ret.func, FFA_SUCCESS_32);
+	handle = ffa_mem_success_handle(ret);
+
+	std::thread receiver_thread([&] {
+		for (;;) {
+			struct ffa_value ret = retrieve(handle);
+
+			if (ret.func != FFA_MEM_RETRIEVE_RESP_32) {
+				/* The handle is freed once reclaimed. */
+				EXPECT_EQ(ffa_error_code(ret),
+					  FFA_INVALID_PARAMETERS);
+				return;
+			}
+
+			/* It can't be reclaimed until relinquished. */
+			EXPECT_FALSE(reclaimed);
+			EXPECT_TRUE(is_mapped(receiver, address));
+			release_rx(receiver);
+
+			ret = relinquish(handle);
+			ASSERT_EQ(ret.func, FFA_SUCCESS_32);
+			retrieved++;
+		}
+	});
+
+	std::thread sender_thread([&] {
+		/* Let the receiver get going first. */
+		while (retrieved < ITERATIONS) {
+		}
+
+		for (;;) {
+			struct ffa_value ret = reclaim(handle);
+
+			if (ret.func == FFA_SUCCESS_32) {
+				reclaimed = true;
+				return;
+			}
+			EXPECT_EQ(ffa_error_code(ret), FFA_DENIED);
+		}
+	});
+
+	receiver_thread.join();
+	sender_thread.join();
+
+	EXPECT_TRUE(reclaimed);
+	EXPECT_GE(retrieved, ITERATIONS);
+	EXPECT_TRUE(is_mapped(sender, address));
+	EXPECT_FALSE(is_mapped(receiver, address));
+}
+
+} /* namespace */
@@ -21,6 +21,7 @@
 #include "hf/cpu.h"
 #include "hf/dlog.h"
 #include "hf/fdt_handler.h"
+#include "hf/ffa_memory.h"
 #include "hf/load.h"
 #include "hf/mm.h"
 #include "hf/mpool.h"
@@ -58,7 +59,7 @@ void one_time_init_mm(void)
 
 	plat_ffa_log_init();
 
-	mpool_init(&ppool, MM_PPOOL_ENTRY_SIZE);
+	mpool_init_buddy(&ppool, MM_PPOOL_ENTRY_SIZE);
 	mpool_add_chunk(&ppool, ptable_buf, sizeof(ptable_buf));
 
 	if (!mm_init(&ppool)) {
@@ -186,5 +187,8 @@ void one_time_init(void)
 	/* Initialise the API page pool. ppool will be empty from now on. */
 	api_init(&ppool);
 
+	/* Initialise the slabs for memory sharing descriptors. */
+	ffa_memory_init();
+
 	dlog_info("Hafnium initialisation completed\n");
 }
@@ -34,32 +34,33 @@
 #include "vmapi/hf/ffa.h"
 
 /**
- * Copies data to an unmapped location by mapping it for write, copying the
- * data, then unmapping it.
+ * Copies data to an unmapped location by sliding a window over it, rather than
+ * mapping all of it in the hypervisor page table.
  *
  * The data is written so that it is available to all cores with the cache
  * disabled. When switching to the partitions, the caching is initially disabled
  * so the data must be available without the cache.
  */
-static bool copy_to_unmapped(struct mm_stage1_locked stage1_locked, paddr_t to,
-			     struct memiter *from_it, struct mpool *ppool)
+static void copy_to_unmapped(paddr_t to, struct memiter *from_it)
 {
-	const void *from = memiter_base(from_it);
+	const char *from = memiter_base(from_it);
 	size_t size = memiter_size(from_it);
-	paddr_t to_end = pa_add(to, size);
-	void *ptr;
+	struct mm_window *window = mm_window_acquire();
 
-	ptr = mm_identity_map(stage1_locked, to, to_end, MM_MODE_W, ppool);
-	if (!ptr) {
-		return false;
-	}
+	while (size > 0) {
+		size_t chunk;
+		void *ptr = mm_window_map(window, to, pa_add(to, size),
+					  MM_MODE_W, &chunk);
 
-	memcpy_s(ptr, size, from, size);
-	arch_mm_flush_dcache(ptr, size);
+		memcpy_s(ptr, chunk, from, chunk);
+		arch_mm_flush_dcache(ptr, chunk);
 
-	CHECK(mm_unmap(stage1_locked, to, to_end, ppool));
+		to = pa_add(to, chunk);
+		from += chunk;
+		size -= chunk;
+	}
 
-	return true;
+	mm_window_release(window);
 }
 
 /**
@@ -67,10 +68,9 @@ static bool copy_to_unmapped(struct mm_stage1_locked stage1_locked, paddr_t to,
  * Stores the kernel size in kernel_size (if kernel_size is not NULL).
  * Returns false if it cannot load the kernel.
  */
-static bool load_kernel(struct mm_stage1_locked stage1_locked, paddr_t begin,
-			paddr_t end, const struct manifest_vm *manifest_vm,
-			const struct memiter *cpio, struct mpool *ppool,
-			size_t *kernel_size)
+static bool load_kernel(paddr_t begin, paddr_t end,
+			const struct manifest_vm *manifest_vm,
+			const struct memiter *cpio, size_t *kernel_size)
 {
 	struct memiter kernel;
 	size_t size;
@@ -87,10 +87,7 @@ static bool load_kernel(struct mm_stage1_locked stage1_locked, paddr_t begin,
 		return false;
 	}
 
-	if (!copy_to_unmapped(stage1_locked, begin, &kernel, ppool)) {
-		dlog_error("Unable to copy kernel.\n");
-		return false;
-	}
+	copy_to_unmapped(begin, &kernel);
 
 	if (kernel_size) {
 		*kernel_size = size;
@@ -161,6 +158,9 @@ static bool load_common(struct mm_stage1_locked stage1_locked,
 
 	vm_locked.vm->smc_whitelist = manifest_vm->smc_whitelist;
 	vm_locked.vm->uuid = manifest_vm->partition.uuid;
+	vm_locked.vm->lazy_retrieve = manifest_vm->lazy_retrieve;
+	vm_locked.vm->mailbox.max_page_count = manifest_vm->rxtx_max_pages;
+	vm_locked.vm->mailbox.queue_slots = manifest_vm->msg_queue_slots;
 
 	/* Populate the interrupt descriptor for current VM. */
 	for (uint16_t i = 0; i < PARTITION_MAX_DEVICE_REGIONS; i++) {
@@ -291,8 +291,8 @@ static bool load_primary(struct mm_stage1_locked stage1_locked,
 	 * booting.
 	 */
 	if (!string_is_empty(&manifest_vm->kernel_filename)) {
-		if (!load_kernel(stage1_locked, primary_begin, primary_end,
-				 manifest_vm, cpio, ppool, NULL)) {
+		if (!load_kernel(primary_begin, primary_end, manifest_vm, cpio,
+				 NULL)) {
 			dlog_error("Unable to load primary kernel.\n");
 			return false;
 		}
@@ -399,11 +399,10 @@ out:
  * fdt_allocated_size is not NULL). The allocated size includes additional space
  * for potential patching.
  */
-static bool load_secondary_fdt(struct mm_stage1_locked stage1_locked,
-			       paddr_t end, size_t fdt_max_size,
+static bool load_secondary_fdt(paddr_t end, size_t fdt_max_size,
 			       const struct manifest_vm *manifest_vm,
-			       const struct memiter *cpio, struct mpool *ppool,
-			       paddr_t *fdt_addr, size_t *fdt_allocated_size)
+			       const struct memiter *cpio, paddr_t *fdt_addr,
+			       size_t *fdt_allocated_size)
 {
 	struct memiter fdt;
 	size_t allocated_size;
@@ -435,10 +434,7 @@ static bool load_secondary_fdt(struct mm_stage1_locked stage1_locked,
 	dlog_info("Loading secondary FDT of allocated size %u at 0x%x.\n",
 		  allocated_size, pa_addr(*fdt_addr));
 
-	if (!copy_to_unmapped(stage1_locked, *fdt_addr, &fdt, ppool)) {
-		dlog_error("Unable to copy FDT.\n");
-		return false;
-	}
+	copy_to_unmapped(*fdt_addr, &fdt);
 
 	if (fdt_allocated_size) {
 		*fdt_allocated_size = allocated_size;
@@ -677,8 +673,8 @@ static bool load_secondary(struct mm_stage1_locked stage1_locked,
 	 * booting.
 	 */
 	if (!string_is_empty(&manifest_vm->kernel_filename)) {
-		if (!load_kernel(stage1_locked, mem_begin, mem_end, manifest_vm,
-				 cpio, ppool, &kernel_size)) {
+		if (!load_kernel(mem_begin, mem_end, manifest_vm, cpio,
+				 &kernel_size)) {
 			dlog_error("Unable to load kernel.\n");
 			return false;
 		}
@@ -695,9 +691,8 @@ static bool load_secondary(struct mm_stage1_locked stage1_locked,
 
 		size_t fdt_allocated_size;
 
-		if (!load_secondary_fdt(stage1_locked, mem_end, fdt_max_size,
-					manifest_vm, cpio, ppool, &fdt_addr,
-					&fdt_allocated_size)) {
+		if (!load_secondary_fdt(mem_end, fdt_max_size, manifest_vm,
+					cpio, &fdt_addr, &fdt_allocated_size)) {
 			dlog_error("Unable to load FDT.\n");
 			return false;
 		}
@@ -359,6 +359,7 @@ static enum manifest_return_code parse_vm_common(const struct fdt_node *node,
 {
 	struct uint32list_iter smcs;
 	size_t idx;
+	enum manifest_return_code ret;
 
 	TRY(read_bool(node, "is_ffa_partition", &vm->is_ffa_partition));
 
@@ -380,6 +381,26 @@ static enum manifest_return_code parse_vm_common(const struct fdt_node *node,
 	TRY(read_bool(node, "smc_whitelist_permissive",
 		      &vm->smc_whitelist.permissive));
 
+	TRY(read_bool(node, "lazy_retrieve", &vm->lazy_retrieve));
+
+	TRY(read_optional_uint16(node, "rxtx_max_pages",
+				 HF_MAILBOX_SIZE / FFA_PAGE_SIZE,
+				 &vm->rxtx_max_pages));
+	if (vm->rxtx_max_pages > MAX_RXTX_PAGES) {
+		return MANIFEST_ERROR_RXTX_TOO_LARGE;
+	}
+
+	/* Messages aren't queued unless the property is given. */
+	ret = read_uint16(node, "msg_queue_slots", &vm->msg_queue_slots);
+	if (ret == MANIFEST_ERROR_PROPERTY_NOT_FOUND) {
+		vm->msg_queue_slots = 0;
+	} else if (ret != MANIFEST_SUCCESS) {
+		return ret;
+	} else if (vm->msg_queue_slots == 0 ||
+		   vm->msg_queue_slots > MANIFEST_MSG_QUEUE_SLOTS_MAX) {
+		return MANIFEST_ERROR_MSG_QUEUE_SLOTS;
+	}
+
 	if (vm_id != HF_PRIMARY_VM_ID) {
 		TRY(read_uint64(node, "mem_size", &vm->secondary.mem_size));
 		TRY(read_uint16(node, "vcpu_count", &vm->secondary.vcpu_count));
@@ -1174,6 +1195,11 @@ const char *manifest_strerror(enum manifest_return_code ret_code)
 		return "Device-region node should have at least one entry";
 	case MANIFEST_ERROR_RXTX_SIZE_MISMATCH:
 		return "RX and TX buffers should be of same size";
+	case MANIFEST_ERROR_RXTX_TOO_LARGE:
+		return "RX and TX buffers larger than the platform allows";
+	case MANIFEST_ERROR_MSG_QUEUE_SLOTS:
+		return "Message queue slots should be between 1 and the number "
+		       "the smallest RX buffer has room for";
 	case MANIFEST_ERROR_MEM_REGION_OVERLAP:
 		return "Memory region overlaps with one already allocated";
 	case MANIFEST_ERROR_INVALID_MEM_PERM:
@@ -207,6 +207,21 @@ class ManifestDtBuilder
 		return BooleanProperty("smc_whitelist_permissive");
 	}
 
+	ManifestDtBuilder &LazyRetrieve()
+	{
+		return BooleanProperty("lazy_retrieve");
+	}
+
+	ManifestDtBuilder &RxtxMaxPages(uint32_t value)
+	{
+		return IntegerProperty("rxtx_max_pages", value);
+	}
+
+	ManifestDtBuilder &MsgQueueSlots(uint32_t value)
+	{
+		return IntegerProperty("msg_queue_slots", value);
+	}
+
 	ManifestDtBuilder &LoadAddress(uint64_t value)
 	{
 		return Integer64Property("load_address", value);
@@ -556,6 +571,75 @@ TEST_F(manifest, vcpu_count_limit)
 		  MANIFEST_ERROR_INTEGER_OVERFLOW);
 }
 
+TEST_F(manifest, rxtx_max_pages_limit)
+{
+	struct_manifest m;
+
+	/* clang-format off */
+	std::vector<char> dtb = ManifestDtBuilder()
+		.StartChild("hypervisor")
+			.Compatible()
+			.StartChild("vm1")
+				.DebugName("primary_vm")
+				.RxtxMaxPages(MAX_RXTX_PAGES + 1)
+			.EndChild()
+		.EndChild()
+		.Build();
+	/* clang-format on */
+
+	ASSERT_EQ(manifest_from_vec(&m, dtb), MANIFEST_ERROR_RXTX_TOO_LARGE);
+}
+
+TEST_F(manifest, msg_queue_slots_zero)
+{
+	struct_manifest m;
+
+	/* clang-format off */
+	std::vector<char> dtb = ManifestDtBuilder()
+		.StartChild("hypervisor")
+			.Compatible()
+			.StartChild("vm1")
+				.DebugName("primary_vm")
+				.MsgQueueSlots(0)
+			.EndChild()
+		.EndChild()
+		.Build();
+	/* clang-format on */
+
+	ASSERT_EQ(manifest_from_vec(&m, dtb), MANIFEST_ERROR_MSG_QUEUE_SLOTS);
+}
+
+TEST_F(manifest, msg_queue_slots_limit)
+{
+	struct_manifest m;
+	struct_manifest m2;
+
+	/* clang-format off */
+	std::vector<char> dtb = ManifestDtBuilder()
+		.StartChild("hypervisor")
+			.Compatible()
+			.StartChild("vm1")
+				.DebugName("primary_vm")
+				.MsgQueueSlots(MANIFEST_MSG_QUEUE_SLOTS_MAX + 1)
+			.EndChild()
+		.EndChild()
+		.Build();
+	std::vector<char> dtb_max = ManifestDtBuilder()
+		.StartChild("hypervisor")
+			.Compatible()
+			.StartChild("vm1")
+				.DebugName("primary_vm")
+				.MsgQueueSlots(MANIFEST_MSG_QUEUE_SLOTS_MAX)
+			.EndChild()
+		.EndChild()
+		.Build();
+	/* clang-format on */
+
+	ASSERT_EQ(manifest_from_vec(&m, dtb), MANIFEST_ERROR_MSG_QUEUE_SLOTS);
+	ASSERT_EQ(manifest_from_vec(&m2, dtb_max), MANIFEST_SUCCESS);
+	ASSERT_EQ(m2.vm[0].msg_queue_slots, MANIFEST_MSG_QUEUE_SLOTS_MAX);
+}
+
 TEST_F(manifest, no_ramdisk_primary)
 {
 	struct_manifest m;
@@ -683,6 +767,9 @@ TEST_F(manifest, valid)
 				.MemSize(12345)
 				.SmcWhitelist({0x04000000, 0x30002222, 0x31445566})
 				.SmcWhitelistPermissive()
+				.LazyRetrieve()
+				.RxtxMaxPages(4)
+				.MsgQueueSlots(16)
 			.EndChild()
 		.EndChild()
 		.Build();
@@ -700,6 +787,9 @@ TEST_F(manifest, valid)
 		std::span(vm->smc_whitelist.smcs, vm->smc_whitelist.smc_count),
 		ElementsAre(0x32000000, 0x33001111));
 	ASSERT_FALSE(vm->smc_whitelist.permissive);
+	ASSERT_FALSE(vm->lazy_retrieve);
+	ASSERT_EQ(vm->rxtx_max_pages, 1);
+	ASSERT_EQ(vm->msg_queue_slots, 0);
 
 	vm = &m.vm[1];
 	ASSERT_STREQ(string_data(&vm->debug_name), "first_secondary_vm");
@@ -710,6 +800,9 @@ TEST_F(manifest, valid)
 		std::span(vm->smc_whitelist.smcs, vm->smc_whitelist.smc_count),
 		ElementsAre(0x04000000, 0x30002222, 0x31445566));
 	ASSERT_TRUE(vm->smc_whitelist.permissive);
+	ASSERT_TRUE(vm->lazy_retrieve);
+	ASSERT_EQ(vm->rxtx_max_pages, 4);
+	ASSERT_EQ(vm->msg_queue_slots, 16);
 
 	vm = &m.vm[2];
 	ASSERT_STREQ(string_data(&vm->debug_name), "second_secondary_vm");
@@ -721,6 +814,7 @@ TEST_F(manifest, valid)
 		std::span(vm->smc_whitelist.smcs, vm->smc_whitelist.smc_count),
 		IsEmpty());
 	ASSERT_FALSE(vm->smc_whitelist.permissive);
+	ASSERT_FALSE(vm->lazy_retrieve);
 }
 
 TEST_F(manifest, ffa_not_compatible)
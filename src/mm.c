@@ -19,6 +19,7 @@
 #include "hf/layout.h"
 #include "hf/plat/console.h"
 #include "hf/static_assert.h"
+#include "hf/std.h"
 
 /**
  * This file has functions for managing the level 1 and 2 page tables used by
@@ -43,6 +44,29 @@ static struct spinlock ptable_lock;
 
 static bool mm_stage2_invalidate = false;
 
+/**
+ * Windows through which the hypervisor accesses memory it doesn't map, enough
+ * for every CPU to hold one at a time.
+ */
+static struct mm_window mm_windows[MAX_CPUS];
+
+/**
+ * The pages of the address space the windows are at, aligned so that a window
+ * can map a group of pages sharing a TLB entry. Their backing memory is never
+ * accessed, the pages being unmapped when the windows aren't in use.
+ */
+alignas(MM_WINDOW_PAGES * PAGE_SIZE) static char
+	mm_window_pages[MAX_CPUS][MM_WINDOW_PAGES * PAGE_SIZE];
+static_assert(MAX_CPUS * MM_WINDOW_PAGES <= MM_PTE_PER_PAGE,
+	      "The pages of the windows must fit in at most two page tables.");
+
+/**
+ * The page tables on the paths to the entries of the first and the last window,
+ * by the level of their entries. Between them they lead to the entries of all
+ * the windows.
+ */
+static struct mm_page_table *mm_window_tables[2][MM_MAX_LEVELS];
+
 /**
  * After calling this function, modifications to stage-2 page tables will use
  * break-before-make and invalidate the TLB for the affected range.
@@ -172,6 +196,120 @@ static void mm_invalidate_tlb(ptable_addr_t begin, ptable_addr_t end, int flags,
 	}
 }
 
+/**
+ * Initialises an empty TLB gather.
+ */
+void mm_tlb_gather_init(struct mm_tlb_gather *tlb)
+{
+	tlb->count = 0;
+	tlb->flags = 0;
+	tlb->id = 0;
+	tlb->ptable = NULL;
+}
+
+/**
+ * Invalidates the TLB entries of the gathered address ranges, if any, and
+ * empties the gather.
+ */
+static void mm_tlb_gather_flush(struct mm_tlb_gather *tlb)
+{
+	uint8_t i;
+
+	for (i = 0; i < tlb->count; ++i) {
+		mm_invalidate_tlb(tlb->ranges[i].begin, tlb->ranges[i].end,
+				  tlb->flags, tlb->id);
+	}
+
+	tlb->count = 0;
+}
+
+/**
+ * Adds the given address range to the ranges whose TLB entries need to be
+ * invalidated, merging it with those it overlaps or is adjacent to. If that
+ * leaves too many disjoint ranges, the ranges gathered so far are invalidated
+ * first.
+ */
+void mm_tlb_gather_add(struct mm_tlb_gather *tlb, ptable_addr_t begin,
+		       ptable_addr_t end)
+{
+	uint8_t first = 0;
+	uint8_t last;
+	uint8_t i;
+
+	if (begin >= end) {
+		return;
+	}
+
+	/* Skip the ranges ending before the new one. */
+	while (first < tlb->count && tlb->ranges[first].end < begin) {
+		first++;
+	}
+
+	/* Merge the ranges overlapping or adjacent to the new one into it. */
+	last = first;
+	while (last < tlb->count && tlb->ranges[last].begin <= end) {
+		if (tlb->ranges[last].begin < begin) {
+			begin = tlb->ranges[last].begin;
+		}
+		if (tlb->ranges[last].end > end) {
+			end = tlb->ranges[last].end;
+		}
+		last++;
+	}
+
+	if (first == last && tlb->count == MM_TLB_GATHER_RANGES) {
+		mm_tlb_gather_flush(tlb);
+		first = 0;
+		last = 0;
+	}
+
+	/* Replace the merged ranges by the new one, keeping them sorted. */
+	if (first == last) {
+		for (i = tlb->count; i > first; --i) {
+			tlb->ranges[i] = tlb->ranges[i - 1];
+		}
+		tlb->count++;
+	} else {
+		for (i = last; i < tlb->count; ++i) {
+			tlb->ranges[first + 1 + i - last] = tlb->ranges[i];
+		}
+		tlb->count -= last - first - 1;
+	}
+
+	tlb->ranges[first].begin = begin;
+	tlb->ranges[first].end = end;
+}
+
+/**
+ * Makes the TLB gather collect the ranges of the given page table. The ranges
+ * gathered for a different page table are invalidated first as a gather only
+ * covers a single translation regime and ID.
+ */
+static void mm_tlb_gather_select(struct mm_tlb_gather *tlb,
+				 struct mm_ptable *t, int flags)
+{
+	flags &= MM_FLAG_STAGE1;
+
+	if (tlb->id != t->id || tlb->flags != flags) {
+		mm_tlb_gather_flush(tlb);
+		tlb->id = t->id;
+		tlb->flags = flags;
+	}
+
+	tlb->ptable = t;
+}
+
+/**
+ * Invalidates the TLB entries of all the ranges gathered so far and syncs the
+ * page table writes so that code following this can use them. This must be
+ * called once the updates a gather was passed to are complete.
+ */
+void mm_tlb_gather_finish(struct mm_tlb_gather *tlb)
+{
+	mm_tlb_gather_flush(tlb);
+	arch_mm_sync_table_writes();
+}
+
 /**
  * Frees all page-table-related memory associated with the given pte at the
  * given level, including any subtables recursively.
@@ -235,9 +373,54 @@ bool mm_ptable_init(struct mm_ptable *t, uint16_t id, int flags,
 	 */
 	t->root = pa_init((uintpaddr_t)tables);
 	t->id = id;
+	t->dirty_begin = UINT64_MAX;
+	t->dirty_end = 0;
+	t->generation = 0;
 	return true;
 }
 
+/**
+ * Records that the entries of the given page table covering the given address
+ * range have been updated, so that the next defrag revisits them.
+ */
+static void mm_ptable_mark_dirty(struct mm_ptable *t, ptable_addr_t begin,
+				 ptable_addr_t end)
+{
+	if (begin >= end) {
+		return;
+	}
+
+	if (begin < t->dirty_begin) {
+		t->dirty_begin = begin;
+	}
+
+	if (end > t->dirty_end) {
+		t->dirty_end = end;
+	}
+}
+
+/**
+ * Records that the entries of the given page table covering the given address
+ * range have been defragmented. The dirty range is only shrunk if the range
+ * covers one of its ends, as it has to remain a single range.
+ */
+static void mm_ptable_mark_clean(struct mm_ptable *t, ptable_addr_t begin,
+				 ptable_addr_t end)
+{
+	if (begin <= t->dirty_begin && end > t->dirty_begin) {
+		t->dirty_begin = end;
+	}
+
+	if (end >= t->dirty_end && begin < t->dirty_end) {
+		t->dirty_end = begin;
+	}
+
+	if (t->dirty_begin >= t->dirty_end) {
+		t->dirty_begin = UINT64_MAX;
+		t->dirty_end = 0;
+	}
+}
+
 /**
  * Frees all memory associated with the give page table.
  */
@@ -261,35 +444,165 @@ static void mm_ptable_fini(struct mm_ptable *t, int flags, struct mpool *ppool)
 
 /**
  * Replaces a page table entry with the given value. If both old and new values
- * are valid, it performs a break-before-make sequence where it first writes an
- * invalid value to the PTE, flushes the TLB, then writes the actual new value.
- * This is to prevent cases where CPUs have different 'valid' values in their
- * TLBs, which may result in issues for example in cache coherency.
+ * are valid and the architecture requires it, it performs a break-before-make
+ * sequence where it first writes an invalid value to the PTE, flushes the TLB,
+ * then writes the actual new value. This is to prevent cases where CPUs have
+ * different 'valid' values in their TLBs, which may result in issues for
+ * example in cache coherency.
+ *
+ * Otherwise, the range of the old entry is added to the TLB gather and its
+ * invalidation is deferred until the gather is flushed.
  */
 static void mm_replace_entry(ptable_addr_t begin, pte_t *pte, pte_t new_pte,
 			     uint8_t level, int flags, struct mpool *ppool,
-			     uint16_t id)
+			     struct mm_tlb_gather *tlb)
 {
 	pte_t v = *pte;
 
 	/*
-	 * We need to do the break-before-make sequence if both values are
-	 * present and the TLB is being invalidated.
+	 * We need to invalidate the TLB if the old value was valid and the TLB
+	 * is being invalidated, and do it before writing the new value if a
+	 * break-before-make sequence is needed.
 	 */
 	if (((flags & MM_FLAG_STAGE1) || mm_stage2_invalidate) &&
 	    arch_mm_pte_is_valid(v, level)) {
-		*pte = arch_mm_absent_pte(level);
-		mm_invalidate_tlb(begin, begin + mm_entry_size(level), flags,
-				  id);
+		mm_tlb_gather_add(tlb, begin, begin + mm_entry_size(level));
+		if (arch_mm_pte_is_valid(new_pte, level) &&
+		    arch_mm_pte_needs_bbm(v, new_pte, level)) {
+			*pte = arch_mm_absent_pte(level);
+			mm_tlb_gather_flush(tlb);
+		}
 	}
 
 	/* Assign the new pte. */
 	*pte = new_pte;
 
+	/*
+	 * Subtables must not be reused until no TLB can hold walks through
+	 * them anymore.
+	 */
+	if (arch_mm_pte_is_table(v, level)) {
+		mm_tlb_gather_flush(tlb);
+		tlb->ptable->generation++;
+	}
+
 	/* Free pages that aren't in use anymore. */
 	mm_free_page_pte(v, level, ppool);
 }
 
+/**
+ * Gets the page table holding the given entry. Tables are page aligned.
+ */
+static struct mm_page_table *mm_table_of_pte(pte_t *pte)
+{
+	return (struct mm_page_table *)((uintptr_t)pte &
+					~((uintptr_t)PAGE_SIZE - 1));
+}
+
+/**
+ * Rewrites the group of entries starting at the given one, which are valid
+ * blocks with the same attributes covering a contiguous range, to set or clear
+ * their contiguous hint.
+ *
+ * All the entries of the group must agree on the hint, so when the TLB is being
+ * invalidated, they are first made absent and the TLB invalidated for the whole
+ * group before the new entries are written.
+ */
+static void mm_write_contiguous_group(ptable_addr_t begin, pte_t *group,
+				      uint8_t level, bool contiguous, int flags,
+				      struct mm_tlb_gather *tlb)
+{
+	uint8_t count = arch_mm_contiguous_entries(level);
+	size_t entry_size = mm_entry_size(level);
+	uint64_t attrs = arch_mm_pte_attrs(group[0], level);
+	uint8_t i;
+
+	if ((flags & MM_FLAG_STAGE1) || mm_stage2_invalidate) {
+		for (i = 0; i < count; ++i) {
+			group[i] = arch_mm_absent_pte(level);
+		}
+		mm_tlb_gather_add(tlb, begin, begin + count * entry_size);
+		mm_tlb_gather_flush(tlb);
+	}
+
+	for (i = 0; i < count; ++i) {
+		group[i] = arch_mm_pte_set_contiguous(
+			arch_mm_block_pte(level,
+					  pa_init(begin + i * entry_size),
+					  attrs),
+			level, contiguous);
+	}
+}
+
+/**
+ * Clears the contiguous hint of the group the given entry belongs to, if it is
+ * set, so that the entry can be updated on its own.
+ */
+static void mm_break_contiguous(ptable_addr_t begin, pte_t *pte, uint8_t level,
+				int flags, struct mm_tlb_gather *tlb)
+{
+	uint8_t count = arch_mm_contiguous_entries(level);
+	size_t group_size = count * mm_entry_size(level);
+
+	if (!arch_mm_pte_is_contiguous(*pte, level)) {
+		return;
+	}
+
+	begin &= ~(group_size - 1);
+	mm_write_contiguous_group(
+		begin, &mm_table_of_pte(pte)->entries[mm_index(begin, level)],
+		level, false, flags, tlb);
+}
+
+/**
+ * Sets the contiguous hint on the groups of entries of the table overlapping
+ * the given range, for those where all the entries are valid blocks with the
+ * same attributes. Groups that already have the hint are left alone as their
+ * entries are left unchanged, any update breaking the group first.
+ *
+ * Setting the hint briefly unmaps entries outside of the updated range. That is
+ * only done in stage-2 tables, where the VM retries the access after a spurious
+ * fault, and not in stage-1 tables, which map the hypervisor itself.
+ */
+static void mm_make_contiguous(struct mm_page_table *table, ptable_addr_t begin,
+			       ptable_addr_t end, uint8_t level, int flags,
+			       struct mm_tlb_gather *tlb)
+{
+	uint8_t count = arch_mm_contiguous_entries(level);
+	size_t group_size = count * mm_entry_size(level);
+	ptable_addr_t group_begin;
+
+	if (count <= 1 || (flags & MM_FLAG_STAGE1)) {
+		return;
+	}
+
+	for (group_begin = begin & ~(group_size - 1); group_begin < end;
+	     group_begin += group_size) {
+		pte_t *group = &table->entries[mm_index(group_begin, level)];
+		uint64_t attrs = arch_mm_pte_attrs(group[0], level);
+		uint8_t i;
+
+		if (!arch_mm_pte_is_valid(group[0], level) ||
+		    !arch_mm_pte_is_block(group[0], level) ||
+		    arch_mm_pte_is_contiguous(group[0], level)) {
+			continue;
+		}
+
+		for (i = 1; i < count; ++i) {
+			if (!arch_mm_pte_is_valid(group[i], level) ||
+			    !arch_mm_pte_is_block(group[i], level) ||
+			    arch_mm_pte_attrs(group[i], level) != attrs) {
+				break;
+			}
+		}
+
+		if (i == count) {
+			mm_write_contiguous_group(group_begin, group, level,
+						  true, flags, tlb);
+		}
+	}
+}
+
 /**
  * Populates the provided page table entry with a reference to another table if
  * needed, that is, if it does not yet point to another table.
@@ -300,7 +613,7 @@ static struct mm_page_table *mm_populate_table_pte(ptable_addr_t begin,
 						   pte_t *pte, uint8_t level,
 						   int flags,
 						   struct mpool *ppool,
-						   uint16_t id)
+						   struct mm_tlb_gather *tlb)
 {
 	struct mm_page_table *ntable;
 	pte_t v = *pte;
@@ -321,6 +634,10 @@ static struct mm_page_table *mm_populate_table_pte(ptable_addr_t begin,
 		return NULL;
 	}
 
+	/* The block is about to be split so it can't stay in its group. */
+	mm_break_contiguous(begin, pte, level, flags, tlb);
+	v = *pte;
+
 	/* Determine template for new pte and its increment. */
 	if (arch_mm_pte_is_block(v, level)) {
 		inc = mm_entry_size(level_below);
@@ -344,16 +661,250 @@ static struct mm_page_table *mm_populate_table_pte(ptable_addr_t begin,
 	/* Replace the pte entry, doing a break-before-make if needed. */
 	mm_replace_entry(begin, pte,
 			 arch_mm_table_pte(level, pa_init((uintpaddr_t)ntable)),
-			 level, flags, ppool, id);
+			 level, flags, ppool, tlb);
 
 	return ntable;
 }
 
+/**
+ * Given the table PTE entries all have identical attributes, returns the single
+ * entry with which it can be replaced.
+ */
+static pte_t mm_merge_table_pte(pte_t table_pte, uint8_t level)
+{
+	struct mm_page_table *table;
+	uint64_t block_attrs;
+	uint64_t table_attrs;
+	uint64_t combined_attrs;
+	paddr_t block_address;
+
+	table = mm_page_table_from_pa(arch_mm_table_from_pte(table_pte, level));
+
+	if (!arch_mm_pte_is_present(table->entries[0], level - 1)) {
+		return arch_mm_absent_pte(level);
+	}
+
+	/* Might not be possible to merge the table into a single block. */
+	if (!arch_mm_is_block_allowed(level)) {
+		return table_pte;
+	}
+
+	/* Replace table with a single block, with equivalent attributes. */
+	block_attrs = arch_mm_pte_attrs(table->entries[0], level - 1);
+	table_attrs = arch_mm_pte_attrs(table_pte, level);
+	combined_attrs =
+		arch_mm_combine_table_entry_attrs(table_attrs, block_attrs);
+	block_address = arch_mm_block_from_pte(table->entries[0], level - 1);
+
+	return arch_mm_block_pte(level, block_address, combined_attrs);
+}
+
+/**
+ * Determines whether the given page table, at the given level, is on the path
+ * to the entries of the windows. As their pages are contiguous there are at
+ * most two tables at each level.
+ */
+static bool mm_table_holds_windows(struct mm_page_table *table, uint8_t level)
+{
+	return table == mm_window_tables[0][level] ||
+	       table == mm_window_tables[1][level];
+}
+
+/**
+ * Determines whether the given entry, at the given level, points to a table on
+ * the path to the entries of the windows.
+ */
+static bool mm_pte_holds_windows(pte_t pte, uint8_t level)
+{
+	if (level == 0 || !arch_mm_pte_is_table(pte, level)) {
+		return false;
+	}
+
+	return mm_table_holds_windows(
+		mm_page_table_from_pa(arch_mm_table_from_pte(pte, level)),
+		level - 1);
+}
+
+/**
+ * Determines whether the entries of the given table, at the given level, can be
+ * replaced by a single entry at the level above, i.e. whether they are all
+ * absent or all blocks with identical attributes. It assumes addresses are
+ * contiguous due to identity mapping.
+ */
+static bool mm_table_is_mergeable(struct mm_page_table *table, uint8_t level)
+{
+	bool base_present = arch_mm_pte_is_present(table->entries[0], level);
+	uint64_t base_attrs = arch_mm_pte_attrs(table->entries[0], level);
+	uint64_t i;
+
+	/*
+	 * The entries of the windows are written without holding the lock of
+	 * the page table, so the tables leading to them must never be freed.
+	 */
+	if (mm_table_holds_windows(table, level)) {
+		return false;
+	}
+
+	if (base_present && !arch_mm_pte_is_block(table->entries[0], level)) {
+		return false;
+	}
+
+	for (i = 1; i < MM_PTE_PER_PAGE; ++i) {
+		pte_t entry = table->entries[i];
+
+		if (arch_mm_pte_is_present(entry, level) != base_present) {
+			return false;
+		}
+
+		if (!base_present) {
+			continue;
+		}
+
+		if (!arch_mm_pte_is_block(entry, level) ||
+		    arch_mm_pte_attrs(entry, level) != base_attrs) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Initialises an empty reservation.
+ */
+void mm_reservation_init(struct mm_reservation *res)
+{
+	res->ptable = NULL;
+	res->attrs = 0;
+	res->flags = 0;
+	res->generation = 0;
+	res->valid = true;
+	res->slots = res->inline_slots;
+	res->capacity = MM_RESERVATION_SLOTS;
+	res->count = 0;
+	memset_s(res->path, sizeof(res->path), 0, sizeof(res->path));
+}
+
+/**
+ * Initialises an empty reservation with room for the given number of address
+ * ranges, such as the constituents of a memory region. The slots are allocated
+ * from the page pool if they don't fit in the reservation itself; if that
+ * fails, the reservation records what fits and the commits of the rest walk
+ * the page table.
+ *
+ * The reservation must be freed with mm_reservation_fini().
+ */
+void mm_reservation_init_sized(struct mm_reservation *res, size_t range_count,
+			       struct mpool *ppool)
+{
+	size_t capacity = range_count * MM_RESERVATION_SLOTS_PER_RANGE;
+	size_t size;
+	struct mm_reservation_slot *slots;
+
+	mm_reservation_init(res);
+
+	if (capacity <= MM_RESERVATION_SLOTS || capacity > UINT32_MAX) {
+		return;
+	}
+
+	size = align_up(capacity * sizeof(struct mm_reservation_slot),
+			MM_PPOOL_ENTRY_SIZE);
+	slots = mpool_alloc_contiguous(ppool, size / MM_PPOOL_ENTRY_SIZE, 1);
+	if (slots == NULL) {
+		return;
+	}
+
+	res->slots = slots;
+	res->capacity = size / sizeof(struct mm_reservation_slot);
+}
+
+/**
+ * Frees the slots allocated for the reservation, if any.
+ */
+void mm_reservation_fini(struct mm_reservation *res, struct mpool *ppool)
+{
+	size_t size = res->capacity * sizeof(struct mm_reservation_slot);
+
+	if (res->slots != res->inline_slots) {
+		mpool_add_chunk(ppool, res->slots,
+				align_up(size, MM_PPOOL_ENTRY_SIZE));
+	}
+
+	res->slots = res->inline_slots;
+	res->capacity = MM_RESERVATION_SLOTS;
+	res->count = 0;
+}
+
+/**
+ * Gets the reservation ready to record the entries prepared for a mapping with
+ * the given attributes and flags in the given page table. The reservation stops
+ * being used if it was already made for a different mapping or if tables may
+ * have been freed since.
+ */
+static void mm_reservation_start(struct mm_reservation *res,
+				 struct mm_ptable *t, uint64_t attrs, int flags)
+{
+	if (res->ptable == NULL) {
+		res->ptable = t;
+		res->attrs = attrs;
+		res->flags = flags;
+		res->generation = t->generation;
+		return;
+	}
+
+	if (res->ptable != t || res->attrs != attrs || res->flags != flags ||
+	    res->generation != t->generation) {
+		res->valid = false;
+	}
+}
+
+/**
+ * Records that the entries of the given table covering the given address range
+ * are to be written by the commit. The range is merged with the previous slot
+ * if it extends it.
+ */
+static void mm_reservation_record(struct mm_reservation *res,
+				  struct mm_page_table *table, uint8_t level,
+				  ptable_addr_t begin, ptable_addr_t end)
+{
+	struct mm_reservation_slot *slot;
+
+	if (res == NULL || !res->valid) {
+		return;
+	}
+
+	if (res->count > 0) {
+		slot = &res->slots[res->count - 1];
+		if (slot->table == table && slot->level == level &&
+		    slot->end == begin) {
+			slot->end = end;
+			return;
+		}
+	}
+
+	if (res->count == res->capacity ||
+	    level >= MM_MAX_LEVELS) {
+		res->valid = false;
+		return;
+	}
+
+	slot = &res->slots[res->count++];
+	slot->table = table;
+	slot->level = level;
+	slot->begin = begin;
+	slot->end = end;
+	memcpy_s(slot->parents, sizeof(slot->parents), res->path,
+		 sizeof(res->path));
+}
+
 /**
  * Updates the page table at the given level to map the given address range to a
  * physical range using the provided (architecture-specific) attributes. Or if
  * MM_FLAG_UNMAP is set, unmap the given range instead.
  *
+ * If `res` is not NULL, the entries written at this level, or that already had
+ * the requested value, are recorded in it.
+ *
  * This function calls itself recursively if it needs to update additional
  * levels, but the recursion is bound by the maximum number of levels in a page
  * table.
@@ -362,13 +913,14 @@ static struct mm_page_table *mm_populate_table_pte(ptable_addr_t begin,
 static bool mm_map_level(ptable_addr_t begin, ptable_addr_t end, paddr_t pa,
 			 uint64_t attrs, struct mm_page_table *table,
 			 uint8_t level, int flags, struct mpool *ppool,
-			 uint16_t id)
+			 struct mm_tlb_gather *tlb, struct mm_reservation *res)
 {
 	pte_t *pte = &table->entries[mm_index(begin, level)];
 	ptable_addr_t level_end = mm_level_end(begin, level);
 	size_t entry_size = mm_entry_size(level);
 	bool commit = flags & MM_FLAG_COMMIT;
 	bool unmap = flags & MM_FLAG_UNMAP;
+	ptable_addr_t updated_begin = begin;
 
 	/* Cap end so that we don't go over the current level max. */
 	if (end > level_end) {
@@ -377,6 +929,13 @@ static bool mm_map_level(ptable_addr_t begin, ptable_addr_t end, paddr_t pa,
 
 	/* Fill each entry in the table. */
 	while (begin < end) {
+		ptable_addr_t entry_end =
+			mm_start_of_next_block(begin, entry_size);
+
+		if (entry_end > end) {
+			entry_end = end;
+		}
+
 		if (unmap ? !arch_mm_pte_is_present(*pte, level)
 			  : arch_mm_pte_is_block(*pte, level) &&
 				    arch_mm_pte_attrs(*pte, level) == attrs) {
@@ -384,22 +943,30 @@ static bool mm_map_level(ptable_addr_t begin, ptable_addr_t end, paddr_t pa,
 			 * If the entry is already mapped with the right
 			 * attributes, or already absent in the case of
 			 * unmapping, no need to do anything; carry on to the
-			 * next entry.
+			 * next entry. The commit still has to check it again.
 			 */
+			mm_reservation_record(res, table, level, begin,
+					      entry_end);
 		} else if ((end - begin) >= entry_size &&
 			   (unmap || arch_mm_is_block_allowed(level)) &&
-			   (begin & (entry_size - 1)) == 0) {
+			   (begin & (entry_size - 1)) == 0 &&
+			   !mm_pte_holds_windows(*pte, level)) {
 			/*
 			 * If the entire entry is within the region we want to
-			 * map, map/unmap the whole entry.
+			 * map, map/unmap the whole entry. Tables leading to
+			 * the windows are kept and updated entry by entry.
 			 */
+			mm_reservation_record(res, table, level, begin,
+					      entry_end);
 			if (commit) {
 				pte_t new_pte =
 					unmap ? arch_mm_absent_pte(level)
 					      : arch_mm_block_pte(level, pa,
 								  attrs);
+				mm_break_contiguous(begin, pte, level, flags,
+						    tlb);
 				mm_replace_entry(begin, pte, new_pte, level,
-						 flags, ppool, id);
+						 flags, ppool, tlb);
 			}
 		} else {
 			/*
@@ -407,26 +974,56 @@ static bool mm_map_level(ptable_addr_t begin, ptable_addr_t end, paddr_t pa,
 			 * replace it with an equivalent subtable and get that.
 			 */
 			struct mm_page_table *nt = mm_populate_table_pte(
-				begin, pte, level, flags, ppool, id);
+				begin, pte, level, flags, ppool, tlb);
 			if (nt == NULL) {
 				return false;
 			}
 
+			if (res != NULL && level < MM_MAX_LEVELS) {
+				res->path[level] = pte;
+			}
+
 			/*
 			 * Recurse to map/unmap the appropriate entries within
 			 * the subtable.
 			 */
 			if (!mm_map_level(begin, end, pa, attrs, nt, level - 1,
-					  flags, ppool, id)) {
+					  flags, ppool, tlb, res)) {
 				return false;
 			}
+
+			/*
+			 * If the update left the subtable uniform, promote it
+			 * to the equivalent block or absent entry and free it.
+			 * This is only done when committing so that it doesn't
+			 * undo the granularity set up by a prepare.
+			 */
+			if (commit && mm_table_is_mergeable(nt, level - 1)) {
+				pte_t new_pte = mm_merge_table_pte(*pte, level);
+
+				if (new_pte != *pte) {
+					mm_replace_entry(
+						begin & ~(entry_size - 1), pte,
+						new_pte, level, flags, ppool,
+						tlb);
+				}
+			}
 		}
 
-		begin = mm_start_of_next_block(begin, entry_size);
+		begin = entry_end;
 		pa = mm_pa_start_of_next_block(pa, entry_size);
 		pte++;
 	}
 
+	/*
+	 * Mark the groups of blocks the update completed with the contiguous
+	 * hint, so they can share a TLB entry.
+	 */
+	if (commit) {
+		mm_make_contiguous(table, updated_begin, end, level, flags,
+				   tlb);
+	}
+
 	return true;
 }
 
@@ -437,7 +1034,8 @@ static bool mm_map_level(ptable_addr_t begin, ptable_addr_t end, paddr_t pa,
  */
 static bool mm_map_root(struct mm_ptable *t, ptable_addr_t begin,
 			ptable_addr_t end, uint64_t attrs, uint8_t root_level,
-			int flags, struct mpool *ppool)
+			int flags, struct mpool *ppool,
+			struct mm_tlb_gather *tlb, struct mm_reservation *res)
 {
 	size_t root_table_size = mm_entry_size(root_level);
 	struct mm_page_table *table =
@@ -445,7 +1043,7 @@ static bool mm_map_root(struct mm_ptable *t, ptable_addr_t begin,
 
 	while (begin < end) {
 		if (!mm_map_level(begin, end, pa_init(begin), attrs, table,
-				  root_level - 1, flags, ppool, t->id)) {
+				  root_level - 1, flags, ppool, tlb, res)) {
 			return false;
 		}
 		begin = mm_start_of_next_block(begin, root_table_size);
@@ -455,19 +1053,153 @@ static bool mm_map_root(struct mm_ptable *t, ptable_addr_t begin,
 	return true;
 }
 
+/**
+ * Promotes the table of a committed slot, and then its ancestors in turn, to
+ * the equivalent block or absent entry for as long as they are uniform. This is
+ * what mm_map_level does for the subtables it recursed into.
+ */
+static void mm_reservation_promote(struct mm_reservation_slot *slot,
+				   uint8_t max_level, int flags,
+				   struct mpool *ppool,
+				   struct mm_tlb_gather *tlb)
+{
+	struct mm_page_table *table = slot->table;
+	ptable_addr_t begin;
+	uint8_t level;
+
+	for (level = slot->level + 1; level <= max_level; ++level) {
+		pte_t *pte = slot->parents[level];
+		pte_t new_pte;
+
+		if (!mm_table_is_mergeable(table, level - 1)) {
+			return;
+		}
+
+		new_pte = mm_merge_table_pte(*pte, level);
+		if (new_pte == *pte) {
+			return;
+		}
+
+		begin = slot->begin & ~(mm_entry_size(level) - 1);
+		mm_replace_entry(begin, pte, new_pte, level, flags, ppool, tlb);
+
+		table = mm_table_of_pte(pte);
+		mm_make_contiguous(table, begin, begin + mm_entry_size(level),
+				   level, flags, tlb);
+	}
+}
+
+/**
+ * Commits the given address range using the entries recorded by the
+ * reservation when it was prepared, without walking the page table from the
+ * root.
+ *
+ * Returns false, without updating the page table, if the reservation can't be
+ * used for the range, in which case the caller must walk the page table.
+ */
+static bool mm_reservation_commit(struct mm_reservation *res,
+				  struct mm_ptable *t, ptable_addr_t begin,
+				  ptable_addr_t end, uint64_t attrs, int flags,
+				  struct mpool *ppool,
+				  struct mm_tlb_gather *tlb)
+{
+	ptable_addr_t covered = begin;
+	uint32_t first = res->count;
+	uint32_t last = 0;
+	uint32_t i;
+
+	if (!res->valid || res->ptable != t || res->attrs != attrs ||
+	    res->flags != (flags & ~MM_FLAG_COMMIT) ||
+	    res->generation != t->generation) {
+		return false;
+	}
+
+	/*
+	 * The slots recorded when preparing the range cover it contiguously in
+	 * increasing address order. Anything else means it was prepared in
+	 * another way, or not at all.
+	 */
+	for (i = 0; i < res->count && covered < end; ++i) {
+		struct mm_reservation_slot *slot = &res->slots[i];
+
+		if (slot->begin < begin || slot->end > end) {
+			continue;
+		}
+
+		if (slot->begin != covered) {
+			return false;
+		}
+
+		if (first == res->count) {
+			first = i;
+		}
+		last = i;
+		covered = slot->end;
+	}
+
+	if (covered != end || begin >= end) {
+		return false;
+	}
+
+	for (i = first; i <= last; ++i) {
+		struct mm_reservation_slot *slot = &res->slots[i];
+
+		/*
+		 * Committing a slot may promote subtables below it. If one of
+		 * the recorded tables may have gone with them, walk the rest
+		 * from the root. Entries already committed are left as they
+		 * are.
+		 */
+		if (res->generation != t->generation) {
+			CHECK(mm_map_root(t, slot->begin, end, attrs,
+					  mm_max_level(flags) + 1, flags,
+					  ppool, tlb, NULL));
+			break;
+		}
+
+		CHECK(mm_map_level(slot->begin, slot->end,
+				   pa_init(slot->begin), attrs, slot->table,
+				   slot->level, flags, ppool, tlb, NULL));
+		mm_reservation_promote(slot, mm_max_level(flags), flags, ppool,
+				       tlb);
+	}
+
+	/*
+	 * Tables freed by this commit must not be mistaken for the ones
+	 * recorded, so the rest of the reservation can't be used anymore.
+	 */
+	if (res->generation != t->generation) {
+		res->valid = false;
+	}
+
+	return true;
+}
+
 /**
  * Updates the given table such that the given physical address range is mapped
  * or not mapped into the address space with the architecture-agnostic mode
  * provided. Only commits the change if MM_FLAG_COMMIT is set.
+ *
+ * If `res` is not NULL, a prepare records the entries to write in it and a
+ * commit writes them directly when it can rather than walking the page table
+ * from the root.
+ *
+ * If `tlb` is not NULL, the ranges whose TLB entries need to be invalidated are
+ * added to it and the caller is responsible for finishing it. Otherwise, the
+ * TLB is invalidated before returning.
  */
 static bool mm_ptable_identity_map(struct mm_ptable *t, paddr_t pa_begin,
 				   paddr_t pa_end, uint64_t attrs, int flags,
-				   struct mpool *ppool)
+				   struct mpool *ppool,
+				   struct mm_reservation *res,
+				   struct mm_tlb_gather *tlb)
 {
 	uint8_t root_level = mm_max_level(flags) + 1;
 	ptable_addr_t ptable_end = mm_ptable_addr_space_end(flags);
 	ptable_addr_t end = mm_round_up_to_page(pa_addr(pa_end));
 	ptable_addr_t begin = pa_addr(arch_mm_clear_pa(pa_begin));
+	struct mm_tlb_gather local_tlb;
+	bool ret;
 
 	/*
 	 * Assert condition to communicate the API constraint of mm_max_level(),
@@ -480,18 +1212,44 @@ static bool mm_ptable_identity_map(struct mm_ptable *t, paddr_t pa_begin,
 		end = ptable_end;
 	}
 
-	if (!mm_map_root(t, begin, end, attrs, root_level, flags, ppool)) {
-		return false;
+	if (tlb == NULL) {
+		mm_tlb_gather_init(&local_tlb);
+		tlb = &local_tlb;
 	}
 
+	mm_tlb_gather_select(tlb, t, flags);
+
 	/*
-	 * All TLB invalidations must be complete already if any entries were
-	 * replaced by mm_replace_entry. Sync all page table writes so that code
-	 * following this can use them.
+	 * Both preparing and committing can leave subtables that may be merged
+	 * by the next defrag.
 	 */
-	arch_mm_sync_table_writes();
+	mm_ptable_mark_dirty(t, begin, end);
 
-	return true;
+	if (!(flags & MM_FLAG_COMMIT)) {
+		if (res != NULL) {
+			mm_reservation_start(res, t, attrs, flags);
+		}
+		ret = mm_map_root(t, begin, end, attrs, root_level, flags,
+				  ppool, tlb, res);
+	} else if (res != NULL && mm_reservation_commit(res, t, begin, end,
+							attrs, flags, ppool,
+							tlb)) {
+		ret = true;
+	} else {
+		ret = mm_map_root(t, begin, end, attrs, root_level, flags,
+				  ppool, tlb, NULL);
+	}
+
+	/*
+	 * Invalidate the TLB entries of all the entries replaced by
+	 * mm_replace_entry in one go, unless the caller gathers them across a
+	 * series of updates.
+	 */
+	if (tlb == &local_tlb) {
+		mm_tlb_gather_finish(&local_tlb);
+	}
+
+	return ret;
 }
 
 /*
@@ -502,13 +1260,19 @@ static bool mm_ptable_identity_map(struct mm_ptable *t, paddr_t pa_begin,
  *
  * In particular, multiple calls to this function will result in the
  * corresponding calls to commit the changes to succeed.
+ *
+ * If `res` is not NULL, the entries the commit will write are recorded in it so
+ * that the commit doesn't need to walk the page table again. The same
+ * reservation must then be passed to the commit.
  */
 static bool mm_ptable_identity_prepare(struct mm_ptable *t, paddr_t pa_begin,
 				       paddr_t pa_end, uint64_t attrs,
-				       int flags, struct mpool *ppool)
+				       int flags, struct mpool *ppool,
+				       struct mm_reservation *res)
 {
 	flags &= ~MM_FLAG_COMMIT;
-	return mm_ptable_identity_map(t, pa_begin, pa_end, attrs, flags, ppool);
+	return mm_ptable_identity_map(t, pa_begin, pa_end, attrs, flags, ppool,
+				      res, NULL);
 }
 
 /**
@@ -523,14 +1287,20 @@ static bool mm_ptable_identity_prepare(struct mm_ptable *t, paddr_t pa_begin,
  * Since the non-failure assumtion is used in the reasoning about the atomicity
  * of higher level memory operations, any detected violations result in a panic.
  *
+ * If `res` is not NULL, it must be the reservation passed to the prepare.
+ *
+ * If `tlb` is not NULL, the TLB invalidation is deferred until it is finished.
+ *
  * TODO: remove ppool argument to be sure no changes are made.
  */
 static void mm_ptable_identity_commit(struct mm_ptable *t, paddr_t pa_begin,
 				      paddr_t pa_end, uint64_t attrs, int flags,
-				      struct mpool *ppool)
+				      struct mpool *ppool,
+				      struct mm_reservation *res,
+				      struct mm_tlb_gather *tlb)
 {
 	CHECK(mm_ptable_identity_map(t, pa_begin, pa_end, attrs,
-				     flags | MM_FLAG_COMMIT, ppool));
+				     flags | MM_FLAG_COMMIT, ppool, res, tlb));
 }
 
 /**
@@ -547,16 +1317,51 @@ static bool mm_ptable_identity_update(struct mm_ptable *t, paddr_t pa_begin,
 				      paddr_t pa_end, uint64_t attrs, int flags,
 				      struct mpool *ppool)
 {
+	struct mm_reservation res;
+
+	mm_reservation_init(&res);
+
 	if (!mm_ptable_identity_prepare(t, pa_begin, pa_end, attrs, flags,
-					ppool)) {
+					ppool, &res)) {
 		return false;
 	}
 
-	mm_ptable_identity_commit(t, pa_begin, pa_end, attrs, flags, ppool);
+	mm_ptable_identity_commit(t, pa_begin, pa_end, attrs, flags, ppool,
+				  &res, NULL);
 
 	return true;
 }
 
+/**
+ * Returns the entry of the given page table mapping the page holding the given
+ * address, or NULL if the address isn't mapped at page granularity. The tables
+ * on the way to it are written to `tables`, by the level of their entries.
+ */
+static pte_t *mm_ptable_page_pte(struct mm_ptable *t, ptable_addr_t addr,
+				 int flags, struct mm_page_table **tables)
+{
+	uint8_t level = mm_max_level(flags);
+	struct mm_page_table *table =
+		&mm_page_table_from_pa(t->root)[mm_index(addr, level + 1)];
+	pte_t *pte = &table->entries[mm_index(addr, level)];
+
+	tables[level] = table;
+
+	while (level > 0) {
+		if (!arch_mm_pte_is_table(*pte, level)) {
+			return NULL;
+		}
+
+		table = mm_page_table_from_pa(
+			arch_mm_table_from_pte(*pte, level));
+		level--;
+		tables[level] = table;
+		pte = &table->entries[mm_index(addr, level)];
+	}
+
+	return pte;
+}
+
 /**
  * Writes the given table to the debug log, calling itself recursively to
  * write sub-tables.
@@ -577,75 +1382,44 @@ static void mm_dump_table_recursive(struct mm_page_table *table, uint8_t level,
 
 		if (arch_mm_pte_is_table(table->entries[i], level)) {
 			mm_dump_table_recursive(
-				mm_page_table_from_pa(arch_mm_table_from_pte(
-					table->entries[i], level)),
-				level - 1, max_level);
-		}
-	}
-}
-
-/**
- * Writes the given table to the debug log.
- */
-static void mm_ptable_dump(struct mm_ptable *t, int flags)
-{
-	struct mm_page_table *tables = mm_page_table_from_pa(t->root);
-	uint8_t max_level = mm_max_level(flags);
-	uint8_t root_table_count = mm_root_table_count(flags);
-	uint8_t i;
-
-	for (i = 0; i < root_table_count; ++i) {
-		mm_dump_table_recursive(&tables[i], max_level, max_level);
-	}
-}
-
-/**
- * Given the table PTE entries all have identical attributes, returns the single
- * entry with which it can be replaced.
- */
-static pte_t mm_merge_table_pte(pte_t table_pte, uint8_t level)
-{
-	struct mm_page_table *table;
-	uint64_t block_attrs;
-	uint64_t table_attrs;
-	uint64_t combined_attrs;
-	paddr_t block_address;
-
-	table = mm_page_table_from_pa(arch_mm_table_from_pte(table_pte, level));
-
-	if (!arch_mm_pte_is_present(table->entries[0], level - 1)) {
-		return arch_mm_absent_pte(level);
-	}
-
-	/* Might not be possible to merge the table into a single block. */
-	if (!arch_mm_is_block_allowed(level)) {
-		return table_pte;
+				mm_page_table_from_pa(arch_mm_table_from_pte(
+					table->entries[i], level)),
+				level - 1, max_level);
+		}
 	}
+}
 
-	/* Replace table with a single block, with equivalent attributes. */
-	block_attrs = arch_mm_pte_attrs(table->entries[0], level - 1);
-	table_attrs = arch_mm_pte_attrs(table_pte, level);
-	combined_attrs =
-		arch_mm_combine_table_entry_attrs(table_attrs, block_attrs);
-	block_address = arch_mm_block_from_pte(table->entries[0], level - 1);
+/**
+ * Writes the given table to the debug log.
+ */
+static void mm_ptable_dump(struct mm_ptable *t, int flags)
+{
+	struct mm_page_table *tables = mm_page_table_from_pa(t->root);
+	uint8_t max_level = mm_max_level(flags);
+	uint8_t root_table_count = mm_root_table_count(flags);
+	uint8_t i;
 
-	return arch_mm_block_pte(level, block_address, combined_attrs);
+	for (i = 0; i < root_table_count; ++i) {
+		mm_dump_table_recursive(&tables[i], max_level, max_level);
+	}
 }
 
 /**
  * Defragments the given PTE by recursively replacing any tables with blocks or
- * absent entries where possible.
+ * absent entries where possible. Only the subtables overlapping the given
+ * address range are visited.
  */
 // NOLINTNEXTLINE(misc-no-recursion)
 static void mm_ptable_defrag_entry(ptable_addr_t base_addr, pte_t *entry,
-				   uint8_t level, int flags,
-				   struct mpool *ppool, uint16_t id)
+				   uint8_t level, ptable_addr_t begin,
+				   ptable_addr_t end, int flags,
+				   struct mpool *ppool,
+				   struct mm_tlb_gather *tlb)
 {
 	struct mm_page_table *table;
-	uint64_t i;
-	bool mergeable;
-	bool base_present;
-	uint64_t base_attrs;
+	size_t entry_size = mm_entry_size(level - 1);
+	uint64_t i = 0;
+	ptable_addr_t block_addr;
 	pte_t new_entry;
 
 	if (!arch_mm_pte_is_table(*entry, level)) {
@@ -654,147 +1428,211 @@ static void mm_ptable_defrag_entry(ptable_addr_t base_addr, pte_t *entry,
 
 	table = mm_page_table_from_pa(arch_mm_table_from_pte(*entry, level));
 
-	/* Defrag the first entry in the table and use it as the base entry. */
 	static_assert(MM_PTE_PER_PAGE >= 1, "There must be at least one PTE.");
 
-	mm_ptable_defrag_entry(base_addr, &(table->entries[0]), level - 1,
-			       flags, ppool, id);
-
-	base_present = arch_mm_pte_is_present(table->entries[0], level - 1);
-	base_attrs = arch_mm_pte_attrs(table->entries[0], level - 1);
-
 	/*
-	 * Defrag the remaining entries in the table and check whether they are
-	 * compatible with the base entry meaning the table can be merged into a
-	 * block entry. It assumes addresses are contiguous due to identity
-	 * mapping.
+	 * Defrag the entries in the table overlapping the range. The others
+	 * haven't been updated since they were last defragmented.
 	 */
-	mergeable = true;
-	for (i = 1; i < MM_PTE_PER_PAGE; ++i) {
-		bool present;
-		ptable_addr_t block_addr =
-			base_addr + (i * mm_entry_size(level - 1));
+	if (begin > base_addr) {
+		i = mm_index(begin, level - 1);
+	}
 
+	for (block_addr = base_addr + (i * entry_size);
+	     i < MM_PTE_PER_PAGE && block_addr < end;
+	     ++i, block_addr += entry_size) {
 		mm_ptable_defrag_entry(block_addr, &(table->entries[i]),
-				       level - 1, flags, ppool, id);
-
-		present = arch_mm_pte_is_present(table->entries[i], level - 1);
+				       level - 1, begin, end, flags, ppool,
+				       tlb);
+	}
 
-		if (present != base_present) {
-			mergeable = false;
-			continue;
-		}
+	/*
+	 * Check whether the entries are compatible with each other meaning the
+	 * table can be merged into a block entry.
+	 */
+	if (!mm_table_is_mergeable(table, level - 1)) {
+		return;
+	}
 
-		if (!present) {
-			continue;
-		}
+	new_entry = mm_merge_table_pte(*entry, level);
+	if (*entry != new_entry) {
+		mm_replace_entry(base_addr, entry, new_entry, level, flags,
+				 ppool, tlb);
+		mm_make_contiguous(mm_table_of_pte(entry), base_addr,
+				   base_addr + mm_entry_size(level), level,
+				   flags, tlb);
+	}
+}
 
-		if (!arch_mm_pte_is_block(table->entries[i], level - 1)) {
-			mergeable = false;
-			continue;
-		}
+/**
+ * Defragments the part of the given page table covering the given address range
+ * by converting page table references to blocks whenever possible.
+ *
+ * If `tlb` is not NULL, the TLB invalidation is deferred until the caller
+ * finishes the gather, so that a series of ranges is invalidated in one go.
+ */
+static void mm_ptable_defrag_range(struct mm_ptable *t, ptable_addr_t begin,
+				   ptable_addr_t end, int flags,
+				   struct mpool *ppool,
+				   struct mm_tlb_gather *tlb)
+{
+	struct mm_page_table *tables = mm_page_table_from_pa(t->root);
+	uint8_t level = mm_max_level(flags);
+	size_t entry_size = mm_entry_size(level);
+	ptable_addr_t ptable_end = mm_ptable_addr_space_end(flags);
+	ptable_addr_t block_addr;
+	struct mm_tlb_gather local_tlb;
 
-		if (arch_mm_pte_attrs(table->entries[i], level - 1) !=
-		    base_attrs) {
-			mergeable = false;
-			continue;
-		}
+	if (end > ptable_end) {
+		end = ptable_end;
 	}
 
-	if (!mergeable) {
+	if (begin >= end) {
 		return;
 	}
 
-	new_entry = mm_merge_table_pte(*entry, level);
-	if (*entry != new_entry) {
-		mm_replace_entry(base_addr, entry, new_entry, level, flags,
-				 ppool, id);
+	if (tlb == NULL) {
+		mm_tlb_gather_init(&local_tlb);
+		tlb = &local_tlb;
+	}
+
+	mm_tlb_gather_select(tlb, t, flags);
+
+	/*
+	 * Loop through each root entry overlapping the range. If it points to
+	 * another table, check if that table can be replaced by a block or an
+	 * absent entry. The root tables are concatenated so they can be indexed
+	 * as a single array.
+	 */
+	for (block_addr = begin & ~(entry_size - 1); block_addr < end;
+	     block_addr += entry_size) {
+		uint64_t i = block_addr / entry_size;
+		pte_t *entry = &tables[i / MM_PTE_PER_PAGE]
+					.entries[i % MM_PTE_PER_PAGE];
+
+		mm_ptable_defrag_entry(block_addr, entry, level, begin, end,
+				       flags, ppool, tlb);
+	}
+
+	if (tlb == &local_tlb) {
+		mm_tlb_gather_finish(&local_tlb);
 	}
+
+	mm_ptable_mark_clean(t, begin, end);
 }
 
 /**
  * Defragments the given page table by converting page table references to
- * blocks whenever possible.
+ * blocks whenever possible. Only the part of the table updated since it was
+ * last defragmented is visited.
  */
 static void mm_ptable_defrag(struct mm_ptable *t, int flags,
 			     struct mpool *ppool)
 {
-	struct mm_page_table *tables = mm_page_table_from_pa(t->root);
-	uint8_t level = mm_max_level(flags);
-	uint8_t root_table_count = mm_root_table_count(flags);
-	uint8_t i;
-	uint64_t j;
-	ptable_addr_t block_addr = 0;
+	mm_ptable_defrag_range(t, t->dirty_begin, t->dirty_end, flags, ppool,
+			       NULL);
+}
 
+/**
+ * Initialises a cursor to query the attributes of ranges of the given page
+ * table.
+ */
+static void mm_attrs_cursor_init(struct mm_mode_cursor *c, struct mm_ptable *t,
+				 int flags)
+{
 	/*
-	 * Loop through each entry in the table. If it points to another table,
-	 * check if that table can be replaced by a block or an absent entry.
+	 * Assert condition to communicate the API constraint of mm_max_level(),
+	 * that isn't encoded in the types, to the static analyzer.
 	 */
-	for (i = 0; i < root_table_count; ++i) {
-		for (j = 0; j < MM_PTE_PER_PAGE; ++j) {
-			mm_ptable_defrag_entry(block_addr,
-					       &(tables[i].entries[j]), level,
-					       flags, ppool, t->id);
-			block_addr = mm_start_of_next_block(
-				block_addr, mm_entry_size(level));
-		}
-	}
+	assert(mm_max_level(flags) < MM_MAX_LEVELS);
 
-	arch_mm_sync_table_writes();
+	c->ptable = t;
+	c->flags = flags;
+	c->level = mm_max_level(flags) + 1;
+	c->got_attrs = false;
+	c->attrs = 0;
 }
 
 /**
- * Gets the attributes applied to the given range of stage-2 addresses at the
- * given level.
+ * Gets the attributes applied to the given range of addresses in the page
+ * table of the cursor, starting the walk from the lowest table cached by the
+ * cursor which covers the start of the range rather than from the root.
  *
- * The `got_attrs` argument is initially passed as false until `attrs` contains
- * attributes of the memory region at which point it is passed as true.
+ * The attributes must also match those of the ranges previously queried with
+ * the cursor. The walk stops at the first entry where they don't.
  *
- * The value returned in `attrs` is only valid if the function returns true.
+ * The value of `c->attrs` is only valid if the function returns true.
  *
  * Returns true if the whole range has the same attributes and false otherwise.
  */
-// NOLINTNEXTLINE(misc-no-recursion)
-static bool mm_ptable_get_attrs_level(struct mm_page_table *table,
-				      ptable_addr_t begin, ptable_addr_t end,
-				      uint8_t level, bool got_attrs,
-				      uint64_t *attrs)
+static bool mm_get_attrs_next(struct mm_mode_cursor *c, ptable_addr_t begin,
+			      ptable_addr_t end)
 {
-	pte_t *pte = &table->entries[mm_index(begin, level)];
-	ptable_addr_t level_end = mm_level_end(begin, level);
-	size_t entry_size = mm_entry_size(level);
+	uint8_t max_level = mm_max_level(c->flags);
+	uint8_t root_level = max_level + 1;
+	ptable_addr_t ptable_end = mm_ptable_addr_space_end(c->flags);
 
-	/* Cap end so that we don't go over the current level max. */
-	if (end > level_end) {
-		end = level_end;
+	begin = mm_round_down_to_page(begin);
+	end = mm_round_up_to_page(end);
+
+	/* Fail if the addresses are out of range. */
+	if (end > ptable_end) {
+		return false;
+	}
+
+	if (begin >= end) {
+		return false;
 	}
 
-	/* Check that each entry is owned. */
 	while (begin < end) {
-		if (arch_mm_pte_is_table(*pte, level)) {
-			if (!mm_ptable_get_attrs_level(
-				    mm_page_table_from_pa(
-					    arch_mm_table_from_pte(*pte,
-								   level)),
-				    begin, end, level - 1, got_attrs, attrs)) {
-				return false;
-			}
-			got_attrs = true;
+		uint8_t level = c->level;
+		struct mm_page_table *table;
+		pte_t pte;
+		uint64_t attrs;
+
+		/* Find the lowest cached table covering the address. */
+		while (level <= max_level &&
+		       (begin < c->bases[level] ||
+			begin - c->bases[level] >= mm_entry_size(level + 1))) {
+			level++;
+		}
+
+		if (level > max_level) {
+			level = max_level;
+			table = &mm_page_table_from_pa(
+				c->ptable->root)[mm_index(begin, root_level)];
+			c->tables[level] = table;
+			c->bases[level] =
+				begin & ~(mm_entry_size(root_level) - 1);
 		} else {
-			if (!got_attrs) {
-				*attrs = arch_mm_pte_attrs(*pte, level);
-				got_attrs = true;
-			} else if (arch_mm_pte_attrs(*pte, level) != *attrs) {
-				return false;
-			}
+			table = c->tables[level];
 		}
 
-		begin = mm_start_of_next_block(begin, entry_size);
-		pte++;
+		/* Walk down to the entry mapping the address. */
+		pte = table->entries[mm_index(begin, level)];
+		while (arch_mm_pte_is_table(pte, level)) {
+			table = mm_page_table_from_pa(
+				arch_mm_table_from_pte(pte, level));
+			level--;
+			c->tables[level] = table;
+			c->bases[level] =
+				begin & ~(mm_entry_size(level + 1) - 1);
+			pte = table->entries[mm_index(begin, level)];
+		}
+		c->level = level;
+
+		attrs = arch_mm_pte_attrs(pte, level);
+		if (!c->got_attrs) {
+			c->attrs = attrs;
+			c->got_attrs = true;
+		} else if (attrs != c->attrs) {
+			return false;
+		}
+
+		begin = mm_start_of_next_block(begin, mm_entry_size(level));
 	}
 
-	/* The entry is a valid block. */
-	return got_attrs;
+	return true;
 }
 
 /**
@@ -808,35 +1646,15 @@ static bool mm_ptable_get_attrs_level(struct mm_page_table *table,
 static bool mm_get_attrs(struct mm_ptable *t, ptable_addr_t begin,
 			 ptable_addr_t end, uint64_t *attrs, int flags)
 {
-	uint8_t max_level = mm_max_level(flags);
-	uint8_t root_level = max_level + 1;
-	size_t root_table_size = mm_entry_size(root_level);
-	ptable_addr_t ptable_end =
-		mm_root_table_count(flags) * mm_entry_size(root_level);
-	struct mm_page_table *table;
-	bool got_attrs = false;
-
-	begin = mm_round_down_to_page(begin);
-	end = mm_round_up_to_page(end);
+	struct mm_mode_cursor c;
 
-	/* Fail if the addresses are out of range. */
-	if (end > ptable_end) {
+	mm_attrs_cursor_init(&c, t, flags);
+	if (!mm_get_attrs_next(&c, begin, end)) {
 		return false;
 	}
 
-	table = &mm_page_table_from_pa(t->root)[mm_index(begin, root_level)];
-	while (begin < end) {
-		if (!mm_ptable_get_attrs_level(table, begin, end, max_level,
-					       got_attrs, attrs)) {
-			return false;
-		}
-
-		got_attrs = true;
-		begin = mm_start_of_next_block(begin, root_table_size);
-		table++;
-	}
-
-	return got_attrs;
+	*attrs = c.attrs;
+	return true;
 }
 
 bool mm_vm_init(struct mm_ptable *t, uint16_t id, struct mpool *ppool)
@@ -870,13 +1688,14 @@ static int mm_mode_to_flags(uint32_t mode)
  * Returns true on success, or false if the update would fail.
  */
 bool mm_identity_prepare(struct mm_ptable *t, paddr_t begin, paddr_t end,
-			 uint32_t mode, struct mpool *ppool)
+			 uint32_t mode, struct mpool *ppool,
+			 struct mm_reservation *res)
 {
 	int flags = MM_FLAG_STAGE1 | mm_mode_to_flags(mode);
 
 	return mm_ptable_identity_prepare(t, begin, end,
 					  arch_mm_mode_to_stage1_attrs(mode),
-					  flags, ppool);
+					  flags, ppool, res);
 }
 
 /**
@@ -885,13 +1704,14 @@ bool mm_identity_prepare(struct mm_ptable *t, paddr_t begin, paddr_t end,
  * `mm_identity_prepare` must be called before this for the same mapping.
  */
 void *mm_identity_commit(struct mm_ptable *t, paddr_t begin, paddr_t end,
-			 uint32_t mode, struct mpool *ppool)
+			 uint32_t mode, struct mpool *ppool,
+			 struct mm_reservation *res, struct mm_tlb_gather *tlb)
 {
 	int flags = MM_FLAG_STAGE1 | mm_mode_to_flags(mode);
 
 	mm_ptable_identity_commit(t, begin, end,
 				  arch_mm_mode_to_stage1_attrs(mode), flags,
-				  ppool);
+				  ppool, res, tlb);
 	return ptr_from_va(va_from_pa(begin));
 }
 
@@ -903,13 +1723,14 @@ void *mm_identity_commit(struct mm_ptable *t, paddr_t begin, paddr_t end,
  * Returns true on success, or false if the update would fail.
  */
 bool mm_vm_identity_prepare(struct mm_ptable *t, paddr_t begin, paddr_t end,
-			    uint32_t mode, struct mpool *ppool)
+			    uint32_t mode, struct mpool *ppool,
+			    struct mm_reservation *res)
 {
 	int flags = mm_mode_to_flags(mode);
 
 	return mm_ptable_identity_prepare(t, begin, end,
 					  arch_mm_mode_to_stage2_attrs(mode),
-					  flags, ppool);
+					  flags, ppool, res);
 }
 
 /**
@@ -918,13 +1739,15 @@ bool mm_vm_identity_prepare(struct mm_ptable *t, paddr_t begin, paddr_t end,
  * `mm_vm_identity_prepare` must be called before this for the same mapping.
  */
 void mm_vm_identity_commit(struct mm_ptable *t, paddr_t begin, paddr_t end,
-			   uint32_t mode, struct mpool *ppool, ipaddr_t *ipa)
+			   uint32_t mode, struct mpool *ppool, ipaddr_t *ipa,
+			   struct mm_reservation *res,
+			   struct mm_tlb_gather *tlb)
 {
 	int flags = mm_mode_to_flags(mode);
 
 	mm_ptable_identity_commit(t, begin, end,
 				  arch_mm_mode_to_stage2_attrs(mode), flags,
-				  ppool);
+				  ppool, res, tlb);
 
 	if (ipa != NULL) {
 		*ipa = ipa_from_pa(begin);
@@ -987,6 +1810,19 @@ void mm_stage1_defrag(struct mm_ptable *t, struct mpool *ppool)
 	mm_ptable_defrag(t, MM_FLAG_STAGE1, ppool);
 }
 
+/**
+ * Defragments the part of a stage1 page table covering the given address
+ * range. If `tlb` is not NULL, the TLB invalidation is deferred until the
+ * caller finishes the gather.
+ */
+void mm_stage1_defrag_range(struct mm_ptable *t, paddr_t begin, paddr_t end,
+			    struct mpool *ppool, struct mm_tlb_gather *tlb)
+{
+	mm_ptable_defrag_range(t, pa_addr(arch_mm_clear_pa(begin)),
+			       mm_round_up_to_page(pa_addr(end)),
+			       MM_FLAG_STAGE1, ppool, tlb);
+}
+
 /**
  * Defragments the VM page table.
  */
@@ -995,6 +1831,20 @@ void mm_vm_defrag(struct mm_ptable *t, struct mpool *ppool)
 	mm_ptable_defrag(t, 0, ppool);
 }
 
+/**
+ * Defragments the part of the VM page table covering the given address range,
+ * e.g. after the range was returned by a memory sharing operation. If `tlb` is
+ * not NULL, the TLB invalidation is deferred until the caller finishes the
+ * gather.
+ */
+void mm_vm_defrag_range(struct mm_ptable *t, paddr_t begin, paddr_t end,
+			struct mpool *ppool, struct mm_tlb_gather *tlb)
+{
+	mm_ptable_defrag_range(t, pa_addr(arch_mm_clear_pa(begin)),
+			       mm_round_up_to_page(pa_addr(end)), 0, ppool,
+			       tlb);
+}
+
 /**
  * Gets the mode of the given range of intermediate physical addresses if they
  * are mapped with the same mode.
@@ -1036,6 +1886,60 @@ bool mm_get_mode(struct mm_ptable *t, vaddr_t begin, vaddr_t end,
 	return ret;
 }
 
+/**
+ * Initialises a cursor to query the modes of a series of ranges of a VM's page
+ * table with `mm_vm_get_mode_next`.
+ */
+void mm_vm_mode_cursor_init(struct mm_mode_cursor *c, struct mm_ptable *t)
+{
+	mm_attrs_cursor_init(c, t, 0);
+}
+
+/**
+ * Initialises a cursor to query the modes of a series of ranges of a stage-1
+ * page table with `mm_get_mode_next`.
+ */
+void mm_mode_cursor_init(struct mm_mode_cursor *c, struct mm_ptable *t)
+{
+	mm_attrs_cursor_init(c, t, MM_FLAG_STAGE1);
+}
+
+/**
+ * Gets the mode of the given range of intermediate physical addresses if they
+ * are mapped with the same mode as all the ranges previously queried with the
+ * cursor. Neighbouring ranges are found without walking from the root, so
+ * querying ranges in increasing order is quickest.
+ *
+ * Returns true if the range is mapped with the same mode and false otherwise.
+ */
+bool mm_vm_get_mode_next(struct mm_mode_cursor *c, ipaddr_t begin,
+			 ipaddr_t end, uint32_t *mode)
+{
+	if (!mm_get_attrs_next(c, ipa_addr(begin), ipa_addr(end))) {
+		return false;
+	}
+
+	*mode = arch_mm_stage2_attrs_to_mode(c->attrs);
+	return true;
+}
+
+/**
+ * Gets the mode of the given range of virtual addresses if they are mapped with
+ * the same mode as all the ranges previously queried with the cursor.
+ *
+ * Returns true if the range is mapped with the same mode and false otherwise.
+ */
+bool mm_get_mode_next(struct mm_mode_cursor *c, vaddr_t begin, vaddr_t end,
+		      uint32_t *mode)
+{
+	if (!mm_get_attrs_next(c, va_addr(begin), va_addr(end))) {
+		return false;
+	}
+
+	*mode = arch_mm_stage1_attrs_to_mode(c->attrs);
+	return true;
+}
+
 static struct mm_stage1_locked mm_stage1_lock_unsafe(void)
 {
 	return (struct mm_stage1_locked){.ptable = &ptable};
@@ -1098,6 +2002,175 @@ void mm_defrag(struct mm_stage1_locked stage1_locked, struct mpool *ppool)
 	mm_ptable_defrag(stage1_locked.ptable, MM_FLAG_STAGE1, ppool);
 }
 
+/**
+ * Invalidates the TLB entries of the first pages of the window on the current
+ * CPU. No other CPU accesses memory through it while it is held.
+ */
+static void mm_window_invalidate(struct mm_window *window, size_t pages)
+{
+	arch_mm_invalidate_stage1_range_local(
+		ptable.id, window->va,
+		va_add(window->va, pages * PAGE_SIZE));
+}
+
+/**
+ * Unmaps the pages the given window maps, if any.
+ */
+static void mm_window_unmap(struct mm_window *window)
+{
+	size_t i;
+
+	if (window->pages == 0) {
+		return;
+	}
+
+	for (i = 0; i < window->pages; i++) {
+		window->pte[i] = arch_mm_absent_pte(0);
+	}
+
+	mm_window_invalidate(window, window->pages);
+	window->pages = 0;
+}
+
+/**
+ * Takes a window not held by another CPU. A CPU must not hold more than one
+ * window at a time, so that there is always one available.
+ */
+struct mm_window *mm_window_acquire(void)
+{
+	struct mm_window *window = NULL;
+	size_t i;
+
+	for (i = 0; i < MAX_CPUS; i++) {
+		if (sl_try_lock(&mm_windows[i].lock)) {
+			window = &mm_windows[i];
+			break;
+		}
+	}
+
+	if (window == NULL) {
+		/*
+		 * The windows were only all taken as other CPUs raced past
+		 * this one for them. Rather than trying them all again, wait
+		 * for the window of this CPU, which is released once the CPU
+		 * holding it is done with it.
+		 */
+		window = &mm_windows[arch_mm_cpu_index()];
+		sl_lock(&window->lock);
+	}
+
+	/*
+	 * Drop any entries cached by a speculative walk while another CPU held
+	 * the window.
+	 */
+	mm_window_invalidate(window, MM_WINDOW_PAGES);
+
+	return window;
+}
+
+/**
+ * Points the given window at the pages holding the physical range from `begin`
+ * to `end`, or as many of them as it can map, in the architecture-agnostic
+ * mode provided, and returns a pointer to `begin` through the window. `size` is
+ * set to the number of bytes from `begin` that can be accessed through it,
+ * until the window is pointed somewhere else or released.
+ *
+ * The window doesn't map past a boundary aligned to its size, so that when it
+ * is moved along a range the pages it maps are aligned after the first time.
+ * Whole aligned groups are mapped with the contiguous hint to share a TLB
+ * entry.
+ *
+ * The page table is updated without its lock, as nothing else writes the
+ * entries of a window, and only the TLB of the current CPU is invalidated.
+ */
+void *mm_window_map(struct mm_window *window, paddr_t begin, paddr_t end,
+		    uint32_t mode, size_t *size)
+{
+	size_t window_size = MM_WINDOW_PAGES * PAGE_SIZE;
+	paddr_t page = pa_init(mm_round_down_to_page(pa_addr(begin)));
+	paddr_t map_end =
+		pa_init(mm_start_of_next_block(pa_addr(page), window_size));
+	uint64_t attrs = arch_mm_mode_to_stage1_attrs(mode);
+	void *ptr = ptr_from_va(va_add(window->va, pa_difference(page, begin)));
+	bool contiguous;
+	size_t i;
+
+	CHECK(pa_addr(begin) < pa_addr(end));
+
+	if (pa_addr(end) < pa_addr(map_end)) {
+		map_end = pa_init(mm_round_up_to_page(pa_addr(end)));
+		*size = pa_difference(begin, end);
+	} else {
+		*size = pa_difference(begin, map_end);
+	}
+
+	contiguous = pa_difference(page, map_end) == window_size &&
+		     arch_mm_contiguous_entries(0) == MM_WINDOW_PAGES;
+
+	/* Break before make if the window still maps other pages. */
+	mm_window_unmap(window);
+
+	for (i = 0; pa_addr(page) < pa_addr(map_end); i++) {
+		pte_t pte = arch_mm_block_pte(0, page, attrs);
+
+		if (contiguous) {
+			pte = arch_mm_pte_set_contiguous(pte, 0, true);
+		}
+
+		window->pte[i] = pte;
+		page = pa_add(page, PAGE_SIZE);
+	}
+
+	window->pages = i;
+	arch_mm_sync_table_writes();
+
+	return ptr;
+}
+
+/**
+ * Unmaps the given window and makes it available to other CPUs.
+ */
+void mm_window_release(struct mm_window *window)
+{
+	mm_window_unmap(window);
+	sl_unlock(&window->lock);
+}
+
+/**
+ * Unmaps the pages the windows are at, which splits the hypervisor page table
+ * down to their entries, and records the entries and the tables leading to
+ * them.
+ */
+static bool mm_windows_init(struct mm_stage1_locked stage1_locked,
+			    struct mpool *ppool)
+{
+	paddr_t begin = pa_from_va(va_from_ptr(mm_window_pages));
+	size_t i;
+
+	if (!mm_unmap(stage1_locked, begin,
+		      pa_add(begin, sizeof(mm_window_pages)), ppool)) {
+		return false;
+	}
+
+	for (i = 0; i < MAX_CPUS; i++) {
+		struct mm_window *window = &mm_windows[i];
+
+		sl_init(&window->lock);
+		window->va = va_from_ptr(mm_window_pages[i]);
+		window->pages = 0;
+		/* The tables of the last window overwrite the others'. */
+		window->pte = mm_ptable_page_pte(
+			stage1_locked.ptable, va_addr(window->va),
+			MM_FLAG_STAGE1,
+			mm_window_tables[i == 0 ? 0 : 1]);
+		if (window->pte == NULL) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
 /**
  * Initialises memory management for the hypervisor itself.
  */
@@ -1142,5 +2215,10 @@ bool mm_init(struct mpool *ppool)
 	/* Arch-specific stack mapping. */
 	arch_stack_mm_init(stage1_locked, ppool);
 
+	if (!mm_windows_init(stage1_locked, ppool)) {
+		dlog_error("Unable to set up the memory windows.\n");
+		return false;
+	}
+
 	return true;
 }
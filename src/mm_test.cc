@@ -70,6 +70,22 @@ std::span<pte_t, MM_PTE_PER_PAGE> get_table(paddr_t pa)
 						 std::end(table->entries));
 }
 
+/**
+ * Get the level 0 table mapping the given address below the first root entry.
+ */
+std::span<pte_t, MM_PTE_PER_PAGE> get_l0_table(const struct mm_ptable &ptable,
+					       paddr_t pa)
+{
+	auto table_l2 = get_ptable(ptable).front();
+	pte_t l2_pte = table_l2[pa_addr(pa) / mm_entry_size(TOP_LEVEL)];
+	EXPECT_TRUE(arch_mm_pte_is_table(l2_pte, TOP_LEVEL));
+	auto table_l1 = get_table(arch_mm_table_from_pte(l2_pte, TOP_LEVEL));
+	pte_t l1_pte = table_l1[(pa_addr(pa) / mm_entry_size(TOP_LEVEL - 1)) %
+				MM_PTE_PER_PAGE];
+	EXPECT_TRUE(arch_mm_pte_is_table(l1_pte, TOP_LEVEL - 1));
+	return get_table(arch_mm_table_from_pte(l1_pte, TOP_LEVEL - 1));
+}
+
 class mm : public ::testing::Test
 {
 	void SetUp() override
@@ -441,10 +457,11 @@ TEST_F(mm, map_block_replaces_table)
 }
 
 /**
- * Map all memory at the top level, unmapping a page and remapping at a lower
- * level does not result in all memory being mapped at the top level again.
+ * Map all memory at the top level, unmapping a page and remapping it results in
+ * all memory being mapped at the top level again as the subtables become
+ * uniform.
  */
-TEST_F(mm, map_does_not_defrag)
+TEST_F(mm, map_promotes_uniform_table)
 {
 	constexpr uint32_t mode = 0;
 	const paddr_t page_begin = pa_init(12000 * PAGE_SIZE);
@@ -454,16 +471,111 @@ TEST_F(mm, map_does_not_defrag)
 	ASSERT_TRUE(mm_vm_identity_map(&ptable, pa_init(0), VM_MEM_END, mode,
 				       &ppool, nullptr));
 	ASSERT_TRUE(mm_vm_unmap(&ptable, page_begin, page_end, &ppool));
+	EXPECT_THAT(get_ptable(ptable),
+		    Contains(Contains(Truly(std::bind(arch_mm_pte_is_table, _1,
+						      TOP_LEVEL)))));
+	ASSERT_TRUE(mm_vm_identity_map(&ptable, page_begin, page_end, mode,
+				       &ppool, nullptr));
+	EXPECT_THAT(
+		get_ptable(ptable),
+		AllOf(SizeIs(4), Each(Each(Truly(std::bind(arch_mm_pte_is_block,
+							   _1, TOP_LEVEL))))));
+	mm_vm_fini(&ptable, &ppool);
+}
+
+/**
+ * Mapping an aligned group of pages sets the contiguous hint on them.
+ */
+TEST_F(mm, map_sets_contiguous_hint)
+{
+	constexpr uint32_t mode = 0;
+	const uint8_t count = arch_mm_contiguous_entries(0);
+	const paddr_t page_begin = pa_init(mm_entry_size(1));
+	const paddr_t page_end = pa_add(page_begin, count * PAGE_SIZE);
+	struct mm_ptable ptable;
+	ASSERT_THAT(count, Eq(16));
+	ASSERT_TRUE(mm_vm_init(&ptable, 0, &ppool));
 	ASSERT_TRUE(mm_vm_identity_map(&ptable, page_begin, page_end, mode,
 				       &ppool, nullptr));
+	auto table_l0 = get_l0_table(ptable, page_begin);
+	EXPECT_THAT(table_l0.first(count),
+		    Each(Truly(std::bind(arch_mm_pte_is_contiguous, _1, 0))));
+	EXPECT_THAT(table_l0.subspan(count), Each(arch_mm_absent_pte(0)));
+	mm_vm_fini(&ptable, &ppool);
+}
+
+/**
+ * Pages that aren't aligned to the size of a group don't get the contiguous
+ * hint.
+ */
+TEST_F(mm, map_unaligned_no_contiguous_hint)
+{
+	constexpr uint32_t mode = 0;
+	const uint8_t count = arch_mm_contiguous_entries(0);
+	const paddr_t page_begin = pa_init(mm_entry_size(1) + PAGE_SIZE);
+	const paddr_t page_end = pa_add(page_begin, count * PAGE_SIZE);
+	struct mm_ptable ptable;
+	ASSERT_TRUE(mm_vm_init(&ptable, 0, &ppool));
+	ASSERT_TRUE(mm_vm_identity_map(&ptable, page_begin, page_end, mode,
+				       &ppool, nullptr));
+	auto table_l0 = get_l0_table(ptable, page_begin);
+	EXPECT_THAT(table_l0, Each(Not(Truly(std::bind(
+				      arch_mm_pte_is_contiguous, _1, 0)))));
+	mm_vm_fini(&ptable, &ppool);
+}
+
+/**
+ * Unmapping part of a group clears the contiguous hint of that group only, and
+ * mapping it again sets it back.
+ */
+TEST_F(mm, unmap_partial_keeps_other_contiguous_hints)
+{
+	constexpr uint32_t mode = 0;
+	const uint8_t count = arch_mm_contiguous_entries(0);
+	const paddr_t page_begin = pa_init(mm_entry_size(1));
+	const paddr_t page_end = pa_add(page_begin, 2 * count * PAGE_SIZE);
+	const paddr_t unmap_begin = pa_add(page_begin, 3 * PAGE_SIZE);
+	const paddr_t unmap_end = pa_add(unmap_begin, PAGE_SIZE);
+	struct mm_ptable ptable;
+	ASSERT_TRUE(mm_vm_init(&ptable, 0, &ppool));
+	ASSERT_TRUE(mm_vm_identity_map(&ptable, page_begin, page_end, mode,
+				       &ppool, nullptr));
+	ASSERT_TRUE(mm_vm_unmap(&ptable, unmap_begin, unmap_end, &ppool));
+	auto table_l0 = get_l0_table(ptable, page_begin);
+	EXPECT_THAT(table_l0.first(count),
+		    Each(Not(Truly(
+			    std::bind(arch_mm_pte_is_contiguous, _1, 0)))));
+	EXPECT_THAT(table_l0[3], Eq(arch_mm_absent_pte(0)));
+	EXPECT_TRUE(arch_mm_pte_is_block(table_l0[4], 0));
+	EXPECT_THAT(table_l0.subspan(count, count),
+		    Each(Truly(std::bind(arch_mm_pte_is_contiguous, _1, 0))));
+
+	ASSERT_TRUE(mm_vm_identity_map(&ptable, unmap_begin, unmap_end, mode,
+				       &ppool, nullptr));
+	table_l0 = get_l0_table(ptable, page_begin);
+	EXPECT_THAT(table_l0.first(2 * count),
+		    Each(Truly(std::bind(arch_mm_pte_is_contiguous, _1, 0))));
+	mm_vm_fini(&ptable, &ppool);
+}
+
+/**
+ * Preparing a mapping splits blocks into subtables which are kept, even if
+ * uniform, so that the commit can't fail.
+ */
+TEST_F(mm, prepare_does_not_promote)
+{
+	constexpr uint32_t mode = 0;
+	const paddr_t page_begin = pa_init(12000 * PAGE_SIZE);
+	const paddr_t page_end = pa_add(page_begin, PAGE_SIZE);
+	struct mm_ptable ptable;
+	ASSERT_TRUE(mm_vm_init(&ptable, 0, &ppool));
+	ASSERT_TRUE(mm_vm_identity_map(&ptable, pa_init(0), VM_MEM_END, mode,
+				       &ppool, nullptr));
+	ASSERT_TRUE(mm_vm_identity_prepare(&ptable, page_begin, page_end,
+					   MM_MODE_R, &ppool, nullptr));
 	EXPECT_THAT(get_ptable(ptable),
-		    AllOf(SizeIs(4),
-			  Each(Each(Truly(std::bind(arch_mm_pte_is_present, _1,
-						    TOP_LEVEL)))),
-			  Contains(Contains(Truly(std::bind(
-				  arch_mm_pte_is_block, _1, TOP_LEVEL)))),
-			  Contains(Contains(Truly(std::bind(
-				  arch_mm_pte_is_table, _1, TOP_LEVEL))))));
+		    Contains(Contains(Truly(std::bind(arch_mm_pte_is_table, _1,
+						      TOP_LEVEL)))));
 	mm_vm_fini(&ptable, &ppool);
 }
 
@@ -503,9 +615,9 @@ TEST_F(mm, prepare_and_commit_first_page)
 	struct mm_ptable ptable;
 	ASSERT_TRUE(mm_vm_init(&ptable, 0, &ppool));
 	ASSERT_TRUE(mm_vm_identity_prepare(&ptable, page_begin, page_end, mode,
-					   &ppool));
+					   &ppool, nullptr));
 	mm_vm_identity_commit(&ptable, page_begin, page_end, mode, &ppool,
-			      nullptr);
+			      nullptr, nullptr, nullptr);
 
 	auto tables = get_ptable(ptable);
 	EXPECT_THAT(tables, SizeIs(4));
@@ -549,13 +661,13 @@ TEST_F(mm, prepare_and_commit_disjoint_regions)
 	struct mm_ptable ptable;
 	ASSERT_TRUE(mm_vm_init(&ptable, 0, &ppool));
 	ASSERT_TRUE(mm_vm_identity_prepare(&ptable, first_begin, first_end,
-					   mode, &ppool));
+					   mode, &ppool, nullptr));
 	ASSERT_TRUE(mm_vm_identity_prepare(&ptable, last_begin, last_end, mode,
-					   &ppool));
+					   &ppool, nullptr));
 	mm_vm_identity_commit(&ptable, first_begin, first_end, mode, &ppool,
-			      nullptr);
+			      nullptr, nullptr, nullptr);
 	mm_vm_identity_commit(&ptable, last_begin, last_end, mode, &ppool,
-			      nullptr);
+			      nullptr, nullptr, nullptr);
 
 	auto tables = get_ptable(ptable);
 	EXPECT_THAT(tables, SizeIs(4));
@@ -621,13 +733,13 @@ TEST_F(mm, prepare_and_commit_overlapping_regions)
 	struct mm_ptable ptable;
 	ASSERT_TRUE(mm_vm_init(&ptable, 0, &ppool));
 	ASSERT_TRUE(mm_vm_identity_prepare(&ptable, high_begin, map_end, mode,
-					   &ppool));
+					   &ppool, nullptr));
 	ASSERT_TRUE(mm_vm_identity_prepare(&ptable, low_begin, map_end, mode,
-					   &ppool));
+					   &ppool, nullptr));
 	mm_vm_identity_commit(&ptable, high_begin, map_end, mode, &ppool,
-			      nullptr);
+			      nullptr, nullptr, nullptr);
 	mm_vm_identity_commit(&ptable, low_begin, map_end, mode, &ppool,
-			      nullptr);
+			      nullptr, nullptr, nullptr);
 
 	auto tables = get_ptable(ptable);
 	EXPECT_THAT(tables, SizeIs(4));
@@ -679,6 +791,170 @@ TEST_F(mm, prepare_and_commit_overlapping_regions)
 	mm_vm_fini(&ptable, &ppool);
 }
 
+/**
+ * Ranges prepared with a reservation are committed from the recorded tables
+ * with the same result as walking the page table.
+ */
+TEST_F(mm, prepare_and_commit_with_reservation)
+{
+	constexpr uint32_t mode = MM_MODE_R;
+	const paddr_t first_begin = pa_init(12000 * PAGE_SIZE);
+	const paddr_t first_end = pa_add(first_begin, 3 * PAGE_SIZE);
+	const paddr_t second_begin = pa_init(mm_entry_size(1) - PAGE_SIZE);
+	const paddr_t second_end =
+		pa_add(second_begin, 2 * mm_entry_size(1) + PAGE_SIZE);
+	struct mm_ptable ptable;
+	struct mm_reservation res;
+	uint32_t read_mode;
+	ASSERT_TRUE(mm_vm_init(&ptable, 0, &ppool));
+	ASSERT_TRUE(mm_vm_identity_map(&ptable, pa_init(0), VM_MEM_END, 0,
+				       &ppool, nullptr));
+	mm_reservation_init(&res);
+	ASSERT_TRUE(mm_vm_identity_prepare(&ptable, first_begin, first_end,
+					   mode, &ppool, &res));
+	ASSERT_TRUE(mm_vm_identity_prepare(&ptable, second_begin, second_end,
+					   mode, &ppool, &res));
+	EXPECT_TRUE(res.valid);
+	mm_vm_identity_commit(&ptable, first_begin, first_end, mode, &ppool,
+			      nullptr, &res, nullptr);
+	mm_vm_identity_commit(&ptable, second_begin, second_end, mode, &ppool,
+			      nullptr, &res, nullptr);
+
+	read_mode = 0;
+	EXPECT_TRUE(mm_vm_get_mode(&ptable, ipa_from_pa(first_begin),
+				   ipa_from_pa(first_end), &read_mode));
+	EXPECT_THAT(read_mode, Eq(mode));
+	read_mode = 0;
+	EXPECT_TRUE(mm_vm_get_mode(&ptable, ipa_from_pa(second_begin),
+				   ipa_from_pa(second_end), &read_mode));
+	EXPECT_THAT(read_mode, Eq(mode));
+	EXPECT_FALSE(mm_vm_get_mode(&ptable, ipa_init(0),
+				    ipa_from_pa(first_end), &read_mode));
+	EXPECT_FALSE(mm_vm_get_mode(&ptable, ipa_from_pa(second_begin),
+				    ipa_add(ipa_from_pa(second_end), PAGE_SIZE),
+				    &read_mode));
+	mm_vm_fini(&ptable, &ppool);
+}
+
+/**
+ * Committing a range that wasn't prepared with the reservation walks the page
+ * table rather than using the recorded tables.
+ */
+TEST_F(mm, commit_unreserved_range_with_reservation)
+{
+	constexpr uint32_t mode = MM_MODE_R;
+	const paddr_t first_begin = pa_init(12000 * PAGE_SIZE);
+	const paddr_t first_end = pa_add(first_begin, PAGE_SIZE);
+	const paddr_t second_begin = pa_init(20000 * PAGE_SIZE);
+	const paddr_t second_end = pa_add(second_begin, PAGE_SIZE);
+	struct mm_ptable ptable;
+	struct mm_reservation res;
+	uint32_t read_mode;
+	ASSERT_TRUE(mm_vm_init(&ptable, 0, &ppool));
+	ASSERT_TRUE(mm_vm_identity_map(&ptable, pa_init(0), VM_MEM_END, 0,
+				       &ppool, nullptr));
+	mm_reservation_init(&res);
+	ASSERT_TRUE(mm_vm_identity_prepare(&ptable, first_begin, first_end,
+					   mode, &ppool, &res));
+	ASSERT_TRUE(mm_vm_identity_prepare(&ptable, second_begin, second_end,
+					   mode, &ppool, nullptr));
+	mm_vm_identity_commit(&ptable, second_begin, second_end, mode, &ppool,
+			      nullptr, &res, nullptr);
+	read_mode = 0;
+	EXPECT_TRUE(mm_vm_get_mode(&ptable, ipa_from_pa(second_begin),
+				   ipa_from_pa(second_end), &read_mode));
+	EXPECT_THAT(read_mode, Eq(mode));
+	read_mode = mode;
+	EXPECT_TRUE(mm_vm_get_mode(&ptable, ipa_from_pa(first_begin),
+				   ipa_from_pa(first_end), &read_mode));
+	EXPECT_THAT(read_mode, Eq(0u));
+	mm_vm_fini(&ptable, &ppool);
+}
+
+/**
+ * A reservation sized for more ranges than it holds itself records them all,
+ * so they are all committed from the recorded tables.
+ */
+TEST_F(mm, sized_reservation_records_all_ranges)
+{
+	constexpr uint32_t mode = MM_MODE_R;
+	constexpr size_t range_count = 3 * MM_RESERVATION_SLOTS;
+	const paddr_t base = pa_init(12000 * PAGE_SIZE);
+	struct mm_ptable ptable;
+	struct mm_reservation res;
+	uint32_t read_mode;
+	size_t i;
+	ASSERT_TRUE(mm_vm_init(&ptable, 0, &ppool));
+	ASSERT_TRUE(mm_vm_identity_map(&ptable, pa_init(0), VM_MEM_END, 0,
+				       &ppool, nullptr));
+	mm_reservation_init_sized(&res, range_count, &ppool);
+	for (i = 0; i < range_count; ++i) {
+		paddr_t begin = pa_add(base, 2 * i * PAGE_SIZE);
+		ASSERT_TRUE(mm_vm_identity_prepare(&ptable, begin,
+						   pa_add(begin, PAGE_SIZE),
+						   mode, &ppool, &res));
+	}
+	EXPECT_TRUE(res.valid);
+	EXPECT_THAT(res.count, Eq(range_count));
+	for (i = 0; i < range_count; ++i) {
+		paddr_t begin = pa_add(base, 2 * i * PAGE_SIZE);
+		mm_vm_identity_commit(&ptable, begin, pa_add(begin, PAGE_SIZE),
+				      mode, &ppool, nullptr, &res, nullptr);
+	}
+	EXPECT_TRUE(res.valid);
+	mm_reservation_fini(&res, &ppool);
+
+	for (i = 0; i < range_count; ++i) {
+		paddr_t begin = pa_add(base, 2 * i * PAGE_SIZE);
+		read_mode = 0;
+		EXPECT_TRUE(mm_vm_get_mode(
+			&ptable, ipa_from_pa(begin),
+			ipa_add(ipa_from_pa(begin), PAGE_SIZE), &read_mode));
+		EXPECT_THAT(read_mode, Eq(mode));
+		read_mode = mode;
+		EXPECT_TRUE(mm_vm_get_mode(
+			&ptable, ipa_add(ipa_from_pa(begin), PAGE_SIZE),
+			ipa_add(ipa_from_pa(begin), 2 * PAGE_SIZE),
+			&read_mode));
+		EXPECT_THAT(read_mode, Eq(0u));
+	}
+	mm_vm_fini(&ptable, &ppool);
+}
+
+/**
+ * Tables freed from another page table don't stop a reservation from being
+ * used.
+ */
+TEST_F(mm, reservation_unaffected_by_other_ptable)
+{
+	constexpr uint32_t mode = MM_MODE_R;
+	const paddr_t page_begin = pa_init(12000 * PAGE_SIZE);
+	const paddr_t page_end = pa_add(page_begin, PAGE_SIZE);
+	struct mm_ptable ptable;
+	struct mm_ptable other;
+	struct mm_reservation res;
+	ASSERT_TRUE(mm_vm_init(&ptable, 0, &ppool));
+	ASSERT_TRUE(mm_vm_init(&other, 1, &ppool));
+	ASSERT_TRUE(mm_vm_identity_map(&ptable, pa_init(0), VM_MEM_END, 0,
+				       &ppool, nullptr));
+	mm_reservation_init(&res);
+	ASSERT_TRUE(mm_vm_identity_prepare(&ptable, page_begin, page_end, mode,
+					   &ppool, &res));
+
+	/* Unmapping the page frees the tables created to map it. */
+	ASSERT_TRUE(mm_vm_identity_map(&other, page_begin, page_end, mode,
+				       &ppool, nullptr));
+	ASSERT_TRUE(mm_vm_unmap(&other, pa_init(0), VM_MEM_END, &ppool));
+	EXPECT_THAT(other.generation, Not(Eq(0u)));
+	EXPECT_THAT(ptable.generation, Eq(0u));
+
+	mm_vm_identity_commit(&ptable, page_begin, page_end, mode, &ppool,
+			      nullptr, &res, nullptr);
+	EXPECT_TRUE(res.valid);
+	mm_vm_fini(&other, &ppool);
+	mm_vm_fini(&ptable, &ppool);
+}
+
 /**
  * If range is not mapped, unmapping has no effect.
  */
@@ -733,33 +1009,13 @@ TEST_F(mm, unmap_round_to_page)
 	ASSERT_TRUE(mm_vm_unmap(&ptable, pa_add(map_begin, 93),
 				pa_add(map_begin, 99), &ppool));
 
-	auto tables = get_ptable(ptable);
-	constexpr auto l3_index = 2;
-
-	/* Check all other top level entries are empty... */
-	EXPECT_THAT(std::span(tables).first(l3_index),
-		    Each(Each(arch_mm_absent_pte(TOP_LEVEL))));
-	EXPECT_THAT(std::span(tables).subspan(l3_index + 1),
-		    Each(Each(arch_mm_absent_pte(TOP_LEVEL))));
-
-	/* Except the mapped page which is absent. */
-	auto table_l2 = tables[l3_index];
-	constexpr auto l2_index = 384;
-	EXPECT_THAT(table_l2.first(l2_index),
-		    Each(arch_mm_absent_pte(TOP_LEVEL)));
-	ASSERT_TRUE(arch_mm_pte_is_table(table_l2[l2_index], TOP_LEVEL));
-	EXPECT_THAT(table_l2.subspan(l2_index + 1),
-		    Each(arch_mm_absent_pte(TOP_LEVEL)));
-
-	auto table_l1 = get_table(
-		arch_mm_table_from_pte(table_l2[l2_index], TOP_LEVEL));
-	ASSERT_TRUE(arch_mm_pte_is_table(table_l1.first(1)[0], TOP_LEVEL - 1));
-	EXPECT_THAT(table_l1.subspan(1),
-		    Each(arch_mm_absent_pte(TOP_LEVEL - 1)));
-
-	auto table_l0 = get_table(
-		arch_mm_table_from_pte(table_l1.first(1)[0], TOP_LEVEL - 1));
-	EXPECT_THAT(table_l0, Each(arch_mm_absent_pte(TOP_LEVEL - 2)));
+	/*
+	 * The whole page was unmapped so the subtables that held it are empty
+	 * and have been replaced by absent entries.
+	 */
+	EXPECT_THAT(
+		get_ptable(ptable),
+		AllOf(SizeIs(4), Each(Each(arch_mm_absent_pte(TOP_LEVEL)))));
 
 	mm_vm_fini(&ptable, &ppool);
 }
@@ -779,42 +1035,13 @@ TEST_F(mm, unmap_across_tables)
 				       &ppool, nullptr));
 	ASSERT_TRUE(mm_vm_unmap(&ptable, map_begin, map_end, &ppool));
 
-	auto tables = get_ptable(ptable);
-
-	/* Check the untouched tables are empty. */
-	EXPECT_THAT(std::span(tables).first(2),
-		    Each(Each(arch_mm_absent_pte(TOP_LEVEL))));
-
-	/* Check the last page is explicity marked as absent. */
-	auto table2_l2 = tables[2];
-	EXPECT_THAT(table2_l2.first(table2_l2.size() - 1),
-		    Each(arch_mm_absent_pte(TOP_LEVEL)));
-	ASSERT_TRUE(arch_mm_pte_is_table(table2_l2.last(1)[0], TOP_LEVEL));
-
-	auto table2_l1 = get_table(
-		arch_mm_table_from_pte(table2_l2.last(1)[0], TOP_LEVEL));
-	EXPECT_THAT(table2_l1.first(table2_l1.size() - 1),
-		    Each(arch_mm_absent_pte(TOP_LEVEL - 1)));
-	ASSERT_TRUE(arch_mm_pte_is_table(table2_l1.last(1)[0], TOP_LEVEL - 1));
-
-	auto table2_l0 = get_table(
-		arch_mm_table_from_pte(table2_l1.last(1)[0], TOP_LEVEL - 1));
-	EXPECT_THAT(table2_l0, Each(arch_mm_absent_pte(TOP_LEVEL - 2)));
-
-	/* Check the first page is explicitly marked as absent. */
-	auto table3_l2 = tables[3];
-	ASSERT_TRUE(arch_mm_pte_is_table(table3_l2.first(1)[0], TOP_LEVEL));
-	EXPECT_THAT(table3_l2.subspan(1), Each(arch_mm_absent_pte(TOP_LEVEL)));
-
-	auto table3_l1 = get_table(
-		arch_mm_table_from_pte(table3_l2.first(1)[0], TOP_LEVEL));
-	ASSERT_TRUE(arch_mm_pte_is_table(table3_l1.first(1)[0], TOP_LEVEL - 1));
-	EXPECT_THAT(table3_l1.subspan(1),
-		    Each(arch_mm_absent_pte(TOP_LEVEL - 1)));
-
-	auto table3_l0 = get_table(
-		arch_mm_table_from_pte(table3_l1.first(1)[0], TOP_LEVEL - 1));
-	EXPECT_THAT(table3_l0, Each(arch_mm_absent_pte(TOP_LEVEL - 2)));
+	/*
+	 * Both pages were unmapped so the subtables in both concatenated tables
+	 * are empty and have been replaced by absent entries.
+	 */
+	EXPECT_THAT(
+		get_ptable(ptable),
+		AllOf(SizeIs(4), Each(Each(arch_mm_absent_pte(TOP_LEVEL)))));
 
 	mm_vm_fini(&ptable, &ppool);
 }
@@ -877,27 +1104,10 @@ TEST_F(mm, unmap_reverse_range_quirk)
 	ASSERT_TRUE(mm_vm_unmap(&ptable, pa_add(page_begin, 100),
 				pa_add(page_begin, 50), &ppool));
 
-	auto tables = get_ptable(ptable);
-	constexpr auto l3_index = 3;
-
-	/* Check all other top level entries are empty... */
-	EXPECT_THAT(std::span(tables).first(l3_index),
-		    Each(Each(arch_mm_absent_pte(TOP_LEVEL))));
-
-	/* Except the mapped page which is absent. */
-	auto table_l2 = tables[l3_index];
-	ASSERT_TRUE(arch_mm_pte_is_table(table_l2.first(1)[0], TOP_LEVEL));
-	EXPECT_THAT(table_l2.subspan(1), Each(arch_mm_absent_pte(TOP_LEVEL)));
-
-	auto table_l1 = get_table(
-		arch_mm_table_from_pte(table_l2.first(1)[0], TOP_LEVEL));
-	ASSERT_TRUE(arch_mm_pte_is_table(table_l1.first(1)[0], TOP_LEVEL - 1));
-	EXPECT_THAT(table_l1.subspan(1),
-		    Each(arch_mm_absent_pte(TOP_LEVEL - 1)));
-
-	auto table_l0 = get_table(
-		arch_mm_table_from_pte(table_l1.first(1)[0], TOP_LEVEL - 1));
-	EXPECT_THAT(table_l0, Each(arch_mm_absent_pte(TOP_LEVEL - 2)));
+	/* The page was unmapped so the whole table is now absent. */
+	EXPECT_THAT(
+		get_ptable(ptable),
+		AllOf(SizeIs(4), Each(Each(arch_mm_absent_pte(TOP_LEVEL)))));
 
 	mm_vm_fini(&ptable, &ppool);
 }
@@ -927,9 +1137,10 @@ TEST_F(mm, unmap_last_address_quirk)
 }
 
 /**
- * Mapping then unmapping a page does not defrag the table.
+ * Mapping then unmapping pages and blocks leaves the table empty again, as the
+ * subtables are replaced by absent entries once they are empty.
  */
-TEST_F(mm, unmap_does_not_defrag)
+TEST_F(mm, unmap_promotes_empty_tables)
 {
 	constexpr uint32_t mode = 0;
 	const paddr_t l0_begin = pa_init(5555 * PAGE_SIZE);
@@ -944,9 +1155,9 @@ TEST_F(mm, unmap_does_not_defrag)
 				       nullptr));
 	ASSERT_TRUE(mm_vm_unmap(&ptable, l0_begin, l0_end, &ppool));
 	ASSERT_TRUE(mm_vm_unmap(&ptable, l1_begin, l1_end, &ppool));
-	EXPECT_THAT(get_ptable(ptable),
-		    AllOf(SizeIs(4),
-			  Not(Each(Each(arch_mm_absent_pte(TOP_LEVEL))))));
+	EXPECT_THAT(
+		get_ptable(ptable),
+		AllOf(SizeIs(4), Each(Each(arch_mm_absent_pte(TOP_LEVEL)))));
 	mm_vm_fini(&ptable, &ppool);
 }
 
@@ -1077,6 +1288,73 @@ TEST_F(mm, get_mode_pages_across_tables)
 	mm_vm_fini(&ptable, &ppool);
 }
 
+/**
+ * A cursor gets the mode of a series of ranges, in any order, if they are all
+ * mapped with the same mode, including across root table boundaries.
+ */
+TEST_F(mm, get_mode_next_same_mode)
+{
+	constexpr uint32_t mode = MM_MODE_R | MM_MODE_W;
+	const paddr_t map_begin = pa_init(0x180'0000'0000 - 4 * PAGE_SIZE);
+	const paddr_t map_end = pa_add(map_begin, 8 * PAGE_SIZE);
+	struct mm_ptable ptable;
+	struct mm_mode_cursor cursor;
+	uint32_t read_mode;
+	ASSERT_TRUE(mm_vm_init(&ptable, 0, &ppool));
+	ASSERT_TRUE(mm_vm_identity_map(&ptable, map_begin, map_end, mode,
+				       &ppool, nullptr));
+
+	read_mode = 0;
+	mm_vm_mode_cursor_init(&cursor, &ptable);
+	EXPECT_TRUE(mm_vm_get_mode_next(
+		&cursor, ipa_from_pa(map_begin),
+		ipa_from_pa(pa_add(map_begin, PAGE_SIZE)), &read_mode));
+	EXPECT_TRUE(mm_vm_get_mode_next(
+		&cursor, ipa_from_pa(pa_add(map_begin, 2 * PAGE_SIZE)),
+		ipa_from_pa(pa_add(map_begin, 6 * PAGE_SIZE)), &read_mode));
+	EXPECT_TRUE(mm_vm_get_mode_next(
+		&cursor, ipa_from_pa(pa_add(map_begin, PAGE_SIZE)),
+		ipa_from_pa(pa_add(map_begin, 2 * PAGE_SIZE)), &read_mode));
+	EXPECT_TRUE(mm_vm_get_mode_next(
+		&cursor, ipa_from_pa(pa_add(map_begin, 6 * PAGE_SIZE)),
+		ipa_from_pa(map_end), &read_mode));
+	EXPECT_THAT(read_mode, Eq(mode));
+	mm_vm_fini(&ptable, &ppool);
+}
+
+/**
+ * A cursor fails to get the mode of a range mapped with a different mode to
+ * the ranges previously queried, even if the range itself is uniform.
+ */
+TEST_F(mm, get_mode_next_different_mode)
+{
+	constexpr uint32_t mode = MM_MODE_R | MM_MODE_W;
+	const paddr_t page0 = pa_init(10 * PAGE_SIZE);
+	const paddr_t page1 = pa_add(page0, PAGE_SIZE);
+	const paddr_t page2 = pa_add(page1, PAGE_SIZE);
+	struct mm_ptable ptable;
+	struct mm_mode_cursor cursor;
+	uint32_t read_mode;
+	ASSERT_TRUE(mm_vm_init(&ptable, 0, &ppool));
+	ASSERT_TRUE(mm_vm_identity_map(&ptable, page0, page1, mode, &ppool,
+				       nullptr));
+	ASSERT_TRUE(mm_vm_identity_map(&ptable, page1, page2, MM_MODE_R,
+				       &ppool, nullptr));
+
+	mm_vm_mode_cursor_init(&cursor, &ptable);
+	EXPECT_TRUE(mm_vm_get_mode_next(&cursor, ipa_from_pa(page0),
+					ipa_from_pa(page1), &read_mode));
+	EXPECT_THAT(read_mode, Eq(mode));
+	EXPECT_FALSE(mm_vm_get_mode_next(&cursor, ipa_from_pa(page1),
+					 ipa_from_pa(page2), &read_mode));
+
+	mm_vm_mode_cursor_init(&cursor, &ptable);
+	EXPECT_TRUE(mm_vm_get_mode_next(&cursor, ipa_from_pa(page1),
+					ipa_from_pa(page2), &read_mode));
+	EXPECT_THAT(read_mode, Eq(MM_MODE_R));
+	mm_vm_fini(&ptable, &ppool);
+}
+
 /**
  * Anything out of range fail to retrieve the mode.
  */
@@ -1166,6 +1444,108 @@ TEST_F(mm, defrag_block_subtables)
 	mm_vm_fini(&ptable, &ppool);
 }
 
+/**
+ * Defragging a range only merges the subtables covering that range, leaving
+ * the others to a later defrag.
+ */
+TEST_F(mm, defrag_range_only_merges_range)
+{
+	constexpr uint32_t mode = 0;
+	const paddr_t first_begin = pa_init(12000 * PAGE_SIZE);
+	const paddr_t first_end = pa_add(first_begin, PAGE_SIZE);
+	const paddr_t second_begin =
+		pa_init(3 * mm_entry_size(TOP_LEVEL + 1) + 5 * PAGE_SIZE);
+	const paddr_t second_end = pa_add(second_begin, PAGE_SIZE);
+	struct mm_ptable ptable;
+	ASSERT_TRUE(mm_vm_init(&ptable, 0, &ppool));
+	ASSERT_TRUE(mm_vm_identity_map(&ptable, pa_init(0), VM_MEM_END, mode,
+				       &ppool, nullptr));
+	ASSERT_TRUE(mm_vm_identity_prepare(&ptable, first_begin, first_end,
+					   MM_MODE_R, &ppool, nullptr));
+	ASSERT_TRUE(mm_vm_identity_prepare(&ptable, second_begin, second_end,
+					   MM_MODE_R, &ppool, nullptr));
+	mm_vm_defrag_range(&ptable, first_begin, first_end, &ppool, nullptr);
+	auto tables = get_ptable(ptable);
+	EXPECT_TRUE(arch_mm_pte_is_block(tables[0][0], TOP_LEVEL));
+	EXPECT_TRUE(arch_mm_pte_is_table(tables[3][0], TOP_LEVEL));
+	mm_vm_defrag(&ptable, &ppool);
+	EXPECT_THAT(
+		get_ptable(ptable),
+		AllOf(SizeIs(4), Each(Each(Truly(std::bind(arch_mm_pte_is_block,
+							   _1, TOP_LEVEL))))));
+	mm_vm_fini(&ptable, &ppool);
+}
+
+/**
+ * Disjoint ranges added to a TLB gather are kept apart, rather than merged into
+ * a single range also covering the addresses between them.
+ */
+TEST_F(mm, tlb_gather_keeps_disjoint_ranges)
+{
+	struct mm_tlb_gather tlb;
+	mm_tlb_gather_init(&tlb);
+	mm_tlb_gather_add(&tlb, 0x10'0000, 0x10'1000);
+	mm_tlb_gather_add(&tlb, 0x1000, 0x2000);
+	mm_tlb_gather_add(&tlb, 0x4000'0000, 0x4000'2000);
+	ASSERT_THAT(tlb.count, Eq(3));
+	EXPECT_THAT(tlb.ranges[0].begin, Eq(0x1000));
+	EXPECT_THAT(tlb.ranges[0].end, Eq(0x2000));
+	EXPECT_THAT(tlb.ranges[1].begin, Eq(0x10'0000));
+	EXPECT_THAT(tlb.ranges[1].end, Eq(0x10'1000));
+	EXPECT_THAT(tlb.ranges[2].begin, Eq(0x4000'0000));
+	EXPECT_THAT(tlb.ranges[2].end, Eq(0x4000'2000));
+	mm_tlb_gather_finish(&tlb);
+	EXPECT_THAT(tlb.count, Eq(0));
+}
+
+/**
+ * Ranges added to a TLB gather are merged with the ranges they overlap or are
+ * adjacent to, including several at once.
+ */
+TEST_F(mm, tlb_gather_merges_touching_ranges)
+{
+	struct mm_tlb_gather tlb;
+	mm_tlb_gather_init(&tlb);
+	mm_tlb_gather_add(&tlb, 0x1000, 0x2000);
+	mm_tlb_gather_add(&tlb, 0x3000, 0x4000);
+	mm_tlb_gather_add(&tlb, 0x8000, 0x9000);
+	mm_tlb_gather_add(&tlb, 0x2000, 0x3000);
+	ASSERT_THAT(tlb.count, Eq(2));
+	EXPECT_THAT(tlb.ranges[0].begin, Eq(0x1000));
+	EXPECT_THAT(tlb.ranges[0].end, Eq(0x4000));
+	EXPECT_THAT(tlb.ranges[1].begin, Eq(0x8000));
+	EXPECT_THAT(tlb.ranges[1].end, Eq(0x9000));
+	mm_tlb_gather_add(&tlb, 0x7000, 0x8800);
+	ASSERT_THAT(tlb.count, Eq(2));
+	EXPECT_THAT(tlb.ranges[1].begin, Eq(0x7000));
+	EXPECT_THAT(tlb.ranges[1].end, Eq(0x9000));
+	mm_tlb_gather_finish(&tlb);
+}
+
+/**
+ * A TLB gather invalidates the ranges gathered so far when it has no room left
+ * for another disjoint range.
+ */
+TEST_F(mm, tlb_gather_flushes_when_full)
+{
+	struct mm_tlb_gather tlb;
+	mm_tlb_gather_init(&tlb);
+	for (size_t i = 0; i < MM_TLB_GATHER_RANGES; ++i) {
+		mm_tlb_gather_add(&tlb, i * 0x10000, i * 0x10000 + PAGE_SIZE);
+	}
+	ASSERT_THAT(tlb.count, Eq(MM_TLB_GATHER_RANGES));
+
+	/* A range touching a gathered one still fits. */
+	mm_tlb_gather_add(&tlb, PAGE_SIZE, 2 * PAGE_SIZE);
+	ASSERT_THAT(tlb.count, Eq(MM_TLB_GATHER_RANGES));
+
+	mm_tlb_gather_add(&tlb, 0x1000'0000, 0x1000'1000);
+	ASSERT_THAT(tlb.count, Eq(1));
+	EXPECT_THAT(tlb.ranges[0].begin, Eq(0x1000'0000));
+	EXPECT_THAT(tlb.ranges[0].end, Eq(0x1000'1000));
+	mm_tlb_gather_finish(&tlb);
+}
+
 } /* namespace */
 
 namespace mm_test
@@ -21,6 +21,28 @@ struct mpool_entry {
 	struct mpool_entry *next;
 };
 
+/**
+ * A chunk of a buddy pool. The header and the order map are stored at the
+ * start of the chunk, followed by the entries from `begin` to `end`.
+ */
+struct mpool_arena {
+	struct mpool_arena *next;
+	uintptr_t begin;
+	uintptr_t end;
+	/**
+	 * For each entry, one more than the order of the free block starting
+	 * at it, or 0 if no free block starts there. This is what tells whether
+	 * a buddy is free, as nothing stored in allocated entries is trusted.
+	 */
+	uint8_t orders[];
+};
+
+/** Header stored in each free block of a buddy pool. */
+struct mpool_block {
+	struct mpool_block *next;
+	struct mpool_block *prev;
+};
+
 static bool mpool_locks_enabled = false;
 
 /**
@@ -34,12 +56,20 @@ void mpool_enable_locks(void)
 
 /**
  * Acquires the lock protecting the given memory pool, if locks are enabled.
+ * Magazines are only used by a single CPU so are never locked.
  */
 static void mpool_lock(struct mpool *p)
 {
-	if (mpool_locks_enabled) {
+	if (!mpool_locks_enabled || p->magazine) {
+		return;
+	}
+
+	if (!sl_try_lock(&p->lock)) {
 		sl_lock(&p->lock);
+		p->stats.lock_contended++;
 	}
+
+	p->stats.lock_acquired++;
 }
 
 /**
@@ -47,7 +77,7 @@ static void mpool_lock(struct mpool *p)
  */
 static void mpool_unlock(struct mpool *p)
 {
-	if (mpool_locks_enabled) {
+	if (mpool_locks_enabled && !p->magazine) {
 		sl_unlock(&p->lock);
 	}
 }
@@ -61,13 +91,39 @@ static void mpool_unlock(struct mpool *p)
  */
 void mpool_init(struct mpool *p, size_t entry_size)
 {
+	size_t i;
+
 	p->entry_size = entry_size;
 	p->chunk_list = NULL;
 	p->entry_list = NULL;
 	p->fallback = NULL;
+	p->magazine = false;
+	p->entry_count = 0;
+	p->stats = (struct mpool_stats){0};
+	p->buddy = false;
+	p->arena_list = NULL;
+	for (i = 0; i < MPOOL_BUDDY_ORDERS; i++) {
+		p->free_areas[i] = NULL;
+	}
 	sl_init(&p->lock);
 }
 
+/**
+ * Initialises the given memory pool like `mpool_init`, and indexes the chunks
+ * added to it as blocks of power-of-two numbers of entries so that
+ * `mpool_alloc_contiguous` doesn't have to search through the chunks and freed
+ * entries are merged back into larger blocks. The entry size must be a power
+ * of two.
+ *
+ * Some of the entries at the start of each chunk are used to store the index,
+ * and the pool can't have a fallback.
+ */
+void mpool_init_buddy(struct mpool *p, size_t entry_size)
+{
+	mpool_init(p, entry_size);
+	p->buddy = true;
+}
+
 /**
  * Initialises the given memory pool by replicating the properties of `from`. It
  * also pulls the chunk and free lists from `from`, consuming all its resources
@@ -75,16 +131,28 @@ void mpool_init(struct mpool *p, size_t entry_size)
  */
 void mpool_init_from(struct mpool *p, struct mpool *from)
 {
+	size_t i;
+
 	mpool_init(p, from->entry_size);
 
 	mpool_lock(from);
 	p->chunk_list = from->chunk_list;
 	p->entry_list = from->entry_list;
+	p->entry_count = from->entry_count;
 	p->fallback = from->fallback;
+	p->buddy = from->buddy;
+	p->arena_list = from->arena_list;
 
 	from->chunk_list = NULL;
 	from->entry_list = NULL;
+	from->entry_count = 0;
 	from->fallback = NULL;
+	from->arena_list = NULL;
+
+	for (i = 0; i < MPOOL_BUDDY_ORDERS; i++) {
+		p->free_areas[i] = from->free_areas[i];
+		from->free_areas[i] = NULL;
+	}
 	mpool_unlock(from);
 }
 
@@ -98,6 +166,23 @@ void mpool_init_with_fallback(struct mpool *p, struct mpool *fallback)
 	p->fallback = fallback;
 }
 
+/**
+ * Initialises the given memory pool as a magazine in front of `backing`, which
+ * must not be a magazine itself. A magazine is a small cache of free entries
+ * used by a single CPU only, so it is accessed without taking any lock.
+ *
+ * Entries are taken from and returned to the backing pool in batches of
+ * MPOOL_MAGAZINE_BATCH, so its lock is taken once per batch rather than once
+ * per entry, and at most MPOOL_MAGAZINE_CAPACITY entries are kept out of it.
+ * Chunks added to the magazine and contiguous allocations go straight to the
+ * backing pool.
+ */
+void mpool_init_magazine(struct mpool *p, struct mpool *backing)
+{
+	mpool_init_with_fallback(p, backing);
+	p->magazine = true;
+}
+
 /**
  * Finishes the given memory pool, giving all free memory to the fallback pool
  * if there is one.
@@ -134,11 +219,189 @@ void mpool_fini(struct mpool *p)
 
 	p->chunk_list = NULL;
 	p->entry_list = NULL;
+	p->entry_count = 0;
 	p->fallback = NULL;
 
 	mpool_unlock(p);
 }
 
+/**
+ * Returns the chunk of the given buddy pool containing the given address, or
+ * NULL if it isn't in any of them.
+ */
+static struct mpool_arena *mpool_buddy_find_arena(struct mpool *p,
+						  uintptr_t addr)
+{
+	struct mpool_arena *arena;
+
+	for (arena = p->arena_list; arena != NULL; arena = arena->next) {
+		if (addr >= arena->begin && addr < arena->end) {
+			return arena;
+		}
+	}
+
+	return NULL;
+}
+
+/**
+ * Returns the index in the order map of the entry at the given address.
+ */
+static size_t mpool_buddy_index(struct mpool *p, struct mpool_arena *arena,
+				uintptr_t addr)
+{
+	return (addr - arena->begin) / p->entry_size;
+}
+
+/**
+ * Adds the block of 2^order entries at the given address to the free areas.
+ */
+static void mpool_buddy_push(struct mpool *p, struct mpool_arena *arena,
+			     uintptr_t addr, uint8_t order)
+{
+	struct mpool_block *block = (struct mpool_block *)addr;
+
+	block->next = p->free_areas[order];
+	block->prev = NULL;
+	if (block->next != NULL) {
+		block->next->prev = block;
+	}
+	p->free_areas[order] = block;
+	arena->orders[mpool_buddy_index(p, arena, addr)] = order + 1;
+}
+
+/**
+ * Removes the given free block of 2^order entries from the free areas.
+ */
+static void mpool_buddy_remove(struct mpool *p, struct mpool_arena *arena,
+			       struct mpool_block *block, uint8_t order)
+{
+	if (block->prev != NULL) {
+		block->prev->next = block->next;
+	} else {
+		p->free_areas[order] = block->next;
+	}
+
+	if (block->next != NULL) {
+		block->next->prev = block->prev;
+	}
+
+	arena->orders[mpool_buddy_index(p, arena, (uintptr_t)block)] = 0;
+}
+
+/**
+ * Frees the block of 2^order entries at the given address, merging it with
+ * its buddy for as long as the buddy is free too.
+ */
+static void mpool_buddy_free_block(struct mpool *p, struct mpool_arena *arena,
+				   uintptr_t addr, uint8_t order)
+{
+	while (order + 1 < MPOOL_BUDDY_ORDERS) {
+		size_t size = p->entry_size << order;
+		uintptr_t buddy = addr ^ size;
+
+		if (buddy < arena->begin || buddy + size > arena->end ||
+		    arena->orders[mpool_buddy_index(p, arena, buddy)] !=
+			    order + 1) {
+			break;
+		}
+
+		mpool_buddy_remove(p, arena, (struct mpool_block *)buddy,
+				   order);
+		addr &= ~size;
+		order++;
+	}
+
+	mpool_buddy_push(p, arena, addr, order);
+}
+
+/**
+ * Frees the entries from `begin` to `end` in the given chunk as the largest
+ * aligned blocks that fit.
+ */
+static void mpool_buddy_free_range(struct mpool *p, struct mpool_arena *arena,
+				   uintptr_t begin, uintptr_t end)
+{
+	while (begin < end) {
+		uint8_t order = 0;
+
+		while (order + 1 < MPOOL_BUDDY_ORDERS) {
+			size_t size = p->entry_size << (order + 1);
+
+			if (!is_aligned(begin, size) || end - begin < size) {
+				break;
+			}
+			order++;
+		}
+
+		mpool_buddy_free_block(p, arena, begin, order);
+		begin += p->entry_size << order;
+	}
+}
+
+/**
+ * Allocates a block of 2^order entries from the given buddy pool, splitting a
+ * larger block if there isn't a free one of that size.
+ */
+static void *mpool_buddy_alloc(struct mpool *p, uint8_t order)
+{
+	struct mpool_block *block;
+	struct mpool_arena *arena;
+	uint8_t i = order;
+
+	while (i < MPOOL_BUDDY_ORDERS && p->free_areas[i] == NULL) {
+		i++;
+	}
+
+	if (i == MPOOL_BUDDY_ORDERS) {
+		return NULL;
+	}
+
+	block = p->free_areas[i];
+	arena = mpool_buddy_find_arena(p, (uintptr_t)block);
+	mpool_buddy_remove(p, arena, block, i);
+
+	/* Give back the upper halves of the block until it's the right size. */
+	while (i > order) {
+		i--;
+		mpool_buddy_push(p, arena,
+				 (uintptr_t)block + (p->entry_size << i), i);
+	}
+
+	return block;
+}
+
+/**
+ * Adds the chunk from `begin` to `end` to the given buddy pool, using its
+ * first entries to store the order map. Returns false if the chunk isn't big
+ * enough to hold any entry after the order map.
+ */
+static bool mpool_buddy_add_arena(struct mpool *p, char *begin, char *end)
+{
+	struct mpool_arena *arena = (struct mpool_arena *)begin;
+	size_t count = (end - begin) / p->entry_size;
+	uintptr_t entries_begin = align_up(
+		(uintptr_t)begin + sizeof(struct mpool_arena) + count,
+		p->entry_size);
+	size_t i;
+
+	if (entries_begin >= (uintptr_t)end) {
+		return false;
+	}
+
+	arena->begin = entries_begin;
+	arena->end = (uintptr_t)end;
+	for (i = 0; i < count; i++) {
+		arena->orders[i] = 0;
+	}
+
+	arena->next = p->arena_list;
+	p->arena_list = arena;
+
+	mpool_buddy_free_range(p, arena, arena->begin, arena->end);
+
+	return true;
+}
+
 /**
  * Adds a contiguous chunk of memory to the given memory pool. The chunk will
  * eventually be broken up into entries of the size held by the memory pool.
@@ -154,6 +417,11 @@ bool mpool_add_chunk(struct mpool *p, void *begin, size_t size)
 	char *new_begin;
 	char *new_end;
 
+	/* Chunks belong to the backing pool, magazines only cache entries. */
+	if (p->magazine) {
+		return mpool_add_chunk(p->fallback, begin, size);
+	}
+
 	/* Round begin address up, and end address down. */
 	new_begin = (void *)align_up((char *)begin, p->entry_size);
 	new_end = (void *)align_down((char *)begin + size, p->entry_size);
@@ -164,9 +432,29 @@ bool mpool_add_chunk(struct mpool *p, void *begin, size_t size)
 	}
 
 	chunk = (struct mpool_chunk *)new_begin;
-	chunk->limit = (struct mpool_chunk *)new_end;
 
 	mpool_lock(p);
+
+	if (p->buddy) {
+		struct mpool_arena *arena =
+			mpool_buddy_find_arena(p, (uintptr_t)new_begin);
+
+		/* Entries from a chunk of the pool are freed back to it. */
+		if (arena != NULL && (uintptr_t)new_end <= arena->end) {
+			mpool_buddy_free_range(p, arena, (uintptr_t)new_begin,
+					       (uintptr_t)new_end);
+			mpool_unlock(p);
+			return true;
+		}
+
+		if (arena == NULL &&
+		    mpool_buddy_add_arena(p, new_begin, new_end)) {
+			mpool_unlock(p);
+			return true;
+		}
+	}
+
+	chunk->limit = (struct mpool_chunk *)new_end;
 	chunk->next_chunk = p->chunk_list;
 	p->chunk_list = chunk;
 	mpool_unlock(p);
@@ -176,30 +464,35 @@ bool mpool_add_chunk(struct mpool *p, void *begin, size_t size)
 
 /**
  * Allocates an entry from the given memory pool, if one is available. The
- * fallback will not be used even if there is one.
+ * caller must hold the lock of the pool.
  */
-static void *mpool_alloc_no_fallback(struct mpool *p)
+static void *mpool_alloc_locked(struct mpool *p)
 {
-	void *ret;
 	struct mpool_chunk *chunk;
 	struct mpool_chunk *new_chunk;
 
 	/* Fetch an entry from the free list if one is available. */
-	mpool_lock(p);
 	if (p->entry_list != NULL) {
 		struct mpool_entry *entry = p->entry_list;
 
 		p->entry_list = entry->next;
-		ret = entry;
-		goto exit;
+		p->entry_count--;
+		return entry;
+	}
+
+	if (p->buddy) {
+		void *ret = mpool_buddy_alloc(p, 0);
+
+		if (ret != NULL) {
+			return ret;
+		}
 	}
 
 	/* There was no free list available. Try a chunk instead. */
 	chunk = p->chunk_list;
 	if (chunk == NULL) {
 		/* The chunk list is also empty, we're out of entries. */
-		ret = NULL;
-		goto exit;
+		return NULL;
 	}
 
 	new_chunk = (struct mpool_chunk *)((char *)chunk + p->entry_size);
@@ -210,9 +503,89 @@ static void *mpool_alloc_no_fallback(struct mpool *p)
 		p->chunk_list = new_chunk;
 	}
 
-	ret = chunk;
+	return chunk;
+}
+
+/**
+ * Stores an entry in the front of the free list of the given memory pool. The
+ * caller must hold the lock of the pool.
+ */
+static void mpool_free_locked(struct mpool *p, void *ptr)
+{
+	struct mpool_entry *e = ptr;
 
-exit:
+	if (p->buddy) {
+		struct mpool_arena *arena =
+			mpool_buddy_find_arena(p, (uintptr_t)ptr);
+
+		if (arena != NULL) {
+			mpool_buddy_free_block(p, arena, (uintptr_t)ptr, 0);
+			return;
+		}
+	}
+
+	e->next = p->entry_list;
+	p->entry_list = e;
+	p->entry_count++;
+}
+
+/**
+ * Moves up to a batch of entries from the backing pool of the given magazine
+ * into the magazine, taking the lock of the backing pool only once.
+ */
+static void mpool_magazine_refill(struct mpool *p)
+{
+	struct mpool *backing = p->fallback;
+	size_t i;
+
+	mpool_lock(backing);
+	for (i = 0; i < MPOOL_MAGAZINE_BATCH; i++) {
+		void *entry = mpool_alloc_locked(backing);
+
+		if (entry == NULL) {
+			break;
+		}
+
+		mpool_free_locked(p, entry);
+	}
+	mpool_unlock(backing);
+
+	p->stats.magazine_refills++;
+}
+
+/**
+ * Returns a batch of entries from the given magazine to its backing pool,
+ * taking the lock of the backing pool only once.
+ */
+static void mpool_magazine_drain(struct mpool *p)
+{
+	struct mpool *backing = p->fallback;
+	size_t i;
+
+	mpool_lock(backing);
+	for (i = 0; i < MPOOL_MAGAZINE_BATCH; i++) {
+		mpool_free_locked(backing, mpool_alloc_locked(p));
+	}
+	mpool_unlock(backing);
+
+	p->stats.magazine_drains++;
+}
+
+/**
+ * Allocates an entry from the given memory pool, if one is available. The
+ * fallback will not be used even if there is one, other than to refill a
+ * magazine.
+ */
+static void *mpool_alloc_no_fallback(struct mpool *p)
+{
+	void *ret;
+
+	if (p->magazine && p->entry_list == NULL) {
+		mpool_magazine_refill(p);
+	}
+
+	mpool_lock(p);
+	ret = mpool_alloc_locked(p);
 	mpool_unlock(p);
 
 	return ret;
@@ -237,6 +610,40 @@ void *mpool_alloc(struct mpool *p)
 	return NULL;
 }
 
+/**
+ * Allocates an entry from the given memory pool, used as a slab of entries
+ * smaller than those of `backing`. If the pool is empty, an entry of `backing`
+ * is split into entries of the pool, so the entry size of the pool must divide
+ * that of `backing`. Entries of `backing` taken by the slab are never given
+ * back, but entries freed to the slab are reused.
+ */
+void *mpool_alloc_slab(struct mpool *p, struct mpool *backing)
+{
+	void *ret = mpool_alloc_no_fallback(p);
+	void *chunk;
+
+	if (ret != NULL) {
+		return ret;
+	}
+
+	chunk = mpool_alloc(backing);
+	if (chunk == NULL) {
+		return NULL;
+	}
+
+	if (!mpool_add_chunk(p, chunk, backing->entry_size)) {
+		mpool_free(backing, chunk);
+		return NULL;
+	}
+
+	mpool_lock(p);
+	p->stats.slab_refills++;
+	ret = mpool_alloc_locked(p);
+	mpool_unlock(p);
+
+	return ret;
+}
+
 /**
  * Frees an entry back into the memory pool, making it available for reuse.
  *
@@ -245,13 +652,23 @@ void *mpool_alloc(struct mpool *p)
  */
 void mpool_free(struct mpool *p, void *ptr)
 {
-	struct mpool_entry *e = ptr;
-
 	/* Store the newly freed entry in the front of the free list. */
 	mpool_lock(p);
-	e->next = p->entry_list;
-	p->entry_list = e;
+	mpool_free_locked(p, ptr);
 	mpool_unlock(p);
+
+	if (p->magazine && p->entry_count >= MPOOL_MAGAZINE_CAPACITY) {
+		mpool_magazine_drain(p);
+	}
+}
+
+/**
+ * Returns the counters of the given memory pool. They are meant for tuning
+ * and are read without locking, so may be slightly out of date.
+ */
+struct mpool_stats mpool_get_stats(struct mpool *p)
+{
+	return p->stats;
 }
 
 /**
@@ -265,10 +682,43 @@ void *mpool_alloc_contiguous_no_fallback(struct mpool *p, size_t count,
 	struct mpool_chunk **prev;
 	void *ret = NULL;
 
-	align *= p->entry_size;
-
 	mpool_lock(p);
 
+	/*
+	 * A block of 2^order entries is aligned to its size, so take the
+	 * smallest one big enough for both the count and the alignment and
+	 * give back the entries past the requested count.
+	 */
+	if (p->buddy && count > 0 && (align & (align - 1)) == 0) {
+		uint8_t order = 0;
+
+		while (order < MPOOL_BUDDY_ORDERS &&
+		       ((size_t)1 << order) < count) {
+			order++;
+		}
+		while (order < MPOOL_BUDDY_ORDERS &&
+		       ((size_t)1 << order) < align) {
+			order++;
+		}
+
+		if (order < MPOOL_BUDDY_ORDERS) {
+			ret = mpool_buddy_alloc(p, order);
+		}
+
+		if (ret != NULL) {
+			uintptr_t begin = (uintptr_t)ret;
+
+			mpool_buddy_free_range(
+				p, mpool_buddy_find_arena(p, begin),
+				begin + count * p->entry_size,
+				begin + (p->entry_size << order));
+			mpool_unlock(p);
+			return ret;
+		}
+	}
+
+	align *= p->entry_size;
+
 	/*
 	 * Go through the chunk list in search of one with enough room for the
 	 * requested allocation
@@ -324,7 +774,8 @@ void *mpool_alloc_contiguous_no_fallback(struct mpool *p, size_t count,
  * Allocates a number of contiguous and aligned entries. This is a best-effort
  * operation and only succeeds if such entries can be found in the chunks list
  * or the chunks of the fallbacks (i.e., the entry list is never used to satisfy
- * these allocations).
+ * these allocations). In buddy pools, freed entries are merged back into their
+ * chunks so are available to these allocations too.
  *
  * The alignment is specified as the number of entries, that is, if `align` is
  * 4, the alignment in bytes will be 4 * entry_size.
@@ -18,6 +18,7 @@ namespace
 {
 using ::testing::Eq;
 using ::testing::IsNull;
+using ::testing::Lt;
 using ::testing::NotNull;
 
 /**
@@ -349,4 +350,209 @@ TEST(mpool, free_with_fallback)
 	EXPECT_THAT(mpool_alloc(&fallback), Eq(ret));
 }
 
+/**
+ * A magazine takes a batch of entries from its backing pool when it is empty.
+ */
+TEST(mpool, magazine_refill)
+{
+	struct mpool backing;
+	struct mpool magazine;
+	constexpr size_t entry_size = 16;
+	constexpr size_t entries_per_chunk = 10;
+	constexpr size_t chunk_count = 10;
+	std::vector<std::unique_ptr<char[]>> chunks;
+	std::vector<uintptr_t> allocs;
+	void* ret;
+
+	mpool_init(&backing, entry_size);
+	mpool_init_magazine(&magazine, &backing);
+
+	/* Allocate from an empty pool. */
+	EXPECT_THAT(mpool_alloc(&magazine), IsNull());
+
+	/* Chunks added to the magazine are given to the backing pool. */
+	add_chunks(chunks, &magazine, chunk_count,
+		   entries_per_chunk * entry_size);
+	EXPECT_THAT(magazine.chunk_list, IsNull());
+
+	/*
+	 * The first allocation takes a batch from the backing pool. The
+	 * allocation from the empty pool also tried to refill the magazine.
+	 */
+	ret = mpool_alloc(&magazine);
+	ASSERT_THAT(ret, NotNull());
+	allocs.push_back((uintptr_t)ret);
+	EXPECT_THAT(magazine.entry_count, Eq(MPOOL_MAGAZINE_BATCH - 1));
+	EXPECT_THAT(mpool_get_stats(&magazine).magazine_refills, Eq(2));
+
+	/* Allocate from the magazine until we run out of memory. */
+	while ((ret = mpool_alloc(&magazine))) {
+		allocs.push_back((uintptr_t)ret);
+	}
+
+	/* Check that returned entries are within chunks that were added. */
+	ASSERT_THAT(check_allocs(chunks, allocs, entries_per_chunk, entry_size),
+		    true);
+
+	/* Entries were taken in batches, plus a refill of each empty pool. */
+	EXPECT_THAT(mpool_get_stats(&magazine).magazine_refills,
+		    Eq(entries_per_chunk * chunk_count / MPOOL_MAGAZINE_BATCH +
+		       2));
+}
+
+/**
+ * A magazine returns a batch of entries to its backing pool when full, and the
+ * rest when it is finished.
+ */
+TEST(mpool, magazine_drain)
+{
+	struct mpool backing;
+	struct mpool magazine;
+	constexpr size_t entry_size = 16;
+	alignas(entry_size) char entries[MPOOL_MAGAZINE_CAPACITY][entry_size];
+	size_t i;
+
+	mpool_init(&backing, entry_size);
+	mpool_init_magazine(&magazine, &backing);
+
+	/* Entries freed to the magazine stay there until it is full. */
+	for (i = 0; i < MPOOL_MAGAZINE_CAPACITY - 1; i++) {
+		mpool_free(&magazine, entries[i]);
+	}
+	EXPECT_THAT(magazine.entry_count, Eq(MPOOL_MAGAZINE_CAPACITY - 1));
+	EXPECT_THAT(mpool_alloc(&backing), IsNull());
+
+	/* Filling the magazine returns a batch to the backing pool. */
+	mpool_free(&magazine, entries[i]);
+	EXPECT_THAT(mpool_get_stats(&magazine).magazine_drains, Eq(1));
+	EXPECT_THAT(magazine.entry_count,
+		    Eq(MPOOL_MAGAZINE_CAPACITY - MPOOL_MAGAZINE_BATCH));
+	EXPECT_THAT(backing.entry_count, Eq(MPOOL_MAGAZINE_BATCH));
+
+	/* Finishing the magazine returns the remaining entries. */
+	mpool_fini(&magazine);
+	EXPECT_THAT(backing.entry_count, Eq(MPOOL_MAGAZINE_CAPACITY));
+	for (i = 0; i < MPOOL_MAGAZINE_CAPACITY; i++) {
+		EXPECT_THAT(mpool_alloc(&backing), NotNull());
+	}
+	EXPECT_THAT(mpool_alloc(&backing), IsNull());
+}
+
+/**
+ * Entries freed one at a time to a buddy pool are merged back into blocks
+ * that can satisfy contiguous allocations.
+ */
+TEST(mpool, buddy_coalesce)
+{
+	constexpr size_t entry_size = 16;
+	constexpr size_t entry_count = 128;
+	alignas(entry_size* entry_count) static char heap[entry_size *
+							   entry_count];
+	struct mpool p;
+	std::vector<void*> allocs;
+	void* ret;
+
+	mpool_init_buddy(&p, entry_size);
+	ASSERT_TRUE(mpool_add_chunk(&p, heap, sizeof(heap)));
+
+	/* Allocate every entry one at a time. */
+	while ((ret = mpool_alloc(&p))) {
+		allocs.push_back(ret);
+	}
+	EXPECT_THAT(mpool_alloc_contiguous(&p, 2, 1), IsNull());
+
+	/* Free them all in a different order to the one they came in. */
+	sort(allocs.begin(), allocs.end());
+	for (void* alloc : allocs) {
+		mpool_free(&p, alloc);
+	}
+
+	/* The second half of the chunk is a single aligned block again. */
+	ret = mpool_alloc_contiguous(&p, entry_count / 2, entry_count / 2);
+	EXPECT_THAT(ret, Eq(&heap[entry_size * entry_count / 2]));
+}
+
+/**
+ * Contiguous allocations from a buddy pool are aligned and only consume the
+ * requested number of entries, and are returned to the pool with
+ * mpool_add_chunk.
+ */
+TEST(mpool, buddy_alloc_contiguous)
+{
+	constexpr size_t entry_size = 16;
+	constexpr size_t entry_count = 128;
+	alignas(entry_size* entry_count) static char heap[entry_size *
+							   entry_count];
+	struct mpool p;
+	size_t available = 0;
+	size_t remaining = 0;
+	void* ret;
+
+	/* Count the entries available after the index. */
+	mpool_init_buddy(&p, entry_size);
+	ASSERT_TRUE(mpool_add_chunk(&p, heap, sizeof(heap)));
+	while (mpool_alloc(&p) != NULL) {
+		available++;
+	}
+
+	mpool_init_buddy(&p, entry_size);
+	ASSERT_TRUE(mpool_add_chunk(&p, heap, sizeof(heap)));
+
+	/* Aligned allocations come from blocks of the right alignment. */
+	ret = mpool_alloc_contiguous(&p, 16, 16);
+	ASSERT_THAT(ret, NotNull());
+	EXPECT_THAT((uintptr_t)ret % (16 * entry_size), Eq(0));
+
+	/* Freeing the entries as a chunk makes them available again. */
+	EXPECT_TRUE(mpool_add_chunk(&p, ret, 16 * entry_size));
+	EXPECT_THAT(mpool_alloc_contiguous(&p, 16, 16), Eq(ret));
+	EXPECT_TRUE(mpool_add_chunk(&p, ret, 16 * entry_size));
+
+	/* The rest of the block is given back for a count of 3. */
+	ASSERT_THAT(mpool_alloc_contiguous(&p, 3, 1), NotNull());
+	while (mpool_alloc(&p) != NULL) {
+		remaining++;
+	}
+	EXPECT_THAT(remaining, Eq(available - 3));
+}
+
+/**
+ * A slab is refilled with one entry of its backing pool at a time, split into
+ * smaller entries.
+ */
+TEST(mpool, slab_refill)
+{
+	struct mpool backing;
+	struct mpool slab;
+	constexpr size_t backing_entry_size = 256;
+	constexpr size_t entry_size = 32;
+	constexpr size_t entries_per_backing_entry =
+		backing_entry_size / entry_size;
+	alignas(backing_entry_size) static char heap[backing_entry_size * 2];
+	std::vector<void*> allocs;
+	void* ret;
+
+	mpool_init(&backing, backing_entry_size);
+	mpool_init(&slab, entry_size);
+	ASSERT_TRUE(mpool_add_chunk(&backing, heap, sizeof(heap)));
+
+	/* Each backing entry is split into entries of the slab. */
+	while ((ret = mpool_alloc_slab(&slab, &backing))) {
+		allocs.push_back(ret);
+	}
+	EXPECT_THAT(allocs.size(), Eq(2 * entries_per_backing_entry));
+	EXPECT_THAT(mpool_get_stats(&slab).slab_refills, Eq(2));
+	for (void* alloc : allocs) {
+		EXPECT_THAT((char*)alloc - heap, Lt(sizeof(heap)));
+		EXPECT_THAT((uintptr_t)alloc % entry_size, Eq(0));
+	}
+	sort(allocs.begin(), allocs.end());
+	EXPECT_THAT(unique(allocs.begin(), allocs.end()), Eq(allocs.end()));
+
+	/* Freed entries are reused without refilling. */
+	mpool_free(&slab, allocs[3]);
+	EXPECT_THAT(mpool_alloc_slab(&slab, &backing), Eq(allocs[3]));
+	EXPECT_THAT(mpool_get_stats(&slab).slab_refills, Eq(2));
+}
+
 } /* namespace */
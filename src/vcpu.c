@@ -12,6 +12,7 @@
 
 #include "hf/check.h"
 #include "hf/dlog.h"
+#include "hf/ffa_memory.h"
 #include "hf/std.h"
 #include "hf/vm.h"
 
@@ -132,10 +133,11 @@ bool vcpu_secondary_reset_and_start(struct vcpu_locked vcpu_locked,
  * spurious fault, and recovering from the latter.
  *
  * Returns true if the caller should resume the current vCPU, or false if its VM
- * should be aborted.
+ * should be aborted. Pages needed to map memory retrieved to be mapped on
+ * demand are taken from `ppool`.
  */
 bool vcpu_handle_page_fault(const struct vcpu *current,
-			    struct vcpu_fault_info *f)
+			    struct vcpu_fault_info *f, struct mpool *ppool)
 {
 	struct vm *vm = current->vm;
 	uint32_t mode;
@@ -180,6 +182,15 @@ bool vcpu_handle_page_fault(const struct vcpu *current,
 		}
 	}
 
+	/*
+	 * The VM may be accessing memory it retrieved to be mapped on demand,
+	 * which is mapped now.
+	 */
+	if (!resume && !locked_vm.vm->el0_partition) {
+		resume = ffa_memory_lazy_fault(locked_vm, f->ipaddr, f->mode,
+					       ppool);
+	}
+
 	vm_unlock(&locked_vm);
 
 	if (!resume) {
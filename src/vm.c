@@ -83,6 +83,7 @@ struct vm *vm_init(ffa_vm_id_t id, ffa_vcpu_count_t vcpu_count,
 	CHECK(vm->vcpus != NULL);
 
 	vm->mailbox.state = MAILBOX_STATE_EMPTY;
+	vm->mailbox.max_page_count = HF_MAILBOX_SIZE / FFA_PAGE_SIZE;
 	atomic_init(&vm->aborting, false);
 	vm->el0_partition = el0_partition;
 
@@ -279,11 +280,15 @@ bool vm_id_is_current_world(ffa_vm_id_t vm_id)
 bool vm_identity_map(struct vm_locked vm_locked, paddr_t begin, paddr_t end,
 		     uint32_t mode, struct mpool *ppool, ipaddr_t *ipa)
 {
-	if (!vm_identity_prepare(vm_locked, begin, end, mode, ppool)) {
+	struct mm_reservation res;
+
+	mm_reservation_init(&res);
+
+	if (!vm_identity_prepare(vm_locked, begin, end, mode, ppool, &res)) {
 		return false;
 	}
 
-	vm_identity_commit(vm_locked, begin, end, mode, ppool, ipa);
+	vm_identity_commit(vm_locked, begin, end, mode, ppool, ipa, &res, NULL);
 
 	return true;
 }
@@ -295,31 +300,42 @@ bool vm_identity_map(struct vm_locked vm_locked, paddr_t begin, paddr_t end,
  * In particular, multiple calls to this function will result in the
  * corresponding calls to commit the changes to succeed.
  *
+ * If `res` is not NULL, it records the entries to write so that the commits
+ * given the same reservation don't need to walk the page table again.
+ *
  * Returns true on success, or false if the update failed and no changes were
  * made.
  */
 bool vm_identity_prepare(struct vm_locked vm_locked, paddr_t begin, paddr_t end,
-			 uint32_t mode, struct mpool *ppool)
+			 uint32_t mode, struct mpool *ppool,
+			 struct mm_reservation *res)
 {
 	if (vm_locked.vm->el0_partition) {
 		return mm_identity_prepare(&vm_locked.vm->ptable, begin, end,
-					   mode, ppool);
+					   mode, ppool, res);
 	}
 	return mm_vm_identity_prepare(&vm_locked.vm->ptable, begin, end, mode,
-				      ppool);
+				      ppool, res);
 }
 
 /**
  * Commits the given address mapping to the VM assuming the operation cannot
  * fail. `vm_identity_prepare` must used correctly before this to ensure
  * this condition.
+ *
+ * If `res` is not NULL, it must be the reservation given to the prepare.
+ *
+ * If `tlb` is not NULL, the TLB invalidation is deferred until the caller
+ * finishes the gather with `mm_tlb_gather_finish`, so that a series of commits
+ * only invalidates the TLB once.
  */
 void vm_identity_commit(struct vm_locked vm_locked, paddr_t begin, paddr_t end,
-			uint32_t mode, struct mpool *ppool, ipaddr_t *ipa)
+			uint32_t mode, struct mpool *ppool, ipaddr_t *ipa,
+			struct mm_reservation *res, struct mm_tlb_gather *tlb)
 {
 	if (vm_locked.vm->el0_partition) {
 		mm_identity_commit(&vm_locked.vm->ptable, begin, end, mode,
-				   ppool);
+				   ppool, res, tlb);
 		if (ipa != NULL) {
 			/*
 			 * EL0 partitions are modeled as lightweight VM's, to
@@ -331,7 +347,7 @@ void vm_identity_commit(struct vm_locked vm_locked, paddr_t begin, paddr_t end,
 		}
 	} else {
 		mm_vm_identity_commit(&vm_locked.vm->ptable, begin, end, mode,
-				      ppool, ipa);
+				      ppool, ipa, res, tlb);
 	}
 	plat_iommu_identity_map(vm_locked, begin, end, mode);
 }
@@ -362,6 +378,24 @@ void vm_ptable_defrag(struct vm_locked vm_locked, struct mpool *ppool)
 	}
 }
 
+/**
+ * Defrag the part of the page tables for an EL0 partition or for a VM covering
+ * the given address range. If `tlb` is not NULL, the TLB invalidation is
+ * deferred until the caller finishes the gather.
+ */
+void vm_ptable_defrag_range(struct vm_locked vm_locked, paddr_t begin,
+			    paddr_t end, struct mpool *ppool,
+			    struct mm_tlb_gather *tlb)
+{
+	if (vm_locked.vm->el0_partition) {
+		mm_stage1_defrag_range(&vm_locked.vm->ptable, begin, end,
+				       ppool, tlb);
+	} else {
+		mm_vm_defrag_range(&vm_locked.vm->ptable, begin, end, ppool,
+				   tlb);
+	}
+}
+
 /**
  * Unmaps the hypervisor pages from the given page table.
  */
@@ -435,6 +469,77 @@ bool vm_mem_get_mode(struct vm_locked vm_locked, ipaddr_t begin, ipaddr_t end,
 	return mm_vm_get_mode(&vm_locked.vm->ptable, begin, end, mode);
 }
 
+/**
+ * Initialises a cursor to query the modes of a series of ranges of the VM's
+ * page table with `vm_mem_get_mode_next`. The VM must stay locked while the
+ * cursor is in use.
+ */
+void vm_mem_mode_cursor_init(struct vm_locked vm_locked,
+			     struct mm_mode_cursor *cursor)
+{
+	if (vm_locked.vm->el0_partition) {
+		mm_mode_cursor_init(cursor, &vm_locked.vm->ptable);
+	} else {
+		mm_vm_mode_cursor_init(cursor, &vm_locked.vm->ptable);
+	}
+}
+
+/**
+ * Gets the mode of the given range of ipa or va if they are mapped with the
+ * same mode as all the ranges previously queried with the cursor. The walk of
+ * the page table resumes from where the previous query left it.
+ *
+ * Returns true if the range is mapped with the same mode and false otherwise.
+ */
+bool vm_mem_get_mode_next(struct vm_locked vm_locked,
+			  struct mm_mode_cursor *cursor, ipaddr_t begin,
+			  ipaddr_t end, uint32_t *mode)
+{
+	if (vm_locked.vm->el0_partition) {
+		return mm_get_mode_next(cursor, va_from_pa(pa_from_ipa(begin)),
+					va_from_pa(pa_from_ipa(end)), mode);
+	}
+	return mm_vm_get_mode_next(cursor, begin, end, mode);
+}
+
+/**
+ * Records that the memory region with the given handle has been retrieved by
+ * the VM to be mapped as it accesses it.
+ *
+ * Returns false if the VM already has as many such regions as it can.
+ */
+bool vm_lazy_retrieval_add(struct vm_locked vm_locked,
+			   ffa_memory_handle_t handle)
+{
+	struct vm *vm = vm_locked.vm;
+
+	if (vm->lazy_retrieval_count == VM_MAX_LAZY_RETRIEVALS) {
+		return false;
+	}
+
+	vm->lazy_retrievals[vm->lazy_retrieval_count++] = handle;
+	return true;
+}
+
+/**
+ * Forgets the memory region with the given handle, once it is no longer
+ * retrieved by the VM.
+ */
+void vm_lazy_retrieval_remove(struct vm_locked vm_locked,
+			      ffa_memory_handle_t handle)
+{
+	struct vm *vm = vm_locked.vm;
+	uint16_t i;
+
+	for (i = 0; i < vm->lazy_retrieval_count; ++i) {
+		if (vm->lazy_retrievals[i] == handle) {
+			vm->lazy_retrievals[i] =
+				vm->lazy_retrievals[--vm->lazy_retrieval_count];
+			return;
+		}
+	}
+}
+
 static struct notifications *vm_get_notifications(struct vm_locked vm_locked,
 						  bool is_from_vm)
 {
@@ -0,0 +1,102 @@
+/*
+ * Copyright 2023 The Hafnium Authors.
+ *
+ * Use of this source code is governed by a BSD-style
+ * license that can be found in the LICENSE file or at
+ * https://opensource.org/licenses/BSD-3-Clause.
+ */
+
+#include "hf/arch/mm.h"
+
+#include "hf/mm.h"
+#include "hf/std.h"
+
+#include "msr.h"
+#include "test/hftest.h"
+
+/** The number of times each way of zeroing memory is timed for each size. */
+#define ZERO_ITERATIONS 16
+
+alignas(PAGE_SIZE) static uint8_t zero_buffer[256 * PAGE_SIZE];
+
+/**
+ * Returns whether the given range is all zeroes.
+ */
+static bool is_zeroed(const uint8_t *base, size_t size)
+{
+	size_t i;
+
+	for (i = 0; i < size; ++i) {
+		if (base[i] != 0) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * Zeroing memory and writing it back with `arch_mm_zero_and_flush` leaves the
+ * bytes either side of the range alone, even when it isn't aligned to a DC ZVA
+ * block.
+ */
+TEST(arch_mm, zero_and_flush_unaligned)
+{
+	const size_t offset = 3;
+	const size_t size = 2 * PAGE_SIZE + 5;
+
+	memset_s(zero_buffer, sizeof(zero_buffer), 0xff, 3 * PAGE_SIZE);
+	arch_mm_zero_and_flush(&zero_buffer[offset], size);
+
+	EXPECT_EQ(zero_buffer[offset - 1], 0xff);
+	EXPECT_TRUE(is_zeroed(&zero_buffer[offset], size));
+	EXPECT_EQ(zero_buffer[offset + size], 0xff);
+}
+
+/**
+ * Compares zeroing memory and writing it back in a single pass with
+ * `arch_mm_zero_and_flush`, as memory sharing calls now clear memory, with
+ * zeroing it with memset_s() and then writing it back with
+ * `arch_mm_flush_dcache`, as they did before. The memory is dirtied again,
+ * untimed, before each run. Ticks of the generic timer are counted as the cycle
+ * counter doesn't count at EL2, and the results are only logged, as they depend
+ * on the platform.
+ */
+TEST(arch_mm, zero_and_flush_benchmark)
+{
+	const size_t sizes[] = {PAGE_SIZE, 16 * PAGE_SIZE,
+				sizeof(zero_buffer)};
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(sizes); ++i) {
+		size_t size = sizes[i];
+		uint64_t before_ticks = 0;
+		uint64_t after_ticks = 0;
+		uint64_t start;
+		uint32_t j;
+
+		for (j = 0; j < ZERO_ITERATIONS; ++j) {
+			memset_s(zero_buffer, sizeof(zero_buffer), 0xff, size);
+			start = read_msr(cntvct_el0);
+			memset_s(zero_buffer, sizeof(zero_buffer), 0, size);
+			arch_mm_flush_dcache(zero_buffer, size);
+			before_ticks += read_msr(cntvct_el0) - start;
+		}
+		EXPECT_TRUE(is_zeroed(zero_buffer, size));
+
+		for (j = 0; j < ZERO_ITERATIONS; ++j) {
+			memset_s(zero_buffer, sizeof(zero_buffer), 0xff, size);
+			start = read_msr(cntvct_el0);
+			arch_mm_zero_and_flush(zero_buffer, size);
+			after_ticks += read_msr(cntvct_el0) - start;
+		}
+		EXPECT_TRUE(is_zeroed(zero_buffer, size));
+
+		HFTEST_LOG(
+			"Zeroing and writing back %u bytes %u times took %u "
+			"ticks with memset_s and %u ticks with DC ZVA, at %u "
+			"Hz.",
+			size, (size_t)ZERO_ITERATIONS, before_ticks,
+			after_ticks, read_msr(cntfrq_el0));
+	}
+}
@@ -11,6 +11,7 @@
 
 #include "vmapi/hf/call.h"
 
+#include "msr.h"
 #include "partition_services.h"
 #include "test/hftest.h"
 #include "test/vmapi/ffa.h"
@@ -37,6 +38,35 @@ TEST(ffa_msg_send_direct_req, succeeds_nwd_to_sp_echo)
 	EXPECT_EQ(res.arg7, msg[3]);
 }
 
+/**
+ * Measures the round trip of direct message requests from the normal world to
+ * an SP pinned to each CPU, whose lazy registers are left live in the system
+ * registers between them. Ticks of the generic timer are counted as the cycle
+ * counter doesn't count at EL2, and the result is only logged, as it depends
+ * on the platform.
+ */
+TEST(ffa_msg_send_direct_req, nwd_to_sp_echo_round_trip)
+{
+	const uint32_t round_trips = 1000;
+	const ffa_vm_id_t receiver_id = SP_ID(1);
+	struct ffa_value res;
+	ffa_vm_id_t own_id = hf_vm_get_id();
+	uint64_t start;
+	uint64_t ticks;
+	uint32_t i;
+
+	start = read_msr(cntvct_el0);
+	for (i = 0; i < round_trips; i++) {
+		res = sp_echo_cmd_send(own_id, receiver_id, i, 0, 0, 0);
+		EXPECT_EQ(res.func, FFA_MSG_SEND_DIRECT_RESP_32);
+		EXPECT_EQ(res.arg4, i);
+	}
+	ticks = read_msr(cntvct_el0) - start;
+
+	HFTEST_LOG("%u direct message round trips took %u ticks at %u Hz.",
+		   round_trips, ticks, read_msr(cntfrq_el0));
+}
+
 /**
  * Validate SP to SP direct messaging is functioning as expected.
  */
@@ -282,6 +282,17 @@ TEST(ffa, ffa_features)
 	ret = ffa_features(FFA_MSG_SEND2_32);
 	EXPECT_EQ(ret.func, FFA_SUCCESS_32);
 #endif
+
+#if (MAKE_FFA_VERSION(1, 2) <= FFA_VERSION_COMPILED)
+	/* The direct messages 2 are only reported once v1.2 is negotiated. */
+	ffa_version(MAKE_FFA_VERSION(1, 2));
+
+	ret = ffa_features(FFA_MSG_SEND_DIRECT_REQ2_64);
+	EXPECT_EQ(ret.func, FFA_SUCCESS_32);
+
+	ret = ffa_features(FFA_MSG_SEND_DIRECT_RESP2_64);
+	EXPECT_EQ(ret.func, FFA_SUCCESS_32);
+#endif
 }
 
 /**
@@ -297,6 +308,15 @@ TEST(ffa, ffa_features_not_supported)
 
 	ret = ffa_features(0x84000000);
 	EXPECT_FFA_ERROR(ret, FFA_NOT_SUPPORTED);
+
+	/* The direct messages 2 require FF-A v1.2 to have been negotiated. */
+	ffa_version(MAKE_FFA_VERSION(1, 1));
+
+	ret = ffa_features(FFA_MSG_SEND_DIRECT_REQ2_64);
+	EXPECT_FFA_ERROR(ret, FFA_NOT_SUPPORTED);
+
+	ret = ffa_features(FFA_MSG_SEND_DIRECT_RESP2_64);
+	EXPECT_FFA_ERROR(ret, FFA_NOT_SUPPORTED);
 }
 
 /**
@@ -237,6 +237,119 @@ TEST(ffa, ffa_send_direct_message_req_echo)
 	EXPECT_EQ(res.arg7, msg[4]);
 }
 
+/**
+ * Measures the round trip of direct message requests and responses, counting
+ * ticks of the generic timer as the cycle counter doesn't count at EL2. The
+ * result is only logged, as it depends on the platform.
+ */
+TEST(ffa, ffa_send_direct_message_req_round_trip)
+{
+	const uint32_t round_trips = 1000;
+	struct mailbox_buffers mb = set_up_mailbox();
+	struct ffa_value res;
+	uint64_t start;
+	uint64_t ticks;
+	uint32_t i;
+
+	SERVICE_SELECT(SERVICE_VM1, "ffa_direct_message_resp_echo_loop",
+		       mb.send);
+	ffa_run(SERVICE_VM1, 0);
+
+	start = read_msr(cntvct_el0);
+	for (i = 0; i < round_trips; i++) {
+		res = ffa_msg_send_direct_req(HF_PRIMARY_VM_ID, SERVICE_VM1, i,
+					      0, 0, 0, 0);
+		EXPECT_EQ(res.func, FFA_MSG_SEND_DIRECT_RESP_32);
+		EXPECT_EQ(res.arg3, i);
+	}
+	ticks = read_msr(cntvct_el0) - start;
+
+	HFTEST_LOG("%u direct message round trips took %u ticks at %u Hz.",
+		   round_trips, ticks, read_msr(cntfrq_el0));
+}
+
+#if (MAKE_FFA_VERSION(1, 2) <= FFA_VERSION_COMPILED)
+/**
+ * Send a direct message 2 filling all payload registers, verify that it is
+ * echoed back.
+ */
+TEST(ffa, ffa_send_direct_message_req2_echo)
+{
+	const uint64_t msg[FFA_DIRECT_MSG2_PAYLOAD_REGS] = {
+		0x1111, 0x2222, 0x3333, 0x4444, 0x5555, 0x6666, 0x7777,
+		0x8888, 0x9999, 0xaaaa, 0xbbbb, 0xcccc, 0xdddd, 0xeeee,
+	};
+	struct mailbox_buffers mb = set_up_mailbox();
+	struct ffa_value_ext res;
+
+	ffa_version(MAKE_FFA_VERSION(1, 2));
+
+	SERVICE_SELECT(SERVICE_VM1, "ffa_direct_message_resp2_echo", mb.send);
+	ffa_run(SERVICE_VM1, 0);
+
+	res = ffa_msg_send_direct_req2(HF_PRIMARY_VM_ID, SERVICE_VM1, SERVICE1,
+				       msg, ARRAY_SIZE(msg));
+
+	EXPECT_EQ(res.val.func, FFA_MSG_SEND_DIRECT_RESP2_64);
+	EXPECT_EQ(res.val.arg4, msg[0]);
+	EXPECT_EQ(res.val.arg5, msg[1]);
+	EXPECT_EQ(res.val.arg6, msg[2]);
+	EXPECT_EQ(res.val.arg7, msg[3]);
+	EXPECT_EQ(res.arg8, msg[4]);
+	EXPECT_EQ(res.arg9, msg[5]);
+	EXPECT_EQ(res.arg10, msg[6]);
+	EXPECT_EQ(res.arg11, msg[7]);
+	EXPECT_EQ(res.arg12, msg[8]);
+	EXPECT_EQ(res.arg13, msg[9]);
+	EXPECT_EQ(res.arg14, msg[10]);
+	EXPECT_EQ(res.arg15, msg[11]);
+	EXPECT_EQ(res.arg16, msg[12]);
+	EXPECT_EQ(res.arg17, msg[13]);
+}
+
+/**
+ * Verify that a direct message 2 can't be sent to a UUID the receiver doesn't
+ * implement.
+ */
+TEST(ffa, ffa_send_direct_message_req2_invalid_uuid)
+{
+	const uint64_t msg[] = {0x1111};
+	struct mailbox_buffers mb = set_up_mailbox();
+	struct ffa_value_ext res;
+
+	ffa_version(MAKE_FFA_VERSION(1, 2));
+
+	SERVICE_SELECT(SERVICE_VM1, "ffa_direct_message_resp2_echo", mb.send);
+	ffa_run(SERVICE_VM1, 0);
+
+	res = ffa_msg_send_direct_req2(HF_PRIMARY_VM_ID, SERVICE_VM1, SERVICE2,
+				       msg, ARRAY_SIZE(msg));
+
+	EXPECT_FFA_ERROR(res.val, FFA_INVALID_PARAMETERS);
+}
+#endif
+
+/**
+ * Verify that a direct message 2 can't be sent without having negotiated FF-A
+ * v1.2.
+ */
+TEST(ffa, ffa_send_direct_message_req2_not_negotiated)
+{
+	const uint64_t msg[] = {0x1111};
+	struct mailbox_buffers mb = set_up_mailbox();
+	struct ffa_value_ext res;
+
+	ffa_version(MAKE_FFA_VERSION(1, 1));
+
+	SERVICE_SELECT(SERVICE_VM1, "ffa_direct_message_resp_echo", mb.send);
+	ffa_run(SERVICE_VM1, 0);
+
+	res = ffa_msg_send_direct_req2(HF_PRIMARY_VM_ID, SERVICE_VM1, SERVICE1,
+				       msg, ARRAY_SIZE(msg));
+
+	EXPECT_FFA_ERROR(res.val, FFA_NOT_SUPPORTED);
+}
+
 /**
  * Send direct message, secondary verifies disallowed SMC invocations while
  * ffa_msg_send_direct_req is being serviced.
@@ -68,3 +68,24 @@ TEST(floating_point, fp_fpcr)
 	EXPECT_EQ(run_res.func, FFA_YIELD_32);
 	EXPECT_EQ(read_msr(fpcr), value);
 }
+
+/**
+ * Test that floating point registers are preserved across running a service
+ * which never accesses them, and so never has its own loaded.
+ */
+TEST(floating_point, fp_unused)
+{
+	const double value = 3.4;
+	struct ffa_value run_res;
+	struct mailbox_buffers mb = set_up_mailbox();
+
+	fill_fp_registers(value);
+	SERVICE_SELECT(SERVICE_VM1, "fp_unused", mb.send);
+	run_res = ffa_run(SERVICE_VM1, 0);
+	EXPECT_EQ(run_res.func, FFA_YIELD_32);
+	EXPECT_EQ(check_fp_register(value), true);
+
+	run_res = ffa_run(SERVICE_VM1, 0);
+	EXPECT_EQ(run_res.func, FFA_YIELD_32);
+	EXPECT_EQ(check_fp_register(value), true);
+}
@@ -77,6 +77,53 @@ TEST_SERVICE(ffa_direct_message_resp_echo)
 				 args.arg7);
 }
 
+/**
+ * Echoes direct message requests back for as long as they are sent.
+ */
+TEST_SERVICE(ffa_direct_message_resp_echo_loop)
+{
+	struct ffa_value args = ffa_msg_wait();
+
+	for (;;) {
+		EXPECT_EQ(args.func, FFA_MSG_SEND_DIRECT_REQ_32);
+		args = ffa_msg_send_direct_resp(ffa_receiver(args),
+						ffa_sender(args), args.arg3,
+						args.arg4, args.arg5,
+						args.arg6, args.arg7);
+	}
+}
+
+#if (MAKE_FFA_VERSION(1, 2) <= FFA_VERSION_COMPILED)
+TEST_SERVICE(ffa_direct_message_resp2_echo)
+{
+	struct ffa_value_ext args;
+	uint64_t msg[FFA_DIRECT_MSG2_PAYLOAD_REGS];
+
+	ffa_version(MAKE_FFA_VERSION(1, 2));
+
+	args = ffa_msg_wait_ext();
+	EXPECT_EQ(args.val.func, FFA_MSG_SEND_DIRECT_REQ2_64);
+
+	msg[0] = args.val.arg4;
+	msg[1] = args.val.arg5;
+	msg[2] = args.val.arg6;
+	msg[3] = args.val.arg7;
+	msg[4] = args.arg8;
+	msg[5] = args.arg9;
+	msg[6] = args.arg10;
+	msg[7] = args.arg11;
+	msg[8] = args.arg12;
+	msg[9] = args.arg13;
+	msg[10] = args.arg14;
+	msg[11] = args.arg15;
+	msg[12] = args.arg16;
+	msg[13] = args.arg17;
+
+	ffa_msg_send_direct_resp2(ffa_receiver(args.val), ffa_sender(args.val),
+				  msg, ARRAY_SIZE(msg));
+}
+#endif
+
 TEST_SERVICE(ffa_direct_msg_req_disallowed_smc)
 {
 	struct ffa_value args = ffa_msg_wait();
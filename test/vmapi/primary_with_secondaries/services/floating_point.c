@@ -35,3 +35,10 @@ TEST_SERVICE(fp_fpcr)
 	ASSERT_EQ(read_msr(fpcr), value);
 	ffa_yield();
 }
+
+TEST_SERVICE(fp_unused)
+{
+	/* Yield without accessing the floating point registers. */
+	ffa_yield();
+	ffa_yield();
+}
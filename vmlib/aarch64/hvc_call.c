@@ -54,3 +54,52 @@ struct ffa_value ffa_call(struct ffa_value args)
 				  .arg6 = r6,
 				  .arg7 = r7};
 }
+
+struct ffa_value_ext ffa_call_ext(struct ffa_value_ext args)
+{
+	register uint64_t r0 __asm__("x0") = args.val.func;
+	register uint64_t r1 __asm__("x1") = args.val.arg1;
+	register uint64_t r2 __asm__("x2") = args.val.arg2;
+	register uint64_t r3 __asm__("x3") = args.val.arg3;
+	register uint64_t r4 __asm__("x4") = args.val.arg4;
+	register uint64_t r5 __asm__("x5") = args.val.arg5;
+	register uint64_t r6 __asm__("x6") = args.val.arg6;
+	register uint64_t r7 __asm__("x7") = args.val.arg7;
+	register uint64_t r8 __asm__("x8") = args.arg8;
+	register uint64_t r9 __asm__("x9") = args.arg9;
+	register uint64_t r10 __asm__("x10") = args.arg10;
+	register uint64_t r11 __asm__("x11") = args.arg11;
+	register uint64_t r12 __asm__("x12") = args.arg12;
+	register uint64_t r13 __asm__("x13") = args.arg13;
+	register uint64_t r14 __asm__("x14") = args.arg14;
+	register uint64_t r15 __asm__("x15") = args.arg15;
+	register uint64_t r16 __asm__("x16") = args.arg16;
+	register uint64_t r17 __asm__("x17") = args.arg17;
+
+	__asm__ volatile(
+		"hvc #0"
+		: /* Output registers, also used as inputs ('+' constraint). */
+		"+r"(r0), "+r"(r1), "+r"(r2), "+r"(r3), "+r"(r4), "+r"(r5),
+		"+r"(r6), "+r"(r7), "+r"(r8), "+r"(r9), "+r"(r10), "+r"(r11),
+		"+r"(r12), "+r"(r13), "+r"(r14), "+r"(r15), "+r"(r16),
+		"+r"(r17));
+
+	return (struct ffa_value_ext){.val = {.func = r0,
+					      .arg1 = r1,
+					      .arg2 = r2,
+					      .arg3 = r3,
+					      .arg4 = r4,
+					      .arg5 = r5,
+					      .arg6 = r6,
+					      .arg7 = r7},
+				     .arg8 = r8,
+				     .arg9 = r9,
+				     .arg10 = r10,
+				     .arg11 = r11,
+				     .arg12 = r12,
+				     .arg13 = r13,
+				     .arg14 = r14,
+				     .arg15 = r15,
+				     .arg16 = r16,
+				     .arg17 = r17};
+}